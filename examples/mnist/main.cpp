@@ -1,6 +1,5 @@
-#include <fstream>
+#include <chrono>
 #include <iostream>
-#include <sstream>
 #include <string>
 #include <vector>
 
@@ -15,50 +14,40 @@
 void load_data(FJML::Tensor& x, FJML::Tensor& y, std::string filename, int limit = -1) {
     // Uses data from the kaggle mnist dataset
     // https://www.kaggle.com/datasets/oddrationale/mnist-in-csv
-    std::ifstream file(filename);
-    if (file.fail()) {
-        std::cerr << "Failed to load data from file " << filename << std::endl;
-        return;
-    }
-
-    // The first line of the file is the header
-    std::string line;
-    std::getline(file, line);
-
-    // Read the data
-    std::vector<FJML::Tensor> x_vec, y_vec;
-    while (std::getline(file, line)) {
-        std::stringstream ss(line);
-
-        // The first value is the label
-        int label;
-        ss >> label;
-
-        // The rest of the values are the pixels
-        FJML::Tensor pixels({28 * 28});
-        for (int i = 0; i < 28 * 28; i++) {
-            int pixel;
-            char comma;
-            ss >> comma >> pixel;
-            pixels.at(i) = pixel / 255.0;
-        }
-
-        // Add the data to the vectors
-        x_vec.push_back(pixels);
-        y_vec.push_back(FJML::Tensor::array(std::vector<float>{(float)label}));
+    // The first line of the file is the header, the first value of each row is the label and the rest are the pixels
+    FJML::Data::load_csv(filename, x, y, 0, true, limit);
+    x /= 255;
+}
 
-        // Stop if we have enough data
-        if (limit != -1 && (int)x_vec.size() >= limit) {
-            break;
+/**
+ * @brief Compare synchronous training with Hogwild training
+ *
+ * Trains the same model with SGD for a few epochs, first one batch at a time, then with several workers updating the
+ * parameters asynchronously, and prints the throughput and the validation accuracy of each.
+ *
+ * @param workers The number of Hogwild workers
+ */
+void compare_hogwild(const FJML::Tensor& x_train, const FJML::Tensor& y_train, const FJML::Tensor& x_test,
+                     const FJML::Tensor& y_test, int workers) {
+    const int epochs = 3, batch_size = 32;
+    for (bool hogwild : {false, true}) {
+        FJML::MLP::MLP model({new FJML::Layers::Dense(28 * 28, 128, FJML::Activations::relu),
+                              new FJML::Layers::Dense(128, 10, FJML::Activations::linear)},
+                             FJML::Loss::sparse_categorical_crossentropy(true), new FJML::Optimizers::SGD(0.05));
+        if (hogwild) {
+            model.set_num_workers(workers);
+            model.set_hogwild(true, workers);
         }
+        auto start = std::chrono::steady_clock::now();
+        model.train(x_train, y_train, x_test, y_test, epochs, batch_size, "");
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << (hogwild ? "Hogwild with " + std::to_string(workers) + " workers" : std::string("Synchronous"))
+                  << ": " << x_train.shape[0] * epochs / seconds << " samples per second, validation accuracy "
+                  << FJML::MLP::sparse_categorical_accuracy.compute(y_test, model.run(x_test)) << std::endl;
     }
-
-    // Convert the vectors to tensors
-    x = FJML::Tensor::array(x_vec);
-    y = FJML::Tensor::array(y_vec);
 }
 
-int main() {
+int main(int argc, char** argv) {
     // Load the data
     FJML::Tensor mnist_train_x, mnist_train_y;
     FJML::Tensor mnist_test_x, mnist_test_y;
@@ -72,6 +61,12 @@ int main() {
     FJML::Tensor x_test, y_test;
     FJML::Data::split(mnist_train_x, mnist_train_y, x_train, y_train, x_test, y_test, 0.8);
 
+    // Run with "hogwild [workers]" to compare the training loops instead
+    if (argc > 1 && std::string(argv[1]) == "hogwild") {
+        compare_hogwild(x_train, y_train, x_test, y_test, argc > 2 ? std::stoi(argv[2]) : 4);
+        return 0;
+    }
+
     // Create the model
     // The model is a simple MLP with 1 hidden layer
     // The input layer has 28 * 28 = 784 neurons
@@ -2,12 +2,16 @@
 #define FJML_INCLUDED
 
 #include "./FJML/activations.h"
+#include "./FJML/allocator.h"
 #include "./FJML/data.h"
+#include "./FJML/expression.h"
+#include "./FJML/half.h"
 #include "./FJML/layers.h"
 #include "./FJML/linalg.h"
 #include "./FJML/tensor.h"
 #include "./FJML/loss.h"
 #include "./FJML/mlp.h"
 #include "./FJML/optimizers.h"
+#include "./FJML/parallel.h"
 
 #endif
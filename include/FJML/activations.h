@@ -24,6 +24,16 @@ namespace Activations {
  */
 class Activation {
   public:
+    /**
+     * @brief A function applying an activation or its derivative to n contiguous floats, reading from in and writing
+     * to out (which may be the same buffer)
+     */
+    using Kernel = void (*)(const float* in, float* out, long n);
+    /**
+     * @brief Like Kernel, on doubles
+     */
+    using DoubleKernel = void (*)(const double* in, double* out, long n);
+
     /**
      * @brief The name of this activation function
      */
@@ -36,6 +46,23 @@ class Activation {
      * @brief The derivative of the function
      */
     std::function<float(float)> derivative;
+    /**
+     * @brief A bulk version of func, or nullptr if there is none
+     *
+     * The built-in activations have vectorized kernels, which are used for contiguous tensors on the CPU instead of
+     * calling func once per element.
+     */
+    Kernel func_kernel;
+    /**
+     * @brief A bulk version of derivative, or nullptr if there is none
+     */
+    Kernel derivative_kernel;
+    /**
+     * @brief func computed in double precision on n contiguous doubles, or nullptr if there is none
+     *
+     * Used by the double precision forward pass that gradients are checked against, see MLP::check_gradients.
+     */
+    DoubleKernel double_kernel;
 
     /**
      * @brief Constructor with given name and functions
@@ -45,15 +72,28 @@ class Activation {
      */
     Activation(std::string name, std::function<float(float)> func, std::function<float(float)> derivative);
 
+    /**
+     * @brief Constructor with given name, functions and bulk kernels
+     * @param name The name of the activation function
+     * @param func The function to apply to a layer
+     * @param derivative The derivative of the function
+     * @param func_kernel A bulk version of func
+     * @param derivative_kernel A bulk version of derivative
+     * @param double_kernel A bulk version of func in double precision
+     */
+    Activation(std::string name, std::function<float(float)> func, std::function<float(float)> derivative,
+               Kernel func_kernel, Kernel derivative_kernel, DoubleKernel double_kernel = nullptr);
+
     /**
      * @brief apply the function to a layer
      *
      * Note: This function modifies the layer in place.
      *
      * @param layer The layer to apply the function to
-     * @return The result of applying the function to the layer
+     * @return The layer, after applying the function to it
+     * @throws std::invalid_argument If the layer does not hold floats
      */
-    Tensor apply(Tensor& layer) const;
+    Tensor& apply(Tensor& layer) const;
 
     /**
      * @brief apply the derivative of the function to a layer
@@ -61,17 +101,22 @@ class Activation {
      * Note: This function modifies the layer in place.
      *
      * @param layer The layer to apply the derivative to
-     * @return The result of applying the derivative to the layer
+     * @return The layer, after applying the derivative to it
+     * @throws std::invalid_argument If the layer does not hold floats
      */
-    Tensor apply_derivative(Tensor& layer) const;
+    Tensor& apply_derivative(Tensor& layer) const;
 
     /**
      * @brief apply the function to a layer
      *
      * Note: This function does not modify the layer.
      *
+     * A DTYPE_FLOAT64 layer is computed in double precision by double_kernel, and gives a DTYPE_FLOAT64 result.
+     *
      * @param layer The layer to apply the function to
      * @return The result of applying the function to the layer
+     * @throws std::runtime_error If the layer holds doubles and the activation has no double_kernel
+     * @throws std::invalid_argument If the layer holds integers
      */
     Tensor forward(const Tensor& layer) const;
 
@@ -82,6 +127,7 @@ class Activation {
      *
      * @param layer The layer to apply the derivative to
      * @return The result of applying the derivative to the layer
+     * @throws std::invalid_argument If the layer does not hold floats
      */
     Tensor backward(const Tensor& layer) const;
 };
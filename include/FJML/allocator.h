@@ -0,0 +1,178 @@
+// Copyright (c) 2023 David Lee
+// This code is licensed under MIT license (see LICENSE for details)
+
+#ifndef ALLOCATOR_INCLUDED
+#define ALLOCATOR_INCLUDED
+
+#include <cstddef>
+#include <vector>
+
+namespace FJML {
+
+/**
+ * @brief A caching allocator for tensor storage
+ *
+ * Every CPU tensor gets its storage from here. Freed blocks are kept in free lists, one per size class, and handed out
+ * again to later allocations of the same size class. Since training repeats the same shapes every step, after the
+ * first step almost every allocation is served from the cache instead of malloc.
+ */
+namespace Memory {
+
+/**
+ * @brief The alignment in bytes of every block returned by allocate
+ *
+ * This is the size of a cache line, so aligned AVX loads and stores may be used on tensor data.
+ */
+constexpr size_t ALIGNMENT = 64;
+
+/**
+ * @brief Counters describing the state of the allocator
+ */
+struct Stats {
+    /**
+     * @brief The number of allocations served from a free list or a step arena
+     */
+    size_t hits;
+    /**
+     * @brief The number of allocations that had to go to the system allocator
+     */
+    size_t misses;
+    /**
+     * @brief The number of bytes held in free lists, ready to be reused
+     */
+    size_t bytes_held;
+    /**
+     * @brief The number of bytes currently handed out to tensors
+     */
+    size_t bytes_in_use;
+};
+
+/**
+ * @brief Allocates a block of memory
+ *
+ * The block is taken from the current step arena of this thread if there is one, and from the size class cache
+ * otherwise.
+ *
+ * @param bytes The number of bytes to allocate
+ * @return A pointer to the block, aligned to ALIGNMENT bytes
+ */
+void* allocate(size_t bytes);
+
+/**
+ * @brief Returns a block of memory obtained from allocate
+ * @param ptr The block to free, may be nullptr
+ */
+void deallocate(void* ptr);
+
+/**
+ * @brief Returns the current allocator counters
+ * @return The counters
+ */
+Stats stats();
+
+/**
+ * @brief Resets the hit and miss counters
+ */
+void reset_stats();
+
+/**
+ * @brief Frees every cached block back to the system
+ *
+ * This only releases the free lists of the shared cache and of the calling thread.
+ */
+void release();
+
+/**
+ * @brief Sets the maximum number of bytes kept in the free lists
+ *
+ * Blocks freed while the cache is full are returned to the system instead.
+ *
+ * @param bytes The maximum number of cached bytes
+ */
+void set_cache_limit(size_t bytes);
+
+/**
+ * @brief Enables or disables per-thread free lists
+ *
+ * With per-thread free lists, a few blocks of each size class are cached by each thread without taking a lock. This
+ * helps when many threads allocate at once.
+ *
+ * @param enabled Whether to use per-thread free lists
+ */
+void set_thread_cache(bool enabled);
+
+/**
+ * @brief A scoped bump allocator for the temporaries of one training step
+ *
+ * While a StepArena is alive, all tensors allocated on the thread that created it are carved out of large chunks
+ * owned by the arena. Calling reset() at the end of a batch makes that memory available again in one go, without
+ * touching any free list.
+ *
+ * It is safe for a tensor to outlive a reset or the arena itself: a chunk that still contains live blocks is retired
+ * instead of reused, and is freed when its last block is freed.
+ */
+class StepArena {
+  public:
+    /**
+     * @brief Creates an arena and makes it the current arena of this thread
+     * @param chunk_size The size of each chunk in bytes
+     */
+    StepArena(size_t chunk_size = 1 << 22);
+
+    /**
+     * @brief Destructor, restores the previous arena of this thread
+     */
+    ~StepArena();
+
+    StepArena(const StepArena&) = delete;
+    StepArena& operator=(const StepArena&) = delete;
+
+    /**
+     * @brief Makes the memory allocated since the last reset available again
+     *
+     * Should be called at batch boundaries.
+     */
+    void reset();
+
+    /**
+     * @brief Allocates a block from the arena
+     * @param bytes The number of bytes to allocate
+     * @return A pointer to the block
+     */
+    void* allocate(size_t bytes);
+
+    /**
+     * @brief The number of bytes allocated since the last reset
+     * @return The number of bytes
+     */
+    size_t bytes_used() const;
+
+    /**
+     * @brief A chunk of memory that blocks are carved out of
+     */
+    struct Chunk;
+
+  private:
+    /**
+     * @brief The size of new chunks
+     */
+    size_t chunk_size;
+    /**
+     * @brief The chunks owned by this arena
+     */
+    std::vector<Chunk*> chunks;
+    /**
+     * @brief The index of the chunk currently being allocated from
+     */
+    size_t current;
+    /**
+     * @brief The arena that was active before this one
+     */
+    StepArena* previous;
+};
+
+} // namespace Memory
+
+} // namespace FJML
+
+#endif
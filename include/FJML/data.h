@@ -5,6 +5,14 @@
 #define DATA_INCLUDED
 
 #include <algorithm>
+#include <condition_variable>
+#include <exception>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
 
 #include "tensor.h"
 
@@ -18,18 +26,21 @@ namespace Data {
 /**
  * @brief One hot encoding of a Tensor x
  *
- * Assumes x is a tensor of integers. If x has shape (a, b, ...), the output will have shape (a, b, ..., n)
+ * Assumes x is a tensor of integers, stored as DTYPE_INT32 or as floats. If x has shape (a, b, ...), the output will
+ * have shape (a, b, ..., n)
  *
  * @param x The number to encode
  * @param n The total number of possible values
  * @return The one hot encoding of x
+ * @throws std::out_of_range If an element of x is not an integer in [0, n)
  */
 Tensor one_hot(Tensor x, int n);
 
 /**
  * @brief Split data into training and testing sets
  *
- * The data should be given as a matrix, where each row is a data point.
+ * The data should be given as a matrix, where each row is a data point. The rows are shuffled into one new buffer per
+ * set, and the training and testing sets are views into it.
  *
  * @param input_set The input data
  * @param output_set The output data
@@ -42,6 +53,417 @@ Tensor one_hot(Tensor x, int n);
 void split(const Tensor& input_set, const Tensor& output_set, Tensor& input_train, Tensor& output_train,
            Tensor& input_test, Tensor& output_test, float train_frac = 0.8);
 
+/**
+ * @brief Load a CSV file of numbers into one matrix
+ *
+ * The file is parsed in parallel: it is split into pieces at line boundaries, the rows of each piece are counted, and
+ * each piece is then parsed straight into its rows of one preallocated tensor. Blank lines are skipped, and every other
+ * line must have the same number of fields.
+ *
+ * @param filename The name of the file
+ * @param header Whether the first line of the file is a header to skip
+ * @param max_rows The largest number of rows to load, or -1 to load every row
+ * @return A matrix with one row per line of the file
+ */
+Tensor load_csv(const std::string& filename, bool header = true, long max_rows = -1);
+
+/**
+ * @brief Load a CSV file of numbers, with one column of labels
+ *
+ * Like the other overload, but the label column is written to y, with shape (rows, 1), and the other columns to x.
+ * With label_dtype DTYPE_INT32, the labels are instead stored as integers of shape (rows), ready for the losses and
+ * metrics that take class indices.
+ *
+ * @param filename The name of the file
+ * @param x Set to the inputs, with one row per line of the file
+ * @param y Set to the labels, or left unchanged if label_column is -1
+ * @param label_column The index of the column holding the labels, or -1 if there is none
+ * @param header Whether the first line of the file is a header to skip
+ * @param max_rows The largest number of rows to load, or -1 to load every row
+ * @param label_dtype The type to store the labels as, DTYPE_FLOAT32 or DTYPE_INT32
+ * @throws std::runtime_error If the labels are DTYPE_INT32 and one is not an integer
+ */
+void load_csv(const std::string& filename, Tensor& x, Tensor& y, int label_column = 0, bool header = true,
+              long max_rows = -1, DType label_dtype = DTYPE_FLOAT32);
+
+/**
+ * @brief Save a tensor to a raw binary file
+ *
+ * The file is a 64 byte header with the shape and element type of the tensor, followed by its elements as native
+ * floats, row after row, so that it can be loaded back with a single read or memory mapped (see MappedDataset).
+ *
+ * @param filename The name of the file
+ * @param data The tensor to save
+ */
+void save_binary(const std::string& filename, const Tensor& data);
+
+/**
+ * @brief Load a tensor saved with save_binary
+ * @param filename The name of the file
+ * @return The tensor
+ */
+Tensor load_binary(const std::string& filename);
+
+/**
+ * @brief Convert a CSV file to binary data files, without loading the whole file
+ *
+ * The rows are read in batches with a CsvStream and appended to the files, so this works on files larger than memory.
+ * The inputs and the labels are written to separate files, which can be loaded with load_binary or mapped with
+ * MappedDataset.
+ *
+ * @param csv_file The name of the CSV file
+ * @param x_file The name of the file to write the inputs to
+ * @param y_file The name of the file to write the labels to, with shape (rows, 1), ignored if label_column is -1
+ * @param label_column The index of the column holding the labels, or -1 if there is none
+ * @param header Whether the first line of the CSV file is a header to skip
+ */
+void csv_to_binary(const std::string& csv_file, const std::string& x_file, const std::string& y_file,
+                   int label_column = 0, bool header = true);
+
+/**
+ * @brief A binary data file mapped into memory
+ *
+ * Nothing is read when the file is opened: the pages of the file are read by the operating system when rows are
+ * first accessed, and are dropped from memory again under memory pressure, so files much larger than memory can be
+ * trained on. The mapping is private, so writing to a view copies the page it is in and never changes the file. The
+ * file stays mapped while any copy of the dataset or any view into it exists.
+ *
+ * Tensors hold fewer than 2^31 elements, so larger files can only be viewed a range of rows at a time.
+ */
+class MappedDataset {
+    /**
+     * @brief The first element of the file, whose deleter unmaps the file
+     */
+    std::shared_ptr<float> storage;
+    /**
+     * @brief The shape of the data, the first dimension being the rows
+     */
+    std::vector<int> data_shape;
+    /**
+     * @brief The number of elements in a row
+     */
+    long row_elements;
+
+  public:
+    /**
+     * @brief Map a file written by save_binary or csv_to_binary
+     * @param filename The name of the file
+     */
+    MappedDataset(const std::string& filename);
+
+    /**
+     * @brief The shape of the data
+     * @return The shape, the first dimension being the number of rows
+     */
+    const std::vector<int>& shape() const;
+
+    /**
+     * @brief The number of rows of the data
+     * @return The number of rows
+     */
+    int num_rows() const;
+
+    /**
+     * @brief The number of elements in a row
+     * @return The number of elements
+     */
+    long row_size() const;
+
+    /**
+     * @brief The elements of a row
+     * @param i The index of the row
+     * @return A pointer to the first element of the row, followed by the rest of the rows
+     */
+    const float* row(int i) const;
+
+    /**
+     * @brief A view of a range of rows, without copying them
+     * @param start The first row
+     * @param end One past the last row
+     * @return A tensor whose first dimension has end - start rows
+     */
+    Tensor rows(int start, int end) const;
+
+    /**
+     * @brief A view of all the data, without copying it
+     * @return A tensor with the shape of the data
+     */
+    Tensor tensor() const;
+
+    /**
+     * @brief Hint that a range of rows will be read soon, so that the operating system starts reading them in
+     * @param start The first row
+     * @param end One past the last row
+     */
+    void prefetch(int start, int end) const;
+
+    /**
+     * @brief Hint that a range of rows will not be read for a while, so that its pages are dropped from memory first
+     * @param start The first row
+     * @param end One past the last row
+     */
+    void release(int start, int end) const;
+};
+
+/**
+ * @brief Reads batches from a CSV file without loading the whole file
+ *
+ * Only the bytes of the current batch are kept in memory, so files larger than memory can be trained on one batch at
+ * a time. The rows of each batch are parsed in parallel, like load_csv.
+ */
+class CsvStream {
+    /**
+     * @brief The file being read
+     */
+    std::ifstream file;
+    /**
+     * @brief The name of the file, used in error messages
+     */
+    std::string filename;
+    /**
+     * @brief The index of the column holding the labels, or -1 if there is none
+     */
+    int label_column;
+    /**
+     * @brief The number of fields on each line
+     */
+    int columns;
+    /**
+     * @brief Whether the first line of the file is a header
+     */
+    bool header;
+    /**
+     * @brief The type the labels are stored as
+     */
+    DType label_dtype;
+    /**
+     * @brief The bytes read from the file but not parsed yet, starting at begin
+     */
+    std::string buffer;
+    /**
+     * @brief The position in the buffer of the first byte not parsed yet
+     */
+    size_t begin;
+    /**
+     * @brief The number of rows returned so far, used in error messages
+     */
+    long rows_read;
+
+    /**
+     * @brief Read more of the file into the buffer
+     * @return Whether anything was read
+     */
+    bool fill();
+
+    /**
+     * @brief Move to the first row of the file
+     */
+    void start();
+
+  public:
+    /**
+     * @brief Open a CSV file
+     *
+     * The number of fields is taken from the first row.
+     *
+     * @param filename The name of the file
+     * @param label_column The index of the column holding the labels, or -1 if there is none
+     * @param header Whether the first line of the file is a header to skip
+     * @param label_dtype The type to store the labels as, DTYPE_FLOAT32 or DTYPE_INT32, like in load_csv
+     */
+    CsvStream(const std::string& filename, int label_column = 0, bool header = true,
+              DType label_dtype = DTYPE_FLOAT32);
+
+    /**
+     * @brief The number of fields on each line of the file
+     * @return The number of fields
+     */
+    int num_columns() const;
+
+    /**
+     * @brief Read the next batch
+     *
+     * The last batch of the file has the rest of the rows. After it, this returns false until rewind() is called.
+     *
+     * @param batch_size The largest number of rows in the batch
+     * @param x Set to the inputs of the batch
+     * @param y Set to the labels of the batch, with shape (rows, 1) for DTYPE_FLOAT32 labels and (rows) for DTYPE_INT32
+     * labels, or left unchanged if there is no label column
+     * @return Whether there were rows left to read
+     */
+    bool next(int batch_size, Tensor& x, Tensor& y);
+
+    /**
+     * @brief Start reading from the first row again
+     */
+    void rewind();
+};
+
+/**
+ * @brief Assembles shuffled batches on a background thread
+ *
+ * A background thread shuffles the rows of the data every epoch and copies them, batch by batch, into a ring of
+ * preallocated buffers, staying up to the size of the ring ahead of the consumer. When a training step finishes, the
+ * next batch is usually ready, so gathering the rows is off the critical path.
+ *
+ * The batches run on from one epoch into the next: after num_batches() batches, the next epoch starts with a new
+ * order. Every batch has batch_size rows except the last one of each epoch, which has the rest.
+ *
+ * The rows can also be shuffled in blocks: the data is cut into blocks of consecutive rows, the order of the blocks is
+ * shuffled, and the rows are shuffled within each block. A batch then reads from one or two blocks rather than from
+ * rows all over the data, so a dataset mapped from disk is read in long runs. When the data is a MappedDataset, the
+ * next block is prefetched while the current one is read, and blocks are released once they have been read. The
+ * batches are less random than with a full shuffle, so blocks should hold many batches.
+ */
+class BatchLoader {
+    /**
+     * @brief A buffer of the ring
+     */
+    struct Slot {
+        Tensor x;
+        Tensor y;
+        int rows;
+    };
+
+    /**
+     * @brief The input and target data when they are tensors, kept alive while the loader reads them
+     */
+    Tensor x, y;
+    /**
+     * @brief The input and target data when they are mapped from files, or nullptr
+     */
+    std::unique_ptr<MappedDataset> x_file, y_file;
+    /**
+     * @brief The first bytes of the input and target data
+     */
+    const char *x_data, *y_data;
+    /**
+     * @brief The number of bytes in a row of the input and target data
+     */
+    size_t x_row, y_row;
+    /**
+     * @brief The number of rows of the data
+     */
+    int rows;
+    /**
+     * @brief The number of rows in a batch
+     */
+    int batch_size;
+    /**
+     * @brief Whether the rows are shuffled every epoch
+     */
+    bool shuffle;
+    /**
+     * @brief The number of rows in a block, or 0 to shuffle the rows without blocks
+     */
+    int block_rows;
+    /**
+     * @brief The ring of buffers, batch i is assembled in slots[i % slots.size()]
+     */
+    std::vector<Slot> slots;
+
+    /**
+     * @brief Guards the counters below
+     */
+    std::mutex mutex;
+    /**
+     * @brief Signalled when a batch is assembled or released
+     */
+    std::condition_variable cv;
+    /**
+     * @brief The number of batches assembled, and the number the consumer is done with
+     */
+    long produced, consumed;
+    /**
+     * @brief Whether the consumer holds the batch at index consumed
+     */
+    bool holding;
+    /**
+     * @brief Set by the destructor to stop the background thread
+     */
+    bool stopping;
+    /**
+     * @brief The error the background thread stopped with, if any
+     */
+    std::exception_ptr error;
+    /**
+     * @brief The background thread
+     */
+    std::thread worker;
+
+    /**
+     * @brief The loop of the background thread
+     * @param seed The seed of the generator the orders are drawn from
+     */
+    void produce(unsigned seed);
+
+    /**
+     * @brief Check the settings, allocate the ring and start the background thread
+     * @param x_shape The shape of the input data
+     * @param y_shape The shape of the target data
+     * @param y_dtype The type of the target data
+     * @param prefetch The number of buffers in the ring
+     */
+    void start(std::vector<int> x_shape, std::vector<int> y_shape, DType y_dtype, int prefetch);
+
+  public:
+    /**
+     * @brief Start loading batches
+     *
+     * The data is not copied if it is contiguous, so it must not be modified while the loader exists.
+     *
+     * @param x The input data, one row per data point
+     * @param y The target data, with the same number of rows, of any dtype, such as DTYPE_INT32 class labels
+     * @param batch_size The number of rows in a batch
+     * @param shuffle Whether to shuffle the rows every epoch, or keep them in order
+     * @param prefetch The number of buffers in the ring, at least 2 for a batch to be assembled while the previous one
+     * is used
+     * @param block_rows The number of rows in a block to shuffle the rows in blocks, or 0 to shuffle them all
+     */
+    BatchLoader(const Tensor& x, const Tensor& y, int batch_size, bool shuffle = true, int prefetch = 2,
+                int block_rows = 0);
+
+    /**
+     * @brief Start loading batches from mapped files
+     *
+     * Only the blocks being read need to be in memory, so the files may be larger than memory when block_rows is set.
+     *
+     * @param x The input data, one row per data point
+     * @param y The target data, with the same number of rows
+     * @param batch_size The number of rows in a batch
+     * @param shuffle Whether to shuffle the rows every epoch, or keep them in order
+     * @param prefetch The number of buffers in the ring
+     * @param block_rows The number of rows in a block to shuffle the rows in blocks, or 0 to shuffle them all
+     */
+    BatchLoader(const MappedDataset& x, const MappedDataset& y, int batch_size, bool shuffle = true, int prefetch = 2,
+                int block_rows = 0);
+
+    /**
+     * @brief Stop the background thread
+     */
+    ~BatchLoader();
+
+    BatchLoader(const BatchLoader&) = delete;
+    BatchLoader& operator=(const BatchLoader&) = delete;
+
+    /**
+     * @brief The number of batches in an epoch
+     * @return The number of batches
+     */
+    int num_batches() const;
+
+    /**
+     * @brief Get the next batch
+     *
+     * Waits until the batch is ready. The batch is a view of a buffer of the ring, which stays valid until the next
+     * call. Errors of the background thread are rethrown here.
+     *
+     * @param x_batch Set to the inputs of the batch
+     * @param y_batch Set to the targets of the batch
+     */
+    void next(Tensor& x_batch, Tensor& y_batch);
+};
+
 } // namespace Data
 
 } // namespace FJML
@@ -0,0 +1,585 @@
+// Copyright (c) 2023 David Lee
+// This code is licensed under MIT license (see LICENSE for details)
+
+#ifndef EXPRESSION_INCLUDED
+#define EXPRESSION_INCLUDED
+
+#include <cmath>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "parallel.h"
+#include "tensor.h"
+
+namespace FJML {
+
+/**
+ * @brief The base class of all expression nodes
+ *
+ * E is the type of the node itself, so that the operators can recover the full type of an expression at compile time.
+ */
+template <typename E> struct Expression {
+    /**
+     * @brief Returns the node as its actual type
+     * @return the node
+     */
+    const E& self() const { return static_cast<const E&>(*this); }
+};
+
+/**
+ * @brief Lazy elementwise arithmetic on tensors
+ *
+ * The arithmetic operators on tensors do not compute anything by themselves. Instead they build a small expression
+ * tree, which is evaluated when it is assigned to a tensor (or converted to one). If every tensor in the tree holds
+ * floats, lives on the CPU, is contiguous and has the shape of the result, the whole tree is evaluated in a single
+ * loop, without any temporary tensors. Otherwise each node is evaluated on its own, with broadcasting, by the kernels
+ * for the type of its elements.
+ *
+ * Expression nodes refer to the named tensors they were built from, and take ownership of temporary tensors, such as
+ * the result of a function call. An expression can therefore be stored in an `auto` variable or returned, as long as
+ * the named tensors in it outlive it, like any reference to them.
+ */
+namespace Expressions {
+
+using Parallel::PARALLEL_THRESHOLD;
+
+/**
+ * @brief The elementwise operations between two operands
+ */
+enum BinaryOp { OP_ADD, OP_SUBTRACT, OP_MULTIPLY, OP_DIVIDE };
+
+/**
+ * @brief The elementwise operations on a single operand
+ */
+enum UnaryOp { OP_NEGATE, OP_SQRT };
+
+/**
+ * @brief Computes an elementwise operation between two tensors, broadcasting them
+ * @param op the operation
+ * @param a the left operand
+ * @param b the right operand
+ * @return the result
+ */
+Tensor compute(BinaryOp op, const Tensor& a, const Tensor& b);
+
+/**
+ * @brief Computes an elementwise operation between a tensor and a scalar
+ * @param op the operation
+ * @param a the tensor
+ * @param b the scalar
+ * @return the result
+ */
+Tensor compute(BinaryOp op, const Tensor& a, float b);
+
+/**
+ * @brief Computes an elementwise operation between a scalar and a tensor
+ * @param op the operation
+ * @param a the scalar
+ * @param b the tensor
+ * @return the result
+ */
+Tensor compute(BinaryOp op, float a, const Tensor& b);
+
+/**
+ * @brief Computes an elementwise operation on a tensor
+ * @param op the operation
+ * @param a the tensor
+ * @return the result
+ */
+Tensor compute(UnaryOp op, const Tensor& a);
+
+/**
+ * @brief Computes the shape two operands of an elementwise operation are broadcast to
+ * @param op the operation, used in the error message when the shapes are incompatible
+ * @param a the shape of the first operand
+ * @param b the shape of the second operand
+ * @return the broadcast shape
+ */
+std::vector<int> broadcast_shape(BinaryOp op, const std::vector<int>& a, const std::vector<int>& b);
+
+struct Add {
+    static constexpr BinaryOp op = OP_ADD;
+    static float apply(float a, float b) { return a + b; }
+};
+
+struct Subtract {
+    static constexpr BinaryOp op = OP_SUBTRACT;
+    static float apply(float a, float b) { return a - b; }
+};
+
+struct Multiply {
+    static constexpr BinaryOp op = OP_MULTIPLY;
+    static float apply(float a, float b) { return a * b; }
+};
+
+struct Divide {
+    static constexpr BinaryOp op = OP_DIVIDE;
+    static float apply(float a, float b) { return a / b; }
+};
+
+struct Negate {
+    static constexpr UnaryOp op = OP_NEGATE;
+    static float apply(float a) { return -a; }
+};
+
+struct Sqrt {
+    static constexpr UnaryOp op = OP_SQRT;
+    static float apply(float a) { return std::sqrt(a); }
+};
+
+/**
+ * @brief A leaf of an expression that refers to a tensor
+ */
+struct TensorLeaf : Expression<TensorLeaf> {
+    /**
+     * @brief The tensor
+     */
+    const Tensor& tensor;
+    /**
+     * @brief The data of the tensor
+     */
+    const float* data;
+
+    TensorLeaf(const Tensor& tensor) : tensor{tensor}, data{tensor.data} {}
+
+    const std::vector<int>& shape() const { return tensor.shape; }
+    bool fusable(const std::vector<int>& shape) const {
+        return tensor.dtype == DTYPE_FLOAT32 && tensor.device == DEVICE_CPU && tensor.is_contiguous() &&
+               tensor.shape == shape;
+    }
+    float eval(long i) const { return data[i]; }
+};
+
+/**
+ * @brief A leaf of an expression that owns a temporary tensor
+ *
+ * The tensor is shared between the copies of the node, so building a larger expression on top of it does not copy its
+ * elements.
+ */
+struct OwnedLeaf : Expression<OwnedLeaf> {
+    /**
+     * @brief The tensor
+     */
+    std::shared_ptr<const Tensor> tensor;
+    /**
+     * @brief The data of the tensor
+     */
+    const float* data;
+
+    OwnedLeaf(Tensor&& tensor) : tensor{std::make_shared<const Tensor>(std::move(tensor))}, data{this->tensor->data} {}
+
+    const std::vector<int>& shape() const { return tensor->shape; }
+    bool fusable(const std::vector<int>& shape) const {
+        return tensor->dtype == DTYPE_FLOAT32 && tensor->device == DEVICE_CPU && tensor->is_contiguous() &&
+               tensor->shape == shape;
+    }
+    float eval(long i) const { return data[i]; }
+};
+
+/**
+ * @brief A leaf of an expression that holds a scalar
+ */
+struct ScalarLeaf : Expression<ScalarLeaf> {
+    /**
+     * @brief The scalar
+     */
+    float value;
+
+    /**
+     * @brief The shape of a scalar, which broadcasts to any shape
+     */
+    std::vector<int> scalar_shape;
+
+    ScalarLeaf(float value) : value{value} {}
+
+    const std::vector<int>& shape() const { return scalar_shape; }
+    bool fusable(const std::vector<int>&) const { return true; }
+    float eval(long) const { return value; }
+};
+
+/**
+ * @brief A node of an expression applying an elementwise operation to two sub-expressions
+ */
+template <typename Op, typename L, typename R> struct BinaryExpr : Expression<BinaryExpr<Op, L, R>> {
+    L lhs;
+    R rhs;
+    /**
+     * @brief The shape of the result, computed when the node is built so that incompatible shapes are reported there
+     */
+    std::vector<int> result_shape;
+
+    BinaryExpr(const L& lhs, const R& rhs)
+        : lhs{lhs}, rhs{rhs}, result_shape{broadcast_shape(Op::op, lhs.shape(), rhs.shape())} {}
+
+    const std::vector<int>& shape() const { return result_shape; }
+    bool fusable(const std::vector<int>& shape) const { return lhs.fusable(shape) && rhs.fusable(shape); }
+    float eval(long i) const { return Op::apply(lhs.eval(i), rhs.eval(i)); }
+    Tensor materialize() const;
+};
+
+/**
+ * @brief A node of an expression applying an elementwise operation to a sub-expression
+ */
+template <typename Op, typename E> struct UnaryExpr : Expression<UnaryExpr<Op, E>> {
+    E expr;
+
+    UnaryExpr(const E& expr) : expr{expr} {}
+
+    const std::vector<int>& shape() const { return expr.shape(); }
+    bool fusable(const std::vector<int>& shape) const { return expr.fusable(shape); }
+    float eval(long i) const { return Op::apply(expr.eval(i)); }
+    Tensor materialize() const;
+};
+
+/**
+ * @brief Evaluates a sub-expression on its own, for the node by node fallback
+ */
+inline const Tensor& evaluate(const TensorLeaf& e) { return e.tensor; }
+
+inline const Tensor& evaluate(const OwnedLeaf& e) { return *e.tensor; }
+
+inline float evaluate(const ScalarLeaf& e) { return e.value; }
+
+template <typename Op, typename L, typename R> Tensor evaluate(const BinaryExpr<Op, L, R>& e) { return e.materialize(); }
+
+template <typename Op, typename E> Tensor evaluate(const UnaryExpr<Op, E>& e) { return e.materialize(); }
+
+template <typename Op, typename L, typename R> Tensor BinaryExpr<Op, L, R>::materialize() const {
+    return compute(Op::op, evaluate(lhs), evaluate(rhs));
+}
+
+template <typename Op, typename E> Tensor UnaryExpr<Op, E>::materialize() const {
+    return compute(Op::op, evaluate(expr));
+}
+
+/**
+ * @brief Whether a type can be an operand of the tensor arithmetic operators
+ */
+template <typename T>
+struct is_operand
+    : std::integral_constant<bool, std::is_same<T, Tensor>::value || std::is_base_of<Expression<T>, T>::value> {};
+
+/**
+ * @brief Whether the type an operator deduces for its operand, a reference for lvalues, can be an operand
+ */
+template <typename T> using is_operand_ref = is_operand<typename std::decay<T>::type>;
+
+inline TensorLeaf as_expression(const Tensor& t) { return TensorLeaf(t); }
+
+inline OwnedLeaf as_expression(Tensor&& t) { return OwnedLeaf(std::move(t)); }
+
+inline OwnedLeaf as_expression(const Tensor&& t) { return OwnedLeaf(Tensor(t)); }
+
+template <typename E> const E& as_expression(const Expression<E>& e) { return e.self(); }
+
+/**
+ * @brief The node type an operand is stored as, given the type the operator deduced for it
+ *
+ * Named tensors are referred to, temporary tensors are owned, and expressions are copied.
+ */
+template <typename T> struct node {
+    using type = typename std::decay<T>::type;
+};
+
+template <> struct node<Tensor&> {
+    using type = TensorLeaf;
+};
+
+template <> struct node<const Tensor&> {
+    using type = TensorLeaf;
+};
+
+template <> struct node<Tensor> {
+    using type = OwnedLeaf;
+};
+
+template <> struct node<const Tensor> {
+    using type = OwnedLeaf;
+};
+
+template <typename T> using node_t = typename node<T>::type;
+
+template <typename Op, typename A, typename B>
+using enable_binary_t = typename std::enable_if<is_operand_ref<A>::value && is_operand_ref<B>::value,
+                                                BinaryExpr<Op, node_t<A>, node_t<B>>>::type;
+
+template <typename Op, typename A>
+using enable_tensor_scalar_t =
+    typename std::enable_if<is_operand_ref<A>::value, BinaryExpr<Op, node_t<A>, ScalarLeaf>>::type;
+
+template <typename Op, typename A>
+using enable_scalar_tensor_t =
+    typename std::enable_if<is_operand_ref<A>::value, BinaryExpr<Op, ScalarLeaf, node_t<A>>>::type;
+
+template <typename Op, typename A>
+using enable_unary_t = typename std::enable_if<is_operand_ref<A>::value, UnaryExpr<Op, node_t<A>>>::type;
+
+/**
+ * @brief Evaluates an expression in a single loop, into contiguous memory of the shape of the expression
+ * @param out the memory to write to, which may be the data of a tensor in the expression
+ * @param expr the expression
+ * @param n the number of elements
+ */
+template <typename E> void evaluate_into(float* out, const E& expr, long n) {
+    Parallel::parallel_for(n, [&](long begin, long end) {
+        for (long i = begin; i < end; i++) {
+            out[i] = expr.eval(i);
+        }
+    });
+}
+
+} // namespace Expressions
+
+template <typename E> Tensor::Tensor(const Expression<E>& expr) : Tensor() { *this = expr; }
+
+template <typename E> Tensor& Tensor::operator=(const Expression<E>& expr) {
+    const E& e = expr.self();
+    const std::vector<int>& result_shape = e.shape();
+    if (!e.fusable(result_shape)) {
+        return *this = e.materialize();
+    }
+    // The loop reads element i of every operand before writing element i, so the result may be written over one of
+    // the operands, as long as no other tensor shares the memory
+    if (dtype == DTYPE_FLOAT32 && device == DEVICE_CPU && data != nullptr && storage.use_count() == 1 &&
+        is_contiguous() && shape == result_shape) {
+        Expressions::evaluate_into(data, e, data_size[0]);
+        return *this;
+    }
+    Tensor result(result_shape, uninitialized);
+    Expressions::evaluate_into(result.data, e, result.data_size[0]);
+    return *this = std::move(result);
+}
+
+template <typename E> Tensor& Tensor::operator+=(const Expression<E>& expr) {
+    return compound_assign<Expressions::Add>(expr.self());
+}
+
+template <typename E> Tensor& Tensor::operator-=(const Expression<E>& expr) {
+    return compound_assign<Expressions::Subtract>(expr.self());
+}
+
+template <typename E> Tensor& Tensor::operator*=(const Expression<E>& expr) {
+    return compound_assign<Expressions::Multiply>(expr.self());
+}
+
+template <typename E> Tensor& Tensor::operator/=(const Expression<E>& expr) {
+    return compound_assign<Expressions::Divide>(expr.self());
+}
+
+template <typename Op, typename E> Tensor& Tensor::compound_assign(const E& e) {
+    if (dtype == DTYPE_FLOAT32 && device == DEVICE_CPU && is_contiguous() && e.fusable(shape)) {
+        Expressions::evaluate_into(data, Expressions::BinaryExpr<Op, Expressions::TensorLeaf, E>(*this, e),
+                                   data_size[0]);
+        return *this;
+    }
+    Tensor other = e.materialize();
+    switch (Op::op) {
+    case Expressions::OP_ADD:
+        return *this += other;
+    case Expressions::OP_SUBTRACT:
+        return *this -= other;
+    case Expressions::OP_MULTIPLY:
+        return *this *= other;
+    default:
+        return *this /= other;
+    }
+}
+
+/**
+ * @brief Element-wise sum of two tensors or expressions, with broadcasting
+ * @param a the first operand
+ * @param b the second operand
+ * @return an expression for the sum
+ */
+template <typename A, typename B> Expressions::enable_binary_t<Expressions::Add, A, B> operator+(A&& a, B&& b) {
+    return {Expressions::as_expression(std::forward<A>(a)), Expressions::as_expression(std::forward<B>(b))};
+}
+
+/**
+ * @brief Element-wise difference of two tensors or expressions, with broadcasting
+ * @param a the first operand
+ * @param b the second operand
+ * @return an expression for the difference
+ */
+template <typename A, typename B>
+Expressions::enable_binary_t<Expressions::Subtract, A, B> operator-(A&& a, B&& b) {
+    return {Expressions::as_expression(std::forward<A>(a)), Expressions::as_expression(std::forward<B>(b))};
+}
+
+/**
+ * @brief Element-wise product of two tensors or expressions, with broadcasting
+ *
+ * Note: this is element-wise multiplication, not matrix multiplication
+ *
+ * @param a the first operand
+ * @param b the second operand
+ * @return an expression for the product
+ */
+template <typename A, typename B>
+Expressions::enable_binary_t<Expressions::Multiply, A, B> operator*(A&& a, B&& b) {
+    return {Expressions::as_expression(std::forward<A>(a)), Expressions::as_expression(std::forward<B>(b))};
+}
+
+/**
+ * @brief Element-wise quotient of two tensors or expressions, with broadcasting
+ *
+ * Note: this is element-wise division, not matrix division
+ *
+ * @param a the first operand
+ * @param b the second operand
+ * @return an expression for the quotient
+ */
+template <typename A, typename B>
+Expressions::enable_binary_t<Expressions::Divide, A, B> operator/(A&& a, B&& b) {
+    return {Expressions::as_expression(std::forward<A>(a)), Expressions::as_expression(std::forward<B>(b))};
+}
+
+/**
+ * @brief Addition of a scalar to a tensor or expression
+ * @param a the tensor or expression
+ * @param b the scalar
+ * @return an expression for the sum
+ */
+template <typename A> Expressions::enable_tensor_scalar_t<Expressions::Add, A> operator+(A&& a, float b) {
+    return {Expressions::as_expression(std::forward<A>(a)), b};
+}
+
+/**
+ * @brief Subtraction of a scalar from a tensor or expression
+ * @param a the tensor or expression
+ * @param b the scalar
+ * @return an expression for the difference
+ */
+template <typename A> Expressions::enable_tensor_scalar_t<Expressions::Subtract, A> operator-(A&& a, float b) {
+    return {Expressions::as_expression(std::forward<A>(a)), b};
+}
+
+/**
+ * @brief Product of a tensor or expression and a scalar
+ * @param a the tensor or expression
+ * @param b the scalar
+ * @return an expression for the product
+ */
+template <typename A> Expressions::enable_tensor_scalar_t<Expressions::Multiply, A> operator*(A&& a, float b) {
+    return {Expressions::as_expression(std::forward<A>(a)), b};
+}
+
+/**
+ * @brief Division of a tensor or expression by a scalar
+ * @param a the tensor or expression
+ * @param b the scalar
+ * @return an expression for the quotient
+ */
+template <typename A> Expressions::enable_tensor_scalar_t<Expressions::Divide, A> operator/(A&& a, float b) {
+    return {Expressions::as_expression(std::forward<A>(a)), b};
+}
+
+/**
+ * @brief Addition of a tensor or expression to a scalar
+ * @param a the scalar
+ * @param b the tensor or expression
+ * @return an expression for the sum
+ */
+template <typename B> Expressions::enable_scalar_tensor_t<Expressions::Add, B> operator+(float a, B&& b) {
+    return {a, Expressions::as_expression(std::forward<B>(b))};
+}
+
+/**
+ * @brief Subtraction of a tensor or expression from a scalar
+ * @param a the scalar
+ * @param b the tensor or expression
+ * @return an expression for the difference
+ */
+template <typename B> Expressions::enable_scalar_tensor_t<Expressions::Subtract, B> operator-(float a, B&& b) {
+    return {a, Expressions::as_expression(std::forward<B>(b))};
+}
+
+/**
+ * @brief Scalar times a tensor or expression
+ * @param a the scalar
+ * @param b the tensor or expression
+ * @return an expression for the product
+ */
+template <typename B> Expressions::enable_scalar_tensor_t<Expressions::Multiply, B> operator*(float a, B&& b) {
+    return {a, Expressions::as_expression(std::forward<B>(b))};
+}
+
+/**
+ * @brief Division of a scalar by a tensor or expression
+ * @param a the scalar
+ * @param b the tensor or expression
+ * @return an expression for the quotient
+ */
+template <typename B> Expressions::enable_scalar_tensor_t<Expressions::Divide, B> operator/(float a, B&& b) {
+    return {a, Expressions::as_expression(std::forward<B>(b))};
+}
+
+/**
+ * @brief Negation of a tensor or expression
+ * @param a the tensor or expression
+ * @return an expression for the negation
+ */
+template <typename A> Expressions::enable_unary_t<Expressions::Negate, A> operator-(A&& a) {
+    return {Expressions::as_expression(std::forward<A>(a))};
+}
+
+/**
+ * @brief Checks if an expression evaluates to a tensor
+ * @param a the expression
+ * @param b the tensor
+ * @return true if the two are equal, false otherwise
+ */
+template <typename E> bool operator==(const Expression<E>& a, const Tensor& b) { return Tensor(a) == b; }
+
+/**
+ * @brief Checks if a tensor is equal to the value of an expression
+ * @param a the tensor
+ * @param b the expression
+ * @return true if the two are equal, false otherwise
+ */
+template <typename E> bool operator==(const Tensor& a, const Expression<E>& b) { return a == Tensor(b); }
+
+/**
+ * @brief Checks if two expressions evaluate to the same tensor
+ * @param a the first expression
+ * @param b the second expression
+ * @return true if the two are equal, false otherwise
+ */
+template <typename E, typename F> bool operator==(const Expression<E>& a, const Expression<F>& b) {
+    return Tensor(a) == Tensor(b);
+}
+
+/**
+ * @brief Checks if an expression does not evaluate to a tensor
+ * @param a the expression
+ * @param b the tensor
+ * @return true if the two are not equal, false otherwise
+ */
+template <typename E> bool operator!=(const Expression<E>& a, const Tensor& b) { return !(a == b); }
+
+/**
+ * @brief Checks if a tensor is not equal to the value of an expression
+ * @param a the tensor
+ * @param b the expression
+ * @return true if the two are not equal, false otherwise
+ */
+template <typename E> bool operator!=(const Tensor& a, const Expression<E>& b) { return !(a == b); }
+
+namespace LinAlg {
+
+/**
+ * @brief Element-wise square root of a tensor or expression
+ * @param a the tensor or expression
+ * @return an expression for the square root
+ */
+template <typename A> Expressions::enable_unary_t<Expressions::Sqrt, A> sqrt(A&& a) {
+    return {Expressions::as_expression(std::forward<A>(a))};
+}
+
+} // namespace LinAlg
+
+} // namespace FJML
+
+#endif
@@ -0,0 +1,143 @@
+// Copyright (c) 2023 David Lee
+// This code is licensed under MIT license (see LICENSE for details)
+
+#ifndef HALF_INCLUDED
+#define HALF_INCLUDED
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "tensor.h"
+
+namespace FJML {
+
+/**
+ * @brief Conversions between floats and 16 bit formats
+ *
+ * Floats are rounded to the nearest 16 bit value, ties to even. NaNs stay NaNs, and floats beyond the range of float16
+ * become infinities.
+ */
+namespace Half {
+
+/**
+ * @brief Convert a float to bfloat16
+ * @param x The float
+ * @return The bits of the nearest bfloat16
+ */
+inline uint16_t to_bfloat16(float x) {
+    uint32_t bits;
+    std::memcpy(&bits, &x, sizeof(bits));
+    if ((bits & 0x7fffffff) > 0x7f800000) {
+        // Keep NaNs quiet, rounding could turn their payload into an infinity
+        return (bits >> 16) | 0x40;
+    }
+    bits += 0x7fff + ((bits >> 16) & 1);
+    return bits >> 16;
+}
+
+/**
+ * @brief Convert a bfloat16 to a float, which is exact
+ * @param x The bits of the bfloat16
+ * @return The float
+ */
+inline float from_bfloat16(uint16_t x) {
+    uint32_t bits = (uint32_t)x << 16;
+    float result;
+    std::memcpy(&result, &bits, sizeof(result));
+    return result;
+}
+
+/**
+ * @brief Convert a float to float16
+ * @param x The float
+ * @return The bits of the nearest float16
+ */
+uint16_t to_float16(float x);
+
+/**
+ * @brief Convert a float16 to a float, which is exact
+ * @param x The bits of the float16
+ * @return The float
+ */
+float from_float16(uint16_t x);
+
+/**
+ * @brief Convert an array of floats to a 16 bit format
+ *
+ * Uses AVX2, and F16C for float16, when they are available.
+ *
+ * @param in The floats
+ * @param out Where the 16 bit values are written
+ * @param n The number of elements
+ * @param dtype DTYPE_BFLOAT16 or DTYPE_FLOAT16
+ */
+void convert(const float* in, uint16_t* out, long n, DType dtype);
+
+/**
+ * @brief Convert an array of 16 bit values to floats
+ * @param in The 16 bit values
+ * @param out Where the floats are written
+ * @param n The number of elements
+ * @param dtype DTYPE_BFLOAT16 or DTYPE_FLOAT16
+ */
+void convert(const uint16_t* in, float* out, long n, DType dtype);
+
+} // namespace Half
+
+/**
+ * @brief A contiguous tensor stored in a 16 bit format
+ *
+ * This takes half the memory of a Tensor, and half the memory bandwidth to read. It only stores data: convert it back
+ * with to_float, or pass it to the routines that take one, such as LinAlg::gemm, which convert its elements to floats
+ * as they load them.
+ */
+class HalfTensor {
+  public:
+    /**
+     * @brief A pointer to the first element, the elements are stored in row-major order
+     */
+    uint16_t* data;
+    /**
+     * @brief The buffer the data lives in
+     */
+    std::shared_ptr<uint16_t> storage;
+    /**
+     * @brief The shape of the tensor
+     */
+    std::vector<int> shape;
+    /**
+     * @brief The format of the elements, DTYPE_BFLOAT16 or DTYPE_FLOAT16
+     */
+    DType dtype;
+
+    /**
+     * @brief Creates an empty tensor
+     */
+    HalfTensor();
+
+    /**
+     * @brief Converts a tensor to a 16 bit format
+     * @param tensor The tensor, which must be on the CPU
+     * @param dtype DTYPE_BFLOAT16 or DTYPE_FLOAT16
+     */
+    HalfTensor(const Tensor& tensor, DType dtype);
+
+    /**
+     * @brief The number of elements
+     * @return The product of the shape, or 0 for an empty tensor
+     */
+    long size() const;
+
+    /**
+     * @brief Converts the tensor back to floats
+     * @return A tensor with the same shape, holding the values exactly
+     */
+    Tensor to_float() const;
+};
+
+} // namespace FJML
+
+#endif
@@ -4,8 +4,12 @@
 #ifndef LAYER_INCLUDED
 #define LAYER_INCLUDED
 
+#include <algorithm>
+#include <cstdint>
 #include <fstream>
+#include <memory>
 #include <string>
+#include <vector>
 
 #include "activations.h"
 #include "linalg.h"
@@ -27,6 +31,9 @@ namespace Layers {
  * An apply function is required for all layers, which takes an input and returns the output.
  * An backward function is also required, equivalent to a backward pass.
  *
+ * During training, the forward function is used instead of apply. Layers may override it to keep intermediate values
+ * that backward would otherwise have to recompute.
+ *
  * A save function is also required, which saves the layer's parameters to a file.
  */
 class Layer {
@@ -57,10 +64,35 @@ class Layer {
      */
     virtual Tensor apply(const Tensor& input) const { return input; }
 
+    /**
+     * @brief Apply the layer to an input during training
+     *
+     * Equivalent to apply, but the layer may remember intermediate values of the computation, which the next call to
+     * backward with the same input uses instead of recomputing them. The default implementation calls apply.
+     *
+     * @param input The input to apply the layer to
+     * @return The output of the layer
+     */
+    virtual Tensor forward(const Tensor& input) { return apply(input); }
+
+    /**
+     * @brief Apply the layer to an input in double precision, with the given values of its parameters
+     *
+     * This is the forward pass MLP::check_gradients compares backward against: the parameters are passed in, so they
+     * can be perturbed without changing the layer. The default implementation throws.
+     *
+     * @param input The input to apply the layer to, a DTYPE_FLOAT64 tensor
+     * @param params The parameters of the layer, in the order of parameters, converted to DTYPE_FLOAT64
+     * @return The output of the layer, a DTYPE_FLOAT64 tensor
+     * @throws std::runtime_error If the layer has no double precision forward pass
+     */
+    virtual Tensor apply_double(const Tensor& input, const std::vector<Tensor>& params) const;
+
     /**
      * @brief Backpropagate through the layer
      *
-     * Applies gradients to the parameters of the layer.
+     * Adds the gradients of the parameters of the layer to gradients, so that several backward passes accumulate until
+     * zero_grad is called. A layer with an optimizer of its own applies the gradients immediately and resets them.
      *
      * @param input_vals The batch of inputs to apply the layer to
      * @param output_grad The batch of gradients of the loss with respect to the output of the layers
@@ -68,6 +100,63 @@ class Layer {
      */
     virtual Tensor backward(const Tensor& input_vals, const Tensor& output_grad) { return output_grad; }
 
+    /**
+     * @brief The trainable parameters of the layer
+     *
+     * The pointers may be used to replace the tensors, for example by views into a larger buffer holding the
+     * parameters of a whole model. The default implementation returns no parameters.
+     *
+     * @return Pointers to the parameter tensors
+     */
+    virtual std::vector<Tensor*> parameters() { return {}; }
+
+    /**
+     * @brief The gradients of the parameters accumulated by backward since the last call to zero_grad
+     *
+     * The gradients are in the same order as the parameters, and each has the shape of its parameter. backward adds
+     * to them in place when they already have the right shape, so they may also be replaced by views.
+     *
+     * @return Pointers to the gradient tensors
+     */
+    virtual std::vector<Tensor*> gradients() { return {}; }
+
+    /**
+     * @brief Set the gradients of the parameters to zero
+     */
+    void zero_grad() {
+        for (Tensor* grad : gradients()) {
+            if (grad->data != nullptr && grad->is_contiguous()) {
+                std::fill(grad->data, grad->data + grad->data_size[0], 0.0f);
+            } else if (grad->data != nullptr) {
+                *grad *= 0.0f;
+            }
+        }
+    }
+
+    /**
+     * @brief Copy the layer
+     * @return A pointer to a new layer with the same parameters
+     */
+    virtual Layer* clone() const { return new Layer(*this); }
+
+    /**
+     * @brief The settings of the layer that are not parameters, as a short string
+     *
+     * Binary model files store it with the parameters, to construct the layer again with Layers::load.
+     *
+     * @return The settings, empty by default
+     */
+    virtual std::string config() const { return ""; }
+
+    /**
+     * @brief The tensors stored for the layer in binary model files, which Layers::load takes back
+     *
+     * The default implementation returns the parameters.
+     *
+     * @return The tensors to store
+     */
+    virtual std::vector<Tensor> saved_parameters() const;
+
     /**
      * Save the layer to a file
      * @param file The file to save the layer to
@@ -108,13 +197,37 @@ class Dense : public Layer {
      */
     Activations::Activation activ;
     /**
-     * @brief The optimizer for the weights of the layer
+     * @brief The optimizer for the weights of the layer, or null to leave the gradients to the owner of the layer
      */
     Optimizers::Optimizer* w_opt;
     /**
-     * @brief The optimizer for the bias of the layer
+     * @brief The optimizer for the bias of the layer, or null to leave the gradients to the owner of the layer
      */
     Optimizers::Optimizer* b_opt;
+    /**
+     * @brief The gradient of the loss with respect to the weights, accumulated by backward
+     */
+    Tensor w_grad;
+    /**
+     * @brief The gradient of the loss with respect to the bias, accumulated by backward
+     */
+    Tensor b_grad;
+    /**
+     * @brief The input of the last call to forward, or an empty tensor if backward has used it already
+     */
+    Tensor forward_input;
+    /**
+     * @brief The pre-activations computed by the last call to forward, input * weights + bias
+     */
+    Tensor pre_activation;
+    /**
+     * @brief The format the weights are stored in, see set_weight_dtype
+     */
+    DType weight_dtype;
+    /**
+     * @brief The weights when they are stored in a 16 bit format, in which case weights is empty
+     */
+    HalfTensor half_weights;
 
     /**
      * @brief Constructor for a fully connected layer
@@ -130,6 +243,17 @@ class Dense : public Layer {
      * @param file The file to load the layer from
      */
     Dense(std::ifstream& file);
+    /**
+     * @brief Create a fully connected layer from its parameters
+     *
+     * The layer takes the tensors over without copying them, so they may be views of memory owned elsewhere, such as
+     * a memory mapped model file.
+     *
+     * @param weights The weights, a matrix of shape (input_size, output_size)
+     * @param bias The bias, a vector of shape (output_size)
+     * @param activ The activation function to use
+     */
+    Dense(Tensor weights, Tensor bias, Activations::Activation activ);
     /**
      * @brief Destructor
      */
@@ -142,14 +266,82 @@ class Dense : public Layer {
      */
     Tensor apply(const Tensor& input) const override;
 
+    /**
+     * @brief Apply the layer to an input during training
+     *
+     * Keeps the pre-activations, so that backward only has to apply the derivative of the activation to them instead
+     * of multiplying the input by the weights again.
+     *
+     * @param input The input to apply the layer to
+     * @return The output of the layer
+     */
+    Tensor forward(const Tensor& input) override;
+
+    /**
+     * @brief Apply the layer to an input in double precision
+     *
+     * Weights stored in a 16 bit format are not parameters, so they are converted from half_weights instead.
+     *
+     * @param input The input to apply the layer to
+     * @param params The weights and the bias, or only the bias if the weights are stored in a 16 bit format
+     * @return The output of the layer
+     */
+    Tensor apply_double(const Tensor& input, const std::vector<Tensor>& params) const override;
+
     /**
      * @brief Apply the gradient of the layer to a batch of inputs
+     *
+     * If input_vals is the input of the last call to forward, the pre-activations it kept are used. Otherwise they are
+     * recomputed.
+     *
+     * The gradients of the weights and bias, averaged over the batch, are added to w_grad and b_grad. If the layer has
+     * optimizers, they are applied and w_grad and b_grad are reset to zero.
+     *
      * @param input_vals The batch of inputs to apply the layer to
      * @param output_grad The batch of gradients of the loss with respect to the output of the layer
      * @return The batch of gradients of the loss with respect to the input of the layer
      */
     Tensor backward(const Tensor& input_vals, const Tensor& output_grad) override;
 
+    /**
+     * @brief The trainable parameters of the layer, the weights and the bias
+     *
+     * Weights stored in a 16 bit format cannot be trained, so only the bias is returned for them.
+     *
+     * @return Pointers to weights and bias
+     */
+    std::vector<Tensor*> parameters() override;
+
+    /**
+     * @brief The gradients of the weights and the bias
+     * @return Pointers to w_grad and b_grad
+     */
+    std::vector<Tensor*> gradients() override;
+
+    /**
+     * @brief Copy the layer
+     *
+     * The copy gets its own copies of the optimizers, without their state.
+     *
+     * @return A pointer to a new layer with the same parameters
+     */
+    Layer* clone() const override;
+
+    /**
+     * @brief The settings of the layer, the name of its activation function
+     *
+     * Weights stored in a 16 bit format add the name of the format after a colon, such as "relu:bfloat16".
+     *
+     * @return The name of the activation function
+     */
+    std::string config() const override;
+
+    /**
+     * @brief The weights and the bias, with weights in a 16 bit format converted back to floats
+     * @return The weights and the bias
+     */
+    std::vector<Tensor> saved_parameters() const override;
+
     /**
      * @brief Save the layer to a file
      * @param file The file to save the layer to
@@ -163,9 +355,144 @@ class Dense : public Layer {
 
     /**
      * @brief Set the optimizer for the layer
-     * @param opt The optimizer to use for the weights and bias
+     * @param opt The optimizer to use for the weights and bias, or null to only compute the gradients in backward
      */
     void set_optimizer(const Optimizers::Optimizer* opt);
+
+    /**
+     * @brief Choose the format the weights are stored in
+     *
+     * Storing the weights as bfloat16 or float16 halves their memory and the bandwidth apply needs to read them, at
+     * the cost of precision: bfloat16 keeps 8 bits of each weight and float16 11. The products are still accumulated
+     * in single precision. Such a layer can only be used for inference, backward throws.
+     *
+     * Converting back to DTYPE_FLOAT32 restores the rounded weights, which can then be trained again.
+     *
+     * @param dtype DTYPE_FLOAT32, DTYPE_BFLOAT16 or DTYPE_FLOAT16
+     */
+    void set_weight_dtype(DType dtype);
+};
+
+/**
+ * @brief A fully connected layer with int8 weights, for inference
+ *
+ * Created from a trained Dense layer by MLP::quantize. Each column of the weights, which feeds one output, is quantized
+ * symmetrically with its own scale, the largest magnitude in the column divided by 127. The input is quantized with a
+ * single scale, found by calibrating on sample inputs, and values beyond the calibrated range are clamped.
+ *
+ * The product is computed exactly in integers by LinAlg::qgemm, then scaled back to floats, with the bias and the
+ * activation applied as each block of the output is finished. The weights take a quarter of the memory of floats.
+ *
+ * The layer cannot be trained: it has no parameters, and backward throws.
+ */
+class QuantizedDense : public Layer {
+  public:
+    /**
+     * @brief The number of nodes in the previous layer
+     */
+    int input_size;
+    /**
+     * @brief The number of nodes in this layer
+     */
+    int output_size;
+    /**
+     * @brief The distance between the rows of weights, input_size rounded up to a multiple of 32
+     */
+    int row_stride;
+    /**
+     * @brief The quantized weights, transposed: row j holds the weights of output j, padded with zeros to row_stride
+     */
+    const int8_t* weights;
+    /**
+     * @brief The buffer the weights live in
+     */
+    std::shared_ptr<const int8_t> weight_storage;
+    /**
+     * @brief The scale of each column of the original weights, a vector of shape (output_size)
+     */
+    Tensor weight_scales;
+    /**
+     * @brief The bias of the layer, a vector of shape (output_size)
+     */
+    Tensor bias;
+    /**
+     * @brief The scale the input is quantized with
+     */
+    float input_scale;
+    /**
+     * @brief The activation function of the layer
+     */
+    Activations::Activation activ;
+
+    /**
+     * @brief Quantize a fully connected layer
+     * @param dense The layer, whose weights may be stored in any format
+     * @param input_scale The scale to quantize the input with, the largest magnitude expected in it divided by 127
+     */
+    QuantizedDense(const Dense& dense, float input_scale);
+
+    /**
+     * @brief Load a quantized layer from a file
+     * @param file The file to load the layer from
+     */
+    QuantizedDense(std::ifstream& file);
+
+    /**
+     * @brief Create a quantized layer from the tensors returned by saved_parameters
+     *
+     * The layer takes the tensors over without copying them, so they may be views of memory owned elsewhere, such as
+     * a memory mapped model file.
+     *
+     * @param input_size The number of nodes in the previous layer
+     * @param params The weights, the scales of the weights, the bias and the input scale
+     * @param activ The activation function to use
+     */
+    QuantizedDense(int input_size, std::vector<Tensor>& params, Activations::Activation activ);
+
+    /**
+     * @brief Apply the layer to an input
+     * @param input The input to apply the layer to
+     * @return The output of the layer
+     */
+    Tensor apply(const Tensor& input) const override;
+
+    /**
+     * @brief Throws, as a quantized layer cannot be trained
+     */
+    Tensor backward(const Tensor& input_vals, const Tensor& output_grad) override;
+
+    /**
+     * @brief Copy the layer, sharing its weights, which are never modified
+     * @return A pointer to a new layer with the same parameters
+     */
+    Layer* clone() const override { return new QuantizedDense(*this); }
+
+    /**
+     * @brief The settings of the layer, the name of its activation function and the number of inputs
+     * @return The name of the activation function and input_size, separated by a colon, such as "relu:784"
+     */
+    std::string config() const override;
+
+    /**
+     * @brief The weights, the scales of the weights, the bias and the input scale
+     *
+     * The weights are stored four to a float, as their raw bytes, in a matrix of shape (output_size, row_stride / 4).
+     * The input scale is a vector of shape (1).
+     *
+     * @return The tensors to store
+     */
+    std::vector<Tensor> saved_parameters() const override;
+
+    /**
+     * @brief Save the layer to a file
+     * @param file The file to save the layer to
+     */
+    void save(std::ofstream& file) const override;
+
+    /**
+     * @brief Print a summary of the layer
+     */
+    void summary() const override;
 };
 
 /**
@@ -193,14 +520,32 @@ class Softmax : public Layer {
      */
     Tensor apply(const Tensor& input) const override;
 
+    /**
+     * @brief Apply the softmax function to an input in double precision
+     * @param input The input to apply the layer to
+     * @param params Unused, the layer has no parameters
+     * @return The output of the layer
+     */
+    Tensor apply_double(const Tensor& input, const std::vector<Tensor>& params) const override;
+
     /**
      * @brief Apply the gradient of the layer to a batch of inputs
+     *
+     * The gradient with respect to each input row is s * (g - dot(g, s)), where s is the softmax of the row and g is
+     * its output gradient, which takes time linear in the number of classes.
+     *
      * @param input_vals The batch of inputs to apply the layer to
      * @param output_grad The batch of gradients of the loss with respect to the output of the layer
      * @return The batch of gradients of the loss with respect to the input of the layer
      */
     Tensor backward(const Tensor& input_vals, const Tensor& output_grad) override;
 
+    /**
+     * @brief Copy the layer
+     * @return A pointer to a new softmax layer
+     */
+    Layer* clone() const override { return new Softmax(*this); }
+
     /**
      * @brief Save the layer to a file
      * @param file The file to save the layer to
@@ -220,6 +565,19 @@ class Softmax : public Layer {
  */
 Layer* load(std::ifstream& file);
 
+/**
+ * @brief Create a layer from its type, settings and parameters
+ *
+ * This is the counterpart of config and parameters, used to load binary model files. The parameters are taken over
+ * without copying them.
+ *
+ * @param type The name of the layer
+ * @param config The settings of the layer, as returned by config
+ * @param params The parameters of the layer, in the order of saved_parameters
+ * @return A pointer to the new layer
+ */
+Layer* load(const std::string& type, const std::string& config, std::vector<Tensor>& params);
+
 } // namespace Layers
 
 } // namespace FJML
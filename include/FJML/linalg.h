@@ -13,6 +13,7 @@
 #include <cuda_runtime.h>
 #endif
 
+#include "half.h"
 #include "tensor.h"
 
 namespace FJML {
@@ -45,6 +46,151 @@ float dot_product(const Tensor& a, const Tensor& b);
  */
 Tensor matrix_multiply(const Tensor& a, const Tensor& b);
 
+/**
+ * @brief Elementwise work fused into the end of sgemm
+ *
+ * Each block of rows of C is finished as soon as its product is complete, while it is still in cache: bias[j] is added
+ * to every element in column j, the result is copied to pre_activation, and activation is applied to it. Any of the
+ * three may be null to skip that step. pre_activation has the same shape and leading dimension as C.
+ */
+struct GemmEpilogue {
+    /**
+     * @brief The bias added to each row of C
+     */
+    const float* bias = nullptr;
+    /**
+     * @brief Where to store C before the activation is applied
+     */
+    float* pre_activation = nullptr;
+    /**
+     * @brief A kernel applied to n contiguous elements of C in place, such as Activations::Activation::func_kernel
+     */
+    void (*activation)(const float* in, float* out, long n) = nullptr;
+};
+
+/**
+ * @brief General matrix multiply on row-major matrices stored as raw arrays.
+ *
+ * Computes C = alpha * op(A) * op(B) + beta * C, where op(X) is X or its transpose. Transposed operands are read in
+ * place, so no transposed copy is made. When beta is 0, C does not need to be initialized.
+ *
+ * This is a packed, cache-blocked kernel with an AVX2/FMA register-tiled inner loop. The work is split across threads
+ * by macro-tiles of C.
+ *
+ * @param trans_a Whether to use the transpose of A.
+ * @param trans_b Whether to use the transpose of B.
+ * @param m The number of rows of op(A) and C.
+ * @param n The number of columns of op(B) and C.
+ * @param k The number of columns of op(A) and rows of op(B).
+ * @param alpha The scale applied to op(A) * op(B).
+ * @param a The matrix A, of shape (m, k), or (k, m) if trans_a is set.
+ * @param lda The distance between consecutive rows of A.
+ * @param b The matrix B, of shape (k, n), or (n, k) if trans_b is set.
+ * @param ldb The distance between consecutive rows of B.
+ * @param beta The scale applied to C before accumulating.
+ * @param c The output matrix C, of shape (m, n).
+ * @param ldc The distance between consecutive rows of C.
+ * @param epilogue Elementwise work applied to C once the product is complete, or null for none.
+ */
+void sgemm(bool trans_a, bool trans_b, int m, int n, int k, float alpha, const float* a, int lda, const float* b,
+           int ldb, float beta, float* c, int ldc, const GemmEpilogue* epilogue = nullptr);
+
+/**
+ * @brief General matrix multiply with B stored in a 16 bit format.
+ *
+ * Like the other overload, but B is stored as bfloat16 or float16. Its elements are converted to floats as its blocks
+ * are packed, so the products are accumulated in single precision while B is read from memory at half the size.
+ *
+ * @param b_dtype The format of B, DTYPE_BFLOAT16 or DTYPE_FLOAT16.
+ */
+void sgemm(bool trans_a, bool trans_b, int m, int n, int k, float alpha, const float* a, int lda, const uint16_t* b,
+           DType b_dtype, int ldb, float beta, float* c, int ldc, const GemmEpilogue* epilogue = nullptr);
+
+/**
+ * @brief General matrix multiply in double precision.
+ *
+ * Like sgemm, with the same packed, cache-blocked kernel computing on doubles. It has no epilogue.
+ */
+void dgemm(bool trans_a, bool trans_b, int m, int n, int k, double alpha, const double* a, int lda, const double* b,
+           int ldb, double beta, double* c, int ldc);
+
+/**
+ * @brief Quantize floats to symmetric int8, rounding x / scale to the nearest integer and clamping it to [-127, 127]
+ *
+ * @param in The floats
+ * @param out Where the quantized values are written
+ * @param n The number of elements
+ * @param scale The value of a step of 1, must be positive
+ */
+void quantize(const float* in, int8_t* out, long n, float scale);
+
+/**
+ * @brief Matrix multiply on int8 matrices, for quantized inference
+ *
+ * Computes C[i][j] = scales[j] * sum_p A[i][p] * B[j][p], which is A * B^T: both A and B are stored with the shared
+ * dimension contiguous. The sums are computed exactly in 32 bit integers with AVX2, and scaled back to floats by the
+ * per-column scales, which are the product of the scales of A and of column j of B.
+ *
+ * The values of A and B must be in [-127, 127], as produced by quantize.
+ *
+ * @param m The number of rows of A and C.
+ * @param n The number of rows of B, and columns of C.
+ * @param k The number of columns of A and B.
+ * @param a The matrix A, m x k.
+ * @param lda The distance between rows of A.
+ * @param b The matrix B, n x k.
+ * @param ldb The distance between rows of B.
+ * @param scales The scale of each column of C.
+ * @param c The matrix C, m x n, which does not need to be initialized.
+ * @param ldc The distance between rows of C.
+ * @param epilogue Elementwise work applied to C once it is dequantized, or null for none.
+ */
+void qgemm(int m, int n, int k, const int8_t* a, int lda, const int8_t* b, int ldb, const float* scales, float* c,
+           int ldc, const GemmEpilogue* epilogue = nullptr);
+
+/**
+ * @brief General matrix multiply, computing out = alpha * op(a) * op(b) + beta * out.
+ *
+ * op(x) is x if the corresponding transpose flag is false, and the transpose of x otherwise. The operands are read
+ * directly, without materializing a transpose.
+ *
+ * The operands must have the same dtype, DTYPE_FLOAT32 or DTYPE_FLOAT64. Double precision matrices are multiplied by
+ * dgemm, on the CPU and without an epilogue.
+ *
+ * If beta is 0 and `out` does not have the shape and dtype of the result, it is replaced by a new tensor of the right
+ * shape and dtype. Otherwise `out` must already have the shape and dtype of the result.
+ *
+ * @param a The first matrix.
+ * @param b The second matrix.
+ * @param trans_a Whether to use the transpose of a.
+ * @param trans_b Whether to use the transpose of b.
+ * @param alpha The scale applied to the product.
+ * @param beta The scale applied to the existing value of out.
+ * @param out The output matrix, accumulated into.
+ * @param epilogue Elementwise work applied to out once the product is complete, or null for none. Only supported on
+ * the CPU.
+ */
+void gemm(const Tensor& a, const Tensor& b, bool trans_a, bool trans_b, float alpha, float beta, Tensor& out,
+          const GemmEpilogue* epilogue = nullptr);
+
+/**
+ * @brief General matrix multiply with b stored in a 16 bit format, computing out = alpha * op(a) * op(b) + beta * out.
+ *
+ * The elements of b are converted to floats as they are loaded, and the products are accumulated in single precision.
+ * The shape of out is handled like in the other overload.
+ *
+ * @param a The first matrix.
+ * @param b The second matrix, stored as bfloat16 or float16.
+ * @param trans_a Whether to use the transpose of a.
+ * @param trans_b Whether to use the transpose of b.
+ * @param alpha The scale applied to the product.
+ * @param beta The scale applied to the existing value of out.
+ * @param out The output matrix, accumulated into.
+ * @param epilogue Elementwise work applied to out once the product is complete, or null for none.
+ */
+void gemm(const Tensor& a, const HalfTensor& b, bool trans_a, bool trans_b, float alpha, float beta, Tensor& out,
+          const GemmEpilogue* epilogue = nullptr);
+
 /**
  * @brief Transposes a matrix.
  * @param a The matrix.
@@ -55,11 +201,27 @@ Tensor transpose(const Tensor& a);
 /**
  * @brief Sums all the elements in a tensor.
  *
+ * The elements are added pairwise, so the rounding error grows with the logarithm of the size of the tensor rather
+ * than with its size.
+ *
  * @param a The tensor.
  * @return The sum of all the elements in the tensor.
  */
 float sum(const Tensor& a);
 
+/**
+ * @brief Sums a tensor along some of its axes.
+ *
+ * For example, sum(a, {0}) sums the rows of a matrix, giving the sum of each column, and sum(a, {0, 1}) sums all of
+ * its elements. Like the sum of the whole tensor, the elements are added pairwise.
+ *
+ * @param a The tensor.
+ * @param axes The axes to sum along, each in [0, a.dim()) and listed at most once.
+ * @param keepdims Whether to keep the summed axes as axes of size 1, so that the result broadcasts against a.
+ * @return The sums. When every axis is summed and keepdims is false, this is a tensor of shape (1).
+ */
+Tensor sum(const Tensor& a, const std::vector<int>& axes, bool keepdims = false);
+
 /**
  * @brief Computes the mean of all the elements in a tensor.
  *
@@ -68,6 +230,41 @@ float sum(const Tensor& a);
  */
 float mean(const Tensor& a);
 
+/**
+ * @brief Computes the mean of a tensor along some of its axes.
+ *
+ * @param a The tensor.
+ * @param axes The axes to compute the mean along, each in [0, a.dim()) and listed at most once.
+ * @param keepdims Whether to keep the reduced axes as axes of size 1.
+ * @return The means.
+ */
+Tensor mean(const Tensor& a, const std::vector<int>& axes, bool keepdims = false);
+
+/**
+ * @brief Computes the variance of a tensor along some of its axes.
+ *
+ * The variance is the mean of the squared differences from the mean, computed in two passes so that it stays accurate
+ * when the mean is large compared to the spread of the values.
+ *
+ * @param a The tensor.
+ * @param axes The axes to compute the variance along, each in [0, a.dim()) and listed at most once.
+ * @param keepdims Whether to keep the reduced axes as axes of size 1.
+ * @return The variances.
+ */
+Tensor var(const Tensor& a, const std::vector<int>& axes, bool keepdims = false);
+
+/**
+ * @brief Computes the logarithm of the sum of the exponentials of a tensor along some of its axes.
+ *
+ * The maximum is subtracted before taking exponentials, so large values do not overflow.
+ *
+ * @param a The tensor.
+ * @param axes The axes to reduce, each in [0, a.dim()) and listed at most once.
+ * @param keepdims Whether to keep the reduced axes as axes of size 1.
+ * @return The log-sum-exps.
+ */
+Tensor logsumexp(const Tensor& a, const std::vector<int>& axes, bool keepdims = false);
+
 /**
  * @brief Raises all the elements in a tensor to a power.
  * @param a The tensor.
@@ -91,19 +288,46 @@ int random_choice(const Tensor& a);
  */
 float max(const Tensor& a);
 
+/**
+ * @brief Computes the maximum of a tensor along some of its axes.
+ * @param a The tensor.
+ * @param axes The axes to compute the maximum along, each in [0, a.dim()) and listed at most once.
+ * @param keepdims Whether to keep the reduced axes as axes of size 1.
+ * @return The maximums.
+ */
+Tensor max(const Tensor& a, const std::vector<int>& axes, bool keepdims = false);
+
+/**
+ * @brief Computes the minimum value in a tensor.
+ * @param a The tensor.
+ * @return The minimum value in the tensor.
+ */
+float min(const Tensor& a);
+
+/**
+ * @brief Computes the minimum of a tensor along some of its axes.
+ * @param a The tensor.
+ * @param axes The axes to compute the minimum along, each in [0, a.dim()) and listed at most once.
+ * @param keepdims Whether to keep the reduced axes as axes of size 1.
+ * @return The minimums.
+ */
+Tensor min(const Tensor& a, const std::vector<int>& axes, bool keepdims = false);
+
 /**
  * @brief Computes the index of the maximum value in a tensor, given an axis to compute along.
  *
  * For example, if the input is a matrix and the axis is 0, the output will be a vector containing the maximum of each
  * column. If the input is a matrix and the axis is 1, the output will be a vector containing the maximum of each row.
+ * If several elements are equal to the maximum, the first one is chosen.
  *
- * The default axis is -1, which means the last axis.
+ * The default axis is -1, which means the index of the maximum in the whole tensor, read in row-major order.
  *
  * @param a The tensor.
  * @param axis The axis to compute the maximum value along.
+ * @param keepdims Whether to keep the reduced axis as an axis of size 1.
  * @return A tensor containing the indices of the maximum value along the specified axis.
  */
-Tensor argmax(const Tensor& a, int axis = -1);
+Tensor argmax(const Tensor& a, int axis = -1, bool keepdims = false);
 
 /**
  * @brief Returns a tensor containing one where the two tensors are equal, and zero otherwise.
@@ -122,6 +346,39 @@ Tensor equal(const Tensor& a, const Tensor& b);
  */
 Tensor dense_forward(const Tensor& input, const Tensor& weights, const Tensor& bias);
 
+/**
+ * @brief Forward pass of a dense layer, with the activation fused into the matrix multiplication.
+ *
+ * The bias and the activation are applied to each tile of the output as soon as it is computed, instead of in separate
+ * passes over the whole output.
+ *
+ * @param input The input tensor.
+ * @param weights The weights tensor.
+ * @param bias The bias tensor.
+ * @param activation A kernel applied to the output in place, such as Activations::Activation::func_kernel, or null
+ * for none.
+ * @param pre_activation If not null, receives the output before the activation is applied. It is only reallocated if
+ * it does not already have the right shape.
+ * @return The output tensor.
+ */
+Tensor dense_forward(const Tensor& input, const Tensor& weights, const Tensor& bias,
+                     void (*activation)(const float* in, float* out, long n), Tensor* pre_activation = nullptr);
+
+/**
+ * @brief Forward pass of a dense layer whose weights are stored in a 16 bit format.
+ *
+ * The weights are converted to floats as they are loaded, so reading them takes half the memory bandwidth, and the
+ * products are accumulated in single precision. The bias and the activation are fused like in the other overloads.
+ *
+ * @param input The input tensor.
+ * @param weights The weights, stored as bfloat16 or float16.
+ * @param bias The bias tensor.
+ * @param activation A kernel applied to the output in place, or null for none.
+ * @return The output tensor.
+ */
+Tensor dense_forward(const Tensor& input, const HalfTensor& weights, const Tensor& bias,
+                     void (*activation)(const float* in, float* out, long n) = nullptr);
+
 } // namespace LinAlg
 
 } // namespace FJML
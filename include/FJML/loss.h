@@ -41,6 +41,30 @@ class Loss {
      * @brief The derivative of the loss function
      */
     std::function<Tensor(const Tensor&, const Tensor&)> derivative;
+    /**
+     * @brief The derivative of the loss with respect to the input of a softmax layer, given the label and the output of
+     * that layer
+     *
+     * This is empty unless the loss has a simpler form when its prediction comes from a softmax layer. When it is set,
+     * a model ending in a softmax layer uses it instead of the derivative of the loss followed by the backward pass of
+     * the softmax layer.
+     */
+    std::function<Tensor(const Tensor&, const Tensor&)> softmax_derivative;
+    /**
+     * @brief The loss function, for labels that are class indices in a DTYPE_INT32 tensor
+     *
+     * This and the two functions below are empty unless the loss takes integer labels. The calc functions use them
+     * when they are given DTYPE_INT32 labels.
+     */
+    std::function<float(const Tensor&, const Tensor&)> label_function;
+    /**
+     * @brief The derivative of the loss function, for labels that are class indices
+     */
+    std::function<Tensor(const Tensor&, const Tensor&)> label_derivative;
+    /**
+     * @brief The derivative of the loss with respect to the input of a softmax layer, for labels that are class indices
+     */
+    std::function<Tensor(const Tensor&, const Tensor&)> label_softmax_derivative;
 
     /**
      * @brief Default constructor
@@ -60,12 +84,30 @@ class Loss {
          std::function<Tensor(const Tensor&, const Tensor&)> derivative)
         : name{name}, function{function}, derivative{derivative} {}
 
+    /**
+     * @brief Constructor for a loss with a fused derivative through a softmax layer
+     *
+     * Each function should take two arguments, the first is the label and the second is the prediction.
+     *
+     * @param name The name of the loss function
+     * @param function The loss function
+     * @param derivative The derivative of the loss function
+     * @param softmax_derivative The derivative of the loss with respect to the input of a softmax layer producing the
+     * prediction
+     */
+    Loss(std::string name, std::function<float(const Tensor&, const Tensor&)> function,
+         std::function<Tensor(const Tensor&, const Tensor&)> derivative,
+         std::function<Tensor(const Tensor&, const Tensor&)> softmax_derivative)
+        : name{name}, function{function}, derivative{derivative}, softmax_derivative{softmax_derivative} {}
+
     /**
      * @brief Calculates the loss
      *
-     * Returns the sum of the loss function applied to each element of the tensors.
+     * Returns the sum of the loss function applied to each element of the tensors. DTYPE_INT32 labels are class
+     * indices, one per sample, and are passed to label_function instead.
      *
      * @param label The label
+     * @throws std::invalid_argument If the labels are DTYPE_INT32 and the loss does not take integer labels
      * @param pred The predicted value (function output)
      * @return The loss
      */
@@ -74,13 +116,26 @@ class Loss {
     /**
      * @brief Calculates the derivative of the loss
      *
-     * Returns the sum of the derivative of the loss function applied to each element of the tensors.
+     * Returns the sum of the derivative of the loss function applied to each element of the tensors. DTYPE_INT32
+     * labels are passed to label_derivative instead.
      *
      * @param label The label
+     * @throws std::invalid_argument If the labels are DTYPE_INT32 and the loss does not take integer labels
      * @param pred The predicted value (function output)
      * @return The derivative of the loss
      */
     Tensor calc_derivative(const Tensor& label, const Tensor& pred) const;
+
+    /**
+     * @brief Calculates the derivative of the loss with respect to the input of a softmax layer
+     *
+     * Only available if softmax_derivative is set, or label_softmax_derivative for DTYPE_INT32 labels.
+     *
+     * @param label The label
+     * @param pred The output of the softmax layer
+     * @return The derivative of the loss with respect to the input of the softmax layer
+     */
+    Tensor calc_softmax_derivative(const Tensor& label, const Tensor& pred) const;
 };
 
 extern const Loss mse, huber;
@@ -94,6 +149,10 @@ Loss binary_crossentropy(bool from_logits = false);
 
 /**
  * @brief The cross entropy loss function
+ *
+ * Without logits, the derivative through a softmax layer is the output of the layer minus the label, which is what
+ * a model ending in a softmax layer uses.
+ *
  * @param from_logits Whether the input is from logits (i.e. not softmaxed)
  * @return The cross entropy loss function
  */
@@ -102,7 +161,13 @@ Loss crossentropy(bool from_logits = false);
 /**
  * @brief The sparse categorical cross entropy loss function
  *
- * The label is expected to be a single integer representing the class index.
+ * The label is expected to be a single integer representing the class index. Without logits, the derivative through a
+ * softmax layer is the output of the layer minus the one-hot encoding of the label.
+ *
+ * The labels are best given as a DTYPE_INT32 tensor, which the loss indexes with directly. Labels given as floats are
+ * converted with astype first, on every call.
+ *
+ * @param from_logits Whether the input is from logits (i.e. not softmaxed)
  */
 Loss sparse_categorical_crossentropy(bool from_logits = false);
 
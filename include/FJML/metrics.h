@@ -33,6 +33,11 @@ class Metric {
      * Note: the arguments are assumed to be a batch of data.
      */
     std::function<float(const Tensor&, const Tensor&)> compute;
+    /**
+     * @brief This function computes the metric for labels that are class indices in a DTYPE_INT32 tensor, or is empty
+     * if the metric does not take them.
+     */
+    std::function<float(const Tensor&, const Tensor&)> compute_labels;
 
     /**
      * @brief Default constructor
@@ -43,6 +48,12 @@ class Metric {
      * @brief Constructor for the Metric class
      */
     Metric(std::string name, std::function<float(const Tensor&, const Tensor&)> compute);
+
+    /**
+     * @brief Constructor for a metric that also takes integer labels
+     */
+    Metric(std::string name, std::function<float(const Tensor&, const Tensor&)> compute,
+           std::function<float(const Tensor&, const Tensor&)> compute_labels);
 };
 
 extern Metric accuracy, mean_squared_error, sparse_categorical_accuracy;
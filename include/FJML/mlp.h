@@ -4,8 +4,11 @@
 #ifndef MLP_INCLUDED
 #define MLP_INCLUDED
 
+#include <chrono>
+#include <stdexcept>
 #include <vector>
 
+#include "data.h"
 #include "layers.h"
 #include "linalg.h"
 #include "loss.h"
@@ -21,8 +24,67 @@ namespace MLP {
  * @brief Multi-layer perceptron class
  *
  * This class implements a multi-layer perceptron with a variable number of layers.
+ *
+ * For training, the parameters of all the layers are gathered into one flat buffer, and the layers' parameters are
+ * replaced by views into it. Their gradients are gathered into a second flat buffer the same way. The backward pass
+ * only computes gradients, and a single optimizer then updates every parameter of the model in one pass over the
+ * buffers.
+ *
+ * With more than one worker, the backward pass is data parallel: each batch is split into shards of rows, one per
+ * worker thread. Each worker runs the forward and backward passes of its shard on its own replica of the layers, which
+ * shares the parameters of the model but keeps its own activations and gradients. The gradients of the replicas are
+ * then summed into flat_grads before the optimizer step.
+ *
+ * In Hogwild mode, train runs the workers asynchronously instead. Each worker trains on its own share of the batches
+ * and applies its updates to the shared parameters as soon as they are computed, without locks.
  */
 class MLP {
+    /**
+     * @brief The replicas of the layers used by workers 1 to num_workers - 1, worker 0 uses the layers themselves
+     */
+    std::vector<std::vector<Layers::Layer*>> replicas;
+    /**
+     * @brief The flat gradients of each replica, laid out like flat_grads
+     */
+    std::vector<Tensor> replica_grads;
+    /**
+     * @brief The optimizer of each replica, used in Hogwild mode
+     */
+    std::vector<Optimizers::Optimizer*> replica_optimizers;
+
+    /**
+     * @brief Create a replica for each worker other than the first, if they do not exist yet
+     */
+    void make_replicas();
+
+    /**
+     * @brief Delete the replicas
+     */
+    void clear_replicas();
+
+    /**
+     * @brief Train on every row once, with the workers updating the parameters asynchronously
+     * @param x_train The input data
+     * @param y_train The target data
+     * @param batch_starts The first row of each batch, the rows of every num_workers-th batch going to the same worker
+     * @param batch_size The size of the batches
+     * @param accumulation_steps The number of batches a worker accumulates before each of its updates
+     * @param start_time The start of the epoch, for the progress bar
+     */
+    void hogwild_epoch(const Tensor& x_train, const Tensor& y_train, const std::vector<int>& batch_starts,
+                       int batch_size, int accumulation_steps, std::chrono::system_clock::time_point start_time);
+
+    /**
+     * @brief Train on every batch of an epoch once, in the order a loader hands them out
+     * @param loader The loader the batches are read from
+     * @param num_inputs The number of rows of the training data
+     * @param batch_size The size of the batches
+     * @param accumulation_steps The number of batches whose gradients are accumulated before each step
+     * @param start_time The start of the epoch, for the progress bar
+     */
+    void loader_epoch(Data::BatchLoader& loader, int num_inputs, int batch_size, int accumulation_steps,
+                      std::chrono::system_clock::time_point start_time);
+
   public:
     /**
      * @brief This is a vector containing pointers to the layers of the MLP.
@@ -32,6 +94,37 @@ class MLP {
      * @brief This is the loss function used by the MLP.
      */
     Loss::Loss loss_fn;
+    /**
+     * @brief The optimizer updating all the parameters of the model, or null if none has been set
+     */
+    Optimizers::Optimizer* optimizer = nullptr;
+    /**
+     * @brief The parameters of all the layers, one after the other, in a flat buffer
+     *
+     * The parameters of the layers are views into this buffer, so copying it is a cheap checkpoint of the whole model.
+     * It is empty until flatten_parameters is called.
+     */
+    Tensor flat_params;
+    /**
+     * @brief The gradients of all the layers, laid out like flat_params
+     */
+    Tensor flat_grads;
+    /**
+     * @brief The largest global norm the gradients are allowed to have before a step, or 0 for no clipping
+     */
+    float max_grad_norm = 0;
+    /**
+     * @brief The number of threads the backward pass of a batch is split across
+     */
+    int num_workers = 1;
+    /**
+     * @brief Whether train updates the parameters asynchronously from all the workers, Hogwild style
+     */
+    bool hogwild = false;
+    /**
+     * @brief In Hogwild mode, how many updates a worker may be ahead of the slowest worker, or -1 for no bound
+     */
+    int max_staleness = -1;
 
     /**
      * @brief Default constructor for MLP
@@ -57,6 +150,8 @@ class MLP {
         for (Layers::Layer* l : layers) {
             delete l;
         }
+        delete optimizer;
+        clear_replicas();
     }
 
     /**
@@ -67,16 +162,129 @@ class MLP {
 
     /**
      * @brief Set the optimizer for the model
+     *
+     * The model keeps a copy of the optimizer, without its state.
+     *
      * @param optimizer The optimizer to use
      */
     void set_optimizer(const Optimizers::Optimizer* optimizer) {
-        for (Layers::Layer* l : layers) {
-            if (l->name == "Dense") {
-                ((Layers::Dense*)l)->set_optimizer(optimizer);
-            }
+        delete this->optimizer;
+        this->optimizer = optimizer->clone();
+        clear_replicas();
+    }
+
+    /**
+     * @brief Set the largest global norm of the gradients
+     * @param max_norm The largest norm, or 0 for no clipping
+     */
+    void set_max_grad_norm(float max_norm) {
+        if (max_norm < 0) {
+            throw std::invalid_argument("The maximum norm of the gradients must not be negative");
         }
+        max_grad_norm = max_norm;
     }
 
+    /**
+     * @brief Set the number of worker threads for data parallel training
+     *
+     * Batches with fewer rows than workers are split across as many workers as there are rows.
+     *
+     * @param workers The number of workers, 1 to run the backward pass on the calling thread only
+     */
+    void set_num_workers(int workers);
+
+    /**
+     * @brief Turn Hogwild training on or off
+     *
+     * In Hogwild mode, each epoch of train deals the batches out to the workers, each of which visits its batches in
+     * an order drawn from its own random generator. A worker computes the gradients of a batch on its replica, then
+     * applies them to the shared parameters with its own copy of the optimizer, without locking them. The updates of
+     * different workers may therefore interleave, and a worker may compute its gradients from parameters that are
+     * being updated. This is cheap and works well when the updates are sparse or small, as with SGD.
+     *
+     * The staleness bound keeps the workers in step: a worker waits before its next batch while it has applied more
+     * than max_staleness updates more than the slowest worker. A bound of 0 makes the workers take turns.
+     *
+     * Hogwild mode only takes effect with more than one worker.
+     *
+     * @param enabled Whether to use Hogwild mode
+     * @param max_staleness The largest lead of a worker over the slowest one, in updates, or -1 for no bound
+     */
+    void set_hogwild(bool enabled, int max_staleness = -1);
+
+    /**
+     * @brief Gather the parameters and gradients of the layers into flat_params and flat_grads
+     *
+     * Does nothing if every parameter and gradient is already a view in its place in the flat buffers. Otherwise, new
+     * buffers are allocated, the parameters are copied into them, the parameters and gradients of the layers are
+     * replaced by views into them, and the state of the optimizer is reset. This happens after layers are added or
+     * loaded, or after a parameter is assigned a tensor with its own memory. The replicas of the workers are then
+     * recreated.
+     *
+     * Layers that had an optimizer of their own lose it, as the model's optimizer updates their parameters instead.
+     *
+     * This is called by grad_descent and backwards_pass.
+     */
+    void flatten_parameters();
+
+    /**
+     * @brief Scale the gradients down so that their global norm is at most max_norm
+     *
+     * The global norm is the norm of all the gradients of the model together, as if they were one vector.
+     *
+     * @param max_norm The largest norm, must be positive
+     * @return The global norm of the gradients before clipping
+     */
+    float clip_grad_norm(float max_norm);
+
+    /**
+     * @brief Set the gradients of all the layers to zero
+     */
+    void zero_grad();
+
+    /**
+     * @brief Compute the gradients of the loss on a batch, adding them to the gradients of the layers
+     *
+     * The parameters are not updated, so the gradients of several batches can be accumulated before calling step.
+     * Each batch contributes the gradient of its mean loss multiplied by scale. To accumulate the gradient of the mean
+     * loss over several batches, scale each by its share of the rows.
+     *
+     * With more than one worker, the batch is split into consecutive shards of rows, processed in parallel.
+     *
+     * @param x_train The input data
+     * @param y_train The target data, or the class of each row as a DTYPE_INT32 tensor for a loss that takes integer
+     * labels
+     * @param scale The factor the gradients are multiplied by before they are accumulated
+     */
+    void backward(const Tensor& x_train, const Tensor& y_train, float scale = 1);
+
+    /**
+     * @brief Check the gradients computed by the backward passes of the layers against finite differences
+     *
+     * The layers are run forward and backward in single precision, from a fixed random gradient r of the output, so
+     * the gradients are those of the mean over the rows of sum_j r_j * output_j. The same function is then computed
+     * in double precision with Layers::Layer::apply_double, and each parameter is moved by epsilon either way to
+     * estimate its derivative by central differences. Double precision keeps the rounding error of the difference
+     * far below the error of the gradients being checked.
+     *
+     * The gradients of the model are overwritten. Every layer needs a double precision forward pass, and the model is
+     * run twice per parameter, so this is meant for small models and batches, in tests.
+     *
+     * @param input A batch of inputs
+     * @param epsilon The step of the finite differences
+     * @return The largest difference between a gradient and its estimate, relative to the larger of them when it
+     * is above 1
+     */
+    double check_gradients(const Tensor& input, double epsilon = 1e-6);
+
+    /**
+     * @brief Update all the parameters from the accumulated gradients
+     *
+     * The gradients are clipped first if max_grad_norm is set, and the optimizer is applied once to the flat buffers.
+     * The gradients are left as they are, call zero_grad before accumulating the next ones.
+     */
+    void step();
+
     /**
      * @brief Add a layer to the model
      * @param layer The layer to add
@@ -92,9 +300,25 @@ class MLP {
      */
     Tensor run(const Tensor& input) const;
 
+    /**
+     * @brief Quantize the Dense layers of a trained model to int8, for inference
+     *
+     * Every Dense layer is replaced by a Layers::QuantizedDense, with a scale for each output computed from its
+     * weights. The scale of its input is calibrated by running the model on a sample of inputs: the largest magnitude
+     * that reaches the layer becomes 127. The sample should be representative, as larger inputs are clamped. Each
+     * layer is calibrated on the outputs of the original layers before it.
+     *
+     * The quantized model can be run and saved like any other, but not trained.
+     *
+     * @param calibration A batch of sample inputs
+     */
+    void quantize(const Tensor& calibration);
+
     /**
      * @brief Applies gradients in a backwards pass
      *
+     * Computes the gradients of every layer, then takes one optimizer step.
+     *
      * @param input the input
      * @param grads the gradients of the output
      */
@@ -103,7 +327,8 @@ class MLP {
     /**
      * @brief Train the model on a batch of data
      *
-     * Calculates the loss and gradients for each layer, then applies the optimizer once to update the weights.
+     * Calculates the loss and gradients for each layer, then applies the optimizer once to update the weights. This is
+     * zero_grad, backward and step in one call.
      *
      * @param x_train The input data
      * @param y_train The target data
@@ -112,18 +337,62 @@ class MLP {
 
     /**
      * @brief Save the model to a file
+     *
+     * The binary format stores the parameters as raw floats, so it is compact, exact and fast to load (see
+     * save_binary). The text format writes every parameter in decimal.
+     *
      * @param filename The name of the file to save to
+     * @param binary Whether to use the binary format rather than the text format
      */
-    void save(std::string filename) const;
+    void save(std::string filename, bool binary = true) const;
 
     /**
      * @brief Load the model from a file
+     *
+     * The format is detected from the start of the file. Binary files are memory mapped (see load_binary).
+     *
      * @param filename The name of the file to load from
      */
     void load(std::string filename);
 
+    /**
+     * @brief Save the model to a file in the binary format
+     *
+     * The file starts with a 64 byte header holding a magic string, the version of the format, a byte order marker and
+     * the locations of two tables. The layer table has an entry for each layer, with its name, its settings (see
+     * Layers::Layer::config) and the range of its parameters in the tensor table. The tensor table has the shape and
+     * offset of each parameter. The parameters follow as raw floats, each starting at a multiple of 64 bytes.
+     *
+     * @param filename The name of the file to save to
+     */
+    void save_binary(const std::string& filename) const;
+
+    /**
+     * @brief Load the model from a file in the binary format
+     *
+     * When the file is memory mapped, the parameters of the layers are views into the mapping rather than copies, so
+     * loading takes no time however large the model is, and processes loading the same file share its pages in the
+     * page cache. The mapping is private: writing to a parameter, for example while training, copies the page it is
+     * in, and never changes the file. The file is unmapped when no parameter refers to it any more.
+     *
+     * @param filename The name of the file to load from
+     * @param map Whether to memory map the file, rather than read it into memory
+     */
+    void load_binary(const std::string& filename, bool map = true);
+
     /**
      * @brief Train the model on a batch of data
+     *
+     * The rows are shuffled every epoch and gathered into batches by a Data::BatchLoader, on a background thread, so
+     * the next batch is ready when a step finishes.
+     *
+     * In Hogwild mode, each worker instead draws a new permutation of its share of the rows every epoch, and gathers
+     * its batches into buffers of its own.
+     *
+     * The targets may also be the class of each row, as a DTYPE_INT32 tensor. The loss and the metrics then read them
+     * directly, and must take integer labels, like Loss::sparse_categorical_crossentropy and
+     * sparse_categorical_accuracy.
+     *
      * @param x_train The input data
      * @param y_train The target data
      * @param x_test The input data to test on
@@ -132,9 +401,40 @@ class MLP {
      * @param batch_size The size of the batches to train on
      * @param save_file The file to save the model to, or "" to not save
      * @param metrics A list of metrics to calculate after each epoch
+     * @param accumulation_steps The number of batches whose gradients are accumulated before each step. The effective
+     * batch size is batch_size * accumulation_steps, while only one batch is in memory at a time. In Hogwild mode,
+     * each worker accumulates this many of its own batches before each of its updates.
      */
     void train(const Tensor& x_train, const Tensor& y_train, const Tensor& x_test, const Tensor& y_test, int epochs,
-               int batch_size, const std::string& save_file, const std::vector<Metric>& metrics = {});
+               int batch_size, const std::string& save_file, const std::vector<Metric>& metrics = {},
+               int accumulation_steps = 1);
+
+    /**
+     * @brief Train the model on data mapped from files
+     *
+     * Only the rows being read need to be in memory, so the training data may be larger than memory. Batches are read
+     * by a Data::BatchLoader shuffling the rows in blocks, so the files are read in long runs, with the next block
+     * prefetched while the current one is trained on. The blocks should hold many batches, so that batches mix rows
+     * from all over a block.
+     *
+     * The metrics on the training data are computed a batch at a time, and averaged with each batch weighted by its
+     * rows, which gives the exact value for metrics that are means over the rows, like the ones provided. Hogwild mode
+     * does not apply: the batches are trained on one at a time, split across the workers.
+     *
+     * @param x_train The input data
+     * @param y_train The target data
+     * @param x_test The input data to test on
+     * @param y_test The target data to test on
+     * @param epochs The number of epochs to train for
+     * @param batch_size The size of the batches to train on
+     * @param save_file The file to save the model to, or "" to not save
+     * @param metrics A list of metrics to calculate after each epoch
+     * @param accumulation_steps The number of batches whose gradients are accumulated before each step
+     * @param block_rows The number of rows in a block, or 0 for blocks of about 64 MB of inputs, and at least a batch
+     */
+    void train(const Data::MappedDataset& x_train, const Data::MappedDataset& y_train, const Tensor& x_test,
+               const Tensor& y_test, int epochs, int batch_size, const std::string& save_file,
+               const std::vector<Metric>& metrics = {}, int accumulation_steps = 1, int block_rows = 0);
 
     /**
      * @brief Print a summary of the model
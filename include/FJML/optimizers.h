@@ -65,18 +65,38 @@ class Optimizer {
  * @brief Stochastic Gradient Descent
  * @details Optimizes an N dimensional tensor during gradient descent. The optimizer updates the parameters by
  * subtracting the learning rate times the gradient from the parameters.
+ *
+ * With momentum, a velocity is kept, updated as velocity = momentum * velocity + gradient, and the parameters move by
+ * the learning rate times the velocity. With Nesterov momentum they move by the learning rate times
+ * gradient + momentum * velocity instead, which looks ahead along the velocity.
  */
 class SGD : public Optimizer {
+    /**
+     * @brief The velocity, used when momentum is not 0
+     */
+    Tensor velocity;
+
   public:
     /**
      * @brief The learning rate
      */
     float alpha;
+    /**
+     * @brief The momentum, between 0 and 1
+     */
+    float momentum;
+    /**
+     * @brief Whether to use Nesterov momentum
+     */
+    bool nesterov;
 
     /**
      * @brief Default constructor
+     * @param learning_rate The learning rate
+     * @param momentum The momentum, or 0 for plain gradient descent
+     * @param nesterov Whether to use Nesterov momentum, which requires a positive momentum
      */
-    SGD(float learning_rate = 0.01) : Optimizer{"SGD"}, alpha{learning_rate} {}
+    SGD(float learning_rate = 0.01, float momentum = 0, bool nesterov = false);
     /**
      * @brief Destructor
      */
@@ -96,7 +116,7 @@ class SGD : public Optimizer {
      *
      * @return A pointer to a copy of the optimizer
      */
-    Optimizer* clone() const override { return new SGD(this->alpha); }
+    Optimizer* clone() const override { return new SGD(this->alpha, this->momentum, this->nesterov); }
 };
 
 /**
@@ -116,6 +136,14 @@ class Adam : public Optimizer {
      * @brief The time step
      */
     int t = 1;
+    /**
+     * @brief beta1 raised to the power t, kept up to date instead of being recomputed every step
+     */
+    float beta1_power;
+    /**
+     * @brief beta2 raised to the power t
+     */
+    float beta2_power;
 
     /**
      * @brief Helper function to initialize the first and second momentums
@@ -149,7 +177,7 @@ class Adam : public Optimizer {
      * @param b2 The second momentum
      */
     Adam(float a = 0.001, float b1 = 0.9, float b2 = 0.999)
-        : Optimizer{"Adam"}, t{1}, alpha{a}, beta1{b1}, beta2{b2} {}
+        : Optimizer{"Adam"}, t{1}, beta1_power{b1}, beta2_power{b2}, alpha{a}, beta1{b1}, beta2{b2} {}
     /**
      * @brief Destructor
      */
@@ -158,6 +186,9 @@ class Adam : public Optimizer {
     /**
      * @brief Applies the gradient to the parameters
      *
+     * When the parameters and gradients are contiguous, the moments and the parameters are updated together in a single
+     * pass, without allocating.
+     *
      * @param params The parameters to be updated
      * @param grads The gradients to be applied
      */
@@ -0,0 +1,107 @@
+// Copyright (c) 2023 David Lee
+// This code is licensed under MIT license (see LICENSE for details)
+
+#ifndef PARALLEL_INCLUDED
+#define PARALLEL_INCLUDED
+
+#include <algorithm>
+#include <vector>
+
+namespace FJML {
+
+/**
+ * @brief Sets the number of threads used by the library
+ *
+ * Elementwise operations, reductions and matrix multiplications split large tensors across this many threads. The
+ * default is the number of threads OpenMP would use, which is the number of cores unless OMP_NUM_THREADS is set.
+ *
+ * @param n The number of threads, at least 1
+ */
+void set_num_threads(int n);
+
+/**
+ * @brief Gets the number of threads used by the library
+ * @return The number of threads
+ */
+int get_num_threads();
+
+/**
+ * @brief The loops used to split work across threads
+ *
+ * Work is split into chunks of consecutive items, and loops with too little work stay on the calling thread, so that
+ * small tensors do not pay for starting threads.
+ */
+namespace Parallel {
+
+/**
+ * @brief Loops over fewer elements than this run on a single thread
+ */
+constexpr long PARALLEL_THRESHOLD = 1 << 16;
+
+/**
+ * @brief The number of elements in each chunk of a loop
+ */
+constexpr long CHUNK_SIZE = 1 << 12;
+
+/**
+ * @brief Calls f(begin, end) on consecutive ranges covering [0, n), in parallel if there is enough work
+ *
+ * Each range is passed to f exactly once, and ranges may run at the same time, so f must only write to data belonging
+ * to its own range.
+ *
+ * @param n The number of items
+ * @param f The function to call on each range
+ * @param cost The number of elements each item stands for, such as the length of a row when the items are rows
+ */
+template <typename F> void parallel_for(long n, F f, long cost = 1) {
+    if (n <= 0) {
+        return;
+    }
+    int threads = get_num_threads();
+    if (threads == 1 || n * cost < PARALLEL_THRESHOLD) {
+        f(0L, n);
+        return;
+    }
+    long chunk = std::max(1L, CHUNK_SIZE / cost), chunks = (n + chunk - 1) / chunk;
+#pragma omp parallel for num_threads(threads)
+    for (long c = 0; c < chunks; c++) {
+        f(c * chunk, std::min(n, (c + 1) * chunk));
+    }
+}
+
+/**
+ * @brief Combines f(begin, end) over consecutive ranges covering [0, n), computing the ranges in parallel if there is
+ * enough work
+ *
+ * The ranges, and the order they are combined in, do not depend on the number of threads, so the result of a floating
+ * point reduction is the same however many threads are used.
+ *
+ * @param n The number of items
+ * @param identity The result for an empty range
+ * @param f The function computing the result for a range
+ * @param combine The function combining the results of two ranges
+ * @return The combined result
+ */
+template <typename T, typename F, typename C> T parallel_reduce(long n, T identity, F f, C combine) {
+    long chunks = (n + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    std::vector<T> partial(chunks, identity);
+    parallel_for(
+        chunks,
+        [&](long first, long last) {
+            for (long c = first; c < last; c++) {
+                partial[c] = f(c * CHUNK_SIZE, std::min(n, (c + 1) * CHUNK_SIZE));
+            }
+        },
+        CHUNK_SIZE);
+    T result = identity;
+    for (const T& p : partial) {
+        result = combine(result, p);
+    }
+    return result;
+}
+
+} // namespace Parallel
+
+} // namespace FJML
+
+#endif
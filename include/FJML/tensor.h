@@ -4,8 +4,12 @@
 #ifndef TENSOR_INCLUDED
 #define TENSOR_INCLUDED
 
+#include <cstdint>
 #include <fstream>
 #include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
 #include <vector>
 
 #ifdef CUDA
@@ -28,27 +32,171 @@ extern bool handle_initialized;
 enum Device { DEVICE_CPU, DEVICE_CUDA };
 
 /**
- * @brief This class represents an N dimensional tensor of floats.
+ * @brief The types elements can have
+ *
+ * A Tensor holds DTYPE_FLOAT32, DTYPE_FLOAT64 or DTYPE_INT32 elements. The 16 bit formats are only used to store
+ * data compactly, in a HalfTensor: elements are converted to floats as they are loaded, and all arithmetic is done on
+ * floats.
+ */
+enum DType {
+    /**
+     * @brief 32 bit IEEE floats
+     */
+    DTYPE_FLOAT32,
+    /**
+     * @brief bfloat16, the top half of a float: the same range, with 8 bits of precision
+     */
+    DTYPE_BFLOAT16,
+    /**
+     * @brief 16 bit IEEE floats: 11 bits of precision, with magnitudes from about 6e-8 to 65504
+     */
+    DTYPE_FLOAT16,
+    /**
+     * @brief 64 bit IEEE floats
+     */
+    DTYPE_FLOAT64,
+    /**
+     * @brief 32 bit signed integers
+     */
+    DTYPE_INT32
+};
+
+/**
+ * @brief The name of a type, as stored in model files
+ * @param dtype The type
+ * @return "float32", "bfloat16", "float16", "float64" or "int32"
+ */
+std::string dtype_name(DType dtype);
+
+/**
+ * @brief The type with a name
+ * @param name "float32", "bfloat16", "float16", "float64" or "int32"
+ * @return The type
+ */
+DType parse_dtype(const std::string& name);
+
+/**
+ * @brief The number of bytes of an element of a type
+ * @param dtype The type
+ * @return The size of an element
+ */
+size_t dtype_size(DType dtype);
+
+/**
+ * @brief The type of the elements of a Tensor that holds values of the C++ type T
+ *
+ * Only float, double and int32_t have one.
+ */
+template <typename T> struct DTypeOf;
+
+template <> struct DTypeOf<float> {
+    static constexpr DType value = DTYPE_FLOAT32;
+};
+
+template <> struct DTypeOf<double> {
+    static constexpr DType value = DTYPE_FLOAT64;
+};
+
+template <> struct DTypeOf<int32_t> {
+    static constexpr DType value = DTYPE_INT32;
+};
+
+/**
+ * @brief Calls f with a value of the C++ type of the elements of a tensor
+ *
+ * This is how the kernels that are written as templates on the element type are picked for a tensor, for example
+ * `dispatch_dtype(t.dtype, [&](auto zero) { using T = decltype(zero); ... })`.
+ *
+ * @param dtype DTYPE_FLOAT32, DTYPE_FLOAT64 or DTYPE_INT32
+ * @param f The function to call
+ * @return The value returned by f
+ * @throws std::invalid_argument If a tensor cannot hold elements of the type
+ */
+template <typename F> auto dispatch_dtype(DType dtype, F f) {
+    switch (dtype) {
+    case DTYPE_FLOAT32:
+        return f(0.0f);
+    case DTYPE_FLOAT64:
+        return f(0.0);
+    case DTYPE_INT32:
+        return f((int32_t)0);
+    default:
+        throw std::invalid_argument("A tensor cannot hold " + dtype_name(dtype) + " elements");
+    }
+}
+
+/**
+ * @brief A tag type used to create a tensor without initializing its elements.
+ */
+struct Uninitialized {};
+
+/**
+ * @brief The tag passed to Tensor constructors to skip initializing the elements.
+ */
+constexpr Uninitialized uninitialized{};
+
+template <typename E> struct Expression;
+
+/**
+ * @brief This class represents an N dimensional tensor of floats, doubles or 32 bit integers.
  * The tensor is stored as a vector, and also has a shape property.
+ *
+ * The type of the elements is a runtime tag, dtype, which is DTYPE_FLOAT32 unless the tensor is created with another
+ * type or converted with astype. Elementwise arithmetic, comparisons, copies, views, reductions and gemm work on every
+ * type that makes sense for them, by running the same kernels instantiated for the element type. The operands of an
+ * elementwise operation must have the same type. Layers, activations and optimizers train on float32 tensors only.
+ *
+ * The buffer holding the elements is reference counted, so a tensor can be a view into part of another tensor's buffer
+ * (see slice, select, view and permute). Views share memory with the tensor they were created from: writing through a
+ * view changes the original. The copy constructor and copy assignment always make a deep copy.
+ *
+ * Elementwise operations between two tensors broadcast their operands like NumPy does: the shapes are aligned at the
+ * last dimension, and a dimension of size 1 (or a missing leading dimension) is repeated to match the other operand.
+ * For example, adding a tensor of shape (3) to one of shape (4, 3) adds it to every row. The repeated operand is never
+ * expanded in memory.
+ *
+ * The arithmetic operators are lazy: `a * b + c` builds an expression, which is evaluated in a single loop when it is
+ * assigned to a tensor (see expression.h).
  */
 class Tensor {
   public:
     /**
-     * @brief A linear array containing the data
+     * @brief A pointer to the first element of the tensor
+     *
+     * The element at index (i_0, ..., i_n) is at data[i_0 * strides[0] + ... + i_n * strides[n]]. If the tensor is
+     * contiguous, this is a linear array containing the data.
+     *
+     * For a tensor whose dtype is not DTYPE_FLOAT32 this points to elements of that type, which are read through
+     * data_as.
      */
     float* data;
+    /**
+     * @brief The buffer the data lives in, shared between a tensor and its views
+     */
+    std::shared_ptr<float> storage;
     /**
      * @brief The shape of the tensor
      */
     std::vector<int> shape;
     /**
      * @brief Element i contains the number of elements in the ith dimension
+     *
+     * This is the product of shape[i], ..., shape[n], so data_size[0] is the total number of elements. It describes
+     * the shape only, and does not depend on how the elements are laid out in memory.
      */
     std::vector<int> data_size;
+    /**
+     * @brief Element i contains the distance, in elements, between consecutive indices along the ith dimension
+     */
+    std::vector<int> strides;
     /**
      * @brief The device this tensor lives on.
      */
     Device device;
+    /**
+     * @brief The type of the elements
+     */
+    DType dtype;
 
     /**
      * @brief Default constructor
@@ -70,6 +218,44 @@ class Tensor {
      */
     Tensor(const std::vector<int>& shape, Device device);
 
+    /**
+     * @brief Creates a tensor with the given shape, without initializing its elements
+     *
+     * Use this when every element is about to be overwritten, to skip a write pass over the whole tensor.
+     *
+     * @param shape the shape of the tensor
+     * @param device the device this tensor lives on
+     */
+    Tensor(const std::vector<int>& shape, Uninitialized, Device device = DEVICE_CPU);
+
+    /**
+     * @brief Creates a tensor of zeros with the given shape and element type
+     * @param shape the shape of the tensor
+     * @param dtype the type of the elements, DTYPE_FLOAT32, DTYPE_FLOAT64 or DTYPE_INT32
+     * @param device the device this tensor lives on
+     */
+    Tensor(const std::vector<int>& shape, DType dtype, Device device = DEVICE_CPU);
+
+    /**
+     * @brief Creates a tensor with the given shape and element type, without initializing its elements
+     * @param shape the shape of the tensor
+     * @param dtype the type of the elements, DTYPE_FLOAT32, DTYPE_FLOAT64 or DTYPE_INT32
+     * @param device the device this tensor lives on
+     */
+    Tensor(const std::vector<int>& shape, Uninitialized, DType dtype, Device device = DEVICE_CPU);
+
+    /**
+     * @brief Creates a contiguous tensor in memory that is already allocated, such as a memory mapped file
+     *
+     * The tensor shares ownership of the memory through storage, which should point to the first element. The
+     * aliasing constructor of std::shared_ptr can make such a pointer into a larger block.
+     *
+     * @param storage the memory holding the elements
+     * @param shape the shape of the tensor
+     * @param device the device the memory is on
+     */
+    Tensor(std::shared_ptr<float> storage, const std::vector<int>& shape, Device device = DEVICE_CPU);
+
     /**
      * @brief Copy constructor
      * @param other the tensor to copy
@@ -89,6 +275,13 @@ class Tensor {
      */
     Tensor& operator=(const Tensor& other);
 
+    /**
+     * @brief Move assignment operator
+     * @param other the tensor to move
+     * @return a reference to this tensor
+     */
+    Tensor& operator=(Tensor&& other);
+
     /**
      * @brief Destructor
      */
@@ -102,6 +295,14 @@ class Tensor {
      */
     static Tensor zeros(const std::vector<int>& shape, Device device = DEVICE_CPU);
 
+    /**
+     * @brief Creates a tensor with the given shape, with uninitialized elements
+     * @param shape the shape of the tensor
+     * @param device the device this tensor lives on
+     * @return a tensor with the given shape, whose elements must be written before they are read
+     */
+    static Tensor empty(const std::vector<int>& shape, Device device = DEVICE_CPU);
+
     /**
      * @brief Creates a tensor with the given shape, filled with ones
      * @param shape the shape of the tensor
@@ -148,6 +349,45 @@ class Tensor {
         return array(tensors, device);
     }
 
+    /**
+     * @brief Create a vector holding the given values, with the element type of the values
+     *
+     * For example, from_vector(std::vector<int32_t>{...}) makes a tensor of integer labels.
+     *
+     * @param vec the values, of type float, double or int32_t
+     * @param device the device this tensor lives on
+     * @return a tensor of shape (vec.size())
+     */
+    template <typename T> static Tensor from_vector(const std::vector<T>& vec, Device device = DEVICE_CPU) {
+        Tensor tensor({(int)vec.size()}, uninitialized, DTypeOf<T>::value, device);
+        std::copy(vec.begin(), vec.end(), tensor.data_as<T>());
+        return tensor;
+    }
+
+    /**
+     * @brief The elements of the tensor, as the C++ type of its dtype
+     * @return a pointer to the first element, which is nullptr for an empty tensor
+     * @throws std::invalid_argument If T is not the type of the elements
+     */
+    template <typename T> T* data_as() const {
+        if (dtype != DTypeOf<T>::value) {
+            throw std::invalid_argument("The tensor holds " + dtype_name(dtype) + " elements, not " +
+                                        dtype_name(DTypeOf<T>::value));
+        }
+        return (T*)data;
+    }
+
+    /**
+     * @brief Converts the elements to another type
+     *
+     * Conversions to DTYPE_INT32 are exact: every element must be an integer in the range of int32.
+     *
+     * @param dtype the type to convert to
+     * @return a contiguous tensor with the same shape, which is a copy even if the type is unchanged
+     * @throws std::out_of_range If an element cannot be converted to an integer exactly
+     */
+    Tensor astype(DType dtype) const;
+
     /**
      * @brief Convert the tensor to a different device
      * @param device the device to convert to
@@ -174,8 +414,63 @@ class Tensor {
      */
     Tensor& reshape(const std::vector<int>& shape);
 
+    /**
+     * @brief Checks whether the elements are laid out in row-major order without gaps
+     * @return true if the tensor is contiguous, false otherwise
+     */
+    bool is_contiguous() const;
+
+    /**
+     * @brief Returns a contiguous tensor with the same elements
+     *
+     * If the tensor is already contiguous, the result is a view sharing its memory. Otherwise the elements are copied.
+     *
+     * @return a contiguous tensor with the same elements
+     */
+    Tensor contiguous() const;
+
+    /**
+     * @brief Returns a view of the tensor with a different shape
+     *
+     * The tensor must be contiguous.
+     *
+     * @param shape the shape of the view
+     * @return a view sharing memory with this tensor
+     */
+    Tensor view(const std::vector<int>& shape) const;
+
+    /**
+     * @brief Returns a view of the indices from start to end (exclusive) along an axis
+     * @param start the first index
+     * @param end one past the last index
+     * @param axis the axis to slice along, default is 0
+     * @return a view sharing memory with this tensor
+     */
+    Tensor slice(int start, int end, int axis = 0) const;
+
+    /**
+     * @brief Returns a view of a single index along an axis, with that axis removed
+     * @param index the index to select
+     * @param axis the axis to select along, default is 0
+     * @return a view sharing memory with this tensor, with one dimension less
+     */
+    Tensor select(int index, int axis = 0) const;
+
+    /**
+     * @brief Returns a view of the tensor with its axes reordered
+     *
+     * Axis i of the result is axis axes[i] of this tensor, so permute({1, 0}) transposes a matrix without copying.
+     *
+     * @param axes a permutation of the axes
+     * @return a view sharing memory with this tensor
+     */
+    Tensor permute(const std::vector<int>& axes) const;
+
     /**
      * @brief Returns the element at the given index
+     *
+     * The element access functions and the iterator read float32 tensors, use data_as for the other types.
+     *
      * @param index the index of the element
      * @return the element at the given index
      */
@@ -334,25 +629,32 @@ class Tensor {
     iterator end();
 
     /**
-     * @brief Overloads the + operator
-     * @param other the other tensor
-     * @return the sum of the two tensors
+     * @brief Creates a tensor holding the value of an expression
+     *
+     * Arithmetic operators on tensors return expressions (see expression.h), which are converted to tensors this way.
+     *
+     * @param expr the expression
      */
-    Tensor operator+(const Tensor& other) const;
+    template <typename E> Tensor(const Expression<E>& expr);
 
     /**
-     * @brief Overloads the += operator
-     * @param other the other tensor
-     * @return the sum of the two tensors
+     * @brief Assigns the value of an expression to the tensor
+     *
+     * If every tensor in the expression is on the CPU, contiguous and has the shape of the result, the expression is
+     * evaluated in a single loop. The result is written into the existing memory when this tensor has the right shape
+     * and is not shared with a view, even if it appears in the expression.
+     *
+     * @param expr the expression
+     * @return a reference to this tensor
      */
-    Tensor& operator+=(const Tensor& other);
+    template <typename E> Tensor& operator=(const Expression<E>& expr);
 
     /**
-     * @brief Overloads the - operator
+     * @brief Overloads the += operator
      * @param other the other tensor
-     * @return the difference of the two tensors
+     * @return the sum of the two tensors
      */
-    Tensor operator-(const Tensor& other) const;
+    Tensor& operator+=(const Tensor& other);
 
     /**
      * @brief Overloads the -= operator
@@ -361,16 +663,6 @@ class Tensor {
      */
     Tensor& operator-=(const Tensor& other);
 
-    /**
-     * @brief Overloads the * operator
-     *
-     * Note: this is element-wise multiplication, not matrix multiplication
-     *
-     * @param other the other tensor
-     * @return the product of the two tensors
-     */
-    Tensor operator*(const Tensor& other) const;
-
     /**
      * @brief Overloads the *= operator
      *
@@ -381,16 +673,6 @@ class Tensor {
      */
     Tensor& operator*=(const Tensor& other);
 
-    /**
-     * @brief Overloads the / operator
-     *
-     * Note: this is element-wise division, not matrix division
-     *
-     * @param other the other tensor
-     * @return the quotient of the two tensors
-     */
-    Tensor operator/(const Tensor& other) const;
-
     /**
      * @brief Overloads the /= operator
      *
@@ -401,13 +683,6 @@ class Tensor {
      */
     Tensor& operator/=(const Tensor& other);
 
-    /**
-     * @brief Addition of a scalar to the tensor
-     * @param other the scalar
-     * @return the sum of the tensor and the scalar
-     */
-    Tensor operator+(float other) const;
-
     /**
      * @brief Overloads the += operator
      * @param other the scalar
@@ -415,13 +690,6 @@ class Tensor {
      */
     Tensor& operator+=(float other);
 
-    /**
-     * @brief Overloads the - operator
-     * @param other the scalar
-     * @return the difference of the tensor and the scalar
-     */
-    Tensor operator-(float other) const;
-
     /**
      * @brief Overloads the -= operator
      * @param other the scalar
@@ -429,13 +697,6 @@ class Tensor {
      */
     Tensor& operator-=(float other);
 
-    /**
-     * @brief Overloads the * operator
-     * @param other the scalar
-     * @return the product of the tensor and the scalar
-     */
-    Tensor operator*(float other) const;
-
     /**
      * @brief Overloads the *= operator
      * @param other the scalar
@@ -443,13 +704,6 @@ class Tensor {
      */
     Tensor& operator*=(float other);
 
-    /**
-     * @brief Overloads the / operator
-     * @param other the scalar
-     * @return the quotient of the tensor and the scalar
-     */
-    Tensor operator/(float other) const;
-
     /**
      * @brief Overloads the /= operator
      * @param other the scalar
@@ -458,42 +712,32 @@ class Tensor {
     Tensor& operator/=(float other);
 
     /**
-     * @brief Overloads the + operator
-     * @param other the scalar
-     * @param tensor the tensor
-     * @return the sum of the tensor and the scalar
-     */
-    friend Tensor operator+(float other, const Tensor& tensor);
-
-    /**
-     * @brief Overloads the - operator
-     * @param other the scalar
-     * @param tensor the tensor
-     * @return the difference of the tensor and the scalar
+     * @brief Adds the value of an expression to the tensor
+     * @param expr the expression
+     * @return a reference to this tensor
      */
-    friend Tensor operator-(float other, const Tensor& tensor);
+    template <typename E> Tensor& operator+=(const Expression<E>& expr);
 
     /**
-     * @brief Scalar times the tensor
-     * @param other the scalar
-     * @param tensor the tensor
-     * @return the product of the tensor and the scalar
+     * @brief Subtracts the value of an expression from the tensor
+     * @param expr the expression
+     * @return a reference to this tensor
      */
-    friend Tensor operator*(float other, const Tensor& tensor);
+    template <typename E> Tensor& operator-=(const Expression<E>& expr);
 
     /**
-     * @brief Overloads the / operator
-     * @param other the scalar
-     * @param tensor the tensor
-     * @return the quotient of the tensor and the scalar
+     * @brief Multiplies the tensor by the value of an expression
+     * @param expr the expression
+     * @return a reference to this tensor
      */
-    friend Tensor operator/(float other, const Tensor& tensor);
+    template <typename E> Tensor& operator*=(const Expression<E>& expr);
 
     /**
-     * @brief Negation of the tensor
-     * @return the negation of the tensor
+     * @brief Divides the tensor by the value of an expression
+     * @param expr the expression
+     * @return a reference to this tensor
      */
-    Tensor operator-() const;
+    template <typename E> Tensor& operator/=(const Expression<E>& expr);
 
     /**
      * @brief Overloads the << operator
@@ -508,13 +752,36 @@ class Tensor {
      * @brief Helper method to print the tensor
      * @param os the output stream
      * @param dim the current dimension
-     * @param index the current index
+     * @param offset the offset of the current element in data
      */
-    void print(std::ostream& os, int dim, int index) const;
+    void print(std::ostream& os, int dim, int offset) const;
+
+    /**
+     * @brief Converts an index into the flattened tensor to an offset in data
+     * @param index the index of the element in row-major order
+     * @return the offset of the element in data
+     */
+    int offset_of(int index) const;
+
+    /**
+     * @brief Checks that the tensor holds floats, for the functions that only read or write floats
+     * @param action what the caller does, for the error message
+     */
+    void require_float(const char* action) const;
+
+    /**
+     * @brief Applies an elementwise operation between the tensor and an expression in place
+     * @param e the expression
+     * @return a reference to this tensor
+     */
+    template <typename Op, typename E> Tensor& compound_assign(const E& e);
 
   public:
     /**
      * @brief Overloads the == operator
+     *
+     * Tensors with different element types are never equal.
+     *
      * @param other the other tensor
      * @return true if the two tensors are equal, false otherwise
      */
@@ -572,4 +839,6 @@ class Tensor {
 
 } // namespace FJML
 
+#include "expression.h"
+
 #endif
@@ -2,12 +2,55 @@
 // This code is licensed under MIT license (see LICENSE for details)
 
 #include "../include/FJML/optimizers.h"
+#include "../include/FJML/parallel.h"
 
 namespace FJML {
 
 namespace Optimizers {
 
-void SGD::apply_grad(Tensor& params, const Tensor& grads) { params -= grads * alpha; }
+SGD::SGD(float learning_rate, float momentum, bool nesterov)
+    : Optimizer{"SGD"}, alpha{learning_rate}, momentum{momentum}, nesterov{nesterov} {
+    if (momentum < 0) {
+        throw std::invalid_argument("Momentum must not be negative");
+    }
+    if (nesterov && momentum == 0) {
+        throw std::invalid_argument("Nesterov momentum requires a positive momentum");
+    }
+}
+
+void SGD::apply_grad(Tensor& params, const Tensor& grads) {
+    if (momentum == 0) {
+        params -= grads * alpha;
+        return;
+    }
+    // A default constructed tensor has a size of 1 but no data, so a parameter with one element is not enough to tell
+    if (velocity.data == nullptr || velocity.shape != params.shape) {
+        velocity = Tensor(params.shape, params.device);
+    }
+
+    if (params.is_contiguous() && grads.is_contiguous() && params.shape == grads.shape) {
+        // Update the velocity and the parameters in a single pass
+        // The step is lr * velocity, or lr * (grads + momentum * velocity) with Nesterov momentum
+        float lr = alpha, mu = momentum, grad_weight = nesterov ? 1 : 0, velocity_weight = nesterov ? momentum : 1;
+        float* __restrict__ p = params.data;
+        float* __restrict__ vel = velocity.data;
+        const float* __restrict__ g = grads.data;
+        Parallel::parallel_for(params.data_size[0], [&](long begin, long end) {
+#pragma omp simd
+            for (long i = begin; i < end; i++) {
+                vel[i] = mu * vel[i] + g[i];
+                p[i] -= lr * (grad_weight * g[i] + velocity_weight * vel[i]);
+            }
+        });
+    } else {
+        velocity = momentum * velocity + grads;
+        if (nesterov) {
+            params -= alpha * (grads + momentum * velocity);
+        } else {
+            params -= alpha * velocity;
+        }
+    }
+}
 
 } // namespace Optimizers
 
@@ -3,35 +3,87 @@
 
 #include <cmath>
 
+#include <immintrin.h>
+
 #include "../include/FJML/optimizers.h"
+#include "../include/FJML/parallel.h"
+
+namespace {
+
+/**
+ * The constants of one Adam step, with the bias corrections folded into step_size and v_scale
+ */
+struct AdamStep {
+    float beta1, beta2, step_size, v_scale, epsilon;
+};
+
+/**
+ * Updates n parameters p and their moments m and v with the gradients g, in one pass.
+ */
+void adam_update(float* __restrict__ p, float* __restrict__ m, float* __restrict__ v, const float* __restrict__ g,
+                 long n, const AdamStep& s) {
+    long i = 0;
+#if defined(__AVX2__) && defined(__FMA__)
+    // Written with intrinsics because the compiler does not vectorize std::sqrt, which may set errno
+    __m256 b1 = _mm256_set1_ps(s.beta1), c1 = _mm256_set1_ps(1 - s.beta1);
+    __m256 b2 = _mm256_set1_ps(s.beta2), c2 = _mm256_set1_ps(1 - s.beta2);
+    __m256 step = _mm256_set1_ps(s.step_size), scale = _mm256_set1_ps(s.v_scale), eps = _mm256_set1_ps(s.epsilon);
+    for (; i + 8 <= n; i += 8) {
+        __m256 gi = _mm256_loadu_ps(g + i);
+        __m256 mi = _mm256_fmadd_ps(b1, _mm256_loadu_ps(m + i), _mm256_mul_ps(c1, gi));
+        __m256 vi = _mm256_fmadd_ps(b2, _mm256_loadu_ps(v + i), _mm256_mul_ps(c2, _mm256_mul_ps(gi, gi)));
+        __m256 denom = _mm256_add_ps(_mm256_sqrt_ps(_mm256_mul_ps(vi, scale)), eps);
+        __m256 pi = _mm256_sub_ps(_mm256_loadu_ps(p + i), _mm256_div_ps(_mm256_mul_ps(step, mi), denom));
+        _mm256_storeu_ps(m + i, mi);
+        _mm256_storeu_ps(v + i, vi);
+        _mm256_storeu_ps(p + i, pi);
+    }
+#endif
+    for (; i < n; i++) {
+        m[i] = s.beta1 * m[i] + (1 - s.beta1) * g[i];
+        v[i] = s.beta2 * v[i] + (1 - s.beta2) * g[i] * g[i];
+        p[i] -= s.step_size * m[i] / (std::sqrt(v[i] * s.v_scale) + s.epsilon);
+    }
+}
+
+} // namespace
 
 namespace FJML {
 
 namespace Optimizers {
 
 void Adam::init(const Tensor& params) {
-    if (m.data_size[0] != params.data_size[0] || v.data_size[0] != params.data_size[0]) {
+    // A default constructed tensor has a size of 1 but no data, so a parameter with one element is not enough to tell
+    if (m.data == nullptr || v.data == nullptr || m.shape != params.shape || v.shape != params.shape) {
         m = Tensor(params.shape, params.device);
         v = Tensor(params.shape, params.device);
         t = 1;
+        beta1_power = beta1;
+        beta2_power = beta2;
     }
 }
 
 void Adam::apply_grad(Tensor& params, const Tensor& grads) {
     init(params);
-    // Update the first and second moment estimates
-    m = beta1 * m + (1 - beta1) * grads;
-    v = beta2 * v + (1 - beta2) * grads * grads;
+    // The bias corrections are folded into the step size and into the scale of v
+    float step_size = alpha / (1 - beta1_power), v_scale = 1 / (1 - beta2_power);
 
-    // Compute bias-corrected first and second moment estimates
-    Tensor m_hat = m / (1 - pow(beta1, t));
-    Tensor v_hat = v / (1 - pow(beta2, t));
-
-    // Update parameters
-    params -= alpha * m_hat / (v_hat.apply_function([](float x) { return std::sqrt(x); }) + epsilon);
+    if (params.is_contiguous() && grads.is_contiguous() && params.shape == grads.shape) {
+        // Update m, v and the parameters in a single pass
+        AdamStep step{beta1, beta2, step_size, v_scale, epsilon};
+        Parallel::parallel_for(params.data_size[0], [&](long begin, long end) {
+            adam_update(params.data + begin, m.data + begin, v.data + begin, grads.data + begin, end - begin, step);
+        });
+    } else {
+        // Each statement below is evaluated in a single pass, with m and v keeping their storage between steps
+        m = beta1 * m + (1 - beta1) * grads;
+        v = beta2 * v + (1 - beta2) * grads * grads;
+        params -= step_size * m / (LinAlg::sqrt(v * v_scale) + epsilon);
+    }
 
-    // Increment time step
     t++;
+    beta1_power *= beta1;
+    beta2_power *= beta2;
 }
 
 } // namespace Optimizers
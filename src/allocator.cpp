@@ -0,0 +1,259 @@
+// Copyright (c) 2023 David Lee
+// This code is licensed under MIT license (see LICENSE for details)
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+
+#include "../include/FJML/allocator.h"
+
+namespace {
+
+/**
+ * Every block starts with a header that says where it came from, so that deallocate only needs the pointer.
+ * The header takes up a whole alignment unit, so the memory handed out after it is aligned as well.
+ */
+struct alignas(FJML::Memory::ALIGNMENT) BlockHeader {
+    FJML::Memory::StepArena::Chunk* chunk; // nullptr for blocks from the size class cache
+    size_t size;                           // usable size of the block in bytes
+};
+
+constexpr size_t HEADER = sizeof(BlockHeader);
+constexpr size_t MIN_SIZE = 64;
+constexpr int NUM_CLASSES = 172;
+constexpr size_t THREAD_CACHE_BLOCKS = 4;
+
+/**
+ * Size classes are spaced four per power of two (64, 80, 96, 112, 128, 160, ...), which wastes at most 25% of a block.
+ */
+int size_class(size_t bytes) {
+    if (bytes <= MIN_SIZE) {
+        return 0;
+    }
+    int k = 63 - __builtin_clzll(bytes - 1);
+    size_t base = size_t(1) << k, step = base / 4;
+    return (k - 6) * 4 + (int)((bytes - base + step - 1) / step);
+}
+
+size_t class_size(int c) {
+    if (c == 0) {
+        return MIN_SIZE;
+    }
+    size_t base = size_t(1) << ((c - 1) / 4 + 6);
+    return base + ((c - 1) % 4 + 1) * (base / 4);
+}
+
+struct Pool {
+    std::mutex mutex[NUM_CLASSES];
+    std::vector<BlockHeader*> free_list[NUM_CLASSES];
+};
+
+// Never destroyed, since tensors with static storage duration may be freed after it would be
+Pool& pool() {
+    static Pool* p = new Pool;
+    return *p;
+}
+
+std::atomic<size_t> hits{0}, misses{0}, bytes_held{0}, bytes_in_use{0};
+std::atomic<size_t> cache_limit{size_t(1) << 30};
+std::atomic<bool> thread_cache_enabled{false};
+
+struct ThreadCache {
+    std::vector<BlockHeader*> free_list[NUM_CLASSES];
+
+    void flush() {
+        for (int c = 0; c < NUM_CLASSES; c++) {
+            if (free_list[c].empty()) {
+                continue;
+            }
+            std::lock_guard<std::mutex> lock(pool().mutex[c]);
+            pool().free_list[c].insert(pool().free_list[c].end(), free_list[c].begin(), free_list[c].end());
+            free_list[c].clear();
+        }
+    }
+
+    ~ThreadCache() { flush(); }
+};
+
+thread_local ThreadCache thread_cache;
+thread_local FJML::Memory::StepArena* current_arena = nullptr;
+
+void* system_allocate(size_t bytes) {
+    // aligned_alloc requires the size to be a multiple of the alignment
+    bytes = (bytes + FJML::Memory::ALIGNMENT - 1) / FJML::Memory::ALIGNMENT * FJML::Memory::ALIGNMENT;
+    void* ptr = std::aligned_alloc(FJML::Memory::ALIGNMENT, bytes);
+    if (ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+} // namespace
+
+namespace FJML {
+
+namespace Memory {
+
+struct StepArena::Chunk {
+    char* memory;
+    size_t size;
+    size_t used;
+    // One reference per live block, plus one held by the owning arena until the chunk is retired
+    std::atomic<size_t> refs;
+};
+
+static void release_chunk(StepArena::Chunk* chunk) {
+    if (chunk->refs.fetch_sub(1) == 1) {
+        std::free(chunk->memory);
+        delete chunk;
+    }
+}
+
+void* allocate(size_t bytes) {
+    if (current_arena != nullptr) {
+        return current_arena->allocate(bytes);
+    }
+    int c = size_class(bytes);
+    size_t size = class_size(c);
+    BlockHeader* block = nullptr;
+    if (thread_cache_enabled && !thread_cache.free_list[c].empty()) {
+        block = thread_cache.free_list[c].back();
+        thread_cache.free_list[c].pop_back();
+    } else {
+        std::lock_guard<std::mutex> lock(pool().mutex[c]);
+        if (!pool().free_list[c].empty()) {
+            block = pool().free_list[c].back();
+            pool().free_list[c].pop_back();
+        }
+    }
+    if (block != nullptr) {
+        hits++;
+        bytes_held -= size;
+    } else {
+        misses++;
+        block = (BlockHeader*)system_allocate(HEADER + size);
+        block->chunk = nullptr;
+        block->size = size;
+    }
+    bytes_in_use += size;
+    return block + 1;
+}
+
+void deallocate(void* ptr) {
+    if (ptr == nullptr) {
+        return;
+    }
+    BlockHeader* block = (BlockHeader*)ptr - 1;
+    bytes_in_use -= block->size;
+    if (block->chunk != nullptr) {
+        release_chunk(block->chunk);
+        return;
+    }
+    if (bytes_held + block->size > cache_limit) {
+        std::free(block);
+        return;
+    }
+    bytes_held += block->size;
+    int c = size_class(block->size);
+    if (thread_cache_enabled && thread_cache.free_list[c].size() < THREAD_CACHE_BLOCKS) {
+        thread_cache.free_list[c].push_back(block);
+        return;
+    }
+    std::lock_guard<std::mutex> lock(pool().mutex[c]);
+    pool().free_list[c].push_back(block);
+}
+
+Stats stats() { return Stats{hits, misses, bytes_held, bytes_in_use}; }
+
+void reset_stats() {
+    hits = 0;
+    misses = 0;
+}
+
+void release() {
+    thread_cache.flush();
+    for (int c = 0; c < NUM_CLASSES; c++) {
+        std::lock_guard<std::mutex> lock(pool().mutex[c]);
+        for (BlockHeader* block : pool().free_list[c]) {
+            bytes_held -= block->size;
+            std::free(block);
+        }
+        pool().free_list[c].clear();
+    }
+}
+
+void set_cache_limit(size_t bytes) { cache_limit = bytes; }
+
+void set_thread_cache(bool enabled) {
+    if (!enabled) {
+        thread_cache.flush();
+    }
+    thread_cache_enabled = enabled;
+}
+
+StepArena::StepArena(size_t chunk_size) : chunk_size{chunk_size}, current{0}, previous{current_arena} {
+    current_arena = this;
+}
+
+StepArena::~StepArena() {
+    for (Chunk* chunk : chunks) {
+        release_chunk(chunk);
+    }
+    current_arena = previous;
+}
+
+void StepArena::reset() {
+    std::vector<Chunk*> reusable;
+    for (Chunk* chunk : chunks) {
+        if (chunk->refs == 1) {
+            // Only the arena's own reference is left, so nothing points into this chunk anymore
+            chunk->used = 0;
+            reusable.push_back(chunk);
+        } else {
+            release_chunk(chunk);
+        }
+    }
+    chunks = reusable;
+    current = 0;
+}
+
+void* StepArena::allocate(size_t bytes) {
+    size_t size = (bytes + HEADER - 1) / HEADER * HEADER;
+    size_t needed = HEADER + size;
+    while (current < chunks.size() && chunks[current]->size - chunks[current]->used < needed) {
+        current++;
+    }
+    if (current == chunks.size()) {
+        misses++;
+        Chunk* chunk = new Chunk;
+        chunk->size = std::max(chunk_size, needed);
+        chunk->memory = (char*)system_allocate(chunk->size);
+        chunk->used = 0;
+        chunk->refs = 1;
+        chunks.push_back(chunk);
+    } else {
+        hits++;
+    }
+    Chunk* chunk = chunks[current];
+    BlockHeader* block = (BlockHeader*)(chunk->memory + chunk->used);
+    chunk->used += needed;
+    chunk->refs++;
+    block->chunk = chunk;
+    block->size = size;
+    bytes_in_use += size;
+    return block + 1;
+}
+
+size_t StepArena::bytes_used() const {
+    size_t total = 0;
+    for (Chunk* chunk : chunks) {
+        total += chunk->used;
+    }
+    return total;
+}
+
+} // namespace Memory
+
+} // namespace FJML
@@ -0,0 +1,182 @@
+// Copyright (c) 2023 David Lee
+// This code is licensed under MIT license (see LICENSE for details)
+
+#include <cstring>
+#include <numeric>
+#include <random>
+#include <stdexcept>
+
+#include "../include/FJML/data.h"
+
+namespace FJML {
+
+namespace Data {
+
+BatchLoader::BatchLoader(const Tensor& x, const Tensor& y, int batch_size, bool shuffle, int prefetch, int block_rows)
+    : x{x.contiguous()}, y{y.contiguous()}, x_data{(const char*)this->x.data}, y_data{(const char*)this->y.data},
+      x_row{0}, y_row{0}, rows{0}, batch_size{batch_size}, shuffle{shuffle}, block_rows{block_rows}, produced{0},
+      consumed{0}, holding{false}, stopping{false} {
+    if (x.dim() == 0 || y.dim() == 0 || x.shape[0] != y.shape[0]) {
+        throw std::invalid_argument("x and y must have the same number of rows");
+    }
+    if (x.device != DEVICE_CPU || y.device != DEVICE_CPU) {
+        throw std::invalid_argument("Batches can only be loaded from data on the CPU");
+    }
+    rows = x.shape[0];
+    if (rows > 0) {
+        x_row = x.data_size[0] / rows * dtype_size(x.dtype);
+        y_row = y.data_size[0] / rows * dtype_size(y.dtype);
+    }
+    start(x.shape, y.shape, y.dtype, prefetch);
+}
+
+BatchLoader::BatchLoader(const MappedDataset& x, const MappedDataset& y, int batch_size, bool shuffle, int prefetch,
+                         int block_rows)
+    : x_file{new MappedDataset(x)}, y_file{new MappedDataset(y)}, x_data{(const char*)x.row(0)},
+      y_data{(const char*)y.row(0)}, x_row{x.row_size() * sizeof(float)}, y_row{y.row_size() * sizeof(float)},
+      rows{x.num_rows()}, batch_size{batch_size}, shuffle{shuffle}, block_rows{block_rows}, produced{0}, consumed{0},
+      holding{false}, stopping{false} {
+    if (x.num_rows() != y.num_rows()) {
+        throw std::invalid_argument("x and y must have the same number of rows");
+    }
+    start(x.shape(), y.shape(), DTYPE_FLOAT32, prefetch);
+}
+
+void BatchLoader::start(std::vector<int> x_shape, std::vector<int> y_shape, DType y_dtype, int prefetch) {
+    if (rows == 0) {
+        throw std::invalid_argument("There must be at least one row of data");
+    }
+    if (batch_size < 1) {
+        throw std::invalid_argument("The batch size must be at least 1");
+    }
+    if (prefetch < 1) {
+        throw std::invalid_argument("There must be at least one buffer to load batches into");
+    }
+    if (block_rows < 0) {
+        throw std::invalid_argument("The number of rows in a block must not be negative");
+    }
+
+    x_shape[0] = y_shape[0] = std::min(batch_size, rows);
+    for (int i = 0; i < prefetch; i++) {
+        slots.push_back(Slot{Tensor(x_shape, uninitialized), Tensor(y_shape, uninitialized, y_dtype), 0});
+    }
+    worker = std::thread(&BatchLoader::produce, this, std::random_device()());
+}
+
+BatchLoader::~BatchLoader() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    cv.notify_all();
+    worker.join();
+}
+
+int BatchLoader::num_batches() const { return (rows + batch_size - 1) / batch_size; }
+
+void BatchLoader::produce(unsigned seed) {
+    try {
+        int n = rows;
+        // Without blocks, the whole data is one block
+        int block = block_rows > 0 ? std::min(block_rows, n) : n;
+        int num_blocks = (n + block - 1) / block;
+        std::vector<int> order(n), blocks(num_blocks);
+        std::iota(blocks.begin(), blocks.end(), 0);
+        std::mt19937 gen(seed);
+        auto block_end = [&](int b) { return std::min(n, (b + 1) * block); };
+        while (true) {
+            if (shuffle) {
+                std::shuffle(blocks.begin(), blocks.end(), gen);
+            }
+            for (int i = 0, position = 0; i < num_blocks; i++) {
+                int first = blocks[i] * block, size = block_end(blocks[i]) - first;
+                std::iota(order.begin() + position, order.begin() + position + size, first);
+                if (shuffle) {
+                    std::shuffle(order.begin() + position, order.begin() + position + size, gen);
+                }
+                position += size;
+            }
+
+            // The blocks up to prefetched have been prefetched, and those before released have been released. The
+            // block after the one being read is prefetched, so that it is in memory by the time it is reached.
+            int prefetched = 0, released = 0;
+            long prefetched_end = 0, released_end = 0;
+            for (int start = 0; start < n; start += batch_size) {
+                // Wait for a buffer that is neither held by the consumer nor waiting to be consumed
+                long index;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    cv.wait(lock, [&] { return stopping || produced - consumed < (long)slots.size(); });
+                    if (stopping) {
+                        return;
+                    }
+                    index = produced;
+                }
+
+                Slot& slot = slots[index % slots.size()];
+                slot.rows = std::min(batch_size, n - start);
+                if (x_file != nullptr && block_rows > 0) {
+                    while (prefetched < num_blocks && prefetched_end < start + slot.rows + block) {
+                        int b = blocks[prefetched++];
+                        x_file->prefetch(b * block, block_end(b));
+                        y_file->prefetch(b * block, block_end(b));
+                        prefetched_end += block_end(b) - b * block;
+                    }
+                }
+                char *x_out = (char*)slot.x.data, *y_out = (char*)slot.y.data;
+                for (int i = 0; i < slot.rows; i++) {
+                    std::memcpy(x_out + i * x_row, x_data + order[start + i] * x_row, x_row);
+                    std::memcpy(y_out + i * y_row, y_data + order[start + i] * y_row, y_row);
+                }
+                if (x_file != nullptr && block_rows > 0) {
+                    while (released < num_blocks) {
+                        int b = blocks[released];
+                        if (released_end + block_end(b) - b * block > start + slot.rows) {
+                            break;
+                        }
+                        x_file->release(b * block, block_end(b));
+                        y_file->release(b * block, block_end(b));
+                        released_end += block_end(b) - b * block;
+                        released++;
+                    }
+                }
+
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    produced++;
+                }
+                cv.notify_all();
+            }
+        }
+    } catch (...) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            error = std::current_exception();
+        }
+        cv.notify_all();
+    }
+}
+
+void BatchLoader::next(Tensor& x_batch, Tensor& y_batch) {
+    std::unique_lock<std::mutex> lock(mutex);
+    // The batch handed out by the last call is no longer needed, so its buffer can be refilled
+    if (holding) {
+        consumed++;
+        holding = false;
+        cv.notify_all();
+    }
+    cv.wait(lock, [&] { return produced > consumed || error; });
+    if (produced <= consumed) {
+        std::rethrow_exception(error);
+    }
+    Slot& slot = slots[consumed % slots.size()];
+    holding = true;
+    lock.unlock();
+
+    x_batch = slot.x.slice(0, slot.rows);
+    y_batch = slot.y.slice(0, slot.rows);
+}
+
+} // namespace Data
+
+} // namespace FJML
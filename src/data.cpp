@@ -3,6 +3,8 @@
 
 #include <cstring>
 #include <random>
+#include <stdexcept>
+#include <string>
 
 #include "../include/FJML/data.h"
 
@@ -11,11 +13,21 @@ namespace FJML {
 namespace Data {
 
 Tensor one_hot(Tensor x, int n) {
+    if (n <= 0) {
+        throw std::invalid_argument("There must be at least one class");
+    }
+    // Labels stored as floats are checked to be integers as they are converted
+    Tensor labels = x.dtype == DTYPE_INT32 ? x.contiguous() : x.astype(DTYPE_INT32);
+    const int32_t* classes = labels.data_as<int32_t>();
     std::vector<int> shape = x.shape;
     shape.push_back(n);
     Tensor res(shape);
-    for (int i = 0; i < x.data_size[0]; i++) {
-        res.data[i * n + (int)x.data[i]] = 1;
+    for (long i = 0; i < labels.data_size[0]; i++) {
+        if (classes[i] < 0 || classes[i] >= n) {
+            throw std::out_of_range("The label " + std::to_string(classes[i]) + " is not the index of one of " +
+                                    std::to_string(n) + " classes");
+        }
+        res.data[i * n + classes[i]] = 1;
     }
     return res;
 }
@@ -33,23 +45,23 @@ void split(const Tensor& input_set, const Tensor& output_set, Tensor& input_trai
     std::mt19937 g(rd());
     std::shuffle(indices.begin(), indices.end(), g);
 
-    input_train = Tensor({train_n, input_set.shape[1]}, input_set.device);
-    output_train = Tensor({train_n, output_set.shape[1]}, output_set.device);
-    input_test = Tensor({n - train_n, input_set.shape[1]}, input_set.device);
-    output_test = Tensor({n - train_n, output_set.shape[1]}, output_set.device);
-
-    for (int i = 0; i < train_n; i++) {
-        std::memcpy(input_train.data + i * input_set.shape[1], input_set.data + indices[i] * input_set.shape[1],
-                    input_set.shape[1] * sizeof(float));
-        std::memcpy(output_train.data + i * output_set.shape[1], output_set.data + indices[i] * output_set.shape[1],
-                    output_set.shape[1] * sizeof(float));
-    }
-    for (int i = train_n; i < n; i++) {
-        std::memcpy(input_test.data + (i - train_n) * input_set.shape[1],
-                    input_set.data + indices[i] * input_set.shape[1], input_set.shape[1] * sizeof(float));
-        std::memcpy(output_test.data + (i - train_n) * output_set.shape[1],
-                    output_set.data + indices[i] * output_set.shape[1], output_set.shape[1] * sizeof(float));
+    // Shuffle each set into a single buffer once, then hand out the training and testing parts as views of it
+    Tensor inputs = input_set.contiguous(), outputs = output_set.contiguous();
+    Tensor shuffled_inputs(inputs.shape, uninitialized, inputs.dtype, inputs.device);
+    Tensor shuffled_outputs(outputs.shape, uninitialized, outputs.dtype, outputs.device);
+    size_t input_row = inputs.data_size[1] * dtype_size(inputs.dtype);
+    size_t output_row = outputs.data_size[1] * dtype_size(outputs.dtype);
+    for (int i = 0; i < n; i++) {
+        std::memcpy((char*)shuffled_inputs.data + i * input_row, (const char*)inputs.data + indices[i] * input_row,
+                    input_row);
+        std::memcpy((char*)shuffled_outputs.data + i * output_row, (const char*)outputs.data + indices[i] * output_row,
+                    output_row);
     }
+
+    input_train = shuffled_inputs.slice(0, train_n);
+    output_train = shuffled_outputs.slice(0, train_n);
+    input_test = shuffled_inputs.slice(train_n, n);
+    output_test = shuffled_outputs.slice(train_n, n);
 }
 
 } // namespace Data
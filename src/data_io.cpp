@@ -0,0 +1,743 @@
+// Copyright (c) 2023 David Lee
+// This code is licensed under MIT license (see LICENSE for details)
+
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <type_traits>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../include/FJML/data.h"
+#include "../include/FJML/parallel.h"
+
+namespace {
+
+/**
+ * @brief The powers of 10 that are exact as doubles
+ */
+const double POWERS_OF_10[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                               1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+/**
+ * @brief Pieces of a file smaller than this are not split further across threads
+ */
+const long MIN_PIECE_SIZE = 1 << 16;
+
+/**
+ * @brief The number of bytes a CsvStream reads at a time
+ */
+const size_t BLOCK_SIZE = 1 << 20;
+
+const char DATA_MAGIC[8] = {'F', 'J', 'M', 'L', 'D', 'A', 'T', '\0'};
+const uint32_t DATA_FORMAT_VERSION = 1;
+const uint32_t BYTE_ORDER_MARK = 0x01020304;
+const int MAX_DIM = 8;
+
+/**
+ * @brief The types of the elements of a data file
+ */
+enum DataType : uint32_t { FLOAT32 = 0 };
+
+struct DataHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t dim;
+    int32_t shape[MAX_DIM];
+    uint32_t dtype;
+    char reserved[8];
+};
+
+static_assert(sizeof(DataHeader) == 64, "The header of a data file is 64 bytes");
+
+/**
+ * @brief The number of rows csv_to_binary converts at a time
+ */
+const int CONVERT_BATCH_ROWS = 1 << 14;
+
+DataHeader make_header(const std::vector<int>& shape) {
+    DataHeader header = {};
+    std::memcpy(header.magic, DATA_MAGIC, sizeof(DATA_MAGIC));
+    header.version = DATA_FORMAT_VERSION;
+    header.byte_order = BYTE_ORDER_MARK;
+    header.dim = shape.size();
+    std::copy(shape.begin(), shape.end(), header.shape);
+    header.dtype = FLOAT32;
+    return header;
+}
+
+/**
+ * @brief Checks the header of a data file of the given size, and returns the shape of the data
+ */
+std::vector<int> read_header(const DataHeader& header, uint64_t size, const std::string& filename) {
+    if (std::memcmp(header.magic, DATA_MAGIC, sizeof(DATA_MAGIC)) != 0) {
+        throw std::runtime_error(filename + " is not a data file");
+    }
+    if (header.byte_order != BYTE_ORDER_MARK) {
+        throw std::runtime_error("The data file was written on a machine with a different byte order");
+    }
+    if (header.version > DATA_FORMAT_VERSION) {
+        throw std::runtime_error("The data file was written by a newer version of the library");
+    }
+    if (header.dtype != FLOAT32) {
+        throw std::runtime_error("The data file holds elements of a type that is not supported");
+    }
+    if (header.dim < 1 || header.dim > MAX_DIM) {
+        throw std::runtime_error("Corrupted data file: the data has an invalid shape");
+    }
+    std::vector<int> shape(header.shape, header.shape + header.dim);
+    uint64_t elements = 1, capacity = (size - sizeof(DataHeader)) / sizeof(float);
+    for (int n : shape) {
+        if (n <= 0) {
+            throw std::runtime_error("Corrupted data file: the data has an invalid shape");
+        }
+        if (elements > capacity / n) {
+            throw std::runtime_error("Corrupted data file: the size of the file does not match the shape");
+        }
+        elements *= n;
+    }
+    if (size != sizeof(DataHeader) + elements * sizeof(float)) {
+        throw std::runtime_error("Corrupted data file: the size of the file does not match the shape");
+    }
+    return shape;
+}
+
+/**
+ * @brief Passes a hint about a range of memory to the operating system, for the pages the range overlaps
+ */
+void advise(const float* begin, const float* end, int advice) {
+    uintptr_t page = sysconf(_SC_PAGESIZE), first = (uintptr_t)begin / page * page;
+    // Only a hint, so failures are ignored
+    madvise((void*)first, (uintptr_t)end - first, advice);
+}
+
+bool is_space(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+bool is_digit(char c) { return (unsigned)(c - '0') < 10; }
+
+/**
+ * @brief Parses a number with strtof, for the forms the fast path does not handle, such as nan or huge exponents
+ */
+const char* parse_float_slow(const char* p, const char* end, float& out) {
+    char token[64];
+    size_t n = 0;
+    while (p + n < end && n < sizeof(token) - 1 && p[n] != ',' && p[n] != '\n') {
+        token[n] = p[n];
+        n++;
+    }
+    token[n] = '\0';
+    char* stop;
+    out = std::strtof(token, &stop);
+    return stop == token ? nullptr : p + (stop - token);
+}
+
+/**
+ * @brief Parses the number at the start of [p, end)
+ *
+ * Up to 19 significant digits are gathered into an integer, which is scaled by an exact power of 10 in double
+ * precision, so the result is the correctly rounded float for all but contrived inputs.
+ *
+ * @return The end of the number, or nullptr if there is no number
+ */
+const char* parse_float(const char* p, const char* end, float& out) {
+    const char* start = p;
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p++ == '-';
+    }
+    uint64_t mantissa = 0;
+    int digits = 0, exponent = 0;
+    bool any_digits = false;
+    for (; p < end && is_digit(*p); p++) {
+        any_digits = true;
+        if (digits < 19) {
+            mantissa = mantissa * 10 + (*p - '0');
+            digits += mantissa != 0;
+        } else {
+            exponent++;
+        }
+    }
+    if (p < end && *p == '.') {
+        for (p++; p < end && is_digit(*p); p++) {
+            any_digits = true;
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (*p - '0');
+                digits += mantissa != 0;
+                exponent--;
+            }
+        }
+    }
+    if (!any_digits) {
+        return parse_float_slow(start, end, out);
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        const char* q = p + 1;
+        bool negative_exponent = false;
+        if (q < end && (*q == '-' || *q == '+')) {
+            negative_exponent = *q++ == '-';
+        }
+        if (q < end && is_digit(*q)) {
+            int e = 0;
+            for (; q < end && is_digit(*q); q++) {
+                e = std::min(e * 10 + (*q - '0'), 100000);
+            }
+            exponent += negative_exponent ? -e : e;
+            p = q;
+        }
+    }
+    if (exponent < -22 || exponent > 22) {
+        return parse_float_slow(start, end, out);
+    }
+    double value = exponent < 0 ? mantissa / POWERS_OF_10[-exponent] : mantissa * POWERS_OF_10[exponent];
+    out = negative ? -value : value;
+    return p;
+}
+
+/**
+ * @brief The end of the line starting at p, which is its newline or the end of the data
+ */
+const char* line_end(const char* p, const char* end) {
+    const char* newline = (const char*)std::memchr(p, '\n', end - p);
+    return newline == nullptr ? end : newline;
+}
+
+bool is_blank(const char* p, const char* end) { return std::all_of(p, end, is_space); }
+
+int count_fields(const char* p, const char* end) { return 1 + std::count(p, end, ','); }
+
+/**
+ * @brief Stores a label parsed from a file
+ * @return Whether the label could be stored, which integer labels can only be if they are integers
+ */
+bool store_label(float value, float* y) {
+    *y = value;
+    return true;
+}
+
+bool store_label(float value, int32_t* y) {
+    if (!(value >= -2147483648.0f && value < 2147483648.0f) || value != (int32_t)value) {
+        return false;
+    }
+    *y = value;
+    return true;
+}
+
+/**
+ * @brief Parses one line into a row of x, and its label into y
+ * @return Whether the line held exactly the expected number of fields, with a label that could be stored
+ */
+template <typename L> bool parse_row(const char* p, const char* end, int columns, int label_column, float* x, L* y) {
+    for (int c = 0; c < columns; c++) {
+        while (p < end && is_space(*p)) {
+            p++;
+        }
+        float value;
+        p = parse_float(p, end, value);
+        if (p == nullptr) {
+            return false;
+        }
+        while (p < end && is_space(*p)) {
+            p++;
+        }
+        if (c == label_column) {
+            if (!store_label(value, y)) {
+                return false;
+            }
+        } else {
+            *x++ = value;
+        }
+        if (c < columns - 1) {
+            if (p == end || *p != ',') {
+                return false;
+            }
+            p++;
+        }
+    }
+    return p == end;
+}
+
+/**
+ * @brief A range of whole lines, and the rows they hold
+ */
+struct Piece {
+    const char* begin;
+    const char* end;
+    long rows;
+    long first_row;
+};
+
+/**
+ * @brief Splits [begin, end) at line boundaries into pieces for the threads, and counts the rows of each in parallel
+ */
+std::vector<Piece> split_rows(const char* begin, const char* end) {
+    long size = end - begin;
+    long count = std::max(1L, std::min((long)FJML::get_num_threads() * 4, size / MIN_PIECE_SIZE));
+    std::vector<Piece> pieces(count);
+    const char* p = begin;
+    for (long i = 0; i < count; i++) {
+        pieces[i].begin = p;
+        const char* cut = i == count - 1 ? end : std::max(p, begin + size * (i + 1) / count);
+        if (cut < end) {
+            cut = line_end(cut, end);
+            cut += cut < end;
+        }
+        pieces[i].end = p = cut;
+    }
+
+    FJML::Parallel::parallel_for(
+        count,
+        [&](long b, long e) {
+            for (long i = b; i < e; i++) {
+                long rows = 0;
+                for (const char* q = pieces[i].begin; q < pieces[i].end;) {
+                    const char* next = line_end(q, pieces[i].end);
+                    rows += !is_blank(q, next);
+                    q = next + 1;
+                }
+                pieces[i].rows = rows;
+            }
+        },
+        size / count);
+    long first_row = 0;
+    for (Piece& piece : pieces) {
+        piece.first_row = first_row;
+        first_row += piece.rows;
+    }
+    return pieces;
+}
+
+/**
+ * @brief Parses the pieces in parallel, straight into their rows of x and y, stopping after the given number of rows
+ * @param first_row The number of rows of the file before the pieces, used in error messages
+ */
+template <typename L>
+void parse_rows(const std::vector<Piece>& pieces, long rows, int columns, int label_column, float* x, L* y,
+                long first_row, const std::string& filename) {
+    long x_columns = columns - (label_column >= 0);
+    std::vector<long> bad_rows(pieces.size(), -1);
+    FJML::Parallel::parallel_for(
+        pieces.size(),
+        [&](long b, long e) {
+            for (long i = b; i < e; i++) {
+                long row = pieces[i].first_row;
+                for (const char* q = pieces[i].begin; q < pieces[i].end && row < rows;) {
+                    const char* next = line_end(q, pieces[i].end);
+                    if (!is_blank(q, next)) {
+                        if (!parse_row(q, next, columns, label_column, x + row * x_columns, y + row)) {
+                            bad_rows[i] = row;
+                            break;
+                        }
+                        row++;
+                    }
+                    q = next + 1;
+                }
+            }
+        },
+        (pieces.back().end - pieces.front().begin) / pieces.size());
+    for (long row : bad_rows) {
+        if (row >= 0) {
+            throw std::runtime_error("Row " + std::to_string(first_row + row + 1) + " of " + filename + " is not " +
+                                     std::to_string(columns) + " numbers separated by commas" +
+                                     (std::is_same<L, int32_t>::value ? ", with an integer label" : ""));
+        }
+    }
+}
+
+void check_label_column(int label_column, int columns) {
+    if (label_column < -1 || label_column >= columns) {
+        throw std::invalid_argument("The label column must be -1 or one of the " + std::to_string(columns) +
+                                    " columns of the file");
+    }
+    if (label_column >= 0 && columns < 2) {
+        throw std::invalid_argument("There must be a column of inputs besides the label column");
+    }
+}
+
+void check_label_dtype(FJML::DType label_dtype, int label_column) {
+    if (label_dtype != FJML::DTYPE_FLOAT32 && label_dtype != FJML::DTYPE_INT32) {
+        throw std::invalid_argument("Labels cannot be stored as " + FJML::dtype_name(label_dtype));
+    }
+    if (label_dtype == FJML::DTYPE_INT32 && label_column < 0) {
+        throw std::invalid_argument("Integer labels must be loaded from a label column");
+    }
+}
+
+/**
+ * @brief A file mapped into memory, read only
+ */
+struct MappedFile {
+    const char* data;
+    size_t size;
+
+    MappedFile(const std::string& filename) : data{nullptr}, size{0} {
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::invalid_argument("File " + filename + " could not be opened");
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0) {
+            close(fd);
+            throw std::runtime_error("Could not read the size of " + filename);
+        }
+        size = info.st_size;
+        if (size > 0) {
+            void* address = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (address == MAP_FAILED) {
+                close(fd);
+                throw std::runtime_error("Could not map " + filename + " into memory");
+            }
+            data = (const char*)address;
+        }
+        close(fd);
+    }
+
+    ~MappedFile() {
+        if (data != nullptr) {
+            munmap((void*)data, size);
+        }
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+};
+
+/**
+ * @brief Allocates the labels of a number of rows: a column of floats, or one integer per row
+ */
+FJML::Tensor make_labels(FJML::DType label_dtype, long rows) {
+    if (label_dtype == FJML::DTYPE_INT32) {
+        return FJML::Tensor({(int)rows}, FJML::uninitialized, label_dtype);
+    }
+    return FJML::Tensor({(int)rows, 1}, FJML::uninitialized);
+}
+
+/**
+ * @brief Parses the pieces into the rows of x and the labels of y, which are stored as the dtype of y
+ */
+void parse_rows(const std::vector<Piece>& pieces, long rows, int columns, int label_column, FJML::Tensor& x,
+                FJML::Tensor& y, long first_row, const std::string& filename) {
+    if (y.dtype == FJML::DTYPE_INT32) {
+        parse_rows(pieces, rows, columns, label_column, x.data, y.data_as<int32_t>(), first_row, filename);
+    } else {
+        parse_rows(pieces, rows, columns, label_column, x.data, y.data, first_row, filename);
+    }
+}
+
+} // namespace
+
+namespace FJML {
+
+namespace Data {
+
+Tensor load_csv(const std::string& filename, bool header, long max_rows) {
+    Tensor x, y;
+    load_csv(filename, x, y, -1, header, max_rows);
+    return x;
+}
+
+void load_csv(const std::string& filename, Tensor& x, Tensor& y, int label_column, bool header, long max_rows,
+              DType label_dtype) {
+    check_label_dtype(label_dtype, label_column);
+    if (max_rows == 0 || max_rows < -1) {
+        throw std::invalid_argument("The number of rows to load must be positive, or -1 for every row");
+    }
+    MappedFile file(filename);
+    const char *begin = file.data, *end = file.data + file.size;
+    if (header && begin < end) {
+        begin = std::min(end, line_end(begin, end) + 1);
+    }
+    while (begin < end && is_blank(begin, line_end(begin, end))) {
+        begin = std::min(end, line_end(begin, end) + 1);
+    }
+    if (begin == end) {
+        throw std::runtime_error("The file " + filename + " has no rows");
+    }
+    int columns = count_fields(begin, line_end(begin, end));
+    check_label_column(label_column, columns);
+
+    if (max_rows > 0) {
+        // Only split and count as much of the file as is needed
+        const char* p = begin;
+        for (long rows = 0; p < end && rows < max_rows;) {
+            const char* next = line_end(p, end);
+            rows += !is_blank(p, next);
+            p = std::min(end, next + 1);
+        }
+        end = p;
+    }
+    std::vector<Piece> pieces = split_rows(begin, end);
+    long rows = pieces.back().first_row + pieces.back().rows;
+    if (rows > INT_MAX) {
+        throw std::runtime_error("The file " + filename + " has too many rows for a tensor");
+    }
+
+    Tensor x_data({(int)rows, columns - (label_column >= 0)}, uninitialized);
+    Tensor y_data = make_labels(label_dtype, rows);
+    parse_rows(pieces, rows, columns, label_column, x_data, y_data, 0, filename);
+    x = std::move(x_data);
+    if (label_column >= 0) {
+        y = std::move(y_data);
+    }
+}
+
+void save_binary(const std::string& filename, const Tensor& data) {
+    if (data.dim() < 1 || data.dim() > MAX_DIM) {
+        throw std::invalid_argument("Only tensors with 1 to " + std::to_string(MAX_DIM) +
+                                    " dimensions can be saved to a data file");
+    }
+    if (data.device != DEVICE_CPU) {
+        throw std::invalid_argument("Only tensors on the CPU can be saved to a data file");
+    }
+    DataHeader header = make_header(data.shape);
+    Tensor contents = data.contiguous();
+    std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) {
+        throw std::invalid_argument("File " + filename + " could not be opened");
+    }
+    file.write((const char*)&header, sizeof(header));
+    file.write((const char*)contents.data, contents.data_size[0] * sizeof(float));
+    if (!file) {
+        throw std::runtime_error("Could not write to " + filename);
+    }
+}
+
+Tensor load_binary(const std::string& filename) {
+    std::ifstream file(filename, std::ios::binary | std::ios::ate);
+    if (!file.is_open()) {
+        throw std::invalid_argument("File " + filename + " could not be opened");
+    }
+    uint64_t size = file.tellg();
+    file.seekg(0);
+    DataHeader header;
+    if (size < sizeof(header) || !file.read((char*)&header, sizeof(header))) {
+        throw std::runtime_error(filename + " is not a data file");
+    }
+    std::vector<int> shape = read_header(header, size, filename);
+    uint64_t elements = (size - sizeof(header)) / sizeof(float);
+    if (elements > INT_MAX) {
+        throw std::runtime_error("The data in " + filename + " is too large for a tensor, map it with MappedDataset");
+    }
+
+    Tensor data(shape, uninitialized);
+    if (!file.read((char*)data.data, elements * sizeof(float))) {
+        throw std::runtime_error("Could not read " + filename);
+    }
+    return data;
+}
+
+void csv_to_binary(const std::string& csv_file, const std::string& x_file, const std::string& y_file,
+                   int label_column, bool header) {
+    CsvStream stream(csv_file, label_column, header);
+    bool labels = label_column >= 0;
+    std::ofstream x_out(x_file, std::ios::binary | std::ios::trunc), y_out;
+    if (!x_out.is_open()) {
+        throw std::invalid_argument("File " + x_file + " could not be opened");
+    }
+    if (labels) {
+        y_out.open(y_file, std::ios::binary | std::ios::trunc);
+        if (!y_out.is_open()) {
+            throw std::invalid_argument("File " + y_file + " could not be opened");
+        }
+    }
+
+    // The headers are written again with the number of rows once it is known
+    int x_columns = stream.num_columns() - labels;
+    DataHeader x_header = make_header({0, x_columns}), y_header = make_header({0, 1});
+    x_out.write((const char*)&x_header, sizeof(x_header));
+    y_out.write((const char*)&y_header, sizeof(y_header));
+    long rows = 0;
+    Tensor x, y;
+    while (stream.next(CONVERT_BATCH_ROWS, x, y)) {
+        rows += x.shape[0];
+        if (rows > INT_MAX) {
+            throw std::runtime_error("The file " + csv_file + " has too many rows for a data file");
+        }
+        x_out.write((const char*)x.data, x.data_size[0] * sizeof(float));
+        y_out.write((const char*)y.data, y.data_size[0] * sizeof(float));
+    }
+    x_header.shape[0] = y_header.shape[0] = rows;
+    x_out.seekp(0);
+    x_out.write((const char*)&x_header, sizeof(x_header));
+    if (!x_out) {
+        throw std::runtime_error("Could not write to " + x_file);
+    }
+    if (labels) {
+        y_out.seekp(0);
+        y_out.write((const char*)&y_header, sizeof(y_header));
+        if (!y_out) {
+            throw std::runtime_error("Could not write to " + y_file);
+        }
+    }
+}
+
+MappedDataset::MappedDataset(const std::string& filename) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::invalid_argument("File " + filename + " could not be opened");
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        throw std::runtime_error("Could not read the size of " + filename);
+    }
+    uint64_t size = info.st_size;
+    if (size < sizeof(DataHeader)) {
+        close(fd);
+        throw std::runtime_error(filename + " is not a data file");
+    }
+    void* address = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (address == MAP_FAILED) {
+        throw std::runtime_error("Could not map " + filename + " into memory");
+    }
+    std::shared_ptr<char> mapping((char*)address, [size](char* p) { munmap(p, size); });
+
+    DataHeader header;
+    std::memcpy(&header, mapping.get(), sizeof(header));
+    data_shape = read_header(header, size, filename);
+    row_elements = (size - sizeof(header)) / sizeof(float) / data_shape[0];
+    if (row_elements > INT_MAX) {
+        throw std::runtime_error("The rows of " + filename + " are too large for a tensor");
+    }
+    storage = std::shared_ptr<float>(mapping, (float*)(mapping.get() + sizeof(header)));
+}
+
+const std::vector<int>& MappedDataset::shape() const { return data_shape; }
+
+int MappedDataset::num_rows() const { return data_shape[0]; }
+
+long MappedDataset::row_size() const { return row_elements; }
+
+const float* MappedDataset::row(int i) const { return storage.get() + i * row_elements; }
+
+Tensor MappedDataset::rows(int start, int end) const {
+    if (start < 0 || end > num_rows() || start >= end) {
+        throw std::out_of_range("The rows " + std::to_string(start) + " to " + std::to_string(end) +
+                                " are not a range of rows of the data");
+    }
+    if ((end - start) * row_elements > INT_MAX) {
+        throw std::invalid_argument("Too many rows for a tensor, view fewer rows at a time");
+    }
+    std::vector<int> shape = data_shape;
+    shape[0] = end - start;
+    return Tensor(std::shared_ptr<float>(storage, storage.get() + start * row_elements), shape);
+}
+
+Tensor MappedDataset::tensor() const { return rows(0, num_rows()); }
+
+void MappedDataset::prefetch(int start, int end) const { advise(row(start), row(end), MADV_WILLNEED); }
+
+void MappedDataset::release(int start, int end) const {
+#ifdef MADV_COLD
+    advise(row(start), row(end), MADV_COLD);
+#endif
+}
+
+CsvStream::CsvStream(const std::string& filename, int label_column, bool header, DType label_dtype)
+    : file(filename, std::ios::binary), filename{filename}, label_column{label_column}, columns{0}, header{header},
+      label_dtype{label_dtype}, begin{0}, rows_read{0} {
+    check_label_dtype(label_dtype, label_column);
+    if (!file.is_open()) {
+        throw std::invalid_argument("File " + filename + " could not be opened");
+    }
+    start();
+    while (true) {
+        size_t newline = buffer.find('\n', begin);
+        if (newline == std::string::npos && fill()) {
+            continue;
+        }
+        size_t line = newline == std::string::npos ? buffer.size() : newline;
+        if (!is_blank(buffer.data() + begin, buffer.data() + line)) {
+            columns = count_fields(buffer.data() + begin, buffer.data() + line);
+            break;
+        }
+        if (newline == std::string::npos) {
+            throw std::runtime_error("The file " + filename + " has no rows");
+        }
+        begin = newline + 1;
+    }
+    check_label_column(label_column, columns);
+}
+
+int CsvStream::num_columns() const { return columns; }
+
+bool CsvStream::fill() {
+    // Drop the parsed bytes once they are most of the buffer, so batches larger than a block are not moved repeatedly
+    if (begin > 0 && begin >= buffer.size() / 2) {
+        buffer.erase(0, begin);
+        begin = 0;
+    }
+    size_t old_size = buffer.size();
+    buffer.resize(old_size + BLOCK_SIZE);
+    file.read(&buffer[old_size], BLOCK_SIZE);
+    buffer.resize(old_size + file.gcount());
+    return file.gcount() > 0;
+}
+
+void CsvStream::start() {
+    file.clear();
+    file.seekg(0);
+    buffer.clear();
+    begin = 0;
+    rows_read = 0;
+    if (header) {
+        size_t newline;
+        while ((newline = buffer.find('\n')) == std::string::npos && fill()) {
+        }
+        begin = newline == std::string::npos ? buffer.size() : newline + 1;
+    }
+}
+
+bool CsvStream::next(int batch_size, Tensor& x, Tensor& y) {
+    if (batch_size < 1) {
+        throw std::invalid_argument("The batch size must be at least 1");
+    }
+    // Find the end of the last row of the batch, reading more of the file as needed
+    long rows = 0;
+    size_t end = begin;
+    while (rows < batch_size) {
+        size_t newline = buffer.find('\n', end);
+        if (newline == std::string::npos) {
+            size_t offset = end - begin;
+            if (fill()) {
+                end = begin + offset;
+                continue;
+            }
+            // The last line of the file may not end with a newline
+            rows += !is_blank(buffer.data() + end, buffer.data() + buffer.size());
+            end = buffer.size();
+            break;
+        }
+        rows += !is_blank(buffer.data() + end, buffer.data() + newline);
+        end = newline + 1;
+    }
+    if (rows == 0) {
+        begin = end;
+        return false;
+    }
+
+    std::vector<Piece> pieces = split_rows(buffer.data() + begin, buffer.data() + end);
+    Tensor x_batch({(int)rows, columns - (label_column >= 0)}, uninitialized);
+    Tensor y_batch = make_labels(label_dtype, rows);
+    parse_rows(pieces, rows, columns, label_column, x_batch, y_batch, rows_read, filename);
+    begin = end;
+    rows_read += rows;
+    x = std::move(x_batch);
+    if (label_column >= 0) {
+        y = std::move(y_batch);
+    }
+    return true;
+}
+
+void CsvStream::rewind() { start(); }
+
+} // namespace Data
+
+} // namespace FJML
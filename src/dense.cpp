@@ -14,7 +14,8 @@ namespace Layers {
 
 Layers::Dense::Dense(int input, int output, Activations::Activation activ, Device device)
     : Layer{"Dense"}, input_size{input}, output_size{output}, weights{Tensor(std::vector<int>{input, output}, device)},
-      bias{Tensor(std::vector<int>{output}, device)}, activ{activ}, w_opt{nullptr}, b_opt{nullptr} {
+      bias{Tensor(std::vector<int>{output}, device)}, activ{activ}, w_opt{nullptr}, b_opt{nullptr},
+      weight_dtype{DTYPE_FLOAT32} {
     std::random_device rd;
     std::mt19937 gen(rd());
     std::normal_distribution d(0.0, std::sqrt(2.0 / input));
@@ -27,9 +28,14 @@ Layers::Dense::Dense(int input, int output, Activations::Activation activ, Devic
 
 Layers::Dense::Dense(std::ifstream& file)
     : Layer{"Dense"}, weights{{0}}, bias{{0}}, activ{Activations::Activation(
-                                                   "", [](float x) { return x; }, [](float x) { return 1; })} {
+                                                   "", [](float x) { return x; }, [](float x) { return 1; })},
+      w_opt{nullptr}, b_opt{nullptr}, weight_dtype{DTYPE_FLOAT32} {
     std::string activation;
     file >> activation;
+    // Weights stored in a 16 bit format are marked by the name of the format after the activation
+    size_t colon = activation.rfind(':');
+    DType dtype = colon == std::string::npos ? DTYPE_FLOAT32 : parse_dtype(activation.substr(colon + 1));
+    activation = activation.substr(0, colon);
     for (Activations::Activation a : Activations::activations) {
         if (a.name == activation) {
             activ = a;
@@ -53,6 +59,17 @@ Layers::Dense::Dense(std::ifstream& file)
     for (int i = 0; i < output_size; i++) {
         file >> bias.at(i);
     }
+    set_weight_dtype(dtype);
+}
+
+Layers::Dense::Dense(Tensor weights, Tensor bias, Activations::Activation activ)
+    : Layer{"Dense"}, weights{std::move(weights)}, bias{std::move(bias)}, activ{activ}, w_opt{nullptr},
+      b_opt{nullptr}, weight_dtype{DTYPE_FLOAT32} {
+    if (this->weights.dim() != 2 || this->bias.dim() != 1 || this->bias.shape[0] != this->weights.shape[1]) {
+        throw std::invalid_argument("The weights of a Dense layer must be a matrix, with a bias for every column");
+    }
+    input_size = this->weights.shape[0];
+    output_size = this->weights.shape[1];
 }
 
 Dense::~Dense() {
@@ -65,43 +82,149 @@ Dense::~Dense() {
 }
 
 Tensor Layers::Dense::apply(const Tensor& input) const {
+    if (weight_dtype != DTYPE_FLOAT32) {
+        if (activ.func_kernel != nullptr) {
+            return LinAlg::dense_forward(input, half_weights, bias, activ.func_kernel);
+        }
+        Tensor res = LinAlg::dense_forward(input, half_weights, bias);
+        activ.apply(res);
+        return res;
+    }
+    if (activ.func_kernel != nullptr) {
+        return LinAlg::dense_forward(input, weights, bias, activ.func_kernel);
+    }
     Tensor res = LinAlg::dense_forward(input, weights, bias);
-    return activ.apply(res);
+    activ.apply(res);
+    return res;
+}
+
+Tensor Layers::Dense::forward(const Tensor& input) {
+    if (weight_dtype != DTYPE_FLOAT32) {
+        // The layer cannot be trained, so there is nothing to keep for backward
+        return apply(input);
+    }
+    // Holding a reference to the input keeps its storage alive, so backward can recognize it by its data pointer
+    forward_input = input.contiguous();
+    if (activ.func_kernel != nullptr) {
+        return LinAlg::dense_forward(forward_input, weights, bias, activ.func_kernel, &pre_activation);
+    }
+    pre_activation = LinAlg::dense_forward(forward_input, weights, bias);
+    return activ.forward(pre_activation);
+}
+
+Tensor Layers::Dense::apply_double(const Tensor& input, const std::vector<Tensor>& params) const {
+    bool half = weight_dtype != DTYPE_FLOAT32;
+    if (params.size() != (half ? 1 : 2)) {
+        throw std::invalid_argument("Wrong number of parameters for a Dense layer");
+    }
+    Tensor converted = half ? half_weights.to_float().astype(DTYPE_FLOAT64) : Tensor();
+    const Tensor &w = half ? converted : params[0], &b = params.back();
+    if (w.shape != std::vector<int>{input_size, output_size} || b.shape != std::vector<int>{output_size} ||
+        w.dtype != DTYPE_FLOAT64 || b.dtype != DTYPE_FLOAT64) {
+        throw std::invalid_argument(
+            "The parameters of a Dense layer must be double precision tensors with the shapes of its weights and bias");
+    }
+    Tensor res;
+    LinAlg::gemm(input, w, false, false, 1, 0, res);
+    res += b;
+    return activ.forward(res);
 }
 
 Tensor Layers::Dense::backward(const Tensor& input_vals, const Tensor& output_grad) {
+    if (weight_dtype != DTYPE_FLOAT32) {
+        throw std::runtime_error("A Dense layer with weights stored as " + dtype_name(weight_dtype) +
+                                 " cannot be trained");
+    }
     int n = input_vals.shape[0];
 
-    Tensor activ_grad = activ.backward(LinAlg::dense_forward(input_vals, weights, bias)) * output_grad;
-    // Tensor activ_grad = LinAlg::dense_forward(input_vals, weights, bias);
-    // activ.apply_derivative(activ_grad);
-    // activ_grad *= output_grad;
+    Tensor activ_grad;
+    if (forward_input.data != nullptr && forward_input.data == input_vals.data &&
+        forward_input.shape == input_vals.shape && forward_input.strides == input_vals.strides) {
+        // The pre-activations were kept by forward, and are not needed after this
+        activ_grad = std::move(pre_activation);
+        activ.apply_derivative(activ_grad);
+    } else if (activ.derivative_kernel != nullptr) {
+        // The derivative of the activation is fused into the forward pass that recomputes the pre-activations
+        activ_grad = LinAlg::dense_forward(input_vals, weights, bias, activ.derivative_kernel);
+    } else {
+        activ_grad = LinAlg::dense_forward(input_vals, weights, bias);
+        activ.apply_derivative(activ_grad);
+    }
+    forward_input = Tensor();
+    activ_grad *= output_grad;
 
-    Tensor w_grad = LinAlg::matrix_multiply(LinAlg::transpose(input_vals), activ_grad);
-    Tensor b_grad = Tensor({output_size}, activ_grad.device);
-    for (int i = 0; i < n; i++) {
-        for (int j = 0; j < output_size; j++) {
-            b_grad.data[j] += activ_grad.data[i * output_size + j];
-        }
+    // w_grad += input_vals^T * activ_grad / n, read without transposing input_vals. The gradients are accumulated in
+    // place, as they may be views owned by a model.
+    if (w_grad.shape != weights.shape) {
+        w_grad = Tensor(weights.shape, weights.device);
+    }
+    LinAlg::gemm(input_vals, activ_grad, true, false, 1.0f / n, 1, w_grad);
+    if (b_grad.shape != bias.shape) {
+        b_grad = Tensor(bias.shape, bias.device);
     }
+    b_grad += LinAlg::sum(activ_grad, {0}) * (1.0f / n);
 
-    Tensor prev_grad = LinAlg::matrix_multiply(activ_grad, LinAlg::transpose(weights));
+    // prev_grad = activ_grad * weights^T, read without transposing weights
+    Tensor prev_grad({n, input_size}, uninitialized, activ_grad.device);
+    LinAlg::gemm(activ_grad, weights, false, true, 1, 0, prev_grad);
 
-    w_grad /= n;
-    b_grad /= n;
-    w_opt->apply_grad(weights, w_grad);
-    b_opt->apply_grad(bias, b_grad);
+    if (w_opt != nullptr) {
+        w_opt->apply_grad(weights, w_grad);
+    }
+    if (b_opt != nullptr) {
+        b_opt->apply_grad(bias, b_grad);
+    }
+    if (w_opt != nullptr || b_opt != nullptr) {
+        zero_grad();
+    }
 
     return prev_grad;
 }
 
+std::vector<Tensor*> Layers::Dense::parameters() {
+    if (weight_dtype != DTYPE_FLOAT32) {
+        return {&bias};
+    }
+    return {&weights, &bias};
+}
+
+std::vector<Tensor*> Layers::Dense::gradients() {
+    if (weight_dtype != DTYPE_FLOAT32) {
+        return {&b_grad};
+    }
+    return {&w_grad, &b_grad};
+}
+
+std::string Layers::Dense::config() const {
+    if (weight_dtype != DTYPE_FLOAT32) {
+        return activ.name + ":" + dtype_name(weight_dtype);
+    }
+    return activ.name;
+}
+
+std::vector<Tensor> Layers::Dense::saved_parameters() const {
+    if (weight_dtype != DTYPE_FLOAT32) {
+        // Every 16 bit value is a float, so the weights are stored exactly
+        return {half_weights.to_float(), bias.contiguous()};
+    }
+    return {weights.contiguous(), bias.contiguous()};
+}
+
+Layer* Layers::Dense::clone() const {
+    Dense* copy = new Dense(*this);
+    copy->w_opt = w_opt == nullptr ? nullptr : w_opt->clone();
+    copy->b_opt = b_opt == nullptr ? nullptr : b_opt->clone();
+    return copy;
+}
+
 void Layers::Dense::save(std::ofstream& file) const {
     file << "Dense" << std::endl;
-    file << activ.name << std::endl;
+    file << config() << std::endl;
     file << input_size << " " << output_size << " ";
+    Tensor saved = weight_dtype == DTYPE_FLOAT32 ? weights : half_weights.to_float();
     for (int i = 0; i < input_size; i++) {
         for (int j = 0; j < output_size; j++) {
-            file << weights.at(i, j) << " ";
+            file << saved.at(i, j) << " ";
         }
     }
     for (int i = 0; i < output_size; i++) {
@@ -113,13 +236,38 @@ void Layers::Dense::save(std::ofstream& file) const {
 void Layers::Dense::summary() const {
     std::cout << "Dense layer with " << input_size << " inputs and " << output_size << " outputs" << std::endl;
     std::cout << "Activation function: " << activ.name << std::endl;
+    if (weight_dtype != DTYPE_FLOAT32) {
+        std::cout << "Weights stored as " << dtype_name(weight_dtype) << std::endl;
+    }
 }
 
 void Layers::Dense::set_optimizer(const Optimizers::Optimizer* opt) {
     delete w_opt;
     delete b_opt;
-    w_opt = opt->clone();
-    b_opt = opt->clone();
+    w_opt = opt == nullptr ? nullptr : opt->clone();
+    b_opt = opt == nullptr ? nullptr : opt->clone();
+}
+
+void Layers::Dense::set_weight_dtype(DType dtype) {
+    if (dtype == weight_dtype) {
+        return;
+    }
+    if (dtype == DTYPE_FLOAT32) {
+        weights = half_weights.to_float();
+        half_weights = HalfTensor();
+    } else {
+        if (weight_dtype != DTYPE_FLOAT32) {
+            // Converts from the other 16 bit format through floats, which hold the values of both exactly
+            weights = half_weights.to_float();
+        }
+        half_weights = HalfTensor(weights, dtype);
+        weights = Tensor();
+    }
+    // The gradients and the values kept by forward belong to the old weights
+    w_grad = Tensor();
+    forward_input = Tensor();
+    pre_activation = Tensor();
+    weight_dtype = dtype;
 }
 
 } // namespace Layers
@@ -0,0 +1,405 @@
+// Copyright (c) 2023 David Lee
+// This code is licensed under MIT license (see LICENSE for details)
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+#include <immintrin.h>
+
+#include "../include/FJML/linalg.h"
+#include "../include/FJML/parallel.h"
+
+/*
+ * A packed, cache-blocked GEMM, in single or double precision.
+ *
+ * The loops follow the usual Goto/BLIS structure:
+ *   - C is split into column blocks of NC columns (B block of KC x NC stays in L3)
+ *   - K is split into blocks of KC (one packed micro-panel of B stays in L1)
+ *   - A is split into row blocks of MC rows (the packed A block stays in L2)
+ *   - each MR x NR tile of C is computed by a register-tiled micro-kernel
+ *
+ * A and B are copied ("packed") into contiguous micro-panels before the micro-kernel runs, so that the kernel only
+ * ever does unit-stride loads. B may be stored in bfloat16 or float16, in which case it is converted to floats while
+ * it is packed: the products are accumulated in single precision, but B is read from memory at half the size.
+ *
+ * The driver is a template on the type the products are computed in. A vector holds half as many doubles as floats,
+ * so the double precision micro-kernel computes tiles of half the width, which keeps its accumulators in registers.
+ */
+
+namespace {
+
+/**
+ * The shape of the tile of C computed by the micro-kernel for each compute type: MR rows and NR columns.
+ */
+template <typename S> struct Tile;
+
+template <> struct Tile<float> {
+    static constexpr int MR = 6;
+    static constexpr int NR = 16;
+};
+
+template <> struct Tile<double> {
+    static constexpr int MR = 6;
+    static constexpr int NR = 8;
+};
+
+constexpr int MC = 120;
+constexpr int KC = 256;
+constexpr int NC = 4096;
+
+/**
+ * Converts an element of B to the compute type. B is stored in the compute type, or as 16 bit values in the given
+ * format.
+ */
+template <typename S> inline S load(const S* b, FJML::DType) { return *b; }
+
+inline float load(const uint16_t* b, FJML::DType dtype) {
+    return dtype == FJML::DTYPE_BFLOAT16 ? FJML::Half::from_bfloat16(*b) : FJML::Half::from_float16(*b);
+}
+
+/**
+ * Converts NR consecutive elements of B to the compute type.
+ */
+template <typename S> inline void load_row(const S* src, FJML::DType, S* dst) {
+    std::memcpy(dst, src, Tile<S>::NR * sizeof(S));
+}
+
+inline void load_row(const uint16_t* src, FJML::DType dtype, float* dst) {
+    constexpr int NR = Tile<float>::NR;
+#if defined(__AVX2__) && defined(__F16C__)
+    static_assert(NR == 16, "A row of a panel is two vectors");
+    __m128i low = _mm_loadu_si128((const __m128i*)src), high = _mm_loadu_si128((const __m128i*)(src + 8));
+    if (dtype == FJML::DTYPE_BFLOAT16) {
+        _mm256_storeu_ps(dst, _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(low), 16)));
+        _mm256_storeu_ps(dst + 8, _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(high), 16)));
+    } else {
+        _mm256_storeu_ps(dst, _mm256_cvtph_ps(low));
+        _mm256_storeu_ps(dst + 8, _mm256_cvtph_ps(high));
+    }
+#else
+    for (int j = 0; j < NR; j++) {
+        dst[j] = load(src + j, dtype);
+    }
+#endif
+}
+
+/**
+ * Packs a kc x nc block of op(B) into panels of NR columns.
+ * Element (p, j) of the block is read from b[p * rsb + j * csb], so a transposed B is just a different pair of strides.
+ * Each panel is stored as kc rows of NR elements. Columns past nc are padded with zeros.
+ * B may be stored in a 16 bit format, which is converted to floats here, so the rest of the kernel only sees the
+ * compute type.
+ */
+template <typename S, typename T>
+void pack_b(int kc, int nc, const T* b, int rsb, int csb, FJML::DType dtype, S* packed) {
+    constexpr int NR = Tile<S>::NR;
+    int panels = (nc + NR - 1) / NR;
+#pragma omp parallel for num_threads(FJML::get_num_threads())
+    for (int jp = 0; jp < panels; jp++) {
+        int j = jp * NR, nr = std::min(NR, nc - j);
+        S* dst = packed + jp * NR * kc;
+        for (int p = 0; p < kc; p++) {
+            const T* src = b + p * rsb + j * csb;
+            if (nr == NR && csb == 1) {
+                load_row(src, dtype, dst);
+            } else {
+                for (int jj = 0; jj < NR; jj++) {
+                    dst[jj] = jj < nr ? load(src + jj * csb, dtype) : 0;
+                }
+            }
+            dst += NR;
+        }
+    }
+}
+
+/**
+ * Packs a mc x kc block of op(A), scaled by alpha, into panels of MR rows.
+ * Element (i, p) of the block is read from a[i * rsa + p * csa].
+ * Each panel is stored as kc columns of MR elements. Rows past mc are padded with zeros.
+ */
+template <typename S> void pack_a(int mc, int kc, const S* a, int rsa, int csa, S alpha, S* packed) {
+    constexpr int MR = Tile<S>::MR;
+    int panels = (mc + MR - 1) / MR;
+#pragma omp parallel for num_threads(FJML::get_num_threads())
+    for (int ip = 0; ip < panels; ip++) {
+        int i = ip * MR, mr = std::min(MR, mc - i);
+        S* dst = packed + ip * MR * kc;
+        for (int p = 0; p < kc; p++) {
+            for (int ii = 0; ii < MR; ii++) {
+                dst[ii] = ii < mr ? alpha * a[(i + ii) * rsa + p * csa] : 0;
+            }
+            dst += MR;
+        }
+    }
+}
+
+/**
+ * Computes a MR x NR tile of C from a packed panel of A and a packed panel of B.
+ * If accumulate is false the tile is overwritten, otherwise the product is added to it.
+ */
+void micro_kernel(int kc, const float* a, const float* b, float* c, int ldc, bool accumulate) {
+    constexpr int MR = Tile<float>::MR, NR = Tile<float>::NR;
+#if defined(__AVX2__) && defined(__FMA__)
+    __m256 acc[MR][2];
+    for (int i = 0; i < MR; i++) {
+        acc[i][0] = _mm256_setzero_ps();
+        acc[i][1] = _mm256_setzero_ps();
+    }
+    for (int p = 0; p < kc; p++) {
+        __m256 b0 = _mm256_loadu_ps(b), b1 = _mm256_loadu_ps(b + 8);
+        for (int i = 0; i < MR; i++) {
+            __m256 ai = _mm256_broadcast_ss(a + i);
+            acc[i][0] = _mm256_fmadd_ps(ai, b0, acc[i][0]);
+            acc[i][1] = _mm256_fmadd_ps(ai, b1, acc[i][1]);
+        }
+        a += MR;
+        b += NR;
+    }
+    for (int i = 0; i < MR; i++) {
+        float* row = c + i * ldc;
+        if (accumulate) {
+            acc[i][0] = _mm256_add_ps(acc[i][0], _mm256_loadu_ps(row));
+            acc[i][1] = _mm256_add_ps(acc[i][1], _mm256_loadu_ps(row + 8));
+        }
+        _mm256_storeu_ps(row, acc[i][0]);
+        _mm256_storeu_ps(row + 8, acc[i][1]);
+    }
+#else
+    float acc[MR][NR] = {};
+    for (int p = 0; p < kc; p++) {
+        for (int i = 0; i < MR; i++) {
+            for (int j = 0; j < NR; j++) {
+                acc[i][j] += a[i] * b[j];
+            }
+        }
+        a += MR;
+        b += NR;
+    }
+    for (int i = 0; i < MR; i++) {
+        for (int j = 0; j < NR; j++) {
+            c[i * ldc + j] = accumulate ? c[i * ldc + j] + acc[i][j] : acc[i][j];
+        }
+    }
+#endif
+}
+
+void micro_kernel(int kc, const double* a, const double* b, double* c, int ldc, bool accumulate) {
+    constexpr int MR = Tile<double>::MR, NR = Tile<double>::NR;
+#if defined(__AVX2__) && defined(__FMA__)
+    __m256d acc[MR][2];
+    for (int i = 0; i < MR; i++) {
+        acc[i][0] = _mm256_setzero_pd();
+        acc[i][1] = _mm256_setzero_pd();
+    }
+    for (int p = 0; p < kc; p++) {
+        __m256d b0 = _mm256_loadu_pd(b), b1 = _mm256_loadu_pd(b + 4);
+        for (int i = 0; i < MR; i++) {
+            __m256d ai = _mm256_broadcast_sd(a + i);
+            acc[i][0] = _mm256_fmadd_pd(ai, b0, acc[i][0]);
+            acc[i][1] = _mm256_fmadd_pd(ai, b1, acc[i][1]);
+        }
+        a += MR;
+        b += NR;
+    }
+    for (int i = 0; i < MR; i++) {
+        double* row = c + i * ldc;
+        if (accumulate) {
+            acc[i][0] = _mm256_add_pd(acc[i][0], _mm256_loadu_pd(row));
+            acc[i][1] = _mm256_add_pd(acc[i][1], _mm256_loadu_pd(row + 4));
+        }
+        _mm256_storeu_pd(row, acc[i][0]);
+        _mm256_storeu_pd(row + 4, acc[i][1]);
+    }
+#else
+    double acc[MR][NR] = {};
+    for (int p = 0; p < kc; p++) {
+        for (int i = 0; i < MR; i++) {
+            for (int j = 0; j < NR; j++) {
+                acc[i][j] += a[i] * b[j];
+            }
+        }
+        a += MR;
+        b += NR;
+    }
+    for (int i = 0; i < MR; i++) {
+        for (int j = 0; j < NR; j++) {
+            c[i * ldc + j] = accumulate ? c[i * ldc + j] + acc[i][j] : acc[i][j];
+        }
+    }
+#endif
+}
+
+/**
+ * Applies an epilogue to a rows x cols block of C starting at row i and column j. The pointers in the epilogue are
+ * relative to element (0, 0) of c, and pre_activation has the same leading dimension as c.
+ */
+void apply_epilogue(const FJML::LinAlg::GemmEpilogue& epilogue, int i, int j, int rows, int cols, float* c, int ldc) {
+    for (int ii = 0; ii < rows; ii++) {
+        float* __restrict__ row = c + (i + ii) * ldc + j;
+        if (epilogue.bias != nullptr) {
+            const float* __restrict__ bias = epilogue.bias + j;
+            for (int jj = 0; jj < cols; jj++) {
+                row[jj] += bias[jj];
+            }
+        }
+        if (epilogue.pre_activation != nullptr) {
+            std::memcpy(epilogue.pre_activation + (i + ii) * ldc + j, row, cols * sizeof(float));
+        }
+        if (epilogue.activation != nullptr) {
+            epilogue.activation(row, row, cols);
+        }
+    }
+}
+
+/**
+ * Runs the micro-kernel over a mc x nc block of C, handling partial tiles at the edges.
+ */
+template <typename S>
+void macro_kernel(int mc, int nc, int kc, const S* packed_a, const S* packed_b, S* c, int ldc, bool accumulate) {
+    constexpr int MR = Tile<S>::MR, NR = Tile<S>::NR;
+    for (int j = 0; j < nc; j += NR) {
+        int nr = std::min(NR, nc - j);
+        for (int i = 0; i < mc; i += MR) {
+            int mr = std::min(MR, mc - i);
+            const S* a = packed_a + (i / MR) * MR * kc;
+            const S* b = packed_b + (j / NR) * NR * kc;
+            if (mr == MR && nr == NR) {
+                micro_kernel(kc, a, b, c + i * ldc + j, ldc, accumulate);
+                continue;
+            }
+            S tile[MR * NR];
+            micro_kernel(kc, a, b, tile, NR, false);
+            for (int ii = 0; ii < mr; ii++) {
+                S* row = c + (i + ii) * ldc + j;
+                for (int jj = 0; jj < nr; jj++) {
+                    row[jj] = accumulate ? row[jj] + tile[ii * NR + jj] : tile[ii * NR + jj];
+                }
+            }
+        }
+    }
+}
+
+/**
+ * The driver of sgemm and dgemm, computing in S with B stored as S or in a 16 bit format. Epilogues only exist for
+ * single precision, dgemm always passes null.
+ */
+template <typename S, typename T>
+void blocked_gemm(bool trans_a, bool trans_b, int m, int n, int k, S alpha, const S* a, int lda, const T* b,
+                  FJML::DType b_dtype, int ldb, S beta, S* c, int ldc, const FJML::LinAlg::GemmEpilogue* epilogue) {
+    using FJML::LinAlg::GemmEpilogue;
+    constexpr int MR = Tile<S>::MR, NR = Tile<S>::NR;
+    auto finish = [&](const GemmEpilogue& e, int i, int j, int rows, int cols) {
+        if constexpr (std::is_same<S, float>::value) {
+            apply_epilogue(e, i, j, rows, cols, c, ldc);
+        }
+    };
+    if (m <= 0 || n <= 0) {
+        return;
+    }
+    if (beta != 0 && beta != 1) {
+        for (int i = 0; i < m; i++) {
+            for (int j = 0; j < n; j++) {
+                c[i * ldc + j] *= beta;
+            }
+        }
+    }
+    if (k <= 0 || alpha == 0) {
+        if (beta == 0) {
+            for (int i = 0; i < m; i++) {
+                std::fill(c + i * ldc, c + i * ldc + n, S(0));
+            }
+        }
+        if (epilogue != nullptr) {
+            finish(*epilogue, 0, 0, m, n);
+        }
+        return;
+    }
+
+    // Strides of op(A) and op(B), which lets the packing routines read transposed operands in place
+    int rsa = trans_a ? 1 : lda, csa = trans_a ? lda : 1;
+    int rsb = trans_b ? 1 : ldb, csb = trans_b ? ldb : 1;
+
+    static thread_local std::vector<S> packed_a, packed_b;
+    int max_kc = std::min(k, KC);
+    packed_a.resize((size_t)((m + MR - 1) / MR) * MR * max_kc);
+    packed_b.resize((size_t)((std::min(n, NC) + NR - 1) / NR) * NR * max_kc);
+
+    for (int jc = 0; jc < n; jc += NC) {
+        int nc = std::min(NC, n - jc);
+        for (int pc = 0; pc < k; pc += KC) {
+            int kc = std::min(KC, k - pc);
+            bool accumulate = pc > 0 || beta != 0;
+            // The epilogue runs on the last block of K, when C is complete
+            const GemmEpilogue* tile_epilogue = pc + kc >= k ? epilogue : nullptr;
+            pack_b(kc, nc, b + pc * rsb + jc * csb, rsb, csb, b_dtype, packed_b.data());
+
+            // Pack every row block of A up front so that the macro-tiles below can be shared between threads.
+            int row_blocks = (m + MC - 1) / MC;
+            for (int ic = 0; ic < m; ic += MC) {
+                pack_a(std::min(MC, m - ic), kc, a + ic * rsa + pc * csa, rsa, csa, alpha,
+                       packed_a.data() + (size_t)ic * kc);
+            }
+
+            // Each macro-tile is a MC x (4 * NR) block of C
+            constexpr int tile_cols = 4 * NR;
+            int col_blocks = (nc + tile_cols - 1) / tile_cols;
+            const S* pa = packed_a.data();
+            const S* pb = packed_b.data();
+            // On the last block of K, the thread that completes the last macro-tile of a row block applies the
+            // epilogue to the whole row block, which is still in cache
+            std::unique_ptr<std::atomic<int>[]> remaining;
+            if (tile_epilogue != nullptr) {
+                remaining.reset(new std::atomic<int>[row_blocks]);
+                for (int ib = 0; ib < row_blocks; ib++) {
+                    remaining[ib] = col_blocks;
+                }
+            }
+#pragma omp parallel for collapse(2) schedule(dynamic) num_threads(FJML::get_num_threads())
+            for (int ib = 0; ib < row_blocks; ib++) {
+                for (int jb = 0; jb < col_blocks; jb++) {
+                    int ic = ib * MC, jr = jb * tile_cols;
+                    int mc = std::min(MC, m - ic), nr = std::min(tile_cols, nc - jr);
+                    macro_kernel(mc, nr, kc, pa + (size_t)ic * kc, pb + (size_t)jr * kc, c + ic * ldc + jc + jr, ldc,
+                                 accumulate);
+                    if (tile_epilogue != nullptr && remaining[ib].fetch_sub(1) == 1) {
+                        finish(*tile_epilogue, ic, jc, mc, nc);
+                    }
+                }
+            }
+        }
+    }
+}
+
+} // namespace
+
+namespace FJML {
+
+namespace LinAlg {
+
+void sgemm(bool trans_a, bool trans_b, int m, int n, int k, float alpha, const float* a, int lda, const float* b,
+           int ldb, float beta, float* c, int ldc, const GemmEpilogue* epilogue) {
+    blocked_gemm(trans_a, trans_b, m, n, k, alpha, a, lda, b, DTYPE_FLOAT32, ldb, beta, c, ldc, epilogue);
+}
+
+void sgemm(bool trans_a, bool trans_b, int m, int n, int k, float alpha, const float* a, int lda, const uint16_t* b,
+           DType b_dtype, int ldb, float beta, float* c, int ldc, const GemmEpilogue* epilogue) {
+    if (b_dtype != DTYPE_BFLOAT16 && b_dtype != DTYPE_FLOAT16) {
+        throw std::invalid_argument("B must be stored in bfloat16 or float16");
+    }
+    blocked_gemm(trans_a, trans_b, m, n, k, alpha, a, lda, b, b_dtype, ldb, beta, c, ldc, epilogue);
+}
+
+void dgemm(bool trans_a, bool trans_b, int m, int n, int k, double alpha, const double* a, int lda, const double* b,
+           int ldb, double beta, double* c, int ldc) {
+    blocked_gemm<double, double>(trans_a, trans_b, m, n, k, alpha, a, lda, b, DTYPE_FLOAT32, ldb, beta, c, ldc,
+                                 nullptr);
+}
+
+} // namespace LinAlg
+
+} // namespace FJML
@@ -0,0 +1,175 @@
+// Copyright (c) 2023 David Lee
+// This code is licensed under MIT license (see LICENSE for details)
+
+#include <stdexcept>
+
+#include <immintrin.h>
+
+#include "../include/FJML/allocator.h"
+#include "../include/FJML/half.h"
+#include "../include/FJML/parallel.h"
+
+namespace {
+
+uint32_t as_bits(float x) {
+    uint32_t bits;
+    std::memcpy(&bits, &x, sizeof(bits));
+    return bits;
+}
+
+float as_float(uint32_t bits) {
+    float x;
+    std::memcpy(&x, &bits, sizeof(x));
+    return x;
+}
+
+void check_dtype(FJML::DType dtype) {
+    if (dtype != FJML::DTYPE_BFLOAT16 && dtype != FJML::DTYPE_FLOAT16) {
+        throw std::invalid_argument("Only bfloat16 and float16 are 16 bit formats");
+    }
+}
+
+} // namespace
+
+namespace FJML {
+
+namespace Half {
+
+uint16_t to_float16(float x) {
+    // Round to nearest even without F16C: values too small for a normal float16 are rounded by adding a power of 2
+    // that pushes their mantissa bits into place, the others by rounding the mantissa of the float.
+    const uint32_t infinity = 255u << 23, overflow = (127u + 16) << 23;
+    const float subnormal_magic = as_float(((127u - 15) + (23 - 10) + 1) << 23);
+    uint32_t bits = as_bits(x), sign = bits & 0x80000000u;
+    bits ^= sign;
+    uint16_t result;
+    if (bits >= overflow) {
+        result = bits > infinity ? 0x7e00 : 0x7c00;
+    } else if (bits < (113u << 23)) {
+        result = as_bits(as_float(bits) + subnormal_magic) - as_bits(subnormal_magic);
+    } else {
+        uint32_t odd = (bits >> 13) & 1;
+        bits += ((15u - 127) << 23) + 0xfff + odd;
+        result = bits >> 13;
+    }
+    return result | (sign >> 16);
+}
+
+float from_float16(uint16_t x) {
+    const uint32_t exponent_mask = 0x7c00u << 13;
+    uint32_t bits = (x & 0x7fffu) << 13, exponent = bits & exponent_mask;
+    bits += (127u - 15) << 23;
+    if (exponent == exponent_mask) {
+        // Infinities and NaNs
+        bits += (128u - 16) << 23;
+    } else if (exponent == 0) {
+        // Zeros and subnormals, renormalized by subtracting the implicit bit
+        bits += 1u << 23;
+        bits = as_bits(as_float(bits) - as_float(113u << 23));
+    }
+    return as_float(bits | (x & 0x8000u) << 16);
+}
+
+void convert(const float* in, uint16_t* out, long n, DType dtype) {
+    check_dtype(dtype);
+    Parallel::parallel_for(n, [&](long begin, long end) {
+        long i = begin;
+        if (dtype == DTYPE_BFLOAT16) {
+#ifdef __AVX2__
+            const __m256i round = _mm256_set1_epi32(0x7fff), one = _mm256_set1_epi32(1),
+                          quiet = _mm256_set1_epi32(0x400000);
+            auto round_half = [&](__m256 x) {
+                __m256i bits = _mm256_castps_si256(x);
+                __m256i rounded = _mm256_add_epi32(
+                    bits, _mm256_add_epi32(round, _mm256_and_si256(_mm256_srli_epi32(bits, 16), one)));
+                __m256i nan = _mm256_castps_si256(_mm256_cmp_ps(x, x, _CMP_UNORD_Q));
+                return _mm256_srli_epi32(_mm256_blendv_epi8(rounded, _mm256_or_si256(bits, quiet), nan), 16);
+            };
+            for (; i + 16 <= end; i += 16) {
+                __m256i low = round_half(_mm256_loadu_ps(in + i)), high = round_half(_mm256_loadu_ps(in + i + 8));
+                // The pack works within 128 bit lanes, so the middle quarters are swapped back
+                __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(low, high), 0xd8);
+                _mm256_storeu_si256((__m256i*)(out + i), packed);
+            }
+#endif
+            for (; i < end; i++) {
+                out[i] = to_bfloat16(in[i]);
+            }
+        } else {
+#ifdef __F16C__
+            for (; i + 8 <= end; i += 8) {
+                __m128i half = _mm256_cvtps_ph(_mm256_loadu_ps(in + i), _MM_FROUND_TO_NEAREST_INT);
+                _mm_storeu_si128((__m128i*)(out + i), half);
+            }
+#endif
+            for (; i < end; i++) {
+                out[i] = to_float16(in[i]);
+            }
+        }
+    });
+}
+
+void convert(const uint16_t* in, float* out, long n, DType dtype) {
+    check_dtype(dtype);
+    Parallel::parallel_for(n, [&](long begin, long end) {
+        long i = begin;
+        if (dtype == DTYPE_BFLOAT16) {
+#ifdef __AVX2__
+            for (; i + 8 <= end; i += 8) {
+                __m256i wide = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(in + i)));
+                _mm256_storeu_ps(out + i, _mm256_castsi256_ps(_mm256_slli_epi32(wide, 16)));
+            }
+#endif
+            for (; i < end; i++) {
+                out[i] = from_bfloat16(in[i]);
+            }
+        } else {
+#ifdef __F16C__
+            for (; i + 8 <= end; i += 8) {
+                _mm256_storeu_ps(out + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(in + i))));
+            }
+#endif
+            for (; i < end; i++) {
+                out[i] = from_float16(in[i]);
+            }
+        }
+    });
+}
+
+} // namespace Half
+
+HalfTensor::HalfTensor() : data{nullptr}, dtype{DTYPE_BFLOAT16} {}
+
+HalfTensor::HalfTensor(const Tensor& tensor, DType dtype) : shape{tensor.shape}, dtype{dtype} {
+    check_dtype(dtype);
+    if (tensor.device != DEVICE_CPU) {
+        throw std::invalid_argument("Only tensors on the CPU can be converted to a 16 bit format");
+    }
+    Tensor contiguous = tensor.contiguous();
+    long n = contiguous.data_size[0];
+    storage = std::shared_ptr<uint16_t>((uint16_t*)Memory::allocate(n * sizeof(uint16_t)), Memory::deallocate);
+    data = storage.get();
+    Half::convert(contiguous.data, data, n, dtype);
+}
+
+long HalfTensor::size() const {
+    if (data == nullptr) {
+        return 0;
+    }
+    long n = 1;
+    for (int s : shape) {
+        n *= s;
+    }
+    return n;
+}
+
+Tensor HalfTensor::to_float() const {
+    if (data == nullptr) {
+        return Tensor();
+    }
+    Tensor result(shape, uninitialized);
+    Half::convert(data, result.data, size(), dtype);
+    return result;
+}
+
+} // namespace FJML
@@ -1,18 +1,80 @@
 // Copyright (c) 2023 David Lee
 // This code is licensed under MIT license (see LICENSE for details)
 
+#include <cstdlib>
+
 #include "../include/FJML/layers.h"
 
 namespace FJML {
 
 namespace Layers {
 
+std::vector<Tensor> Layer::saved_parameters() const {
+    std::vector<Tensor> saved;
+    // parameters() is not const, as it hands out pointers the caller may assign through, but nothing is changed here
+    for (Tensor* param : const_cast<Layer*>(this)->parameters()) {
+        saved.push_back(param->contiguous());
+    }
+    return saved;
+}
+
+Tensor Layer::apply_double(const Tensor& input, const std::vector<Tensor>& params) const {
+    throw std::runtime_error(name + " layers cannot be applied in double precision");
+}
+
 Layer* load(std::ifstream& file) {
     std::string type;
     file >> type;
     if (type == "Dense") {
         return new Layers::Dense(file);
     }
+    if (type == "QuantizedDense") {
+        return new Layers::QuantizedDense(file);
+    }
+    if (type == "Softmax") {
+        return new Layers::Softmax;
+    }
+    throw std::runtime_error("Invalid layer type");
+}
+
+Layer* load(const std::string& type, const std::string& config, std::vector<Tensor>& params) {
+    if (type == "Dense") {
+        if (params.size() != 2) {
+            throw std::runtime_error("A Dense layer must have a weights and a bias tensor");
+        }
+        // Weights stored in a 16 bit format are marked by the name of the format after the activation
+        size_t colon = config.rfind(':');
+        std::string activation = config.substr(0, colon);
+        DType dtype = colon == std::string::npos ? DTYPE_FLOAT32 : parse_dtype(config.substr(colon + 1));
+        for (const Activations::Activation& a : Activations::activations) {
+            if (a.name == activation) {
+                Layers::Dense* layer = new Layers::Dense(std::move(params[0]), std::move(params[1]), a);
+                try {
+                    layer->set_weight_dtype(dtype);
+                } catch (...) {
+                    delete layer;
+                    throw;
+                }
+                return layer;
+            }
+        }
+        throw std::runtime_error("Unknown activation function");
+    }
+    if (type == "QuantizedDense") {
+        // The number of inputs follows the activation, as the rows of the weights are padded
+        size_t colon = config.rfind(':');
+        if (colon == std::string::npos) {
+            throw std::runtime_error("The settings of a QuantizedDense layer must include its number of inputs");
+        }
+        std::string activation = config.substr(0, colon);
+        int input_size = std::atoi(config.c_str() + colon + 1);
+        for (const Activations::Activation& a : Activations::activations) {
+            if (a.name == activation) {
+                return new Layers::QuantizedDense(input_size, params, a);
+            }
+        }
+        throw std::runtime_error("Unknown activation function");
+    }
     if (type == "Softmax") {
         return new Layers::Softmax;
     }
@@ -1,7 +1,10 @@
 // Copyright (c) 2023 David Lee
 // This code is licensed under MIT license (see LICENSE for details)
 
+#include <functional>
+
 #include "../include/FJML/linalg.h"
+#include "../include/FJML/parallel.h"
 
 static std::string print_shape(const FJML::Tensor& a) {
     std::string res = "(";
@@ -14,6 +17,25 @@ static std::string print_shape(const FJML::Tensor& a) {
     return res;
 }
 
+/**
+ * Describes a matrix view in the form sgemm expects. A matrix with unit column stride is read as is, and one with unit
+ * row stride (such as a permuted matrix) is read as the transpose of a row-major matrix. Returns false if neither
+ * stride is 1.
+ */
+static bool gemm_layout(const FJML::Tensor& a, bool& trans, int& ld) {
+    if (a.shape[1] == 1 || a.strides[1] == 1) {
+        trans = false;
+        ld = a.shape[0] == 1 ? a.shape[1] : a.strides[0];
+        return true;
+    }
+    if (a.shape[0] == 1 || a.strides[0] == 1) {
+        trans = true;
+        ld = a.strides[1];
+        return true;
+    }
+    return false;
+}
+
 namespace FJML {
 
 namespace LinAlg {
@@ -22,14 +44,33 @@ float dot_product(const Tensor& a, const Tensor& b) {
     if (a.data_size[0] != b.data_size[0]) {
         throw std::invalid_argument("The two vectors must have the same size.");
     }
-    float res = 0;
-    for (int i = 0; i < (int)a.data_size[0]; i++) {
-        res += a.data[i] * b.data[i];
+    if (!a.is_contiguous() || !b.is_contiguous()) {
+        return dot_product(a.contiguous(), b.contiguous());
     }
-    return res;
+    const float *x = a.data, *y = b.data;
+    return Parallel::parallel_reduce(
+        a.data_size[0], 0.0f,
+        [&](long begin, long end) {
+            float res = 0;
+#pragma omp simd reduction(+ : res)
+            for (long i = begin; i < end; i++) {
+                res += x[i] * y[i];
+            }
+            return res;
+        },
+        std::plus<float>());
 }
 
 Tensor matrix_multiply(const Tensor& a, const Tensor& b) {
+    if ((a.dtype != DTYPE_FLOAT32 || b.dtype != DTYPE_FLOAT32) && (a.dim() != 2 || b.dim() != 2)) {
+        throw std::invalid_argument("Only matrices can be multiplied when their elements are not " +
+                                    dtype_name(DTYPE_FLOAT32));
+    }
+    // Matrices on the CPU are read in place by gemm, everything else needs contiguous operands
+    bool strided_gemm = a.dim() == 2 && b.dim() == 2 && a.device == DEVICE_CPU && b.device == DEVICE_CPU;
+    if (!strided_gemm && (!a.is_contiguous() || !b.is_contiguous())) {
+        return matrix_multiply(a.contiguous(), b.contiguous());
+    }
 #ifdef CUDA
     if (!handle_initialized) {
         cublasStatus_t status = cublasCreate(&handle);
@@ -42,7 +83,7 @@ Tensor matrix_multiply(const Tensor& a, const Tensor& b) {
     if (a.dim() == 1 && b.dim() == 1) {
         if (a.device == DEVICE_CUDA && b.device == DEVICE_CUDA) {
 #ifdef CUDA
-            Tensor result({a.shape[0], b.shape[0]}, 0.0, DEVICE_CUDA);
+            Tensor result({a.shape[0], b.shape[0]}, uninitialized, DEVICE_CUDA);
             cublasStatus_t status = CUBLAS_STATUS_SUCCESS;
 
             float *d_a, *d_b, *d_result;
@@ -51,7 +92,7 @@ Tensor matrix_multiply(const Tensor& a, const Tensor& b) {
             cudaHostGetDevicePointer(&d_result, result.data, 0);
 
             const float alpha = 1, beta = 0;
-            status = cublasDgemm(handle, CUBLAS_OP_N, CUBLAS_OP_N, b.shape[0], a.shape[0], 1, &alpha, d_b, b.shape[0],
+            status = cublasSgemm(handle, CUBLAS_OP_N, CUBLAS_OP_N, b.shape[0], a.shape[0], 1, &alpha, d_b, b.shape[0],
                                  d_a, 1, &beta, d_result, b.shape[0]);
             if (status != CUBLAS_STATUS_SUCCESS) {
                 throw std::runtime_error("Cublas matrix multiplication failed");
@@ -59,7 +100,7 @@ Tensor matrix_multiply(const Tensor& a, const Tensor& b) {
             return result;
 #endif
         } else {
-            Tensor result({a.shape[0], b.shape[0]});
+            Tensor result({a.shape[0], b.shape[0]}, uninitialized);
             for (int i = 0; i < a.shape[0]; i++) {
                 for (int j = 0; j < b.shape[0]; j++) {
                     result.data[i * b.shape[0] + j] = a.data[i] * b.data[j];
@@ -73,7 +114,7 @@ Tensor matrix_multiply(const Tensor& a, const Tensor& b) {
         }
 #ifdef CUDA
         if (a.device == DEVICE_CUDA && b.device == DEVICE_CUDA) {
-            Tensor result({b.shape[1]}, 0.0, DEVICE_CUDA);
+            Tensor result({b.shape[1]}, uninitialized, DEVICE_CUDA);
             cublasStatus_t status = CUBLAS_STATUS_SUCCESS;
 
             float *d_a, *d_b, *d_result;
@@ -82,7 +123,7 @@ Tensor matrix_multiply(const Tensor& a, const Tensor& b) {
             cudaHostGetDevicePointer(&d_result, result.data, 0);
 
             const float alpha = 1, beta = 0;
-            status = cublasDgemv(handle, CUBLAS_OP_N, b.shape[1], b.shape[0], &alpha, d_b, b.shape[1], d_a, 1, &beta,
+            status = cublasSgemv(handle, CUBLAS_OP_N, b.shape[1], b.shape[0], &alpha, d_b, b.shape[1], d_a, 1, &beta,
                                  d_result, 1);
             if (status != CUBLAS_STATUS_SUCCESS) {
                 throw std::runtime_error("Cublas matrix multiplication failed");
@@ -103,7 +144,7 @@ Tensor matrix_multiply(const Tensor& a, const Tensor& b) {
         }
 #ifdef CUDA
         if (a.device == DEVICE_CUDA && b.device == DEVICE_CUDA) {
-            Tensor result({a.shape[0]}, 0.0, DEVICE_CUDA);
+            Tensor result({a.shape[0]}, uninitialized, DEVICE_CUDA);
             cublasStatus_t status = CUBLAS_STATUS_SUCCESS;
 
             float *d_a, *d_b, *d_result;
@@ -112,7 +153,7 @@ Tensor matrix_multiply(const Tensor& a, const Tensor& b) {
             cudaHostGetDevicePointer(&d_result, result.data, 0);
 
             const float alpha = 1, beta = 0;
-            status = cublasDgemv(handle, CUBLAS_OP_T, a.shape[1], a.shape[0], &alpha, d_a, a.shape[1], d_b, 1, &beta,
+            status = cublasSgemv(handle, CUBLAS_OP_T, a.shape[1], a.shape[0], &alpha, d_a, a.shape[1], d_b, 1, &beta,
                                  d_result, 1);
             if (status != CUBLAS_STATUS_SUCCESS) {
                 throw std::runtime_error("Cublas matrix multiplication failed");
@@ -131,8 +172,8 @@ Tensor matrix_multiply(const Tensor& a, const Tensor& b) {
         throw std::invalid_argument("Invalid matrix dimensions: " + print_shape(a) + " and " + print_shape(b));
     }
 #ifdef CUDA
-    if (a.device == DEVICE_CUDA && b.device == DEVICE_CUDA) {
-        Tensor result({a.shape[0], b.shape[1]}, 0.0, DEVICE_CUDA);
+    if (a.device == DEVICE_CUDA && b.device == DEVICE_CUDA && a.dtype == DTYPE_FLOAT32) {
+        Tensor result({a.shape[0], b.shape[1]}, uninitialized, DEVICE_CUDA);
         cublasStatus_t status = CUBLAS_STATUS_SUCCESS;
 
         float *d_a, *d_b, *d_result;
@@ -141,7 +182,7 @@ Tensor matrix_multiply(const Tensor& a, const Tensor& b) {
         cudaHostGetDevicePointer(&d_result, result.data, 0);
 
         const float alpha = 1, beta = 0;
-        status = cublasDgemm(handle, CUBLAS_OP_N, CUBLAS_OP_N, b.shape[1], a.shape[0], a.shape[1], &alpha, d_b,
+        status = cublasSgemm(handle, CUBLAS_OP_N, CUBLAS_OP_N, b.shape[1], a.shape[0], a.shape[1], &alpha, d_b,
                              b.shape[1], d_a, a.shape[1], &beta, d_result, b.shape[1]);
         if (status != CUBLAS_STATUS_SUCCESS) {
             throw std::runtime_error("Cublas matrix multiplication failed");
@@ -149,50 +190,148 @@ Tensor matrix_multiply(const Tensor& a, const Tensor& b) {
         return result;
     }
 #endif
-    Tensor result({a.shape[0], b.shape[1]});
-#pragma omp parallel for
-    for (int i = 0; i < a.shape[0]; i++) {
-        for (int k = 0; k < a.shape[1]; k++) {
-            for (int j = 0; j < b.shape[1]; j++) {
-                result.data[i * b.shape[1] + j] += a.data[i * a.shape[1] + k] * b.data[k * b.shape[1] + j];
+    Tensor result({a.shape[0], b.shape[1]}, uninitialized, a.dtype);
+    gemm(a, b, false, false, 1, 0, result);
+    return result;
+}
+
+void gemm(const Tensor& a, const Tensor& b, bool trans_a, bool trans_b, float alpha, float beta, Tensor& out,
+          const GemmEpilogue* epilogue) {
+    if (a.dim() != 2 || b.dim() != 2) {
+        throw std::invalid_argument("Invalid matrix dimensions: " + print_shape(a) + " and " + print_shape(b));
+    }
+    int m = trans_a ? a.shape[1] : a.shape[0], k = trans_a ? a.shape[0] : a.shape[1];
+    int n = trans_b ? b.shape[0] : b.shape[1];
+    if ((trans_b ? b.shape[1] : b.shape[0]) != k) {
+        throw std::invalid_argument("Invalid matrix dimensions: " + print_shape(a) + " and " + print_shape(b));
+    }
+    if (a.dtype != b.dtype || (a.dtype != DTYPE_FLOAT32 && a.dtype != DTYPE_FLOAT64)) {
+        throw std::invalid_argument("Cannot multiply " + dtype_name(a.dtype) + " and " + dtype_name(b.dtype) +
+                                    " matrices");
+    }
+    if (out.shape != std::vector<int>{m, n} || out.dtype != a.dtype) {
+        if (beta != 0) {
+            throw std::invalid_argument("Output is a " + dtype_name(out.dtype) + " tensor of shape " +
+                                        print_shape(out) + ", expected a " + dtype_name(a.dtype) +
+                                        " tensor of shape (" + std::to_string(m) + ", " + std::to_string(n) + ")");
+        }
+        out = Tensor({m, n}, uninitialized, a.dtype, a.device);
+    }
+    if (a.dtype == DTYPE_FLOAT64 && (a.device != DEVICE_CPU || b.device != DEVICE_CPU || epilogue != nullptr)) {
+        throw std::invalid_argument("Double precision matrices can only be multiplied on the CPU, without epilogues");
+    }
+#ifdef CUDA
+    if (a.device == DEVICE_CUDA && b.device == DEVICE_CUDA && out.device == DEVICE_CUDA) {
+        if (!a.is_contiguous() || !b.is_contiguous() || !out.is_contiguous()) {
+            throw std::invalid_argument("CUDA gemm requires contiguous matrices");
+        }
+        if (epilogue != nullptr) {
+            throw std::invalid_argument("CUDA gemm does not support epilogues");
+        }
+        if (!handle_initialized) {
+            cublasStatus_t status = cublasCreate(&handle);
+            if (status != CUBLAS_STATUS_SUCCESS) {
+                throw std::runtime_error("Cublas initialization failed");
             }
+            handle_initialized = true;
+        }
+        float *d_a, *d_b, *d_out;
+        cudaHostGetDevicePointer(&d_a, a.data, 0);
+        cudaHostGetDevicePointer(&d_b, b.data, 0);
+        cudaHostGetDevicePointer(&d_out, out.data, 0);
+
+        // cuBLAS is column-major, so compute out^T = op(b)^T * op(a)^T
+        cublasStatus_t status =
+            cublasSgemm(handle, trans_b ? CUBLAS_OP_T : CUBLAS_OP_N, trans_a ? CUBLAS_OP_T : CUBLAS_OP_N, n, m, k,
+                        &alpha, d_b, b.shape[1], d_a, a.shape[1], &beta, d_out, n);
+        if (status != CUBLAS_STATUS_SUCCESS) {
+            throw std::runtime_error("Cublas matrix multiplication failed");
         }
+        return;
     }
-    return result;
+#endif
+    bool stored_trans_a, stored_trans_b, stored_trans_out;
+    int lda, ldb, ldc;
+    if (!gemm_layout(a, stored_trans_a, lda)) {
+        gemm(a.contiguous(), b, trans_a, trans_b, alpha, beta, out, epilogue);
+        return;
+    }
+    if (!gemm_layout(b, stored_trans_b, ldb)) {
+        gemm(a, b.contiguous(), trans_a, trans_b, alpha, beta, out, epilogue);
+        return;
+    }
+    if (!gemm_layout(out, stored_trans_out, ldc) || stored_trans_out) {
+        throw std::invalid_argument("The output of gemm must have a column stride of 1");
+    }
+    if (a.dtype == DTYPE_FLOAT64) {
+        dgemm(trans_a != stored_trans_a, trans_b != stored_trans_b, m, n, k, alpha, a.data_as<double>(), lda,
+              b.data_as<double>(), ldb, beta, out.data_as<double>(), ldc);
+        return;
+    }
+    sgemm(trans_a != stored_trans_a, trans_b != stored_trans_b, m, n, k, alpha, a.data, lda, b.data, ldb, beta,
+          out.data, ldc, epilogue);
 }
 
-Tensor transpose(const Tensor& a) {
-    if (a.dim() != 2) {
-        throw std::invalid_argument("Argument must be a matrix");
+void gemm(const Tensor& a, const HalfTensor& b, bool trans_a, bool trans_b, float alpha, float beta, Tensor& out,
+          const GemmEpilogue* epilogue) {
+    if (a.dim() != 2 || b.shape.size() != 2) {
+        throw std::invalid_argument("Invalid matrix dimensions: both operands must be matrices");
+    }
+    int m = trans_a ? a.shape[1] : a.shape[0], k = trans_a ? a.shape[0] : a.shape[1];
+    int n = trans_b ? b.shape[0] : b.shape[1];
+    if ((trans_b ? b.shape[1] : b.shape[0]) != k) {
+        throw std::invalid_argument("Invalid matrix dimensions: " + print_shape(a) + " and (" +
+                                    std::to_string(b.shape[0]) + ", " + std::to_string(b.shape[1]) + ")");
+    }
+    if (a.device != DEVICE_CPU) {
+        throw std::invalid_argument("Matrices stored in 16 bit formats can only be multiplied on the CPU");
     }
-    Tensor result({a.shape[1], a.shape[0]}, a.device);
-    for (int i = 0; i < a.shape[0]; i++) {
-        for (int j = 0; j < a.shape[1]; j++) {
-            result.data[j * a.shape[0] + i] = a.data[i * a.shape[1] + j];
+    if (out.shape != std::vector<int>{m, n}) {
+        if (beta != 0) {
+            throw std::invalid_argument("Output has shape " + print_shape(out) + ", expected (" + std::to_string(m) +
+                                        ", " + std::to_string(n) + ")");
         }
+        out = Tensor({m, n}, uninitialized);
     }
-    return result;
+    bool stored_trans_a, stored_trans_out;
+    int lda, ldc;
+    if (!gemm_layout(a, stored_trans_a, lda)) {
+        gemm(a.contiguous(), b, trans_a, trans_b, alpha, beta, out, epilogue);
+        return;
+    }
+    if (!gemm_layout(out, stored_trans_out, ldc) || stored_trans_out) {
+        throw std::invalid_argument("The output of gemm must have a column stride of 1");
+    }
+    sgemm(trans_a != stored_trans_a, trans_b, m, n, k, alpha, a.data, lda, b.data, b.dtype, b.shape[1], beta,
+          out.data, ldc, epilogue);
 }
 
-float sum(const Tensor& a) {
-    float res = 0;
-    for (int i = 0; i < a.data_size[0]; i++) {
-        res += a.data[i];
+Tensor transpose(const Tensor& a) {
+    if (a.dim() != 2) {
+        throw std::invalid_argument("Argument must be a matrix");
     }
-    return res;
+    return a.permute({1, 0}).contiguous();
 }
 
-float mean(const Tensor& a) { return sum(a) / a.data_size[0]; }
-
 Tensor pow(const Tensor& a, float b) {
-    Tensor result(a.shape, a.device);
-    for (int i = 0; i < a.data_size[0]; i++) {
-        result.data[i] = std::pow(a.data[i], b);
+    if (!a.is_contiguous()) {
+        return pow(a.contiguous(), b);
     }
+    Tensor result(a.shape, uninitialized, a.device);
+    const float* x = a.data;
+    float* y = result.data;
+    Parallel::parallel_for(a.data_size[0], [&](long begin, long end) {
+        for (long i = begin; i < end; i++) {
+            y[i] = std::pow(x[i], b);
+        }
+    });
     return result;
 }
 
 int random_choice(const Tensor& a) {
+    if (!a.is_contiguous()) {
+        return random_choice(a.contiguous());
+    }
     float rand_num = (float)rand() / (float)RAND_MAX;
     for (int i = 0; i < a.data_size[0]; i++) {
         if (rand_num < a.data[i]) {
@@ -203,62 +342,21 @@ int random_choice(const Tensor& a) {
     return a.data_size[0] - 1;
 }
 
-float max(const Tensor& a) {
-    float result = a.data[0];
-    for (int i = 1; i < a.data_size[0]; i++) {
-        if (a.data[i] > result) {
-            result = a.data[i];
-        }
-    }
-    return result;
-}
-
-Tensor argmax(const Tensor& a, int axis) {
-    if (axis == -1) {
-        Tensor result(std::vector<int>{1});
-        float max_value = -INFINITY;
-        for (int i = 0; i < a.data_size[0]; i++) {
-            if (a.data[i] > max_value) {
-                max_value = a.data[i];
-                result.data[0] = i;
-            }
-        }
-        return result;
-    }
-    if (axis < 0 || axis >= a.dim()) {
-        throw std::invalid_argument("Invalid axis");
-    }
-    std::vector<int> result_shape;
-    for (int i = 0; i < a.dim(); i++) {
-        if (i != axis) {
-            result_shape.push_back(a.shape[i]);
-        }
-    }
-    Tensor result(result_shape);
-    for (int i = 0; i < result.data_size[0]; i++) {
-        int max_index = 0;
-        float max_value = -INFINITY;
-        for (int j = 0; j < a.shape[axis]; j++) {
-            int index = i % a.data_size[axis + 1] + j * a.data_size[axis + 1] +
-                        i / a.data_size[axis + 1] * a.data_size[axis];
-            if (a.data[index] > max_value) {
-                max_value = a.data[index];
-                max_index = j;
-            }
-        }
-        result.data[i] = max_index;
-    }
-    return result;
-}
-
 Tensor equal(const Tensor& a, const Tensor& b) {
     if (a.data_size[0] != b.data_size[0]) {
         throw std::invalid_argument("Tensor sizes must match");
     }
-    Tensor result(a.shape);
-    for (int i = 0; i < a.data_size[0]; i++) {
-        result.data[i] = a.data[i] == b.data[i];
+    if (!a.is_contiguous() || !b.is_contiguous()) {
+        return equal(a.contiguous(), b.contiguous());
     }
+    Tensor result(a.shape, uninitialized);
+    const float *x = a.data, *y = b.data;
+    float* z = result.data;
+    Parallel::parallel_for(a.data_size[0], [&](long begin, long end) {
+        for (long i = begin; i < end; i++) {
+            z[i] = x[i] == y[i];
+        }
+    });
     return result;
 }
 
@@ -277,7 +375,7 @@ Tensor dense_forward(const Tensor& input, const Tensor& weights, const Tensor& b
                 throw std::runtime_error("Cublas initialization failed");
             }
         }
-        Tensor result({input.shape[0], weights.shape[1]}, 0.0, DEVICE_CUDA);
+        Tensor result({input.shape[0], weights.shape[1]}, uninitialized, DEVICE_CUDA);
         float *d_input, *d_weights, *d_result, *d_bias;
         cudaHostGetDevicePointer(&d_input, input.data, 0);
         cudaHostGetDevicePointer(&d_weights, weights.data, 0);
@@ -285,11 +383,11 @@ Tensor dense_forward(const Tensor& input, const Tensor& weights, const Tensor& b
         cudaHostGetDevicePointer(&d_bias, bias.data, 0);
 
         for (int i = 0; i < input.shape[0]; i++) {
-            cublasDcopy(handle, bias.shape[0], d_bias, 1, d_result + i * bias.shape[0], 1);
+            cublasScopy(handle, bias.shape[0], d_bias, 1, d_result + i * bias.shape[0], 1);
         }
 
         const float alpha = 1, beta = 1;
-        cublasStatus_t status = cublasDgemm(handle, CUBLAS_OP_N, CUBLAS_OP_N, weights.shape[1], input.shape[0],
+        cublasStatus_t status = cublasSgemm(handle, CUBLAS_OP_N, CUBLAS_OP_N, weights.shape[1], input.shape[0],
                                             weights.shape[0], &alpha, d_weights, weights.shape[1], d_input,
                                             input.shape[1], &beta, d_result, weights.shape[1]);
         if (status != CUBLAS_STATUS_SUCCESS) {
@@ -298,13 +396,58 @@ Tensor dense_forward(const Tensor& input, const Tensor& weights, const Tensor& b
         return result;
     }
 #endif
-    Tensor result = matrix_multiply(input, weights);
-#pragma omp parallel for
-    for (int i = 0; i < result.shape[0]; i++) {
-        for (int j = 0; j < result.shape[1]; j++) {
-            result.data[i * result.shape[1] + j] += bias.data[j];
+    return dense_forward(input, weights, bias, nullptr);
+}
+
+Tensor dense_forward(const Tensor& input, const Tensor& weights, const Tensor& bias,
+                     void (*activation)(const float* in, float* out, long n), Tensor* pre_activation) {
+    if (input.dim() != 2 || weights.dim() != 2 || bias.dim() != 1) {
+        throw std::invalid_argument("Invalid dimensions for dense layer");
+    }
+    if (input.shape[1] != weights.shape[0] || weights.shape[1] != bias.shape[0]) {
+        throw std::invalid_argument("Invalid dimensions for dense layer");
+    }
+    std::vector<int> shape{input.shape[0], weights.shape[1]};
+    if (pre_activation != nullptr && (pre_activation->shape != shape || pre_activation->device != DEVICE_CPU ||
+                                      !pre_activation->is_contiguous() || pre_activation->storage.use_count() > 1)) {
+        *pre_activation = Tensor(shape, uninitialized);
+    }
+#ifdef CUDA
+    if (input.device == DEVICE_CUDA && weights.device == DEVICE_CUDA && bias.device == DEVICE_CUDA) {
+        Tensor result = dense_forward(input, weights, bias);
+        if (pre_activation != nullptr) {
+            *pre_activation = result;
+        }
+        if (activation != nullptr) {
+            activation(result.data, result.data, result.data_size[0]);
         }
+        return result;
+    }
+#endif
+    Tensor contiguous_bias = bias.contiguous();
+    GemmEpilogue epilogue;
+    epilogue.bias = contiguous_bias.data;
+    epilogue.pre_activation = pre_activation != nullptr ? pre_activation->data : nullptr;
+    epilogue.activation = activation;
+    Tensor result(shape, uninitialized);
+    gemm(input, weights, false, false, 1, 0, result, &epilogue);
+    return result;
+}
+
+Tensor dense_forward(const Tensor& input, const HalfTensor& weights, const Tensor& bias,
+                     void (*activation)(const float* in, float* out, long n)) {
+    if (input.dim() != 2 || weights.shape.size() != 2 || bias.dim() != 1) {
+        throw std::invalid_argument("Invalid dimensions for dense layer");
+    }
+    if (input.shape[1] != weights.shape[0] || weights.shape[1] != bias.shape[0]) {
+        throw std::invalid_argument("Invalid dimensions for dense layer");
     }
+    Tensor contiguous_bias = bias.contiguous();
+    GemmEpilogue epilogue;
+    epilogue.bias = contiguous_bias.data;
+    epilogue.activation = activation;
+    Tensor result({input.shape[0], weights.shape[1]}, uninitialized);
+    gemm(input, weights, false, false, 1, 0, result, &epilogue);
     return result;
 }
 
@@ -1,18 +1,167 @@
 // Copyright (c) 2023 David Lee
 // This code is licensed under MIT license (see LICENSE for details)
 
+#include <algorithm>
 #include <cmath>
 #include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
 
+#include "../include/FJML/linalg.h"
 #include "../include/FJML/loss.h"
+#include "../include/FJML/parallel.h"
+
+namespace {
+
+/**
+ * @brief Checks that there is one label per sample, each the index of one of the classes of the prediction
+ * @return The number of classes
+ */
+int check_labels(const FJML::Tensor& label, const FJML::Tensor& pred) {
+    if (pred.dim() != 2 || label.dim() == 0 || label.shape[0] != pred.shape[0] ||
+        label.data_size[0] != pred.shape[0]) {
+        throw std::invalid_argument("The two tensors must have the same number of samples");
+    }
+    int classes = pred.shape[1];
+    if (label.data_size[0] > 0 && (FJML::LinAlg::min(label) < 0 || FJML::LinAlg::max(label) >= classes)) {
+        throw std::out_of_range("The labels must be the indices of one of " + std::to_string(classes) + " classes");
+    }
+    return classes;
+}
+
+float sparse_crossentropy(const FJML::Tensor& label, const FJML::Tensor& pred) {
+    int classes = check_labels(label, pred);
+    const int32_t* labels = label.data_as<int32_t>();
+    double result = 0;
+    for (int i = 0; i < label.shape[0]; i++) {
+        result += -std::log(pred.data[(long)i * classes + labels[i]]);
+    }
+    return result;
+}
+
+FJML::Tensor sparse_crossentropy_derivative(const FJML::Tensor& label, const FJML::Tensor& pred) {
+    int classes = check_labels(label, pred);
+    const int32_t* labels = label.data_as<int32_t>();
+    FJML::Tensor result(pred.shape, pred.device);
+    for (int i = 0; i < label.shape[0]; i++) {
+        long index = (long)i * classes + labels[i];
+        result.data[index] = -1 / pred.data[index];
+    }
+    return result;
+}
+
+FJML::Tensor sparse_crossentropy_softmax_derivative(const FJML::Tensor& label, const FJML::Tensor& pred) {
+    int classes = check_labels(label, pred);
+    const int32_t* labels = label.data_as<int32_t>();
+    FJML::Tensor result(pred.shape, FJML::uninitialized, pred.device);
+    FJML::Parallel::parallel_for(
+        pred.shape[0],
+        [&](long first, long last) {
+            for (long i = first; i < last; i++) {
+                const float* s = pred.data + i * classes;
+                float* out = result.data + i * classes;
+                int ind = labels[i];
+                for (int j = 0; j < classes; j++) {
+                    out[j] = s[j] - (j == ind);
+                }
+            }
+        },
+        classes);
+    return result;
+}
+
+float sparse_crossentropy_logits(const FJML::Tensor& label, const FJML::Tensor& pred) {
+    int classes = check_labels(label, pred);
+    const int32_t* labels = label.data_as<int32_t>();
+    double result = 0;
+    for (int i = 0; i < label.shape[0]; i++) {
+        const float* z = pred.data + (long)i * classes;
+        float denom = 0, max = *std::max_element(z, z + classes);
+        for (int j = 0; j < classes; j++) {
+            denom += std::exp(z[j] - max);
+        }
+        result += -(z[labels[i]] - max) + std::log(denom);
+    }
+    return result;
+}
+
+FJML::Tensor sparse_crossentropy_logits_derivative(const FJML::Tensor& label, const FJML::Tensor& pred) {
+    int classes = check_labels(label, pred);
+    const int32_t* labels = label.data_as<int32_t>();
+    FJML::Tensor result(pred.shape, FJML::uninitialized, pred.device);
+    for (int i = 0; i < label.shape[0]; i++) {
+        const float* z = pred.data + (long)i * classes;
+        float* out = result.data + (long)i * classes;
+        float denom = 0, max = *std::max_element(z, z + classes);
+        for (int j = 0; j < classes; j++) {
+            denom += std::exp(z[j] - max);
+        }
+        for (int j = 0; j < classes; j++) {
+            out[j] = std::exp(z[j] - max) / denom;
+        }
+        out[labels[i]] -= 1;
+    }
+    return result;
+}
+
+/**
+ * @brief Wraps a function of integer labels into one taking labels stored as floats, which converts them first
+ */
+template <typename F> auto from_float_labels(F f) {
+    return [f](const FJML::Tensor& label, const FJML::Tensor& pred) {
+        return f(label.astype(FJML::DTYPE_INT32), pred);
+    };
+}
+
+} // namespace
 
 namespace FJML {
 
 namespace Loss {
 
-float Loss::calc_loss(const Tensor& obs, const Tensor& pred) const { return function(obs, pred); }
+float Loss::calc_loss(const Tensor& obs, const Tensor& pred) const {
+    if (obs.dtype == DTYPE_INT32) {
+        if (!label_function) {
+            throw std::invalid_argument("The loss function " + name + " does not take integer labels");
+        }
+        return label_function(obs.contiguous(), pred.contiguous());
+    }
+    if (!obs.is_contiguous() || !pred.is_contiguous()) {
+        return function(obs.contiguous(), pred.contiguous());
+    }
+    return function(obs, pred);
+}
 
-Tensor Loss::calc_derivative(const Tensor& obs, const Tensor& pred) const { return derivative(obs, pred); }
+Tensor Loss::calc_derivative(const Tensor& obs, const Tensor& pred) const {
+    if (obs.dtype == DTYPE_INT32) {
+        if (!label_derivative) {
+            throw std::invalid_argument("The loss function " + name + " does not take integer labels");
+        }
+        return label_derivative(obs.contiguous(), pred.contiguous());
+    }
+    if (!obs.is_contiguous() || !pred.is_contiguous()) {
+        return derivative(obs.contiguous(), pred.contiguous());
+    }
+    return derivative(obs, pred);
+}
+
+Tensor Loss::calc_softmax_derivative(const Tensor& obs, const Tensor& pred) const {
+    if (obs.dtype == DTYPE_INT32) {
+        if (!label_softmax_derivative) {
+            throw std::runtime_error("The loss function " + name +
+                                     " has no derivative through a softmax layer for integer labels");
+        }
+        return label_softmax_derivative(obs.contiguous(), pred.contiguous());
+    }
+    if (!softmax_derivative) {
+        throw std::runtime_error("The loss function " + name + " has no derivative through a softmax layer");
+    }
+    if (!obs.is_contiguous() || !pred.is_contiguous()) {
+        return softmax_derivative(obs.contiguous(), pred.contiguous());
+    }
+    return softmax_derivative(obs, pred);
+}
 
 /**
  * @brief The mean squared error loss function
@@ -33,7 +182,7 @@ const Loss mse(
         if (label.data_size[0] != pred.data_size[0]) {
             throw std::invalid_argument("The two tensors must have the same size");
         }
-        Tensor result(label.shape, label.device);
+        Tensor result(label.shape, uninitialized, label.device);
         for (int i = 0; i < label.data_size[0]; i++) {
             result.data[i] = 2 * (pred.data[i] - label.data[i]);
         }
@@ -66,7 +215,7 @@ const Loss huber(
         if (label.data_size[0] != pred.data_size[0]) {
             throw std::invalid_argument("The two tensors must have the same size");
         }
-        Tensor result(label.shape, label.device);
+        Tensor result(label.shape, uninitialized, label.device);
         for (int i = 0; i < label.data_size[0]; i++) {
             float diff = pred.data[i] - label.data[i];
             if (diff < -1) {
@@ -99,7 +248,7 @@ Loss binary_crossentropy(bool from_logits) {
                 if (label.data_size[0] != pred.data_size[0]) {
                     throw std::invalid_argument("The two tensors must have the same size");
                 }
-                Tensor result(label.shape, label.device);
+                Tensor result(label.shape, uninitialized, label.device);
                 for (int i = 0; i < label.data_size[0]; i++) {
                     result.data[i] = -label.data[i] / pred.data[i] + (1 - label.data[i]) / (1 - pred.data[i]);
                 }
@@ -116,7 +265,7 @@ Loss binary_crossentropy(bool from_logits) {
             return result;
         },
         [](const Tensor& label, const Tensor& pred) -> Tensor {
-            Tensor result(label.shape, label.device);
+            Tensor result(label.shape, uninitialized, label.device);
             for (int i = 0; i < label.data_size[0]; i++) {
                 float exp_b = std::exp(pred.data[i]);
                 result.data[i] = -label.data[i] + exp_b / (1 + exp_b);
@@ -143,11 +292,36 @@ Loss crossentropy(bool from_logits) {
                 if (label.data_size[0] != pred.data_size[0]) {
                     throw std::invalid_argument("The two tensors must have the same size");
                 }
-                Tensor result(label.shape, label.device);
+                Tensor result(label.shape, uninitialized, label.device);
                 for (int i = 0; i < label.data_size[0]; i++) {
                     result.data[i] = -label.data[i] / pred.data[i];
                 }
                 return result;
+            },
+            [](const Tensor& label, const Tensor& pred) -> Tensor {
+                if (label.shape != pred.shape || pred.dim() != 2) {
+                    throw std::invalid_argument("The two tensors must be batches of the same shape");
+                }
+                // -sum(y * log(s)) differentiates to s * sum(y) - y, which is s - y for a distribution y
+                Tensor result(pred.shape, uninitialized, pred.device);
+                int classes = pred.shape[1];
+                Parallel::parallel_for(
+                    pred.shape[0],
+                    [&](long first, long last) {
+                        for (long i = first; i < last; i++) {
+                            const float *y = label.data + i * classes, *s = pred.data + i * classes;
+                            float* out = result.data + i * classes;
+                            float total = 0;
+                            for (int j = 0; j < classes; j++) {
+                                total += y[j];
+                            }
+                            for (int j = 0; j < classes; j++) {
+                                out[j] = s[j] * total - y[j];
+                            }
+                        }
+                    },
+                    classes);
+                return result;
             });
     }
     return Loss(
@@ -160,7 +334,7 @@ Loss crossentropy(bool from_logits) {
             for (int datapoint = 0; datapoint < label.shape[0]; datapoint++) {
                 int offset = datapoint * label.data_size[1];
                 float denom = 0, max = pred.data[offset];
-                for (int i = 1; i < label.data_size[1]; i++) {
+                for (int i = 1; i < pred.data_size[1]; i++) {
                     if (pred.data[offset + i] > max) {
                         max = pred.data[offset + i];
                     }
@@ -179,11 +353,11 @@ Loss crossentropy(bool from_logits) {
             if (label.data_size[0] != pred.data_size[0] || label.shape[0] != pred.shape[0]) {
                 throw std::invalid_argument("The two tensors must have the same size");
             }
-            Tensor result(label.shape, label.device);
+            Tensor result(label.shape, uninitialized, label.device);
             for (int datapoint = 0; datapoint < label.shape[0]; datapoint++) {
                 int offset = datapoint * label.data_size[1];
                 float denom = 0, max = pred.data[offset];
-                for (int i = 1; i < label.data_size[1]; i++) {
+                for (int i = 1; i < pred.data_size[1]; i++) {
                     if (pred.data[offset + i] > max) {
                         max = pred.data[offset + i];
                     }
@@ -200,76 +374,21 @@ Loss crossentropy(bool from_logits) {
 }
 
 Loss sparse_categorical_crossentropy(bool from_logits) {
+    Loss loss;
     if (!from_logits) {
-        return Loss(
-            "sparse_categorical_crossentropy",
-            [](const Tensor& label, const Tensor& pred) -> float {
-                if (label.shape[0] != pred.shape[0]) {
-                    throw std::invalid_argument("The two tensors must have the same number of samples");
-                }
-                float result = 0;
-                for (int i = 0; i < label.shape[0]; i++) {
-                    result += -std::log(pred.data[static_cast<int>(label.data[i])]);
-                }
-                return result;
-            },
-            [](const Tensor& label, const Tensor& pred) -> Tensor {
-                if (label.shape[0] != pred.shape[0]) {
-                    throw std::invalid_argument("The two tensors must have the same number of samples");
-                }
-                Tensor result(pred.shape, pred.device);
-                for (int i = 0; i < label.shape[0]; i++) {
-                    int ind = static_cast<int>(label.data[i]), offset = i * pred.data_size[1];
-                    result.data[offset + ind] = -1 / pred.data[offset + ind];
-                }
-                return result;
-            });
+        loss = Loss("sparse_categorical_crossentropy", from_float_labels(sparse_crossentropy),
+                    from_float_labels(sparse_crossentropy_derivative),
+                    from_float_labels(sparse_crossentropy_softmax_derivative));
+        loss.label_function = sparse_crossentropy;
+        loss.label_derivative = sparse_crossentropy_derivative;
+        loss.label_softmax_derivative = sparse_crossentropy_softmax_derivative;
+    } else {
+        loss = Loss("sparse_categorical_crossentropy", from_float_labels(sparse_crossentropy_logits),
+                    from_float_labels(sparse_crossentropy_logits_derivative));
+        loss.label_function = sparse_crossentropy_logits;
+        loss.label_derivative = sparse_crossentropy_logits_derivative;
     }
-    return Loss(
-        "sparse_categorical_crossentropy",
-        [](const Tensor& label, const Tensor& pred) -> float {
-            if (label.shape[0] != pred.shape[0]) {
-                throw std::invalid_argument("The two tensors must have the same number of samples");
-            }
-            float result = 0;
-            for (int i = 0; i < label.shape[0]; i++) {
-                int offset = i * pred.data_size[1];
-                float denom = 0, max = pred.data[offset];
-                for (int i = 1; i < label.data_size[1]; i++) {
-                    if (pred.data[offset + i] > max) {
-                        max = pred.data[offset + i];
-                    }
-                }
-                for (int i = 0; i < pred.data_size[1]; i++) {
-                    denom += std::exp(pred.data[offset + i] - max);
-                }
-                result += -(pred.data[offset + static_cast<int>(label.data[i])] - max) + std::log(denom);
-            }
-            return result;
-        },
-        [](const Tensor& label, const Tensor& pred) -> Tensor {
-            if (label.shape[0] != pred.shape[0]) {
-                throw std::invalid_argument("The two tensors must have the same number of samples");
-            }
-            Tensor result(pred.shape, pred.device);
-            for (int i = 0; i < label.shape[0]; i++) {
-                int ind = static_cast<int>(label.data[i]), offset = i * pred.data_size[1];
-                float denom = 0, max = pred.data[offset];
-                for (int i = 1; i < label.data_size[1]; i++) {
-                    if (pred.data[offset + i] > max) {
-                        max = pred.data[offset + i];
-                    }
-                }
-                for (int i = 0; i < pred.data_size[1]; i++) {
-                    denom += std::exp(pred.data[offset + i] - max);
-                }
-                for (int i = 0; i < pred.data_size[1]; i++) {
-                    result.data[offset + i] = std::exp(pred.data[offset + i] - max) / denom;
-                }
-                result.data[offset + ind] -= 1;
-            }
-            return result;
-        });
+    return loss;
 }
 
 } // namespace Loss
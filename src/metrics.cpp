@@ -1,6 +1,9 @@
 // Copyright (c) 2023 David Lee
 // This code is licensed under MIT license (see LICENSE for details)
 
+#include <algorithm>
+#include <stdexcept>
+
 #include "../include/FJML/metrics.h"
 #include "../include/FJML/linalg.h"
 
@@ -11,6 +14,10 @@ namespace MLP {
 Metric::Metric(std::string name, std::function<float(const Tensor&, const Tensor&)> compute)
     : name{name}, compute{compute} {}
 
+Metric::Metric(std::string name, std::function<float(const Tensor&, const Tensor&)> compute,
+               std::function<float(const Tensor&, const Tensor&)> compute_labels)
+    : name{name}, compute{compute}, compute_labels{compute_labels} {}
+
 /**
  * @brief This is the accuracy metric.
  *
@@ -36,18 +43,28 @@ Metric mean_squared_error{"mean_squared_error", [](const Tensor& label, const Te
  *
  * The sparse categorical accuracy metric is defined as the percentage of correct predictions.
  *
- * Here each label is an integer representing the class.
+ * Here each label is an integer representing the class. DTYPE_INT32 labels are compared with the index of the
+ * largest output directly.
  */
 Metric sparse_categorical_accuracy{"sparse_categorical_accuracy",
                                    [](const Tensor& label, const Tensor& output) -> float {
-                                       Tensor output_argmax = LinAlg::argmax(output, 1);
-                                       int correct = 0;
-                                       for (int i = 0; i < label.shape[0]; i++) {
-                                           if (label.data[i] == output_argmax.data[i]) {
-                                               correct++;
-                                           }
+                                       return LinAlg::mean(LinAlg::equal(label, LinAlg::argmax(output, 1)));
+                                   },
+                                   [](const Tensor& label, const Tensor& output) -> float {
+                                       if (output.dim() != 2 || label.dim() == 0 || label.shape[0] != output.shape[0] ||
+                                           label.data_size[0] != output.shape[0]) {
+                                           throw std::invalid_argument(
+                                               "The labels and outputs must have the same number of samples");
+                                       }
+                                       Tensor pred = output.contiguous(), labels = label.contiguous();
+                                       const int32_t* classes_of = labels.data_as<int32_t>();
+                                       int classes = pred.shape[1], n = labels.shape[0];
+                                       long correct = 0;
+                                       for (int i = 0; i < n; i++) {
+                                           const float* row = pred.data + (long)i * classes;
+                                           correct += std::max_element(row, row + classes) - row == classes_of[i];
                                        }
-                                       return (float)correct / ((float)label.shape[0]);
+                                       return (float)correct / n;
                                    }};
 
 } // namespace MLP
@@ -2,13 +2,25 @@
 // This code is licensed under MIT license (see LICENSE for details)
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <chrono>
+#include <climits>
+#include <cmath>
 #include <cstring>
+#include <exception>
 #include <iomanip>
 #include <iostream>
+#include <memory>
+#include <random>
+#include <thread>
 
+#include <omp.h>
+
+#include "../include/FJML/allocator.h"
+#include "../include/FJML/data.h"
 #include "../include/FJML/mlp.h"
+#include "../include/FJML/parallel.h"
 
 // TODO: Refactor everything
 
@@ -37,82 +49,610 @@ namespace FJML {
 
 namespace MLP {
 
-void MLP::grad_descent(const Tensor& x_train, const Tensor& y_train) {
+/**
+ * @brief Whether a loss has a derivative through a softmax layer, for targets stored as floats or as integer labels
+ */
+static bool has_softmax_derivative(const Loss::Loss& loss_fn, const Tensor& y_train) {
+    return y_train.dtype == DTYPE_INT32 ? (bool)loss_fn.label_softmax_derivative : (bool)loss_fn.softmax_derivative;
+}
+
+/**
+ * @brief Computes a metric, with compute_labels for integer labels
+ */
+static float compute_metric(const Metric& metric, const Tensor& label, const Tensor& output) {
+    if (label.dtype != DTYPE_INT32) {
+        return metric.compute(label, output);
+    }
+    if (!metric.compute_labels) {
+        throw std::invalid_argument("The metric " + metric.name + " does not take integer labels");
+    }
+    return metric.compute_labels(label, output);
+}
+
+/**
+ * @brief A buffer for a batch of rows of a contiguous tensor
+ */
+static Tensor batch_buffer(const Tensor& data, int rows) {
+    std::vector<int> shape = data.shape;
+    shape[0] = rows;
+    return Tensor(shape, uninitialized, data.dtype);
+}
+
+/**
+ * @brief Copies some rows of a contiguous tensor into the first rows of a buffer
+ */
+static void gather_rows(const Tensor& data, const int* rows, int count, Tensor& out) {
+    size_t row = data.data_size[0] / data.shape[0] * dtype_size(data.dtype);
+    const char* from = (const char*)data.data;
+    char* to = (char*)out.data;
+    for (int i = 0; i < count; i++) {
+        std::memcpy(to + i * row, from + rows[i] * row, row);
+    }
+}
+
+/**
+ * @brief Runs the forward and backward passes of a batch through a list of layers, accumulating their gradients
+ */
+static void accumulate_gradients(const std::vector<Layers::Layer*>& layers, const Loss::Loss& loss_fn,
+                                 const Tensor& x_train, const Tensor& y_train, float scale) {
     int num_layers = layers.size();
 
     std::vector<Tensor> run_res(num_layers + 1);
-    run_res[0] = x_train;
+    run_res[0] = x_train.contiguous();
     for (int i = 0; i < num_layers; i++) {
-        run_res[i + 1] = layers[i]->apply(run_res[i]);
+        run_res[i + 1] = layers[i]->forward(run_res[i]);
     }
 
-    Tensor out_grad = loss_fn.calc_derivative(y_train, run_res[num_layers]);
-    for (int i = num_layers - 1; i >= 0; i--) {
+    // A softmax layer feeding a loss with a fused derivative is differentiated together with the loss, in one pass
+    // that does not divide by the probabilities
+    int last = num_layers;
+    Tensor out_grad;
+    if (num_layers > 0 && has_softmax_derivative(loss_fn, y_train) &&
+        dynamic_cast<Layers::Softmax*>(layers.back()) != nullptr) {
+        out_grad = loss_fn.calc_softmax_derivative(y_train, run_res[num_layers]);
+        last--;
+    } else {
+        out_grad = loss_fn.calc_derivative(y_train, run_res[num_layers]);
+    }
+    if (scale != 1) {
+        out_grad *= scale;
+    }
+    for (int i = last - 1; i >= 0; i--) {
         out_grad = layers[i]->backward(run_res[i], out_grad);
     }
 }
 
+void MLP::make_replicas() {
+    bool up_to_date = (int)replicas.size() == num_workers - 1;
+    for (const std::vector<Layers::Layer*>& replica : replicas) {
+        up_to_date = up_to_date && replica.size() == layers.size();
+        for (int i = 0; up_to_date && i < (int)layers.size(); i++) {
+            up_to_date = replica[i]->name == layers[i]->name;
+        }
+    }
+    if (up_to_date) {
+        return;
+    }
+    clear_replicas();
+    long size = flat_params.data == nullptr ? 0 : flat_params.data_size[0];
+    replica_grads.reserve(num_workers - 1);
+    for (int r = 1; r < num_workers; r++) {
+        // The parameters of a replica are views into flat_params, so only the activations and gradients are its own
+        Tensor grads = size == 0 ? Tensor() : Tensor({(int)size}, flat_params.device);
+        std::vector<Layers::Layer*> replica;
+        long offset = 0;
+        for (Layers::Layer* l : layers) {
+            Layers::Layer* copy = l->clone();
+            std::vector<Tensor*> params = copy->parameters(), layer_grads = copy->gradients();
+            for (int i = 0; i < (int)params.size(); i++) {
+                long n = params[i]->data_size[0];
+                std::vector<int> shape = params[i]->shape;
+                *params[i] = flat_params.slice(offset, offset + n).view(shape);
+                *layer_grads[i] = grads.slice(offset, offset + n).view(shape);
+                offset += n;
+            }
+            replica.push_back(copy);
+        }
+        replicas.push_back(replica);
+        replica_grads.push_back(std::move(grads));
+        replica_optimizers.push_back(optimizer == nullptr ? nullptr : optimizer->clone());
+    }
+}
+
+void MLP::clear_replicas() {
+    for (std::vector<Layers::Layer*>& replica : replicas) {
+        for (Layers::Layer* l : replica) {
+            delete l;
+        }
+    }
+    for (Optimizers::Optimizer* opt : replica_optimizers) {
+        delete opt;
+    }
+    replicas.clear();
+    replica_grads.clear();
+    replica_optimizers.clear();
+}
+
+void MLP::set_num_workers(int workers) {
+    if (workers < 1) {
+        throw std::invalid_argument("The number of workers must be at least 1");
+    }
+    num_workers = workers;
+    clear_replicas();
+}
+
+void MLP::set_hogwild(bool enabled, int max_staleness) {
+    if (max_staleness < -1) {
+        throw std::invalid_argument("The staleness bound must be at least 0, or -1 for no bound");
+    }
+    hogwild = enabled;
+    this->max_staleness = max_staleness;
+}
+
+void MLP::flatten_parameters() {
+    std::vector<Tensor*> params, grads;
+    for (Layers::Layer* l : layers) {
+        std::vector<Tensor*> layer_params = l->parameters(), layer_grads = l->gradients();
+        if (layer_params.size() != layer_grads.size()) {
+            throw std::runtime_error("Layer " + l->name + " has a different number of parameters and gradients");
+        }
+        params.insert(params.end(), layer_params.begin(), layer_params.end());
+        grads.insert(grads.end(), layer_grads.begin(), layer_grads.end());
+    }
+
+    long flat_size = flat_params.data == nullptr ? 0 : flat_params.data_size[0], offset = 0;
+    bool in_place = true;
+    for (int i = 0; i < (int)params.size(); i++) {
+        long size = params[i]->data_size[0];
+        in_place = in_place && offset + size <= flat_size && params[i]->data == flat_params.data + offset &&
+                   params[i]->is_contiguous() && grads[i]->data == flat_grads.data + offset &&
+                   grads[i]->shape == params[i]->shape;
+        offset += size;
+    }
+    if (in_place && offset == flat_size) {
+        return;
+    }
+
+    if (offset == 0) {
+        flat_params = Tensor();
+        flat_grads = Tensor();
+    } else {
+        Device device = params[0]->device;
+        flat_params = Tensor({(int)offset}, device);
+        flat_grads = Tensor({(int)offset}, device);
+    }
+    offset = 0;
+    for (int i = 0; i < (int)params.size(); i++) {
+        long size = params[i]->data_size[0];
+        // Adding to the zeroed view copies the values in place. Moving the view in swaps it with the old tensor, whose
+        // memory is freed once nothing else refers to it.
+        Tensor param = flat_params.slice(offset, offset + size).view(params[i]->shape);
+        param += *params[i];
+        *params[i] = std::move(param);
+        *grads[i] = flat_grads.slice(offset, offset + size).view(params[i]->shape);
+        offset += size;
+    }
+    for (Layers::Layer* l : layers) {
+        if (l->name == "Dense") {
+            ((Layers::Dense*)l)->set_optimizer(nullptr);
+        }
+    }
+    clear_replicas();
+    // The state of the optimizer belongs to the old layout
+    if (optimizer != nullptr) {
+        Optimizers::Optimizer* fresh = optimizer->clone();
+        delete optimizer;
+        optimizer = fresh;
+    }
+}
+
+/**
+ * @brief Scales a flat tensor of gradients down so that its norm is at most max_norm, returning the norm before
+ */
+static float clip_norm(Tensor& grads, float max_norm) {
+    float norm = std::sqrt(LinAlg::dot_product(grads, grads));
+    if (norm > max_norm) {
+        grads *= max_norm / norm;
+    }
+    return norm;
+}
+
+float MLP::clip_grad_norm(float max_norm) {
+    if (max_norm <= 0) {
+        throw std::invalid_argument("The maximum norm of the gradients must be positive");
+    }
+    if (flat_grads.data == nullptr) {
+        return 0;
+    }
+    return clip_norm(flat_grads, max_norm);
+}
+
+void MLP::step() {
+    if (optimizer == nullptr) {
+        throw std::runtime_error("No optimizer has been set for the model");
+    }
+    if (flat_params.data == nullptr) {
+        return;
+    }
+    if (max_grad_norm > 0) {
+        clip_grad_norm(max_grad_norm);
+    }
+    optimizer->apply_grad(flat_params, flat_grads);
+}
+
+void MLP::zero_grad() {
+    flatten_parameters();
+    if (flat_grads.data != nullptr) {
+        std::fill(flat_grads.data, flat_grads.data + flat_grads.data_size[0], 0.0f);
+    }
+}
+
+void MLP::backward(const Tensor& x_train, const Tensor& y_train, float scale) {
+    flatten_parameters();
+    int rows = x_train.shape[0], workers = std::min(num_workers, rows);
+    if (workers <= 1) {
+        accumulate_gradients(layers, loss_fn, x_train, y_train, scale);
+        return;
+    }
+    make_replicas();
+
+    // Worker 0 runs on the calling thread, with the layers of the model and any step arena of that thread
+    std::vector<std::exception_ptr> errors(workers);
+#pragma omp parallel for num_threads(workers) schedule(static, 1)
+    for (int w = 0; w < workers; w++) {
+        try {
+            int begin = (long)rows * w / workers, end = (long)rows * (w + 1) / workers;
+            if (w > 0 && replica_grads[w - 1].data != nullptr) {
+                std::fill(replica_grads[w - 1].data, replica_grads[w - 1].data + replica_grads[w - 1].data_size[0],
+                          0.0f);
+            }
+            accumulate_gradients(w == 0 ? layers : replicas[w - 1], loss_fn, x_train.slice(begin, end),
+                                 y_train.slice(begin, end), scale * (end - begin) / rows);
+        } catch (...) {
+            errors[w] = std::current_exception();
+        }
+    }
+    for (const std::exception_ptr& error : errors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+    // Each range of elements is summed by one thread, adding the replicas in a fixed order, so no locks are needed
+    // and the result does not depend on the number of threads
+    if (flat_grads.data == nullptr) {
+        return;
+    }
+    float* total = flat_grads.data;
+    Parallel::parallel_for(
+        flat_grads.data_size[0],
+        [&](long begin, long end) {
+            for (int r = 0; r < workers - 1; r++) {
+                const float* grads = replica_grads[r].data;
+#pragma omp simd
+                for (long i = begin; i < end; i++) {
+                    total[i] += grads[i];
+                }
+            }
+        },
+        workers - 1);
+}
+
+void MLP::grad_descent(const Tensor& x_train, const Tensor& y_train) {
+    zero_grad();
+    backward(x_train, y_train);
+    step();
+}
+
 void MLP::backwards_pass(const Tensor& input, const Tensor& grads) {
+    zero_grad();
     int num_layers = layers.size();
 
     std::vector<Tensor> run_res(num_layers + 1);
-    run_res[0] = input;
+    run_res[0] = input.contiguous();
     for (int i = 0; i < num_layers; i++) {
-        run_res[i + 1] = layers[i]->apply(run_res[i]);
+        run_res[i + 1] = layers[i]->forward(run_res[i]);
     }
 
     Tensor out_grad = grads;
     for (int i = num_layers - 1; i >= 0; i--) {
         out_grad = layers[i]->backward(run_res[i], out_grad);
     }
+    step();
+}
+
+double MLP::check_gradients(const Tensor& input, double epsilon) {
+    if (!(epsilon > 0)) {
+        throw std::invalid_argument("The step of the finite differences must be positive");
+    }
+    if (input.dim() != 2 || input.shape[0] == 0) {
+        throw std::invalid_argument("The input must be a non-empty batch of vectors");
+    }
+    zero_grad();
+    int num_layers = layers.size(), rows = input.shape[0];
+
+    std::vector<Tensor> run_res(num_layers + 1);
+    run_res[0] = input.contiguous();
+    for (int i = 0; i < num_layers; i++) {
+        run_res[i + 1] = layers[i]->forward(run_res[i]);
+    }
+    std::mt19937 gen(0);
+    std::uniform_real_distribution<float> dist(-1, 1);
+    Tensor cotangent(run_res[num_layers].shape, uninitialized);
+    for (long i = 0; i < cotangent.data_size[0]; i++) {
+        cotangent.data[i] = dist(gen);
+    }
+    Tensor out_grad = cotangent;
+    for (int i = num_layers - 1; i >= 0; i--) {
+        out_grad = layers[i]->backward(run_res[i], out_grad);
+    }
+
+    std::vector<std::vector<Tensor>> params(num_layers);
+    for (int i = 0; i < num_layers; i++) {
+        for (Tensor* param : layers[i]->parameters()) {
+            params[i].push_back(param->astype(DTYPE_FLOAT64));
+        }
+    }
+    Tensor input_double = input.astype(DTYPE_FLOAT64);
+    auto objective = [&]() {
+        Tensor output = input_double;
+        for (int i = 0; i < num_layers; i++) {
+            output = layers[i]->apply_double(output, params[i]);
+        }
+        if (output.shape != cotangent.shape) {
+            throw std::runtime_error("The double precision forward pass has the wrong shape");
+        }
+        output = output.contiguous();
+        const double* values = output.data_as<double>();
+        double total = 0;
+        for (long i = 0; i < output.data_size[0]; i++) {
+            total += cotangent.data[i] * values[i];
+        }
+        return total / rows;
+    };
+
+    double worst = 0;
+    for (int i = 0; i < num_layers; i++) {
+        std::vector<Tensor*> grads = layers[i]->gradients();
+        for (size_t j = 0; j < params[i].size(); j++) {
+            Tensor grad = grads[j]->contiguous();
+            for (long p = 0; p < params[i][j].data_size[0]; p++) {
+                double& value = params[i][j].data_as<double>()[p];
+                double original = value;
+                value = original + epsilon;
+                double above = objective();
+                value = original - epsilon;
+                double below = objective();
+                value = original;
+                double numeric = (above - below) / (2 * epsilon), analytic = grad.data[p];
+                double scale = std::max({1.0, std::abs(numeric), std::abs(analytic)});
+                worst = std::max(worst, std::abs(analytic - numeric) / scale);
+            }
+        }
+    }
+    return worst;
 }
 
 Tensor MLP::run(const Tensor& input) const {
-    Tensor result = input;
+    Tensor result = input.contiguous();
     for (Layers::Layer* l : layers) {
         result = l->apply(result);
     }
     return result;
 }
 
+void MLP::quantize(const Tensor& calibration) {
+    Tensor result = calibration.contiguous();
+    for (Layers::Layer*& l : layers) {
+        Tensor next = l->apply(result);
+        Layers::Dense* dense = dynamic_cast<Layers::Dense*>(l);
+        if (dense != nullptr) {
+            const float* x = result.data;
+            float max = Parallel::parallel_reduce(
+                result.data_size[0], 0.0f,
+                [&](long begin, long end) {
+                    float res = 0;
+                    for (long i = begin; i < end; i++) {
+                        res = std::max(res, std::abs(x[i]));
+                    }
+                    return res;
+                },
+                [](float a, float b) { return std::max(a, b); });
+            // An input that is always zero quantizes to zeros with any scale
+            Layers::Layer* quantized = new Layers::QuantizedDense(*dense, max > 0 ? max / 127 : 1);
+            delete l;
+            l = quantized;
+        }
+        result = std::move(next);
+    }
+    // The replicas of the workers are copies of the layers that were replaced
+    clear_replicas();
+}
+
 #define time_elapsed                                                                                                   \
     std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now() - start_time).count() /     \
         1000.0
 
+void MLP::hogwild_epoch(const Tensor& x_train, const Tensor& y_train, const std::vector<int>& batch_starts,
+                        int batch_size, int accumulation_steps, std::chrono::system_clock::time_point start_time) {
+    if (optimizer == nullptr) {
+        throw std::runtime_error("No optimizer has been set for the model");
+    }
+    flatten_parameters();
+    make_replicas();
+    int num_inputs = x_train.shape[0], num_batches = batch_starts.size();
+    int workers = std::min(num_workers, num_batches);
+    unsigned seed = std::random_device()();
+    Tensor x_data = x_train.contiguous();
+    Tensor y_data = y_train.contiguous();
+
+    // The number of updates each worker has applied. Workers that are done, or that did not get a thread, do not hold
+    // the others back.
+    std::unique_ptr<std::atomic<long>[]> clocks(new std::atomic<long>[workers]);
+    for (int w = 0; w < workers; w++) {
+        clocks[w] = LONG_MAX;
+    }
+    std::atomic<int> batches_done{0};
+    std::vector<std::exception_ptr> errors(workers);
+#pragma omp parallel num_threads(workers)
+    {
+        int w = omp_get_thread_num(), team = omp_get_num_threads();
+        clocks[w] = 0;
+#pragma omp barrier
+        try {
+            // Worker w trains on the rows of every team-th batch. Its generator draws a new permutation of those rows
+            // every epoch, which is cut into batches that are gathered into the buffers of the worker.
+            std::vector<int> rows;
+            for (int k = w; k < num_batches; k += team) {
+                for (int j = batch_starts[k]; j < std::min(batch_starts[k] + batch_size, num_inputs); j++) {
+                    rows.push_back(j);
+                }
+            }
+            std::seed_seq seq{seed, (unsigned)w};
+            std::mt19937 gen(seq);
+            std::shuffle(rows.begin(), rows.end(), gen);
+            int worker_rows = rows.size(), worker_batches = (worker_rows + batch_size - 1) / batch_size;
+            Tensor x_buffer = batch_buffer(x_data, batch_size);
+            Tensor y_buffer = batch_buffer(y_data, batch_size);
+
+            // Worker 0 runs on the calling thread, with the layers and optimizer of the model
+            const std::vector<Layers::Layer*>& worker_layers = w == 0 ? layers : replicas[w - 1];
+            Tensor& grads = w == 0 ? flat_grads : replica_grads[w - 1];
+            Optimizers::Optimizer* worker_optimizer = w == 0 ? optimizer : replica_optimizers[w - 1];
+            std::unique_ptr<Memory::StepArena> arena;
+            for (int b = 0; b < worker_batches; b += accumulation_steps) {
+                while (max_staleness >= 0) {
+                    long slowest = LONG_MAX;
+                    for (int other = 0; other < team; other++) {
+                        slowest = std::min(slowest, clocks[other].load());
+                    }
+                    if (clocks[w] - slowest <= max_staleness) {
+                        break;
+                    }
+                    std::this_thread::yield();
+                }
+
+                int group_end = std::min(b + accumulation_steps, worker_batches);
+                int group_rows = std::min(group_end * batch_size, worker_rows) - b * batch_size;
+                if (grads.data != nullptr) {
+                    std::fill(grads.data, grads.data + grads.data_size[0], 0.0f);
+                }
+                for (int k = b; k < group_end; k++) {
+                    if (arena != nullptr) {
+                        arena->reset();
+                    }
+                    int j = k * batch_size, count = std::min(batch_size, worker_rows - j);
+                    gather_rows(x_data, rows.data() + j, count, x_buffer);
+                    gather_rows(y_data, rows.data() + j, count, y_buffer);
+                    accumulate_gradients(worker_layers, loss_fn, x_buffer.slice(0, count), y_buffer.slice(0, count),
+                                         (float)count / group_rows);
+                    int done = ++batches_done;
+                    if (w == 0) {
+                        progress_bar(std::min(done * batch_size, num_inputs), num_inputs, 69, time_elapsed);
+                    }
+                }
+                // The update races with the other workers, which is what makes it lock free
+                if (grads.data != nullptr) {
+                    if (max_grad_norm > 0) {
+                        clip_norm(grads, max_grad_norm);
+                    }
+                    worker_optimizer->apply_grad(flat_params, grads);
+                }
+                clocks[w]++;
+                if (w == 0 && arena == nullptr) {
+                    arena = std::make_unique<Memory::StepArena>();
+                }
+            }
+        } catch (...) {
+            errors[w] = std::current_exception();
+        }
+        clocks[w] = LONG_MAX;
+    }
+    for (const std::exception_ptr& error : errors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+}
+
+void MLP::loader_epoch(Data::BatchLoader& loader, int num_inputs, int batch_size, int accumulation_steps,
+                       std::chrono::system_clock::time_point start_time) {
+    int num_batches = loader.num_batches();
+    Tensor x_batch, y_batch;
+    // The temporaries of each batch are carved out of a step arena that is reset at every batch boundary. The first
+    // step runs without it, so that state created on that step (such as optimizer moments) is not placed in it.
+    std::unique_ptr<Memory::StepArena> arena;
+    for (int b = 0; b < num_batches; b += accumulation_steps) {
+        // The gradients of a group of batches are accumulated, each weighted by its share of the rows, so that the
+        // step follows the gradient of the mean loss over the group
+        int group_end = std::min(b + accumulation_steps, num_batches), group_rows = 0;
+        for (int k = b; k < group_end; k++) {
+            group_rows += std::min(batch_size, num_inputs - k * batch_size);
+        }
+        zero_grad();
+        for (int k = b; k < group_end; k++) {
+            if (arena != nullptr) {
+                arena->reset();
+            }
+            progress_bar(k * batch_size, num_inputs, 69, time_elapsed);
+            loader.next(x_batch, y_batch);
+            backward(x_batch, y_batch, (float)x_batch.shape[0] / group_rows);
+        }
+        step();
+        if (arena == nullptr) {
+            arena = std::make_unique<Memory::StepArena>();
+        }
+    }
+}
+
 void MLP::train(const Tensor& x_train, const Tensor& y_train, const Tensor& x_test, const Tensor& y_test, int epochs,
-                int batch_size, const std::string& save_file, const std::vector<Metric>& metrics) {
+                int batch_size, const std::string& save_file, const std::vector<Metric>& metrics,
+                int accumulation_steps) {
     if (x_train.shape[0] != y_train.shape[0]) {
         throw std::invalid_argument("x_train and y_train must have the same number of samples");
     }
     if (x_test.shape[0] != y_test.shape[0]) {
         throw std::invalid_argument("x_test and y_test must have the same number of samples");
     }
+    if (accumulation_steps < 1) {
+        throw std::invalid_argument("The number of accumulation steps must be at least 1");
+    }
+    if (batch_size < 1) {
+        throw std::invalid_argument("The batch size must be at least 1");
+    }
+    if (y_train.dtype != y_test.dtype) {
+        throw std::invalid_argument("y_train and y_test must have the same dtype");
+    }
+    // Fail before the first epoch rather than after it
+    if (y_train.dtype == DTYPE_INT32) {
+        if (!loss_fn.label_derivative) {
+            throw std::invalid_argument("The loss function " + loss_fn.name + " does not take integer labels");
+        }
+        for (const Metric& m : metrics) {
+            if (!m.compute_labels) {
+                throw std::invalid_argument("The metric " + m.name + " does not take integer labels");
+            }
+        }
+    }
     int num_inputs = x_train.shape[0];
-    std::vector<int> indices(num_inputs);
-    for (int i = 0; i < num_inputs; i++) {
-        indices[i] = i;
+    bool asynchronous = hogwild && num_workers > 1;
+    // Hogwild workers shuffle their share of the rows and gather each batch themselves. Otherwise the rows are
+    // shuffled and gathered into batches on a background thread, while the previous batch is trained on.
+    std::vector<int> batch_starts;
+    for (int j = 0; j < num_inputs; j += batch_size) {
+        batch_starts.push_back(j);
+    }
+    std::unique_ptr<Data::BatchLoader> loader;
+    if (!asynchronous && num_inputs > 0) {
+        loader = std::make_unique<Data::BatchLoader>(x_train, y_train, batch_size);
     }
     for (int i = 0; i < epochs; i++) {
         std::cout << "Epoch " << i + 1 << ":\n";
         std::chrono::time_point<std::chrono::system_clock> start_time = std::chrono::system_clock::now();
-        std::random_device rd;
-        std::mt19937 g(rd());
-        std::shuffle(indices.begin(), indices.end(), g);
-        for (int j = 0; j < num_inputs; j += batch_size) {
-            progress_bar(j, num_inputs, 69, time_elapsed);
-            int batch_end = std::min(j + batch_size, num_inputs);
-            std::vector<int> batch_shape_x = x_train.shape, batch_shape_y = y_train.shape;
-            batch_shape_x[0] = batch_end - j;
-            batch_shape_y[0] = batch_end - j;
-            Tensor x_batch(batch_shape_x, x_train.device);
-            Tensor y_batch(batch_shape_y, y_train.device);
-            for (int k = j; k < batch_end; k++) {
-                memcpy(x_batch.data + (k - j) * x_train.data_size[1], x_train.data + indices[k] * x_train.data_size[1],
-                       x_train.data_size[1] * sizeof(float));
-                memcpy(y_batch.data + (k - j) * y_train.data_size[1], y_train.data + indices[k] * y_train.data_size[1],
-                       y_train.data_size[1] * sizeof(float));
-            }
-            grad_descent(x_batch, y_batch);
+        if (asynchronous) {
+            hogwild_epoch(x_train, y_train, batch_starts, batch_size, accumulation_steps, start_time);
+        } else if (loader != nullptr) {
+            loader_epoch(*loader, num_inputs, batch_size, accumulation_steps, start_time);
         }
         progress_bar(num_inputs, num_inputs, 69, time_elapsed);
         if (save_file.size() > 0) {
@@ -123,34 +663,62 @@ void MLP::train(const Tensor& x_train, const Tensor& y_train, const Tensor& x_te
         Tensor y_test_pred = run(x_test);
         for (const Metric& m : metrics) {
             std::cout << "Metric " << m.name << ": ";
-            std::cout << "Train: " << m.compute(y_train, y_train_pred) << ", ";
-            std::cout << "Validation: " << m.compute(y_test, y_test_pred) << std::endl;
+            std::cout << "Train: " << compute_metric(m, y_train, y_train_pred) << ", ";
+            std::cout << "Validation: " << compute_metric(m, y_test, y_test_pred) << std::endl;
         }
     }
 }
-#undef time_elapsed
 
-void MLP::save(std::string filename) const {
-    std::ofstream file(filename);
-    file << layers.size() << std::endl;
-    for (Layers::Layer* l : layers) {
-        l->save(file);
+void MLP::train(const Data::MappedDataset& x_train, const Data::MappedDataset& y_train, const Tensor& x_test,
+                const Tensor& y_test, int epochs, int batch_size, const std::string& save_file,
+                const std::vector<Metric>& metrics, int accumulation_steps, int block_rows) {
+    if (x_test.shape[0] != y_test.shape[0]) {
+        throw std::invalid_argument("x_test and y_test must have the same number of samples");
     }
-}
-
-void MLP::load(std::string filename) {
-    std::ifstream file(filename);
-    if (!file.is_open()) {
-        std::cout << "File " << filename << " could not be opened" << std::endl;
-        throw std::invalid_argument("File " + filename + " could not be opened");
+    if (accumulation_steps < 1) {
+        throw std::invalid_argument("The number of accumulation steps must be at least 1");
     }
-    int num_layers;
-    file >> num_layers;
-    layers.clear();
-    for (int i = 0; i < num_layers; i++) {
-        layers.push_back(Layers::load(file));
+    if (block_rows < 0) {
+        throw std::invalid_argument("The number of rows in a block must not be negative");
+    }
+    if (block_rows == 0) {
+        // Blocks of about 64 MB, holding at least a batch
+        long row_bytes = x_train.row_size() * sizeof(float);
+        block_rows = std::max<long>(batch_size, std::min<long>(INT_MAX, (64L << 20) / row_bytes));
+    }
+    // The loader checks the rest of the arguments
+    Data::BatchLoader loader(x_train, y_train, batch_size, true, 2, block_rows);
+    int num_inputs = x_train.num_rows();
+    for (int i = 0; i < epochs; i++) {
+        std::cout << "Epoch " << i + 1 << ":\n";
+        std::chrono::time_point<std::chrono::system_clock> start_time = std::chrono::system_clock::now();
+        loader_epoch(loader, num_inputs, batch_size, accumulation_steps, start_time);
+        progress_bar(num_inputs, num_inputs, 69, time_elapsed);
+        if (save_file.size() > 0) {
+            save(save_file);
+        }
+        std::cout << std::endl;
+        if (metrics.empty()) {
+            continue;
+        }
+        // Only a batch of the training data is in memory at a time
+        std::vector<double> train_values(metrics.size(), 0);
+        for (int start = 0; start < num_inputs; start += batch_size) {
+            int end = std::min(num_inputs, start + batch_size);
+            Tensor y_batch = y_train.rows(start, end), y_pred = run(x_train.rows(start, end));
+            for (int m = 0; m < (int)metrics.size(); m++) {
+                train_values[m] += (double)metrics[m].compute(y_batch, y_pred) * (end - start) / num_inputs;
+            }
+        }
+        Tensor y_test_pred = run(x_test);
+        for (int m = 0; m < (int)metrics.size(); m++) {
+            std::cout << "Metric " << metrics[m].name << ": ";
+            std::cout << "Train: " << train_values[m] << ", ";
+            std::cout << "Validation: " << metrics[m].compute(y_test, y_test_pred) << std::endl;
+        }
     }
 }
+#undef time_elapsed
 
 void MLP::summary() {
     std::cout << "Layers:\n";
@@ -0,0 +1,312 @@
+// Copyright (c) 2023 David Lee
+// This code is licensed under MIT license (see LICENSE for details)
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../include/FJML/allocator.h"
+#include "../include/FJML/mlp.h"
+
+namespace {
+
+const char MAGIC[8] = {'F', 'J', 'M', 'L', 'B', 'I', 'N', '\0'};
+const uint32_t FORMAT_VERSION = 1;
+// Read back in the opposite byte order, this is 0x04030201
+const uint32_t BYTE_ORDER_MARK = 0x01020304;
+const int MAX_DIM = 8;
+
+struct FileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t num_layers;
+    uint32_t num_tensors;
+    uint64_t layer_table;
+    uint64_t tensor_table;
+    uint64_t file_size;
+    char reserved[16];
+};
+
+struct LayerEntry {
+    char type[24];
+    char config[24];
+    uint32_t first_tensor;
+    uint32_t num_tensors;
+    char reserved[8];
+};
+
+struct TensorEntry {
+    uint64_t offset;
+    uint32_t dim;
+    int32_t shape[MAX_DIM];
+    char reserved[20];
+};
+
+static_assert(sizeof(FileHeader) == 64 && sizeof(LayerEntry) == 64 && sizeof(TensorEntry) == 64,
+              "The entries of a model file are 64 bytes each");
+
+uint64_t align(uint64_t offset) {
+    return (offset + FJML::Memory::ALIGNMENT - 1) / FJML::Memory::ALIGNMENT * FJML::Memory::ALIGNMENT;
+}
+
+void copy_name(char* dest, size_t size, const std::string& name) {
+    if (name.size() >= size) {
+        throw std::runtime_error("The name " + name + " is too long for a model file");
+    }
+    std::memset(dest, 0, size);
+    std::memcpy(dest, name.data(), name.size());
+}
+
+std::string read_name(const char* name, size_t size) {
+    if (std::memchr(name, '\0', size) == nullptr) {
+        throw std::runtime_error("Corrupted model file: a name is not terminated");
+    }
+    return std::string(name);
+}
+
+/**
+ * @brief Creates the layers stored in a binary model file, whose contents are in memory
+ *
+ * The parameters of the layers are views into the contents, which they keep alive.
+ */
+std::vector<FJML::Layers::Layer*> parse(const std::shared_ptr<char>& contents, uint64_t size) {
+    const char* base = contents.get();
+    if (size < sizeof(FileHeader)) {
+        throw std::runtime_error("Corrupted model file: the file is too short");
+    }
+    FileHeader header;
+    std::memcpy(&header, base, sizeof(header));
+    if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0) {
+        throw std::runtime_error("Not a binary model file");
+    }
+    if (header.byte_order != BYTE_ORDER_MARK) {
+        throw std::runtime_error("The model file was written on a machine with a different byte order");
+    }
+    if (header.version > FORMAT_VERSION) {
+        throw std::runtime_error("The model file was written by a newer version of the library");
+    }
+    if (header.file_size != size || header.layer_table > size ||
+        header.num_layers > (size - header.layer_table) / sizeof(LayerEntry) || header.tensor_table > size ||
+        header.num_tensors > (size - header.tensor_table) / sizeof(TensorEntry)) {
+        throw std::runtime_error("Corrupted model file: the tables do not fit in the file");
+    }
+
+    std::vector<TensorEntry> tensors(header.num_tensors);
+    std::memcpy(tensors.data(), base + header.tensor_table, header.num_tensors * sizeof(TensorEntry));
+    std::vector<FJML::Layers::Layer*> layers;
+    try {
+        for (uint32_t i = 0; i < header.num_layers; i++) {
+            LayerEntry entry;
+            std::memcpy(&entry, base + header.layer_table + i * sizeof(LayerEntry), sizeof(entry));
+            if (entry.first_tensor > header.num_tensors || entry.num_tensors > header.num_tensors - entry.first_tensor) {
+                throw std::runtime_error("Corrupted model file: a layer refers to missing parameters");
+            }
+            std::vector<FJML::Tensor> params;
+            for (uint32_t t = entry.first_tensor; t < entry.first_tensor + entry.num_tensors; t++) {
+                const TensorEntry& tensor = tensors[t];
+                if (tensor.dim < 1 || tensor.dim > MAX_DIM) {
+                    throw std::runtime_error("Corrupted model file: a parameter has an invalid shape");
+                }
+                std::vector<int> shape(tensor.shape, tensor.shape + tensor.dim);
+                uint64_t elements = 1;
+                for (int n : shape) {
+                    if (n <= 0 || elements > std::numeric_limits<int>::max() / (uint64_t)n) {
+                        throw std::runtime_error("Corrupted model file: a parameter has an invalid shape");
+                    }
+                    elements *= n;
+                }
+                if (tensor.offset % FJML::Memory::ALIGNMENT != 0 || tensor.offset > size ||
+                    elements > (size - tensor.offset) / sizeof(float)) {
+                    throw std::runtime_error("Corrupted model file: a parameter does not fit in the file");
+                }
+                params.emplace_back(std::shared_ptr<float>(contents, (float*)(contents.get() + tensor.offset)), shape);
+            }
+            layers.push_back(FJML::Layers::load(read_name(entry.type, sizeof(entry.type)),
+                                                read_name(entry.config, sizeof(entry.config)), params));
+        }
+    } catch (...) {
+        for (FJML::Layers::Layer* l : layers) {
+            delete l;
+        }
+        throw;
+    }
+    return layers;
+}
+
+} // namespace
+
+namespace FJML {
+
+namespace MLP {
+
+void MLP::save(std::string filename, bool binary) const {
+    if (binary) {
+        save_binary(filename);
+        return;
+    }
+    std::ofstream file(filename);
+    // Enough digits for every float to be read back exactly
+    file << std::setprecision(std::numeric_limits<float>::max_digits10);
+    file << layers.size() << std::endl;
+    for (Layers::Layer* l : layers) {
+        l->save(file);
+    }
+}
+
+void MLP::load(std::string filename) {
+    std::ifstream file(filename, std::ios::binary);
+    if (!file.is_open()) {
+        std::cout << "File " << filename << " could not be opened" << std::endl;
+        throw std::invalid_argument("File " + filename + " could not be opened");
+    }
+    char magic[sizeof(MAGIC)] = {};
+    file.read(magic, sizeof(magic));
+    if (file.gcount() == sizeof(magic) && std::memcmp(magic, MAGIC, sizeof(MAGIC)) == 0) {
+        file.close();
+        load_binary(filename);
+        return;
+    }
+
+    file.clear();
+    file.seekg(0);
+    int num_layers;
+    file >> num_layers;
+    std::vector<Layers::Layer*> loaded;
+    try {
+        for (int i = 0; i < num_layers; i++) {
+            loaded.push_back(Layers::load(file));
+        }
+    } catch (...) {
+        for (Layers::Layer* l : loaded) {
+            delete l;
+        }
+        throw;
+    }
+    for (Layers::Layer* l : layers) {
+        delete l;
+    }
+    layers = loaded;
+}
+
+void MLP::save_binary(const std::string& filename) const {
+    std::vector<LayerEntry> layer_table;
+    std::vector<TensorEntry> tensor_table;
+    std::vector<Tensor> blobs;
+    uint64_t tensor_table_start = sizeof(FileHeader) + layers.size() * sizeof(LayerEntry);
+    uint64_t offset = 0;
+    for (Layers::Layer* l : layers) {
+        LayerEntry entry = {};
+        copy_name(entry.type, sizeof(entry.type), l->name);
+        copy_name(entry.config, sizeof(entry.config), l->config());
+        entry.first_tensor = tensor_table.size();
+        for (Tensor& param : l->saved_parameters()) {
+            if (param.dim() > MAX_DIM) {
+                throw std::runtime_error("A parameter has too many dimensions for a model file");
+            }
+            TensorEntry tensor = {};
+            tensor.dim = param.dim();
+            std::copy(param.shape.begin(), param.shape.end(), tensor.shape);
+            tensor.offset = offset;
+            offset = align(offset + param.data_size[0] * sizeof(float));
+            tensor_table.push_back(tensor);
+            blobs.push_back(std::move(param));
+        }
+        entry.num_tensors = tensor_table.size() - entry.first_tensor;
+        layer_table.push_back(entry);
+    }
+    // The offsets so far are relative to the start of the data, which follows the tables
+    uint64_t data_start = align(tensor_table_start + tensor_table.size() * sizeof(TensorEntry));
+    for (TensorEntry& tensor : tensor_table) {
+        tensor.offset += data_start;
+    }
+
+    FileHeader header = {};
+    std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = FORMAT_VERSION;
+    header.byte_order = BYTE_ORDER_MARK;
+    header.num_layers = layer_table.size();
+    header.num_tensors = tensor_table.size();
+    header.layer_table = sizeof(FileHeader);
+    header.tensor_table = tensor_table_start;
+    header.file_size = data_start + offset;
+
+    std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) {
+        throw std::invalid_argument("File " + filename + " could not be opened");
+    }
+    file.write((const char*)&header, sizeof(header));
+    file.write((const char*)layer_table.data(), layer_table.size() * sizeof(LayerEntry));
+    file.write((const char*)tensor_table.data(), tensor_table.size() * sizeof(TensorEntry));
+    const char padding[Memory::ALIGNMENT] = {};
+    uint64_t position = tensor_table_start + tensor_table.size() * sizeof(TensorEntry);
+    for (int i = 0; i < (int)blobs.size(); i++) {
+        file.write(padding, tensor_table[i].offset - position);
+        file.write((const char*)blobs[i].data, blobs[i].data_size[0] * sizeof(float));
+        position = tensor_table[i].offset + blobs[i].data_size[0] * sizeof(float);
+    }
+    file.write(padding, header.file_size - position);
+    if (!file) {
+        throw std::runtime_error("Could not write to " + filename);
+    }
+}
+
+void MLP::load_binary(const std::string& filename, bool map) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::invalid_argument("File " + filename + " could not be opened");
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        throw std::runtime_error("Could not read the size of " + filename);
+    }
+    uint64_t size = info.st_size;
+    std::shared_ptr<char> contents;
+    if (size == 0) {
+        close(fd);
+        throw std::runtime_error("Corrupted model file: the file is empty");
+    }
+    if (map) {
+        void* address = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (address == MAP_FAILED) {
+            throw std::runtime_error("Could not map " + filename + " into memory");
+        }
+        contents = std::shared_ptr<char>((char*)address, [size](char* p) { munmap(p, size); });
+    } else {
+        // Allocated like a tensor, so the parameters keep their alignment
+        contents = std::shared_ptr<char>((char*)Memory::allocate(size), Memory::deallocate);
+        uint64_t done = 0;
+        while (done < size) {
+            ssize_t n = read(fd, contents.get() + done, size - done);
+            if (n <= 0) {
+                close(fd);
+                throw std::runtime_error("Could not read " + filename);
+            }
+            done += n;
+        }
+        close(fd);
+    }
+
+    std::vector<Layers::Layer*> loaded = parse(contents, size);
+    for (Layers::Layer* l : layers) {
+        delete l;
+    }
+    layers = loaded;
+}
+
+} // namespace MLP
+
+} // namespace FJML
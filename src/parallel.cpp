@@ -0,0 +1,28 @@
+// Copyright (c) 2023 David Lee
+// This code is licensed under MIT license (see LICENSE for details)
+
+#include <atomic>
+#include <stdexcept>
+
+#include <omp.h>
+
+#include "../include/FJML/parallel.h"
+
+namespace {
+
+std::atomic<int> num_threads{omp_get_max_threads()};
+
+} // namespace
+
+namespace FJML {
+
+void set_num_threads(int n) {
+    if (n < 1) {
+        throw std::invalid_argument("The number of threads must be at least 1");
+    }
+    num_threads = n;
+}
+
+int get_num_threads() { return num_threads; }
+
+} // namespace FJML
@@ -0,0 +1,202 @@
+// Copyright (c) 2023 David Lee
+// This code is licensed under MIT license (see LICENSE for details)
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+#include <immintrin.h>
+
+#include "../include/FJML/linalg.h"
+#include "../include/FJML/parallel.h"
+
+/*
+ * An int8 GEMM for quantized inference.
+ *
+ * Both operands are stored with the shared dimension contiguous: A is m x k and B is n x k, so each element of C is a
+ * dot product of two rows. A tile of C of up to MR rows and NR columns is computed at a time, reading 32 bytes of each
+ * of its rows per step.
+ *
+ * The products are formed with vpmaddubsw, which multiplies unsigned bytes by signed bytes and adds adjacent pairs into
+ * saturating 16 bit sums. Signed A is handled by taking its absolute value and moving its sign onto B, which gives the
+ * same products. As the values are in [-127, 127], a pair of products is at most 2 * 127 * 127 = 32258, so the 16 bit
+ * sums never saturate. vpmaddwd then widens the pairs into 32 bit sums, which are accumulated exactly. With AVX-VNNI,
+ * vpdpbusd does all three steps in one instruction.
+ *
+ * The integer sums are scaled back to floats, and the bias and activation are applied, while the tile is in registers
+ * and its row of C is still in cache.
+ */
+
+namespace {
+
+constexpr int MR = 2;
+constexpr int NR = 4;
+// The number of columns of C each task computes, so the activation is applied to a contiguous run of a row
+constexpr int NC = 64;
+
+#ifdef __AVX2__
+int horizontal_sum(__m256i x) {
+    __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(x), _mm256_extracti128_si256(x, 1));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4e));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xb1));
+    return _mm_cvtsi128_si32(sum);
+}
+#endif
+
+/**
+ * Computes the integer dot products of rows [0, R) of a with rows [0, C) of b into sums.
+ */
+template <int R, int C>
+void dot_tile(int k, const int8_t* a, int lda, const int8_t* b, int ldb, int32_t sums[MR][NR]) {
+    int p = 0;
+#ifdef __AVX2__
+#ifndef __AVXVNNI__
+    const __m256i ones = _mm256_set1_epi16(1);
+#endif
+    __m256i acc[R][C];
+    for (int r = 0; r < R; r++) {
+        for (int c = 0; c < C; c++) {
+            acc[r][c] = _mm256_setzero_si256();
+        }
+    }
+    for (; p + 32 <= k; p += 32) {
+        __m256i a_row[R], a_abs[R];
+        for (int r = 0; r < R; r++) {
+            a_row[r] = _mm256_loadu_si256((const __m256i*)(a + r * lda + p));
+            a_abs[r] = _mm256_abs_epi8(a_row[r]);
+        }
+        for (int c = 0; c < C; c++) {
+            __m256i b_row = _mm256_loadu_si256((const __m256i*)(b + c * ldb + p));
+            for (int r = 0; r < R; r++) {
+#ifdef __AVXVNNI__
+                acc[r][c] = _mm256_dpbusd_avx_epi32(acc[r][c], a_abs[r], _mm256_sign_epi8(b_row, a_row[r]));
+#else
+                __m256i pairs = _mm256_maddubs_epi16(a_abs[r], _mm256_sign_epi8(b_row, a_row[r]));
+                acc[r][c] = _mm256_add_epi32(acc[r][c], _mm256_madd_epi16(pairs, ones));
+#endif
+            }
+        }
+    }
+    for (int r = 0; r < R; r++) {
+        for (int c = 0; c < C; c++) {
+            sums[r][c] = horizontal_sum(acc[r][c]);
+        }
+    }
+#else
+    for (int r = 0; r < R; r++) {
+        for (int c = 0; c < C; c++) {
+            sums[r][c] = 0;
+        }
+    }
+#endif
+    for (; p < k; p++) {
+        for (int r = 0; r < R; r++) {
+            for (int c = 0; c < C; c++) {
+                sums[r][c] += (int32_t)a[r * lda + p] * b[c * ldb + p];
+            }
+        }
+    }
+}
+
+template <int R>
+void dot_tile(int cols, int k, const int8_t* a, int lda, const int8_t* b, int ldb, int32_t sums[MR][NR]) {
+    switch (cols) {
+    case 1:
+        dot_tile<R, 1>(k, a, lda, b, ldb, sums);
+        break;
+    case 2:
+        dot_tile<R, 2>(k, a, lda, b, ldb, sums);
+        break;
+    case 3:
+        dot_tile<R, 3>(k, a, lda, b, ldb, sums);
+        break;
+    default:
+        dot_tile<R, NR>(k, a, lda, b, ldb, sums);
+    }
+}
+
+} // namespace
+
+namespace FJML {
+
+namespace LinAlg {
+
+void quantize(const float* in, int8_t* out, long n, float scale) {
+    if (!(scale > 0)) {
+        throw std::invalid_argument("The scale of a quantized tensor must be positive");
+    }
+    float inverse = 1 / scale;
+    long i = 0;
+#ifdef __AVX2__
+    const __m256 inv = _mm256_set1_ps(inverse), low = _mm256_set1_ps(-127), high = _mm256_set1_ps(127);
+    // packs works within 128 bit lanes, which leaves the 4 byte groups of the 4 vectors interleaved
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    auto round = [&](const float* x) {
+        __m256 scaled = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_loadu_ps(x), inv), low), high);
+        return _mm256_cvtps_epi32(scaled);
+    };
+    for (; i + 32 <= n; i += 32) {
+        __m256i low_half = _mm256_packs_epi32(round(in + i), round(in + i + 8));
+        __m256i high_half = _mm256_packs_epi32(round(in + i + 16), round(in + i + 24));
+        __m256i bytes = _mm256_permutevar8x32_epi32(_mm256_packs_epi16(low_half, high_half), order);
+        _mm256_storeu_si256((__m256i*)(out + i), bytes);
+    }
+#endif
+    for (; i < n; i++) {
+        out[i] = (int8_t)std::nearbyint(std::min(std::max(in[i] * inverse, -127.0f), 127.0f));
+    }
+}
+
+void qgemm(int m, int n, int k, const int8_t* a, int lda, const int8_t* b, int ldb, const float* scales, float* c,
+           int ldc, const GemmEpilogue* epilogue) {
+    if (m < 0 || n < 0 || k < 0 || lda < k || ldb < k || ldc < n) {
+        throw std::invalid_argument("Invalid dimensions for qgemm");
+    }
+    long row_blocks = (m + MR - 1) / MR, col_blocks = (n + NC - 1) / NC;
+    Parallel::parallel_for(
+        row_blocks * col_blocks,
+        [&](long begin, long end) {
+            for (long task = begin; task < end; task++) {
+                int i = task / col_blocks * MR, j_begin = task % col_blocks * NC;
+                int rows = std::min(MR, m - i), j_end = std::min(n, j_begin + NC);
+                for (int j = j_begin; j < j_end; j += NR) {
+                    int cols = std::min(NR, j_end - j);
+                    int32_t sums[MR][NR];
+                    if (rows == MR) {
+                        dot_tile<MR>(cols, k, a + (long)i * lda, lda, b + (long)j * ldb, ldb, sums);
+                    } else {
+                        dot_tile<1>(cols, k, a + (long)i * lda, lda, b + (long)j * ldb, ldb, sums);
+                    }
+                    for (int r = 0; r < rows; r++) {
+                        float* row = c + (long)(i + r) * ldc;
+                        for (int col = 0; col < cols; col++) {
+                            float value = sums[r][col] * scales[j + col];
+                            if (epilogue != nullptr && epilogue->bias != nullptr) {
+                                value += epilogue->bias[j + col];
+                            }
+                            row[j + col] = value;
+                        }
+                    }
+                }
+                if (epilogue == nullptr) {
+                    continue;
+                }
+                for (int r = 0; r < rows; r++) {
+                    float* row = c + (long)(i + r) * ldc + j_begin;
+                    if (epilogue->pre_activation != nullptr) {
+                        std::memcpy(epilogue->pre_activation + (long)(i + r) * ldc + j_begin, row,
+                                    (j_end - j_begin) * sizeof(float));
+                    }
+                    if (epilogue->activation != nullptr) {
+                        epilogue->activation(row, row, j_end - j_begin);
+                    }
+                }
+            }
+        },
+        (long)MR * NC * std::max(k, 1) / 8);
+}
+
+} // namespace LinAlg
+
+} // namespace FJML
@@ -0,0 +1,222 @@
+// Copyright (c) 2023 David Lee
+// This code is licensed under MIT license (see LICENSE for details)
+
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#include "../include/FJML/allocator.h"
+#include "../include/FJML/layers.h"
+#include "../include/FJML/parallel.h"
+
+namespace {
+
+constexpr int ROW_ALIGNMENT = 32;
+
+int round_up(int n) { return (n + ROW_ALIGNMENT - 1) / ROW_ALIGNMENT * ROW_ALIGNMENT; }
+
+std::shared_ptr<int8_t> allocate_bytes(long n) {
+    return std::shared_ptr<int8_t>((int8_t*)FJML::Memory::allocate(n), FJML::Memory::deallocate);
+}
+
+} // namespace
+
+namespace FJML {
+
+namespace Layers {
+
+QuantizedDense::QuantizedDense(const Dense& dense, float input_scale)
+    : Layer{"QuantizedDense"}, input_size{dense.input_size}, output_size{dense.output_size},
+      row_stride{round_up(dense.input_size)}, input_scale{input_scale}, activ{dense.activ} {
+    if (!(input_scale > 0)) {
+        throw std::invalid_argument("The scale of the input must be positive");
+    }
+    std::vector<Tensor> params = dense.saved_parameters();
+    if (params[0].device != DEVICE_CPU) {
+        throw std::invalid_argument("Only layers on the CPU can be quantized");
+    }
+    const float* w = params[0].data;
+    bias = params[1];
+    weight_scales = Tensor({output_size}, uninitialized);
+
+    std::shared_ptr<int8_t> quantized = allocate_bytes((long)output_size * row_stride);
+    Parallel::parallel_for(
+        output_size,
+        [&](long begin, long end) {
+            for (long j = begin; j < end; j++) {
+                float max = 0;
+                for (int p = 0; p < input_size; p++) {
+                    max = std::max(max, std::abs(w[(long)p * output_size + j]));
+                }
+                // A column of zeros quantizes to zeros with any scale
+                float scale = max > 0 ? max / 127 : 1;
+                weight_scales.data[j] = scale;
+                int8_t* row = quantized.get() + j * row_stride;
+                for (int p = 0; p < input_size; p++) {
+                    row[p] = (int8_t)std::nearbyint(w[(long)p * output_size + j] / scale);
+                }
+                std::memset(row + input_size, 0, row_stride - input_size);
+            }
+        },
+        input_size);
+    weight_storage = quantized;
+    weights = quantized.get();
+}
+
+QuantizedDense::QuantizedDense(std::ifstream& file)
+    : Layer{"QuantizedDense"}, activ{Activations::Activation(
+                                   "", [](float x) { return x; }, [](float x) { return 1; })} {
+    std::string activation;
+    file >> activation;
+    bool found = false;
+    for (const Activations::Activation& a : Activations::activations) {
+        if (a.name == activation) {
+            activ = a;
+            found = true;
+            break;
+        }
+    }
+    if (!found) {
+        throw std::runtime_error("Unknown activation function");
+    }
+    file >> input_size >> output_size >> input_scale;
+    if (!file || input_size <= 0 || output_size <= 0 || !(input_scale > 0)) {
+        throw std::runtime_error("Invalid sizes or scale for QuantizedDense layer");
+    }
+    row_stride = round_up(input_size);
+    weight_scales = Tensor({output_size}, uninitialized);
+    bias = Tensor({output_size}, uninitialized);
+    for (int j = 0; j < output_size; j++) {
+        file >> weight_scales.data[j];
+    }
+    for (int j = 0; j < output_size; j++) {
+        file >> bias.data[j];
+    }
+    std::shared_ptr<int8_t> quantized = allocate_bytes((long)output_size * row_stride);
+    std::memset(quantized.get(), 0, (long)output_size * row_stride);
+    for (int j = 0; j < output_size; j++) {
+        for (int p = 0; p < input_size; p++) {
+            int value;
+            file >> value;
+            if (value < -127 || value > 127) {
+                throw std::runtime_error("A quantized weight is out of range");
+            }
+            quantized.get()[(long)j * row_stride + p] = value;
+        }
+    }
+    if (!file) {
+        throw std::runtime_error("Could not read the QuantizedDense layer");
+    }
+    weight_storage = quantized;
+    weights = quantized.get();
+}
+
+QuantizedDense::QuantizedDense(int input_size, std::vector<Tensor>& params, Activations::Activation activ)
+    : Layer{"QuantizedDense"}, input_size{input_size}, row_stride{round_up(input_size)}, activ{activ} {
+    if (params.size() != 4) {
+        throw std::invalid_argument("A QuantizedDense layer must have weights, weight scales, a bias and an input scale");
+    }
+    Tensor& packed = params[0];
+    if (input_size <= 0 || packed.dim() != 2 || packed.shape[1] * 4 != row_stride || params[1].dim() != 1 ||
+        params[1].shape[0] != packed.shape[0] || params[2].shape != params[1].shape ||
+        params[3].shape != std::vector<int>{1}) {
+        throw std::invalid_argument("The parameters of a QuantizedDense layer have the wrong shapes");
+    }
+    if (!packed.is_contiguous() || packed.device != DEVICE_CPU) {
+        throw std::invalid_argument("The weights of a QuantizedDense layer must be contiguous and on the CPU");
+    }
+    output_size = packed.shape[0];
+    input_scale = params[3].data[0];
+    if (!(input_scale > 0)) {
+        throw std::invalid_argument("The scale of the input must be positive");
+    }
+    weight_storage = std::shared_ptr<const int8_t>(packed.storage, (const int8_t*)packed.data);
+    weights = weight_storage.get();
+    weight_scales = std::move(params[1]);
+    bias = std::move(params[2]);
+}
+
+Tensor QuantizedDense::apply(const Tensor& input) const {
+    if (input.dim() != 2 || input.shape[1] != input_size) {
+        throw std::invalid_argument("Invalid input shape for QuantizedDense layer");
+    }
+    if (input.device != DEVICE_CPU) {
+        throw std::invalid_argument("Quantized layers can only be applied on the CPU");
+    }
+    Tensor x = input.contiguous();
+    int m = x.shape[0];
+
+    // Each row is quantized into a row padded with zeros like those of the weights, so that qgemm only sees whole
+    // blocks of 32 bytes
+    std::shared_ptr<int8_t> quantized = allocate_bytes(std::max(1L, (long)m * row_stride));
+    Parallel::parallel_for(
+        m,
+        [&](long begin, long end) {
+            for (long i = begin; i < end; i++) {
+                int8_t* row = quantized.get() + i * row_stride;
+                LinAlg::quantize(x.data + i * input_size, row, input_size, input_scale);
+                std::memset(row + input_size, 0, row_stride - input_size);
+            }
+        },
+        input_size);
+
+    std::vector<float> scales(output_size);
+    for (int j = 0; j < output_size; j++) {
+        scales[j] = weight_scales.data[j] * input_scale;
+    }
+    Tensor contiguous_bias = bias.contiguous();
+    LinAlg::GemmEpilogue epilogue;
+    epilogue.bias = contiguous_bias.data;
+    epilogue.activation = activ.func_kernel;
+    Tensor result({m, output_size}, uninitialized);
+    LinAlg::qgemm(m, output_size, row_stride, quantized.get(), row_stride, weights, row_stride, scales.data(),
+                  result.data, output_size, &epilogue);
+    if (activ.func_kernel == nullptr) {
+        activ.apply(result);
+    }
+    return result;
+}
+
+Tensor QuantizedDense::backward(const Tensor& input_vals, const Tensor& output_grad) {
+    throw std::runtime_error("A QuantizedDense layer cannot be trained");
+}
+
+std::string QuantizedDense::config() const { return activ.name + ":" + std::to_string(input_size); }
+
+std::vector<Tensor> QuantizedDense::saved_parameters() const {
+    // The bytes are only copied to the file, never read as floats
+    std::shared_ptr<float> packed(weight_storage, (float*)const_cast<int8_t*>(weights));
+    Tensor scale({1}, uninitialized);
+    scale.data[0] = input_scale;
+    return {Tensor(packed, {output_size, row_stride / 4}), weight_scales.contiguous(), bias.contiguous(), scale};
+}
+
+void QuantizedDense::save(std::ofstream& file) const {
+    file << "QuantizedDense" << std::endl;
+    file << activ.name << std::endl;
+    file << input_size << " " << output_size << " " << input_scale << std::endl;
+    for (int j = 0; j < output_size; j++) {
+        file << weight_scales.at(j) << " ";
+    }
+    file << std::endl;
+    for (int j = 0; j < output_size; j++) {
+        file << bias.at(j) << " ";
+    }
+    file << std::endl;
+    for (int j = 0; j < output_size; j++) {
+        for (int p = 0; p < input_size; p++) {
+            file << (int)weights[(long)j * row_stride + p] << " ";
+        }
+        file << std::endl;
+    }
+}
+
+void QuantizedDense::summary() const {
+    std::cout << "Quantized dense layer with " << input_size << " inputs and " << output_size << " outputs" << std::endl;
+    std::cout << "Activation function: " << activ.name << std::endl;
+}
+
+} // namespace Layers
+
+} // namespace FJML
@@ -0,0 +1,456 @@
+// Copyright (c) 2023 David Lee
+// This code is licensed under MIT license (see LICENSE for details)
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <numeric>
+
+#include "../include/FJML/linalg.h"
+#include "../include/FJML/parallel.h"
+
+/*
+ * Every reduction is done on a contiguous tensor viewed as a (outer, size, inner) block, reducing the middle axis. When
+ * the reduced axes are next to each other this is just the tensor itself. Otherwise the reduced axes are moved to the
+ * end first, so inner is 1.
+ *
+ * With inner == 1 each output is the reduction of a contiguous row. With inner > 1 each output is the reduction of a
+ * column of a (size, inner) matrix, and a whole row of outputs is accumulated at once, which vectorizes well.
+ *
+ * Sums are computed pairwise: ranges are split in halves until they are small, and the halves are added together. The
+ * rounding error then grows with the logarithm of the number of elements instead of linearly.
+ *
+ * The kernels are templates on the type of the elements, and each reduction runs the instantiation for the dtype of its
+ * tensor. The maximum, minimum and argmax take any type, the other reductions floating point types.
+ */
+
+namespace {
+
+using FJML::Tensor;
+
+/**
+ * Ranges of a row at most this long are reduced with a plain loop
+ */
+constexpr long ROW_BLOCK = 256;
+
+/**
+ * Ranges of at most this many rows of a matrix are reduced with a plain loop
+ */
+constexpr long COLUMN_BLOCK = 32;
+
+/**
+ * The number of columns of a matrix that are reduced together by a thread, when there is a single matrix
+ */
+constexpr long COLUMN_CHUNK = 64;
+
+template <typename T> struct Sum {
+    static T identity() { return 0; }
+    static T combine(T a, T b) { return a + b; }
+};
+
+template <typename T> struct Max {
+    static T identity() {
+        return std::numeric_limits<T>::has_infinity ? -std::numeric_limits<T>::infinity()
+                                                    : std::numeric_limits<T>::lowest();
+    }
+    static T combine(T a, T b) { return std::max(a, b); }
+};
+
+template <typename T> struct Min {
+    static T identity() {
+        return std::numeric_limits<T>::has_infinity ? std::numeric_limits<T>::infinity()
+                                                    : std::numeric_limits<T>::max();
+    }
+    static T combine(T a, T b) { return std::min(a, b); }
+};
+
+/**
+ * Reduces the elements themselves
+ */
+struct Identity {
+    template <typename T> T operator()(T x, long) const { return x; }
+    Identity at(long) const { return *this; }
+};
+
+/**
+ * Reduces the squared differences between the elements and the mean of their output
+ */
+template <typename T> struct SquaredDeviation {
+    const T* mean;
+    T operator()(T x, long i) const {
+        T d = x - mean[i];
+        return d * d;
+    }
+    SquaredDeviation at(long offset) const { return {mean + offset}; }
+};
+
+/**
+ * Reduces the exponentials of the elements, shifted by the maximum of their output
+ */
+template <typename T> struct ShiftedExp {
+    const T* shift;
+    T operator()(T x, long i) const { return std::exp(x - shift[i]); }
+    ShiftedExp at(long offset) const { return {shift + offset}; }
+};
+
+/**
+ * Reduces t(x[i], 0) over a contiguous range of n elements, pairwise.
+ */
+template <template <typename> class Op, typename T, typename F> T reduce_row(const T* x, long n, const F& t) {
+    if (n > ROW_BLOCK) {
+        long half = n / 2 / 8 * 8;
+        return Op<T>::combine(reduce_row<Op>(x, half, t), reduce_row<Op>(x + half, n - half, t));
+    }
+    // Independent accumulators, so that the loop vectorizes without reordering the operations
+    T acc[8];
+    std::fill(acc, acc + 8, Op<T>::identity());
+    long i = 0;
+    for (; i + 8 <= n; i += 8) {
+        for (int k = 0; k < 8; k++) {
+            acc[k] = Op<T>::combine(acc[k], t(x[i + k], 0));
+        }
+    }
+    for (; i < n; i++) {
+        acc[0] = Op<T>::combine(acc[0], t(x[i], 0));
+    }
+    return Op<T>::combine(Op<T>::combine(Op<T>::combine(acc[0], acc[1]), Op<T>::combine(acc[2], acc[3])),
+                          Op<T>::combine(Op<T>::combine(acc[4], acc[5]), Op<T>::combine(acc[6], acc[7])));
+}
+
+/**
+ * The number of elements of scratch space reduce_columns needs for each column
+ */
+long column_scratch(long rows) {
+    long levels = 0;
+    for (; rows > COLUMN_BLOCK; rows = (rows + 1) / 2) {
+        levels++;
+    }
+    return levels;
+}
+
+/**
+ * Reduces the columns of a rows x cols matrix with row stride ld into out, pairwise over the rows. out[j] is the
+ * reduction of t(x[r * ld + j], j). scratch must have room for column_scratch(rows) * cols elements.
+ */
+template <template <typename> class Op, typename T, typename F>
+void reduce_columns(const T* x, long rows, long cols, long ld, const F& t, T* __restrict__ out, T* scratch) {
+    if (rows > COLUMN_BLOCK) {
+        long half = rows / 2;
+        reduce_columns<Op>(x, half, cols, ld, t, out, scratch + cols);
+        reduce_columns<Op>(x + half * ld, rows - half, cols, ld, t, scratch, scratch + cols);
+        for (long j = 0; j < cols; j++) {
+            out[j] = Op<T>::combine(out[j], scratch[j]);
+        }
+        return;
+    }
+    for (long j = 0; j < cols; j++) {
+        out[j] = t(x[j], j);
+    }
+    for (long r = 1; r < rows; r++) {
+        const T* row = x + r * ld;
+        for (long j = 0; j < cols; j++) {
+            out[j] = Op<T>::combine(out[j], t(row[j], j));
+        }
+    }
+}
+
+/**
+ * A tensor prepared for reducing some of its axes
+ */
+struct Reduction {
+    /**
+     * The contiguous data, laid out as (outer, size, inner)
+     */
+    Tensor source;
+    long outer, size, inner;
+    /**
+     * The shape of the result
+     */
+    std::vector<int> shape;
+};
+
+Reduction prepare(const Tensor& a, std::vector<int> axes, bool keepdims) {
+    if (axes.empty()) {
+        throw std::invalid_argument("At least one axis must be reduced");
+    }
+    std::sort(axes.begin(), axes.end());
+    for (int i = 0; i < (int)axes.size(); i++) {
+        if (axes[i] < 0 || axes[i] >= a.dim()) {
+            throw std::invalid_argument("Invalid axis " + std::to_string(axes[i]) + " for a tensor with " +
+                                        std::to_string(a.dim()) + " axes");
+        }
+        if (i > 0 && axes[i] == axes[i - 1]) {
+            throw std::invalid_argument("Axis " + std::to_string(axes[i]) + " is reduced more than once");
+        }
+    }
+
+    Reduction r{Tensor(), 1, 1, 1, {}};
+    std::vector<bool> reduced(a.dim(), false);
+    for (int axis : axes) {
+        reduced[axis] = true;
+    }
+    for (int d = 0; d < a.dim(); d++) {
+        if (reduced[d]) {
+            r.size *= a.shape[d];
+        }
+        if (!reduced[d] || keepdims) {
+            r.shape.push_back(reduced[d] ? 1 : a.shape[d]);
+        }
+    }
+    if (r.shape.empty()) {
+        r.shape.push_back(1);
+    }
+
+    if (axes.back() - axes.front() + 1 == (int)axes.size()) {
+        r.source = a.contiguous();
+        for (int d = 0; d < axes.front(); d++) {
+            r.outer *= a.shape[d];
+        }
+        for (int d = axes.back() + 1; d < a.dim(); d++) {
+            r.inner *= a.shape[d];
+        }
+    } else {
+        // Move the reduced axes to the end, so that each output is the reduction of a row
+        std::vector<int> order;
+        for (int d = 0; d < a.dim(); d++) {
+            if (!reduced[d]) {
+                order.push_back(d);
+                r.outer *= a.shape[d];
+            }
+        }
+        order.insert(order.end(), axes.begin(), axes.end());
+        r.source = a.permute(order).contiguous();
+    }
+    return r;
+}
+
+/**
+ * Computes out[o * inner + j] as the reduction of t(x, o * inner + j) over its column, splitting the work across
+ * threads
+ */
+template <template <typename> class Op, typename T, typename F> void reduce(const Reduction& r, T* out, const F& t) {
+    const T* x = r.source.data_as<T>();
+    if (r.inner == 1 && r.outer == 1) {
+        // A single long row, which is split into chunks whose results are combined pairwise in a fixed order
+        long chunk = FJML::Parallel::CHUNK_SIZE, chunks = (r.size + chunk - 1) / chunk;
+        std::vector<T> partial(chunks);
+        FJML::Parallel::parallel_for(
+            chunks,
+            [&](long first, long last) {
+                for (long c = first; c < last; c++) {
+                    partial[c] = reduce_row<Op>(x + c * chunk, std::min(chunk, r.size - c * chunk), t);
+                }
+            },
+            chunk);
+        out[0] = reduce_row<Op>(partial.data(), chunks, Identity());
+    } else if (r.inner == 1) {
+        FJML::Parallel::parallel_for(
+            r.outer,
+            [&](long first, long last) {
+                for (long o = first; o < last; o++) {
+                    out[o] = reduce_row<Op>(x + o * r.size, r.size, t.at(o));
+                }
+            },
+            r.size);
+    } else if (r.outer == 1) {
+        // A single matrix, whose columns are split across threads
+        long chunks = (r.inner + COLUMN_CHUNK - 1) / COLUMN_CHUNK;
+        FJML::Parallel::parallel_for(
+            chunks,
+            [&](long first, long last) {
+                std::vector<T> scratch(column_scratch(r.size) * COLUMN_CHUNK);
+                for (long c = first; c < last; c++) {
+                    long j = c * COLUMN_CHUNK, cols = std::min(COLUMN_CHUNK, r.inner - j);
+                    reduce_columns<Op>(x + j, r.size, cols, r.inner, t.at(j), out + j, scratch.data());
+                }
+            },
+            r.size * COLUMN_CHUNK);
+    } else {
+        FJML::Parallel::parallel_for(
+            r.outer,
+            [&](long first, long last) {
+                std::vector<T> scratch(column_scratch(r.size) * r.inner);
+                for (long o = first; o < last; o++) {
+                    reduce_columns<Op>(x + o * r.size * r.inner, r.size, r.inner, r.inner, t.at(o * r.inner),
+                                       out + o * r.inner, scratch.data());
+                }
+            },
+            r.size * r.inner);
+    }
+}
+
+template <template <typename> class Op, typename T, typename F> Tensor reduce(const Reduction& r, const F& t) {
+    Tensor result(r.shape, FJML::uninitialized, FJML::DTypeOf<T>::value);
+    reduce<Op>(r, result.data_as<T>(), t);
+    return result;
+}
+
+/**
+ * Divides every element of a contiguous tensor by n
+ */
+template <typename T> void divide(Tensor& t, long n) {
+    T* x = t.data_as<T>();
+    T scale = T(1) / n;
+    for (long i = 0; i < t.data_size[0]; i++) {
+        x[i] *= scale;
+    }
+}
+
+/**
+ * Calls f with a value of the type of the elements of a, which must be floating point
+ */
+template <typename F> auto dispatch_floating(const Tensor& a, const std::string& action, F f) {
+    if (a.dtype == FJML::DTYPE_INT32) {
+        throw std::invalid_argument("Cannot " + action + " an integer tensor");
+    }
+    return FJML::dispatch_dtype(a.dtype, f);
+}
+
+/**
+ * The only element of a tensor, as a float
+ */
+float only_element(const Tensor& t) {
+    return FJML::dispatch_dtype(t.dtype, [&](auto zero) { return (float)t.data_as<decltype(zero)>()[0]; });
+}
+
+std::vector<int> all_axes(const Tensor& a) {
+    std::vector<int> axes(a.dim());
+    std::iota(axes.begin(), axes.end(), 0);
+    return axes;
+}
+
+} // namespace
+
+namespace FJML {
+
+namespace LinAlg {
+
+float sum(const Tensor& a) { return only_element(sum(a, all_axes(a))); }
+
+Tensor sum(const Tensor& a, const std::vector<int>& axes, bool keepdims) {
+    return dispatch_floating(a, "sum", [&](auto zero) {
+        return reduce<Sum, decltype(zero)>(prepare(a, axes, keepdims), Identity());
+    });
+}
+
+float mean(const Tensor& a) { return only_element(mean(a, all_axes(a))); }
+
+Tensor mean(const Tensor& a, const std::vector<int>& axes, bool keepdims) {
+    return dispatch_floating(a, "average", [&](auto zero) {
+        using T = decltype(zero);
+        Reduction r = prepare(a, axes, keepdims);
+        Tensor result = reduce<Sum, T>(r, Identity());
+        divide<T>(result, r.size);
+        return result;
+    });
+}
+
+Tensor var(const Tensor& a, const std::vector<int>& axes, bool keepdims) {
+    return dispatch_floating(a, "compute the variance of", [&](auto zero) {
+        using T = decltype(zero);
+        Reduction r = prepare(a, axes, keepdims);
+        Tensor means = reduce<Sum, T>(r, Identity());
+        divide<T>(means, r.size);
+        Tensor result = reduce<Sum, T>(r, SquaredDeviation<T>{means.data_as<T>()});
+        divide<T>(result, r.size);
+        return result;
+    });
+}
+
+Tensor logsumexp(const Tensor& a, const std::vector<int>& axes, bool keepdims) {
+    return dispatch_floating(a, "compute the logsumexp of", [&](auto zero) {
+        using T = decltype(zero);
+        Reduction r = prepare(a, axes, keepdims);
+        Tensor shift_tensor = reduce<Max, T>(r, Identity());
+        T* shift = shift_tensor.data_as<T>();
+        // Outputs whose maximum is infinite are not shifted, so that they come out as infinite rather than NaN
+        long n = shift_tensor.data_size[0];
+        for (long i = 0; i < n; i++) {
+            if (!std::isfinite(shift[i])) {
+                shift[i] = 0;
+            }
+        }
+        Tensor result = reduce<Sum, T>(r, ShiftedExp<T>{shift});
+        T* out = result.data_as<T>();
+        for (long i = 0; i < n; i++) {
+            out[i] = std::log(out[i]) + shift[i];
+        }
+        return result;
+    });
+}
+
+float max(const Tensor& a) { return only_element(max(a, all_axes(a))); }
+
+Tensor max(const Tensor& a, const std::vector<int>& axes, bool keepdims) {
+    return dispatch_dtype(a.dtype, [&](auto zero) {
+        return reduce<Max, decltype(zero)>(prepare(a, axes, keepdims), Identity());
+    });
+}
+
+float min(const Tensor& a) { return only_element(min(a, all_axes(a))); }
+
+Tensor min(const Tensor& a, const std::vector<int>& axes, bool keepdims) {
+    return dispatch_dtype(a.dtype, [&](auto zero) {
+        return reduce<Min, decltype(zero)>(prepare(a, axes, keepdims), Identity());
+    });
+}
+
+Tensor argmax(const Tensor& a, int axis, bool keepdims) {
+    Reduction r = prepare(a, axis == -1 ? all_axes(a) : std::vector<int>{axis}, keepdims);
+    Tensor result(r.shape, uninitialized);
+    float* out = result.data;
+    dispatch_dtype(a.dtype, [&](auto zero) {
+        using T = decltype(zero);
+        const T* x = r.source.data_as<T>();
+        if (r.inner == 1) {
+            Parallel::parallel_for(
+                r.outer,
+                [&](long first, long last) {
+                    for (long o = first; o < last; o++) {
+                        const T* row = x + o * r.size;
+                        long best = 0;
+                        for (long i = 1; i < r.size; i++) {
+                            if (row[i] > row[best]) {
+                                best = i;
+                            }
+                        }
+                        out[o] = best;
+                    }
+                },
+                r.size);
+            return;
+        }
+
+        // Each item is a block of at most COLUMN_CHUNK columns of one matrix, whose maximums are tracked together
+        long chunks = (r.inner + COLUMN_CHUNK - 1) / COLUMN_CHUNK;
+        Parallel::parallel_for(
+            r.outer * chunks,
+            [&](long first, long last) {
+                T best[COLUMN_CHUNK];
+                for (long item = first; item < last; item++) {
+                    long o = item / chunks, j = item % chunks * COLUMN_CHUNK,
+                         cols = std::min(COLUMN_CHUNK, r.inner - j);
+                    const T* block = x + o * r.size * r.inner + j;
+                    float* index = out + o * r.inner + j;
+                    for (long c = 0; c < cols; c++) {
+                        best[c] = block[c];
+                        index[c] = 0;
+                    }
+                    for (long i = 1; i < r.size; i++) {
+                        const T* row = block + i * r.inner;
+                        for (long c = 0; c < cols; c++) {
+                            bool greater = row[c] > best[c];
+                            best[c] = greater ? row[c] : best[c];
+                            index[c] = greater ? (float)i : index[c];
+                        }
+                    }
+                }
+            },
+            r.size * COLUMN_CHUNK);
+    });
+    return result;
+}
+
+} // namespace LinAlg
+
+} // namespace FJML
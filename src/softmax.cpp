@@ -1,68 +1,85 @@
 // Copyright (c) 2023 David Lee
 // This code is licensed under MIT license (see LICENSE for details)
 
+#include <algorithm>
 #include <cmath>
 #include <iostream>
 
 #include "../include/FJML/layers.h"
+#include "../include/FJML/parallel.h"
 
 namespace FJML {
 
 namespace Layers {
 
 Tensor Softmax::apply(const Tensor& input) const {
+    if (input.dim() != 2) {
+        throw std::invalid_argument("The input of a softmax layer must be a batch of vectors");
+    }
     Tensor res = input;
-    for (int i = 0; i < res.shape[0]; i++) {
-        float max = res.data[0];
-        for (int j = 1; j < res.shape[1]; j++) {
-            if (res.data[i * res.shape[1] + j] > max) {
-                max = res.data[i * res.shape[1] + j];
+    int classes = res.shape[1];
+    Parallel::parallel_for(
+        res.shape[0],
+        [&](long first, long last) {
+            for (long i = first; i < last; i++) {
+                float* row = res.data + i * classes;
+                float max = row[0];
+                for (int j = 1; j < classes; j++) {
+                    max = std::max(max, row[j]);
+                }
+                float sum = 0;
+                for (int j = 0; j < classes; j++) {
+                    row[j] = std::exp(row[j] - max);
+                    sum += row[j];
+                }
+                float scale = 1 / sum;
+                for (int j = 0; j < classes; j++) {
+                    row[j] *= scale;
+                }
             }
-        }
-        float sum = 0;
-        for (int j = 0; j < res.shape[1]; j++) {
-            res.data[i * res.shape[1] + j] = exp(res.data[i * res.shape[1] + j] - max);
-            sum += res.data[i * res.shape[1] + j];
-        }
-        for (int j = 0; j < res.shape[1]; j++) {
-            res.data[i * res.shape[1] + j] /= sum;
-        }
+        },
+        classes);
+    return res;
+}
+
+Tensor Softmax::apply_double(const Tensor& input, const std::vector<Tensor>& params) const {
+    if (input.dim() != 2 || input.dtype != DTYPE_FLOAT64) {
+        throw std::invalid_argument("The input of a softmax layer in double precision must be a batch of vectors of "
+                                    "doubles");
+    }
+    // Each row is exp(x - logsumexp(x)), whose largest exponent is at most 0
+    Tensor res = input - LinAlg::logsumexp(input, {1}, true);
+    double* x = res.data_as<double>();
+    for (long i = 0; i < res.data_size[0]; i++) {
+        x[i] = std::exp(x[i]);
     }
     return res;
 }
 
 Tensor Softmax::backward(const Tensor& input_vals, const Tensor& output_grad) {
-    Tensor res{input_vals.shape, 0.0, input_vals.device};
-    Tensor out = input_vals;
-    for (int i = 0; i < res.shape[0]; i++) {
-        float max = out.data[i * res.shape[1]];
-        for (int j = 1; j < res.shape[1]; j++) {
-            if (out.data[i * res.shape[1] + j] > max) {
-                max = out.data[i * res.shape[1] + j];
-            }
-        }
-        float sum = 0;
-        for (int j = 0; j < res.shape[1]; j++) {
-            out.data[i * out.shape[1] + j] = exp(out.data[i * out.shape[1] + j] - max);
-            sum += out.data[i * out.shape[1] + j];
-        }
-
-        float denom = sum * sum;
-        for (int j = 0; j < res.shape[1]; j++) {
-            for (int k = 0; k < res.shape[1]; k++) {
-                if (j == k) {
-                    res.data[i * res.shape[1] + j] += (sum - out.data[i * res.shape[1] + k]) / denom *
-                                                      output_grad.data[i * res.shape[1] + k] *
-                                                      out.data[i * res.shape[1] + k];
-                } else {
-                    res.data[i * res.shape[1] + j] += -out.data[i * res.shape[1] + k] / denom *
-                                                      output_grad.data[i * res.shape[1] + k] *
-                                                      out.data[i * res.shape[1] + j];
+    if (output_grad.shape != input_vals.shape) {
+        throw std::invalid_argument("The gradient of a softmax layer must have the shape of its input");
+    }
+    // The product of the Jacobian of softmax with g is s * (g - dot(g, s)) in each row, so it does not need to be
+    // built
+    Tensor res = apply(input_vals), grad = output_grad.contiguous();
+    int classes = res.shape[1];
+    Parallel::parallel_for(
+        res.shape[0],
+        [&](long first, long last) {
+            for (long i = first; i < last; i++) {
+                float* s = res.data + i * classes;
+                const float* g = grad.data + i * classes;
+                float dot = 0;
+                for (int j = 0; j < classes; j++) {
+                    dot += g[j] * s[j];
+                }
+                for (int j = 0; j < classes; j++) {
+                    s[j] *= g[j] - dot;
                 }
             }
-        }
-    }
-
+        },
+        classes);
     return res;
 }
 
@@ -1,145 +1,518 @@
 // Copyright (c) 2023 David Lee
 // This code is licensed under MIT license (see LICENSE for details)
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
 #include <cstdarg>
 #include <cstring>
 #include <iostream>
 #include <numeric>
+#include <type_traits>
 
 #ifdef CUDA
 #include <cublas_v2.h>
 #include <cuda_runtime.h>
 #endif
 
+#include "../include/FJML/allocator.h"
+#include "../include/FJML/parallel.h"
 #include "../include/FJML/tensor.h"
 
-namespace FJML {
+namespace {
+
+/**
+ * Calls f(offsets, inner_strides, inner_size) once for every innermost row of a tensor with the given shape, where
+ * offsets[t] is the offset of the row in operand t and inner_strides[t] is the stride along the row. A stride of 0
+ * repeats the same element, which is how broadcast operands are read without expanding them.
+ *
+ * Dimensions that are laid out back to back in every operand are merged first, so when every operand is contiguous f
+ * is called with the whole tensor as a single row of unit stride, or with consecutive pieces of it when it is large. Large
+ * loops are split across threads, so f must only write to elements of its own row, unless parallel is false.
+ */
+template <size_t N, typename F>
+void for_each_row(const std::vector<int>& shape, const std::array<const std::vector<int>*, N>& strides, F f,
+                  bool parallel = true) {
+    std::vector<int> dims;
+    std::array<std::vector<int>, N> dim_strides;
+    for (int d = 0; d < (int)shape.size(); d++) {
+        if (shape[d] == 0) {
+            return;
+        }
+        if (shape[d] == 1) {
+            continue;
+        }
+        bool mergeable = !dims.empty();
+        for (size_t t = 0; t < N && mergeable; t++) {
+            mergeable = dim_strides[t].back() == shape[d] * (*strides[t])[d];
+        }
+        if (mergeable) {
+            dims.back() *= shape[d];
+            for (size_t t = 0; t < N; t++) {
+                dim_strides[t].back() = (*strides[t])[d];
+            }
+        } else {
+            dims.push_back(shape[d]);
+            for (size_t t = 0; t < N; t++) {
+                dim_strides[t].push_back((*strides[t])[d]);
+            }
+        }
+    }
 
-#ifdef CUDA
-cublasHandle_t handle;
-bool handle_initialized = false;
-#endif
+    std::array<int, N> inner_strides;
+    if (dims.empty()) {
+        inner_strides.fill(1);
+        f(std::array<long, N>{}, inner_strides, 1);
+        return;
+    }
+    int outer = (int)dims.size() - 1, inner = dims[outer];
+    for (size_t t = 0; t < N; t++) {
+        inner_strides[t] = dim_strides[t][outer];
+    }
+    long rows = 1;
+    for (int d = 0; d < outer; d++) {
+        rows *= dims[d];
+    }
+
+    if (rows == 1) {
+        // A single long row, which is split into ranges of elements instead
+        auto range = [&](long first, long last) {
+            std::array<long, N> offsets;
+            for (size_t t = 0; t < N; t++) {
+                offsets[t] = first * inner_strides[t];
+            }
+            f(offsets, inner_strides, (int)(last - first));
+        };
+        if (parallel) {
+            FJML::Parallel::parallel_for(inner, range);
+        } else {
+            range(0, inner);
+        }
+        return;
+    }
+
+    // The rows are split into ranges, and each range walks its rows with an odometer over the outer dimensions
+    auto range = [&](long first, long last) {
+        std::vector<int> index(outer);
+        std::array<long, N> offsets{};
+        for (long r = first, d = outer - 1; d >= 0; d--) {
+            index[d] = r % dims[d];
+            r /= dims[d];
+            for (size_t t = 0; t < N; t++) {
+                offsets[t] += (long)index[d] * dim_strides[t][d];
+            }
+        }
+        for (long r = first; r < last; r++) {
+            f(offsets, inner_strides, inner);
+            for (int d = outer - 1; d >= 0; d--) {
+                for (size_t t = 0; t < N; t++) {
+                    offsets[t] += dim_strides[t][d];
+                }
+                if (++index[d] < dims[d]) {
+                    break;
+                }
+                for (size_t t = 0; t < N; t++) {
+                    offsets[t] -= (long)dims[d] * dim_strides[t][d];
+                }
+                index[d] = 0;
+            }
+        }
+    };
+    if (parallel) {
+        FJML::Parallel::parallel_for(rows, range, inner);
+    } else {
+        range(0, rows);
+    }
+}
 
-Tensor::Tensor() : data{nullptr}, shape(0), data_size{1}, device{DEVICE_CPU} {}
+std::string shape_string(const std::vector<int>& shape) {
+    std::string res = "(";
+    for (int i = 0; i < (int)shape.size(); i++) {
+        res += (i ? ", " : "") + std::to_string(shape[i]);
+    }
+    return res + ")";
+}
+
+/**
+ * Computes the shape two operands are broadcast to, following the NumPy rules: shapes are aligned at their last
+ * dimension, and each pair of dimensions must be equal or contain a 1.
+ */
+std::vector<int> broadcast_shape(const std::vector<int>& a, const std::vector<int>& b, const std::string& action) {
+    std::vector<int> shape(std::max(a.size(), b.size()));
+    for (int i = 1; i <= (int)shape.size(); i++) {
+        int x = i <= (int)a.size() ? a[a.size() - i] : 1, y = i <= (int)b.size() ? b[b.size() - i] : 1;
+        if (x != y && x != 1 && y != 1) {
+            throw std::invalid_argument("Cannot " + action + " tensors with shapes " + shape_string(a) + " and " +
+                                        shape_string(b));
+        }
+        shape[shape.size() - i] = x == 1 ? y : x;
+    }
+    return shape;
+}
 
-Tensor::Tensor(const std::vector<int>& shape, float init, Device device) : shape{shape}, device{device} {
-    data_size = shape;
+/**
+ * Returns the strides that read t as if it had the given broadcast shape. Missing leading dimensions and dimensions of
+ * size 1 get a stride of 0, so their elements are repeated rather than copied.
+ */
+std::vector<int> broadcast_strides(const FJML::Tensor& t, const std::vector<int>& shape) {
+    std::vector<int> strides(shape.size(), 0);
+    int offset = shape.size() - t.shape.size();
+    for (int i = 0; i < (int)t.shape.size(); i++) {
+        strides[offset + i] = t.shape[i] == 1 ? 0 : t.strides[i];
+    }
+    return strides;
+}
+
+/**
+ * Computes out = f(a) elementwise, reading a as elements of type S and writing out as elements of type T. out must
+ * have the shape of a, and may be a itself.
+ */
+template <typename S, typename T, typename F> void map_unary(const FJML::Tensor& a, FJML::Tensor& out, F f) {
+    const S* x = a.data_as<S>();
+    T* y = out.data_as<T>();
+    for_each_row<2>(a.shape, {&a.strides, &out.strides}, [&](std::array<long, 2> off, std::array<int, 2> st, int n) {
+        if (st[0] == 1 && st[1] == 1) {
+            for (int i = 0; i < n; i++) {
+                y[off[1] + i] = f(x[off[0] + i]);
+            }
+        } else {
+            for (int i = 0; i < n; i++) {
+                y[off[1] + (long)i * st[1]] = f(x[off[0] + (long)i * st[0]]);
+            }
+        }
+    });
+}
+
+/**
+ * Computes out = f(a, b) elementwise, broadcasting a and b to the shape of out. out may be a or b. Every operand holds
+ * elements of type T.
+ */
+template <typename T, typename F>
+void map_binary(const FJML::Tensor& a, const FJML::Tensor& b, FJML::Tensor& out, F f) {
+    const T *x = a.data_as<T>(), *y = b.data_as<T>();
+    T* z = out.data_as<T>();
+    std::vector<int> a_strides = broadcast_strides(a, out.shape), b_strides = broadcast_strides(b, out.shape);
+    for_each_row<3>(out.shape, {&a_strides, &b_strides, &out.strides},
+                    [&](std::array<long, 3> off, std::array<int, 3> st, int n) {
+                        if (st[0] == 1 && st[1] == 1 && st[2] == 1) {
+                            for (int i = 0; i < n; i++) {
+                                z[off[2] + i] = f(x[off[0] + i], y[off[1] + i]);
+                            }
+                        } else if (st[0] == 1 && st[1] == 0 && st[2] == 1) {
+                            // Row of a combined with a single element of b, such as a column vector
+                            T y0 = y[off[1]];
+                            for (int i = 0; i < n; i++) {
+                                z[off[2] + i] = f(x[off[0] + i], y0);
+                            }
+                        } else {
+                            for (int i = 0; i < n; i++) {
+                                z[off[2] + (long)i * st[2]] =
+                                    f(x[off[0] + (long)i * st[0]], y[off[1] + (long)i * st[1]]);
+                            }
+                        }
+                    });
+}
+
+/**
+ * Returns the verb used in error messages about an elementwise operation.
+ */
+std::string op_name(FJML::Expressions::BinaryOp op) {
+    switch (op) {
+    case FJML::Expressions::OP_ADD:
+        return "add";
+    case FJML::Expressions::OP_SUBTRACT:
+        return "subtract";
+    case FJML::Expressions::OP_MULTIPLY:
+        return "multiply";
+    default:
+        return "divide";
+    }
+}
+
+/**
+ * Checks that the operands of an elementwise operation hold the same type of elements.
+ */
+void check_same_dtype(const FJML::Tensor& a, const FJML::Tensor& b, const std::string& action) {
+    if (a.dtype != b.dtype) {
+        throw std::invalid_argument("Cannot " + action + " tensors of types " + FJML::dtype_name(a.dtype) + " and " +
+                                    FJML::dtype_name(b.dtype));
+    }
+}
+
+/**
+ * Computes the result of a broadcasting binary operation on elements of type T into a new tensor.
+ */
+template <typename T, typename F>
+FJML::Tensor broadcast_op(const FJML::Tensor& a, const FJML::Tensor& b, const std::string& action, F f) {
+    check_same_dtype(a, b, action);
+    FJML::Tensor result(broadcast_shape(a.shape, b.shape, action), FJML::uninitialized, a.dtype);
+    map_binary<T>(a, b, result, f);
+    return result;
+}
+
+/**
+ * Applies a broadcasting binary operation on elements of type T in place. b must broadcast to the shape of a.
+ */
+template <typename T, typename F>
+void broadcast_op_inplace(FJML::Tensor& a, const FJML::Tensor& b, const std::string& action, F f) {
+    check_same_dtype(a, b, action);
+    if (broadcast_shape(a.shape, b.shape, action) != a.shape) {
+        throw std::invalid_argument("Cannot " + action + " tensors with shapes " + shape_string(a.shape) + " and " +
+                                    shape_string(b.shape) + " in place");
+    }
+    map_binary<T>(a, b, a, f);
+}
+
+/**
+ * Returns a scalar operand of an elementwise operation as the type of the elements of the tensor. A scalar combined
+ * with integers must be an integer itself.
+ */
+template <typename T> T scalar_as(float x, const std::string& action) {
+    if (std::is_integral<T>::value && x != (T)x) {
+        throw std::invalid_argument("Cannot " + action + " an integer tensor and the scalar " + std::to_string(x));
+    }
+    return (T)x;
+}
+
+/**
+ * Checks that an operation that is only defined on floating point elements, such as division, is not applied to
+ * integers.
+ */
+void check_floating(const FJML::Tensor& a, const std::string& action) {
+    if (a.dtype == FJML::DTYPE_INT32) {
+        throw std::invalid_argument("Cannot " + action + " integer tensors");
+    }
+}
+
+/**
+ * Applies the elementwise operation op, computed by f on elements of type T, to a tensor and a scalar into out, which
+ * may be a.
+ */
+template <typename F>
+void scalar_op(const FJML::Tensor& a, float b, FJML::Expressions::BinaryOp op, FJML::Tensor& out, F f) {
+    if (op == FJML::Expressions::OP_DIVIDE) {
+        check_floating(a, "divide");
+    }
+    FJML::dispatch_dtype(a.dtype, [&](auto zero) {
+        using T = decltype(zero);
+        T y = scalar_as<T>(b, op_name(op));
+        map_unary<T, T>(a, out, [&](T x) { return f(x, y); });
+    });
+}
+
+/**
+ * Copies the elements of src into dst, which must have the same shape.
+ */
+void copy_into(const FJML::Tensor& src, FJML::Tensor& dst) {
+    if (src.is_contiguous() && dst.is_contiguous()) {
+        memcpy(dst.data, src.data, src.data_size[0] * FJML::dtype_size(src.dtype));
+        return;
+    }
+    FJML::dispatch_dtype(src.dtype, [&](auto zero) {
+        using T = decltype(zero);
+        map_unary<T, T>(src, dst, [](T x) { return x; });
+    });
+}
+
+/**
+ * Returns the second operand of an elementwise operation laid out with the shape of the first.
+ *
+ * Operands with the same number of elements but a different shape are combined in row-major order, in which case the
+ * reshaped operand is stored in holder.
+ */
+const FJML::Tensor& match_shape(const FJML::Tensor& a, const FJML::Tensor& b, FJML::Tensor& holder) {
+    if (a.shape == b.shape) {
+        return b;
+    }
+    holder = b.contiguous().view(a.shape);
+    return holder;
+}
+
+/**
+ * Returns a tensor that refers to the same elements as t, without copying them.
+ */
+FJML::Tensor alias(const FJML::Tensor& t) {
+    FJML::Tensor result;
+    result.data = t.data;
+    result.storage = t.storage;
+    result.shape = t.shape;
+    result.data_size = t.data_size;
+    result.strides = t.strides;
+    result.device = t.device;
+    result.dtype = t.dtype;
+    return result;
+}
+
+std::vector<int> suffix_products(const std::vector<int>& shape) {
+    std::vector<int> data_size = shape;
     for (int i = (int)shape.size() - 2; i >= 0; i--) {
         data_size[i] *= data_size[i + 1];
     }
     data_size.push_back(1);
-    if (device == DEVICE_CPU) {
-        data = (float*)malloc(data_size[0] * sizeof(float));
-        for (int i = 0; i < data_size[0]; i++) {
-            data[i] = init;
-        }
-    } else if (device == DEVICE_CUDA) {
+    return data_size;
+}
+
+std::shared_ptr<float> allocate_storage(size_t size, FJML::DType dtype, FJML::Device device) {
+    size_t bytes = size * FJML::dtype_size(dtype);
+    if (device == FJML::DEVICE_CPU) {
+        return std::shared_ptr<float>((float*)FJML::Memory::allocate(bytes), FJML::Memory::deallocate);
+    } else if (device == FJML::DEVICE_CUDA) {
 #ifdef CUDA
-        cudaHostAlloc(&data, data_size[0] * sizeof(float), cudaHostAllocMapped);
-        for (int i = 0; i < data_size[0]; i++) {
-            data[i] = init;
-        }
+        float* data;
+        cudaHostAlloc(&data, bytes, cudaHostAllocMapped);
+        return std::shared_ptr<float>(data, cudaFreeHost);
 #else
         throw std::runtime_error("The library was not compiled with CUDA support");
 #endif
-    } else {
-        throw std::runtime_error("Unsupported device");
     }
+    throw std::runtime_error("Unsupported device");
+}
+
+} // namespace
+
+namespace FJML {
+
+#ifdef CUDA
+cublasHandle_t handle;
+bool handle_initialized = false;
+#endif
+
+std::string dtype_name(DType dtype) {
+    switch (dtype) {
+    case DTYPE_FLOAT32:
+        return "float32";
+    case DTYPE_BFLOAT16:
+        return "bfloat16";
+    case DTYPE_FLOAT16:
+        return "float16";
+    case DTYPE_FLOAT64:
+        return "float64";
+    case DTYPE_INT32:
+        return "int32";
+    }
+    throw std::invalid_argument("Unknown dtype");
+}
+
+DType parse_dtype(const std::string& name) {
+    for (DType dtype : {DTYPE_FLOAT32, DTYPE_BFLOAT16, DTYPE_FLOAT16, DTYPE_FLOAT64, DTYPE_INT32}) {
+        if (dtype_name(dtype) == name) {
+            return dtype;
+        }
+    }
+    throw std::invalid_argument("Unknown dtype " + name);
+}
+
+size_t dtype_size(DType dtype) {
+    switch (dtype) {
+    case DTYPE_BFLOAT16:
+    case DTYPE_FLOAT16:
+        return 2;
+    case DTYPE_FLOAT64:
+        return 8;
+    default:
+        return 4;
+    }
+}
+
+Tensor::Tensor() : data{nullptr}, shape(0), data_size{1}, device{DEVICE_CPU}, dtype{DTYPE_FLOAT32} {}
+
+Tensor::Tensor(const std::vector<int>& shape, Uninitialized, Device device)
+    : Tensor(shape, uninitialized, DTYPE_FLOAT32, device) {}
+
+Tensor::Tensor(const std::vector<int>& shape, Uninitialized, DType dtype, Device device)
+    : shape{shape}, data_size{suffix_products(shape)}, device{device}, dtype{dtype} {
+    if (dtype != DTYPE_FLOAT32 && dtype != DTYPE_FLOAT64 && dtype != DTYPE_INT32) {
+        throw std::invalid_argument("A tensor cannot hold " + dtype_name(dtype) + " elements");
+    }
+    strides.assign(data_size.begin() + 1, data_size.end());
+    storage = allocate_storage(data_size[0], dtype, device);
+    data = storage.get();
+}
+
+Tensor::Tensor(const std::vector<int>& shape, DType dtype, Device device)
+    : Tensor(shape, uninitialized, dtype, device) {
+    // Zero is all bits clear in every type
+    std::memset(data, 0, data_size[0] * dtype_size(dtype));
+}
+
+Tensor::Tensor(const std::vector<int>& shape, float init, Device device) : Tensor(shape, uninitialized, device) {
+    std::fill(data, data + data_size[0], init);
 }
 
 Tensor::Tensor(const std::vector<int>& shape, Device device) : Tensor(shape, 0.0, device) {}
 
-Tensor::Tensor(const Tensor& other) : device{other.device} {
+Tensor::Tensor(std::shared_ptr<float> storage, const std::vector<int>& shape, Device device)
+    : data{storage.get()}, storage{std::move(storage)}, shape{shape}, data_size{suffix_products(shape)},
+      device{device}, dtype{DTYPE_FLOAT32} {
+    strides.assign(data_size.begin() + 1, data_size.end());
+}
+
+Tensor::Tensor(const Tensor& other) : device{other.device}, dtype{other.dtype} {
     shape = other.shape;
     data_size = other.data_size;
-    if (device == DEVICE_CPU) {
-        if (other.data == nullptr) {
-            data = nullptr;
-            return;
-        }
-        data = (float*)malloc(data_size[0] * sizeof(float));
-        for (int i = 0; i < data_size[0]; i++) {
-            data[i] = other.data[i];
-        }
-    } else if (device == DEVICE_CUDA) {
-#ifdef CUDA
-        if (other.data == nullptr) {
-            data = nullptr;
-            return;
-        }
-        cudaHostAlloc(&data, data_size[0] * sizeof(float), cudaHostAllocMapped);
-        memcpy(data, other.data, data_size[0] * sizeof(float));
-#else
-        throw std::runtime_error("The library was not compiled with CUDA support");
-#endif
-    } else {
-        throw std::runtime_error("Unsupported device");
+    if (other.data == nullptr) {
+        data = nullptr;
+        return;
     }
+    strides.assign(data_size.begin() + 1, data_size.end());
+    storage = allocate_storage(data_size[0], dtype, device);
+    data = storage.get();
+    copy_into(other, *this);
 }
 
-Tensor::Tensor(Tensor&& other) : device{other.device} {
+Tensor::Tensor(Tensor&& other) : device{other.device}, dtype{other.dtype} {
     shape = std::move(other.shape);
     data_size = std::move(other.data_size);
+    strides = std::move(other.strides);
+    storage = std::move(other.storage);
     data = other.data;
     other.data = nullptr;
 }
 
-Tensor::~Tensor() {
-    if (device == DEVICE_CPU) {
-        free(data);
-    } else if (device == DEVICE_CUDA) {
-#ifdef CUDA
-        cudaFreeHost(data);
-#endif
-    }
-}
+Tensor::~Tensor() {}
 
 Tensor& Tensor::operator=(const Tensor& other) {
+    if (this == &other) {
+        return *this;
+    }
     if (other.device != DEVICE_CPU && other.device != DEVICE_CUDA) {
         throw std::runtime_error("Unsupported device");
     }
-    if (device == DEVICE_CPU) {
-        if (data != nullptr) {
-            free(data);
-        }
-    } else if (device == DEVICE_CUDA) {
-#ifdef CUDA
-        if (data != nullptr) {
-            cudaFreeHost(data);
-        }
-        cudaHostAlloc(&data, data_size[0] * sizeof(float), cudaHostAllocMapped);
-        std::memcpy(data, other.data, data_size[0] * sizeof(float));
-#else
-        throw std::runtime_error("The library was not compiled with CUDA support");
-#endif
-    }
-    device = other.device;
-    shape = other.shape;
-    data_size = other.data_size;
-    if (other.data == nullptr) {
-        data = nullptr;
+    if (device == DEVICE_CPU && other.device == DEVICE_CPU && data != nullptr && other.data != nullptr &&
+        storage.use_count() == 1 && is_contiguous() && data_size[0] == other.data_size[0] && dtype == other.dtype) {
+        // Nothing else refers to the existing buffer and it has the right size, so it can be reused
+        shape = other.shape;
+        data_size = other.data_size;
+        strides.assign(data_size.begin() + 1, data_size.end());
+        copy_into(other, *this);
         return *this;
     }
-    if (device == DEVICE_CPU) {
-        data = (float*)malloc(data_size[0] * sizeof(float));
-        memcpy(data, other.data, data_size[0] * sizeof(float));
-    } else {
-#ifdef CUDA
-        cudaHostAlloc(&data, data_size[0] * sizeof(float), cudaHostAllocMapped);
-        memcpy(data, other.data, data_size[0] * sizeof(float));
-#else
-        throw std::runtime_error("The library was not compiled with CUDA support");
-#endif
+    return *this = Tensor(other);
+}
+
+Tensor& Tensor::operator=(Tensor&& other) {
+    if (this == &other) {
+        return *this;
     }
+    std::swap(data, other.data);
+    std::swap(storage, other.storage);
+    std::swap(device, other.device);
+    std::swap(dtype, other.dtype);
+    shape = std::move(other.shape);
+    data_size = std::move(other.data_size);
+    strides = std::move(other.strides);
     return *this;
 }
 
 Tensor Tensor::zeros(const std::vector<int>& shape, Device device) { return Tensor(shape, 0.0, device); }
 
+Tensor Tensor::empty(const std::vector<int>& shape, Device device) { return Tensor(shape, uninitialized, device); }
+
 Tensor Tensor::ones(const std::vector<int>& shape, Device device) { return Tensor(shape, 1.0, device); }
 
 Tensor Tensor::rand(const std::vector<int>& shape, Device device) {
-    Tensor tensor(shape, 0, device);
+    Tensor tensor(shape, uninitialized, device);
     for (int i = 0; i < tensor.data_size[0]; i++) {
         tensor.data[i] = float(std::rand()) / float(RAND_MAX);
     }
@@ -147,10 +520,8 @@ Tensor Tensor::rand(const std::vector<int>& shape, Device device) {
 }
 
 Tensor Tensor::array(const std::vector<float>& vec, Device device) {
-    Tensor tensor({(int)vec.size()}, 0.0, device);
-    for (int i = 0; i < (int)vec.size(); i++) {
-        tensor.data[i] = vec[i];
-    }
+    Tensor tensor({(int)vec.size()}, uninitialized, device);
+    std::copy(vec.begin(), vec.end(), tensor.data);
     return tensor;
 }
 
@@ -158,33 +529,58 @@ Tensor Tensor::array(const std::vector<Tensor>& vec, Device device) {
     std::vector<int> shape;
     shape.push_back((int)vec.size());
     shape.insert(shape.end(), vec[0].shape.begin(), vec[0].shape.end());
-    Tensor tensor(shape, 0.0, device);
+    Tensor tensor(shape, uninitialized, vec[0].dtype, device);
     for (int i = 0; i < (int)vec.size(); i++) {
-        memcpy(tensor.data + i * vec[i].data_size[0], vec[i].data, vec[i].data_size[0] * sizeof(float));
+        check_same_dtype(vec[0], vec[i], "stack");
+        Tensor row = tensor.select(i);
+        copy_into(vec[i], row);
     }
     return tensor;
 }
 
 Tensor Tensor::to_device(Device device) const {
-    Tensor tensor(shape, 0.0, device);
-    if (device == DEVICE_CPU) {
-        for (int i = 0; i < data_size[0]; i++) {
-            tensor.data[i] = data[i];
-        }
-    } else if (device == DEVICE_CUDA) {
-#ifdef CUDA
-        cudaFreeHost(tensor.data);
-        cudaHostAlloc(&tensor.data, data_size[0] * sizeof(float), cudaHostAllocMapped);
-        memcpy(tensor.data, data, data_size[0] * sizeof(float));
-#else
-        throw std::runtime_error("The library was not compiled with CUDA support");
-#endif
-    } else {
-        throw std::runtime_error("Unsupported device");
-    }
+    Tensor tensor(shape, uninitialized, dtype, device);
+    copy_into(*this, tensor);
     return tensor;
 }
 
+Tensor Tensor::astype(DType dtype) const {
+    if (data == nullptr) {
+        Tensor result;
+        result.dtype = dtype;
+        return result;
+    }
+    Tensor result(shape, uninitialized, dtype, device);
+    dispatch_dtype(this->dtype, [&](auto from) {
+        using S = decltype(from);
+        dispatch_dtype(dtype, [&](auto to) {
+            using T = decltype(to);
+            if (std::is_integral<T>::value && !std::is_integral<S>::value) {
+                // 2^31 is the first value past the range of int32, and is exact in both float types. The loop may run
+                // on several threads, so it only flags the values it cannot convert.
+                auto exact = [](S x) { return x >= (S)-2147483648.0 && x < (S)2147483648.0 && x == (S)(T)x; };
+                std::atomic<bool> all_exact{true};
+                map_unary<S, T>(*this, result, [&](S x) {
+                    if (!exact(x)) {
+                        all_exact.store(false, std::memory_order_relaxed);
+                        return (T)0;
+                    }
+                    return (T)x;
+                });
+                if (!all_exact) {
+                    Tensor source = contiguous();
+                    const S* x = source.data_as<S>();
+                    S value = *std::find_if_not(x, x + data_size[0], exact);
+                    throw std::out_of_range("The value " + std::to_string(value) + " is not an integer");
+                }
+            } else {
+                map_unary<S, T>(*this, result, [](S x) { return (T)x; });
+            }
+        });
+    });
+    return result;
+}
+
 int Tensor::ndim() const { return shape.size(); }
 
 int Tensor::dim() const { return shape.size(); }
@@ -194,64 +590,119 @@ Tensor& Tensor::reshape(const std::vector<int>& shape) {
         throw std::invalid_argument("Cannot reshape tensor with size " + std::to_string(data_size[0]) + " to shape " +
                                     std::to_string(shape[0]));
     }
-    this->shape = shape;
-    data_size = shape;
-    for (int i = (int)shape.size() - 2; i >= 0; i--) {
-        data_size[i] *= data_size[i + 1];
+    if (!is_contiguous()) {
+        *this = contiguous();
     }
-    data_size.push_back(1);
+    this->shape = shape;
+    data_size = suffix_products(shape);
+    strides.assign(data_size.begin() + 1, data_size.end());
     return *this;
 }
 
-float& Tensor::operator[](const std::vector<int>& index) {
-    if (index.size() != shape.size()) {
-        throw std::invalid_argument("Index has " + std::to_string(index.size()) + " dimensions, but tensor has " +
-                                    std::to_string(shape.size()));
-    }
-    int i = 0;
-    for (int j = 0; j < (int)index.size(); j++) {
-        if (index[j] >= shape[j]) {
-            throw std::out_of_range("Index " + std::to_string(index[j]) + " is out of range for dimension " +
-                                    std::to_string(j) + " with size " + std::to_string(shape[j]));
+bool Tensor::is_contiguous() const {
+    for (int i = 0; i < (int)shape.size(); i++) {
+        if (shape[i] != 1 && strides[i] != data_size[i + 1]) {
+            return false;
         }
-        i += index[j] * data_size[j + 1];
     }
-    return data[i];
+    return true;
 }
 
-const float& Tensor::operator[](const std::vector<int>& index) const {
-    if (index.size() != shape.size()) {
-        throw std::invalid_argument("Index has " + std::to_string(index.size()) + " dimensions, but tensor has " +
-                                    std::to_string(shape.size()));
+Tensor Tensor::contiguous() const {
+    if (!is_contiguous()) {
+        return Tensor(*this);
     }
-    int i = 0;
-    for (int j = 0; j < (int)index.size(); j++) {
-        if (index[j] >= shape[j]) {
-            throw std::out_of_range("Index " + std::to_string(index[j]) + " is out of range for dimension " +
-                                    std::to_string(j) + " with size " + std::to_string(shape[j]));
-        }
-        i += index[j] * data_size[j + 1];
+    return alias(*this);
+}
+
+Tensor Tensor::view(const std::vector<int>& shape) const {
+    if (!is_contiguous()) {
+        throw std::invalid_argument("Cannot view a non-contiguous tensor, call contiguous() first");
     }
-    return data[i];
+    Tensor result = contiguous();
+    result.reshape(shape);
+    return result;
 }
 
-float& Tensor::at(const std::vector<int>& index) {
-    if (index.size() != shape.size()) {
-        throw std::invalid_argument("Index has " + std::to_string(index.size()) + " dimensions, but tensor has " +
-                                    std::to_string(shape.size()));
+Tensor Tensor::slice(int start, int end, int axis) const {
+    if (axis < 0 || axis >= dim()) {
+        throw std::invalid_argument("Invalid axis");
     }
-    int i = 0;
-    for (int j = 0; j < (int)index.size(); j++) {
-        if (index[j] >= shape[j]) {
-            throw std::out_of_range("Index " + std::to_string(index[j]) + " is out of range for dimension " +
-                                    std::to_string(j) + " with size " + std::to_string(shape[j]));
+    if (start < 0 || end > shape[axis] || start > end) {
+        throw std::out_of_range("Slice [" + std::to_string(start) + ", " + std::to_string(end) +
+                                ") is out of range for dimension " + std::to_string(axis) + " with size " +
+                                std::to_string(shape[axis]));
+    }
+    Tensor result = alias(*this);
+    result.data = (float*)((char*)data + (long)start * strides[axis] * dtype_size(dtype));
+    result.shape[axis] = end - start;
+    result.data_size = suffix_products(result.shape);
+    return result;
+}
+
+Tensor Tensor::select(int index, int axis) const {
+    if (axis < 0 || axis >= dim()) {
+        throw std::invalid_argument("Invalid axis");
+    }
+    if (index < 0 || index >= shape[axis]) {
+        throw std::out_of_range("Index " + std::to_string(index) + " is out of range for dimension " +
+                                std::to_string(axis) + " with size " + std::to_string(shape[axis]));
+    }
+    Tensor result = slice(index, index + 1, axis);
+    result.shape.erase(result.shape.begin() + axis);
+    result.strides.erase(result.strides.begin() + axis);
+    result.data_size = suffix_products(result.shape);
+    return result;
+}
+
+Tensor Tensor::permute(const std::vector<int>& axes) const {
+    if ((int)axes.size() != dim()) {
+        throw std::invalid_argument("Permutation has " + std::to_string(axes.size()) + " axes, but tensor has " +
+                                    std::to_string(dim()));
+    }
+    std::vector<bool> seen(dim(), false);
+    Tensor result = alias(*this);
+    for (int i = 0; i < dim(); i++) {
+        if (axes[i] < 0 || axes[i] >= dim() || seen[axes[i]]) {
+            throw std::invalid_argument("Invalid permutation of axes");
         }
-        i += index[j] * data_size[j + 1];
+        seen[axes[i]] = true;
+        result.shape[i] = shape[axes[i]];
+        result.strides[i] = strides[axes[i]];
+    }
+    result.data_size = suffix_products(result.shape);
+    return result;
+}
+
+void Tensor::require_float(const char* action) const {
+    if (dtype != DTYPE_FLOAT32) {
+        throw std::invalid_argument(std::string("Cannot ") + action + " a tensor of " + dtype_name(dtype) +
+                                    " elements, use data_as to read it");
     }
-    return data[i];
+}
+
+int Tensor::offset_of(int index) const {
+    if (is_contiguous()) {
+        return index;
+    }
+    int offset = 0;
+    for (int i = dim() - 1; i >= 0; i--) {
+        offset += index % shape[i] * strides[i];
+        index /= shape[i];
+    }
+    return offset;
+}
+
+float& Tensor::operator[](const std::vector<int>& index) { return at(index); }
+
+const float& Tensor::operator[](const std::vector<int>& index) const { return at(index); }
+
+float& Tensor::at(const std::vector<int>& index) {
+    return const_cast<float&>(static_cast<const Tensor&>(*this).at(index));
 }
 
 const float& Tensor::at(const std::vector<int>& index) const {
+    require_float("index into");
     if (index.size() != shape.size()) {
         throw std::invalid_argument("Index has " + std::to_string(index.size()) + " dimensions, but tensor has " +
                                     std::to_string(shape.size()));
@@ -262,12 +713,13 @@ const float& Tensor::at(const std::vector<int>& index) const {
             throw std::out_of_range("Index " + std::to_string(index[j]) + " is out of range for dimension " +
                                     std::to_string(j) + " with size " + std::to_string(shape[j]));
         }
-        i += index[j] * data_size[j + 1];
+        i += index[j] * strides[j];
     }
     return data[i];
 }
 
 float& Tensor::at(int index...) {
+    require_float("index into");
     va_list args;
     va_start(args, index);
 
@@ -280,12 +732,14 @@ float& Tensor::at(int index...) {
             throw std::out_of_range("Index " + std::to_string(index) + " is out of range for dimension " +
                                     std::to_string(j) + " with size " + std::to_string(shape[j]));
         }
-        i += index * data_size[j + 1];
+        i += index * strides[j];
     }
+    va_end(args);
     return data[i];
 }
 
 const float& Tensor::at(int index...) const {
+    require_float("index into");
     va_list args;
     va_start(args, index);
 
@@ -298,8 +752,9 @@ const float& Tensor::at(int index...) const {
             throw std::out_of_range("Index " + std::to_string(index) + " is out of range for dimension " +
                                     std::to_string(j) + " with size " + std::to_string(shape[j]));
         }
-        i += index * data_size[j + 1];
+        i += index * strides[j];
     }
+    va_end(args);
     return data[i];
 }
 
@@ -307,9 +762,9 @@ Tensor::iterator::iterator(Tensor& tensor, int index) : tensor{tensor}, index{in
 
 Tensor::iterator::iterator(const iterator& itr) : tensor{itr.tensor}, index{itr.index} {}
 
-float& Tensor::iterator::operator*() { return tensor.data[index]; }
+float& Tensor::iterator::operator*() { return tensor.data[tensor.offset_of(index)]; }
 
-const float& Tensor::iterator::operator*() const { return tensor.data[index]; }
+const float& Tensor::iterator::operator*() const { return tensor.data[tensor.offset_of(index)]; }
 
 Tensor::iterator& Tensor::iterator::operator++() {
     index++;
@@ -363,40 +818,10 @@ Tensor::iterator Tensor::begin() { return Tensor::iterator{*this, 0}; }
 
 Tensor::iterator Tensor::end() { return Tensor::iterator{*this, data_size[0]}; }
 
-Tensor Tensor::operator+(const Tensor& other) const {
-    if (data_size[0] != other.data_size[0]) {
-        throw std::invalid_argument("Cannot add tensors with different shapes");
-    }
-#ifdef CUDA
-    if (device == DEVICE_CUDA && other.device == DEVICE_CUDA) {
-        Tensor result(shape, 0.0, DEVICE_CUDA);
-        if (!handle_initialized) {
-            cublasCreate(&handle);
-            handle_initialized = true;
-        }
-        const float alpha = 1;
-        float *d_data, *d_other_data, *d_result_data;
-        cudaHostGetDevicePointer(&d_data, data, 0);
-        cudaHostGetDevicePointer(&d_other_data, other.data, 0);
-        cudaHostGetDevicePointer(&d_result_data, result.data, 0);
-        cublasDcopy(handle, data_size[0], d_data, 1, d_result_data, 1);
-        cublasDaxpy(handle, data_size[0], &alpha, d_data, 1, d_result_data, 1);
-        return result;
-    }
-#endif
-    Tensor result(shape);
-    for (int i = 0; i < data_size[0]; i++) {
-        result.data[i] = data[i] + other.data[i];
-    }
-    return result;
-}
-
 Tensor& Tensor::operator+=(const Tensor& other) {
-    if (data_size[0] != other.data_size[0]) {
-        throw std::invalid_argument("Cannot add tensors with different shapes");
-    }
 #ifdef CUDA
-    if (device == DEVICE_CUDA && other.device == DEVICE_CUDA) {
+    if (device == DEVICE_CUDA && other.device == DEVICE_CUDA && shape == other.shape && dtype == DTYPE_FLOAT32 &&
+        other.dtype == DTYPE_FLOAT32) {
         if (!handle_initialized) {
             cublasCreate(&handle);
             handle_initialized = true;
@@ -405,250 +830,219 @@ Tensor& Tensor::operator+=(const Tensor& other) {
         float *d_data = data, *d_other_data = other.data;
         cudaHostGetDevicePointer(&d_data, data, 0);
         cudaHostGetDevicePointer(&d_other_data, other.data, 0);
-        cublasStatus_t status = cublasDaxpy(handle, data_size[0], &alpha, d_other_data, 1, d_data, 1);
+        cublasStatus_t status = cublasSaxpy(handle, data_size[0], &alpha, d_other_data, 1, d_data, 1);
         if (status != CUBLAS_STATUS_SUCCESS) {
             throw std::runtime_error("Tensor addition failed");
         }
         return *this;
     }
 #endif
-    for (int i = 0; i < data_size[0]; i++) {
-        data[i] += other.data[i];
-    }
+    dispatch_dtype(dtype, [&](auto zero) {
+        using T = decltype(zero);
+        broadcast_op_inplace<T>(*this, other, "add", [](T x, T y) { return x + y; });
+    });
     return *this;
 }
 
-Tensor Tensor::operator-(const Tensor& other) const {
-    if (data_size[0] != other.data_size[0]) {
-        throw std::invalid_argument("Cannot subtract tensors with different shapes");
-    }
-    Tensor result(shape);
-    for (int i = 0; i < data_size[0]; i++) {
-        result.data[i] = data[i] - other.data[i];
-    }
-    return result;
-}
-
 Tensor& Tensor::operator-=(const Tensor& other) {
-    if (data_size[0] != other.data_size[0]) {
-        throw std::invalid_argument("Cannot subtract tensors with different shapes");
-    }
-    for (int i = 0; i < data_size[0]; i++) {
-        data[i] -= other.data[i];
-    }
+    dispatch_dtype(dtype, [&](auto zero) {
+        using T = decltype(zero);
+        broadcast_op_inplace<T>(*this, other, "subtract", [](T x, T y) { return x - y; });
+    });
     return *this;
 }
 
-Tensor Tensor::operator*(const Tensor& other) const {
-    if (data_size[0] != other.data_size[0]) {
-        throw std::invalid_argument("Cannot multiply tensors with different shapes");
-    }
-    Tensor result(shape);
-    for (int i = 0; i < data_size[0]; i++) {
-        result.data[i] = data[i] * other.data[i];
-    }
-    return result;
-}
-
 Tensor& Tensor::operator*=(const Tensor& other) {
-    if (data_size[0] != other.data_size[0]) {
-        throw std::invalid_argument("Cannot multiply tensors with different shapes");
-    }
-    for (int i = 0; i < data_size[0]; i++) {
-        data[i] *= other.data[i];
-    }
+    dispatch_dtype(dtype, [&](auto zero) {
+        using T = decltype(zero);
+        broadcast_op_inplace<T>(*this, other, "multiply", [](T x, T y) { return x * y; });
+    });
     return *this;
 }
 
-Tensor Tensor::operator/(const Tensor& other) const {
-    if (data_size[0] != other.data_size[0]) {
-        throw std::invalid_argument("Cannot divide tensors with different shapes");
-    }
-    Tensor result(shape);
-    for (int i = 0; i < data_size[0]; i++) {
-        result.data[i] = data[i] / other.data[i];
-    }
-    return result;
-}
-
 Tensor& Tensor::operator/=(const Tensor& other) {
-    if (data_size[0] != other.data_size[0]) {
-        throw std::invalid_argument("Cannot divide tensors with different shapes");
-    }
-    for (int i = 0; i < data_size[0]; i++) {
-        data[i] /= other.data[i];
-    }
+    check_floating(*this, "divide");
+    dispatch_dtype(dtype, [&](auto zero) {
+        using T = decltype(zero);
+        broadcast_op_inplace<T>(*this, other, "divide", [](T x, T y) { return x / y; });
+    });
     return *this;
 }
 
-Tensor Tensor::operator+(float other) const {
-    Tensor result(shape);
-    for (int i = 0; i < data_size[0]; i++) {
-        result.data[i] = data[i] + other;
-    }
-    return result;
-}
-
 Tensor& Tensor::operator+=(float other) {
-    for (int i = 0; i < data_size[0]; i++) {
-        data[i] += other;
-    }
+    scalar_op(*this, other, Expressions::OP_ADD, *this, [](auto x, auto y) { return x + y; });
     return *this;
 }
 
-Tensor Tensor::operator-(float other) const {
-    Tensor result(shape);
-    for (int i = 0; i < data_size[0]; i++) {
-        result.data[i] = data[i] - other;
-    }
-    return result;
-}
-
 Tensor& Tensor::operator-=(float other) {
-    for (int i = 0; i < data_size[0]; i++) {
-        data[i] -= other;
-    }
+    scalar_op(*this, other, Expressions::OP_SUBTRACT, *this, [](auto x, auto y) { return x - y; });
     return *this;
 }
 
-Tensor Tensor::operator*(float other) const {
+Tensor& Tensor::operator*=(float other) {
 #ifdef CUDA
-    if (device == DEVICE_CUDA) {
-        Tensor result(shape, 0.0, DEVICE_CUDA);
+    if (device == DEVICE_CUDA && dtype == DTYPE_FLOAT32) {
         if (!handle_initialized) {
             cublasCreate(&handle);
             handle_initialized = true;
         }
         const float alpha = other;
-        float *d_data = data, *d_result_data = result.data;
+        float* d_data = data;
         cudaHostGetDevicePointer(&d_data, data, 0);
-        cudaHostGetDevicePointer(&d_result_data, result.data, 0);
-        cublasDcopy(handle, data_size[0], d_data, 1, d_result_data, 1);
-        cublasStatus_t status = cublasDscal(handle, data_size[0], &alpha, d_result_data, 1);
+        cublasStatus_t status = cublasSscal(handle, data_size[0], &alpha, d_data, 1);
         if (status != CUBLAS_STATUS_SUCCESS) {
             throw std::runtime_error("Tensor multiplication failed");
         }
-        return result;
+        return *this;
     }
 #endif
-    Tensor result(shape);
-    for (int i = 0; i < data_size[0]; i++) {
-        result.data[i] = data[i] * other;
-    }
-    return result;
+    scalar_op(*this, other, Expressions::OP_MULTIPLY, *this, [](auto x, auto y) { return x * y; });
+    return *this;
 }
 
-Tensor& Tensor::operator*=(float other) {
+Tensor& Tensor::operator/=(float other) {
 #ifdef CUDA
-    if (device == DEVICE_CUDA) {
+    if (device == DEVICE_CUDA && dtype == DTYPE_FLOAT32) {
         if (!handle_initialized) {
             cublasCreate(&handle);
             handle_initialized = true;
         }
-        const float alpha = other;
+        const float alpha = 1.0 / other;
         float* d_data = data;
         cudaHostGetDevicePointer(&d_data, data, 0);
-        cublasStatus_t status = cublasDscal(handle, data_size[0], &alpha, d_data, 1);
+        cublasStatus_t status = cublasSscal(handle, data_size[0], &alpha, d_data, 1);
         if (status != CUBLAS_STATUS_SUCCESS) {
-            throw std::runtime_error("Tensor multiplication failed");
+            throw std::runtime_error("Tensor division failed");
         }
         return *this;
     }
 #endif
-    for (int i = 0; i < data_size[0]; i++) {
-        data[i] *= other;
-    }
+    scalar_op(*this, other, Expressions::OP_DIVIDE, *this, [](auto x, auto y) { return x / y; });
     return *this;
 }
 
-Tensor Tensor::operator/(float other) const {
+namespace Expressions {
+
+std::vector<int> broadcast_shape(BinaryOp op, const std::vector<int>& a, const std::vector<int>& b) {
+    return ::broadcast_shape(a, b, op_name(op));
+}
+
+Tensor compute(BinaryOp op, const Tensor& a, const Tensor& b) {
 #ifdef CUDA
-    if (device == DEVICE_CUDA) {
+    if (op == OP_ADD && a.device == DEVICE_CUDA && b.device == DEVICE_CUDA && a.shape == b.shape &&
+        a.dtype == DTYPE_FLOAT32 && b.dtype == DTYPE_FLOAT32) {
+        Tensor result(a.shape, uninitialized, DEVICE_CUDA);
         if (!handle_initialized) {
             cublasCreate(&handle);
             handle_initialized = true;
         }
-        const float alpha = 1.0 / other;
-        Tensor result(shape, 0.0, DEVICE_CUDA);
-        float *d_data = data, *d_result_data = result.data;
-        cudaHostGetDevicePointer(&d_data, data, 0);
+        const float alpha = 1;
+        float *d_data, *d_other_data, *d_result_data;
+        cudaHostGetDevicePointer(&d_data, a.data, 0);
+        cudaHostGetDevicePointer(&d_other_data, b.data, 0);
         cudaHostGetDevicePointer(&d_result_data, result.data, 0);
-        cublasDcopy(handle, data_size[0], d_data, 1, d_result_data, 1);
-        cublasStatus_t status = cublasDscal(handle, data_size[0], &alpha, d_result_data, 1);
-        if (status != CUBLAS_STATUS_SUCCESS) {
-            throw std::runtime_error("Tensor division failed");
-        }
+        cublasScopy(handle, a.data_size[0], d_data, 1, d_result_data, 1);
+        cublasSaxpy(handle, a.data_size[0], &alpha, d_other_data, 1, d_result_data, 1);
         return result;
     }
 #endif
-    Tensor result(shape);
-    for (int i = 0; i < data_size[0]; i++) {
-        result.data[i] = data[i] / other;
-    }
-    return result;
+    if (op == OP_DIVIDE) {
+        check_floating(a, "divide");
+    }
+    return dispatch_dtype(a.dtype, [&](auto zero) {
+        using T = decltype(zero);
+        switch (op) {
+        case OP_ADD:
+            return broadcast_op<T>(a, b, "add", [](T x, T y) { return x + y; });
+        case OP_SUBTRACT:
+            return broadcast_op<T>(a, b, "subtract", [](T x, T y) { return x - y; });
+        case OP_MULTIPLY:
+            return broadcast_op<T>(a, b, "multiply", [](T x, T y) { return x * y; });
+        default:
+            return broadcast_op<T>(a, b, "divide", [](T x, T y) { return x / y; });
+        }
+    });
 }
 
-Tensor& Tensor::operator/=(float other) {
+Tensor compute(BinaryOp op, const Tensor& a, float b) {
 #ifdef CUDA
-    if (device == DEVICE_CUDA) {
+    if ((op == OP_MULTIPLY || op == OP_DIVIDE) && a.device == DEVICE_CUDA && a.dtype == DTYPE_FLOAT32) {
+        Tensor result(a.shape, uninitialized, DEVICE_CUDA);
         if (!handle_initialized) {
             cublasCreate(&handle);
             handle_initialized = true;
         }
-        const float alpha = 1.0 / other;
-        float* d_data = data;
-        cudaHostGetDevicePointer(&d_data, data, 0);
-        cublasStatus_t status = cublasDscal(handle, data_size[0], &alpha, d_data, 1);
+        const float alpha = op == OP_MULTIPLY ? b : 1.0 / b;
+        float *d_data = a.data, *d_result_data = result.data;
+        cudaHostGetDevicePointer(&d_data, a.data, 0);
+        cudaHostGetDevicePointer(&d_result_data, result.data, 0);
+        cublasScopy(handle, a.data_size[0], d_data, 1, d_result_data, 1);
+        cublasStatus_t status = cublasSscal(handle, a.data_size[0], &alpha, d_result_data, 1);
         if (status != CUBLAS_STATUS_SUCCESS) {
-            throw std::runtime_error("Tensor division failed");
+            throw std::runtime_error(op == OP_MULTIPLY ? "Tensor multiplication failed" : "Tensor division failed");
         }
-        return *this;
+        return result;
     }
 #endif
-    for (int i = 0; i < data_size[0]; i++) {
-        data[i] /= other;
-    }
-    return *this;
-}
-
-Tensor operator+(float other, const Tensor& tensor) { return tensor + other; }
-
-Tensor operator-(float other, const Tensor& tensor) {
-    Tensor result(tensor.shape);
-    for (int i = 0; i < tensor.data_size[0]; i++) {
-        result.data[i] = other - tensor.data[i];
+    Tensor result(a.shape, uninitialized, a.dtype);
+    switch (op) {
+    case OP_ADD:
+        scalar_op(a, b, op, result, [](auto x, auto y) { return x + y; });
+        break;
+    case OP_SUBTRACT:
+        scalar_op(a, b, op, result, [](auto x, auto y) { return x - y; });
+        break;
+    case OP_MULTIPLY:
+        scalar_op(a, b, op, result, [](auto x, auto y) { return x * y; });
+        break;
+    case OP_DIVIDE:
+        scalar_op(a, b, op, result, [](auto x, auto y) { return x / y; });
+        break;
     }
     return result;
 }
 
-Tensor operator*(float other, const Tensor& tensor) { return tensor * other; }
-
-Tensor operator/(float other, const Tensor& tensor) {
-    Tensor result(tensor.shape);
-    for (int i = 0; i < tensor.data_size[0]; i++) {
-        result.data[i] = other / tensor.data[i];
+Tensor compute(BinaryOp op, float a, const Tensor& b) {
+    if (op == OP_ADD || op == OP_MULTIPLY) {
+        return compute(op, b, a);
+    }
+    Tensor result(b.shape, uninitialized, b.dtype);
+    if (op == OP_SUBTRACT) {
+        scalar_op(b, a, op, result, [](auto x, auto y) { return y - x; });
+    } else {
+        scalar_op(b, a, op, result, [](auto x, auto y) { return y / x; });
     }
     return result;
 }
 
-Tensor Tensor::operator-() const {
-    Tensor result(shape);
-    for (int i = 0; i < data_size[0]; i++) {
-        result.data[i] = -data[i];
-    }
+Tensor compute(UnaryOp op, const Tensor& a) {
+    if (op == OP_SQRT) {
+        check_floating(a, "take the square root of");
+    }
+    Tensor result(a.shape, uninitialized, a.dtype);
+    dispatch_dtype(a.dtype, [&](auto zero) {
+        using T = decltype(zero);
+        if (op == OP_NEGATE) {
+            map_unary<T, T>(a, result, [](T x) { return -x; });
+        } else {
+            map_unary<T, T>(a, result, [](T x) { return (T)std::sqrt(x); });
+        }
+    });
     return result;
 }
 
+} // namespace Expressions
+
 std::ostream& operator<<(std::ostream& os, const Tensor& tensor) {
     tensor.print(os, 0, 0);
     return os;
 }
 
-void Tensor::print(std::ostream& os, int dim, int index) const {
+void Tensor::print(std::ostream& os, int dim, int offset) const {
     if (dim == (int)shape.size() - 1) {
         os << "[";
         for (int i = 0; i < shape[dim]; i++) {
-            os << data[index + i];
+            dispatch_dtype(dtype, [&](auto zero) { os << data_as<decltype(zero)>()[offset + i * strides[dim]]; });
             if (i != shape[dim] - 1) {
                 os << ", ";
             }
@@ -657,7 +1051,7 @@ void Tensor::print(std::ostream& os, int dim, int index) const {
     } else {
         os << "[";
         for (int i = 0; i < shape[dim]; i++) {
-            print(os, dim + 1, index + i * data_size[dim + 1]);
+            print(os, dim + 1, offset + i * strides[dim]);
             if (i != shape[dim] - 1) {
                 os << ", ";
             }
@@ -667,54 +1061,51 @@ void Tensor::print(std::ostream& os, int dim, int index) const {
 }
 
 bool Tensor::operator==(const Tensor& other) const {
-    if (data_size[0] != other.data_size[0]) {
+    if (data_size[0] != other.data_size[0] || dtype != other.dtype) {
         return false;
     }
-    for (int i = 0; i < data_size[0]; i++) {
-        if (data[i] != other.data[i]) {
-            return false;
-        }
-    }
-    return true;
+    Tensor reshaped;
+    const Tensor& rhs = match_shape(*this, other, reshaped);
+    bool equal = true;
+    dispatch_dtype(dtype, [&](auto zero) {
+        using T = decltype(zero);
+        const T *x = data_as<T>(), *y = rhs.data_as<T>();
+        for_each_row<2>(
+            shape, {&strides, &rhs.strides},
+            [&](std::array<long, 2> off, std::array<int, 2> st, int n) {
+                for (int i = 0; i < n && equal; i++) {
+                    equal = x[off[0] + (long)i * st[0]] == y[off[1] + (long)i * st[1]];
+                }
+            },
+            false);
+    });
+    return equal;
 }
 
 bool Tensor::operator!=(const Tensor& other) const { return !(*this == other); }
 
 Tensor& Tensor::apply_function(std::function<float(float)> f) {
-    // std::cerr << "apply_function " << data_size[0] << " " << this << " " << data << std::endl;
-    for (int i = 0; i < data_size[0]; i++) {
-        data[i] = f(data[i]);
-    }
+    require_float("apply a function of floats to");
+    map_unary<float, float>(*this, *this, f);
     return *this;
 }
 
 Tensor Tensor::calc_function(std::function<float(float)> f) const {
-    Tensor result(shape);
-    for (int i = 0; i < data_size[0]; i++) {
-        result.data[i] = f(data[i]);
-    }
+    require_float("apply a function of floats to");
+    Tensor result(shape, uninitialized);
+    map_unary<float, float>(*this, result, f);
     return result;
 }
 
 Tensor& Tensor::apply_function(std::function<float(float, float)> f, const Tensor& other) {
-    if (data_size[0] != other.data_size[0]) {
-        throw std::invalid_argument("Tensors must have the same shape");
-    }
-    for (int i = 0; i < data_size[0]; i++) {
-        data[i] = f(data[i], other.data[i]);
-    }
+    require_float("apply a function of floats to");
+    broadcast_op_inplace<float>(*this, other, "combine", f);
     return *this;
 }
 
 Tensor Tensor::calc_function(std::function<float(float, float)> f, const Tensor& other) const {
-    if (data_size[0] != other.data_size[0]) {
-        throw std::invalid_argument("Tensors must have the same shape");
-    }
-    Tensor result(shape);
-    for (int i = 0; i < data_size[0]; i++) {
-        result.data[i] = f(data[i], other.data[i]);
-    }
-    return result;
+    require_float("apply a function of floats to");
+    return broadcast_op<float>(*this, other, "combine", f);
 }
 
 } // namespace FJML
@@ -1,4 +1,5 @@
 #include <catch2/catch_all.hpp>
+#include <cmath>
 
 #include "../include/FJML/activations.h"
 
@@ -34,6 +35,19 @@ TEST_CASE("Test activations", "[activations]") {
         REQUIRE(dy.at(0) == Approx(0.41997434161402614));
         REQUIRE(dy.at(1) == Approx(0.07065082485316452));
         REQUIRE(dy.at(2) == Approx(0.41997434161402614));
+
+        // Small inputs keep their relative precision, on both sides of the switch to the exponential form
+        std::vector<float> values;
+        for (float magnitude : {1e-30f, 1e-8f, 1e-7f, 1e-6f, 1e-5f, 1e-3f, 0.1f, 0.5f, 0.6249f, 0.625f, 0.7f, 3.0f}) {
+            values.push_back(magnitude);
+            values.push_back(-magnitude);
+        }
+        values.push_back(0);
+        Tensor small = Tensor::array(values);
+        Tensor small_y = Activations::tanh.forward(small);
+        for (int i = 0; i < (int)values.size(); i++) {
+            REQUIRE(small_y.at(i) == Approx(std::tanh(values[i])).epsilon(1e-6).margin(0));
+        }
     }
 
     SECTION("Test relu") {
@@ -92,6 +106,59 @@ TEST_CASE("Test activations", "[activations]") {
         REQUIRE(dy.at(2) == Approx(0.07232949137687683));
     }
 
+    SECTION("Test bulk kernels") {
+        // Long enough to use the vectorized kernels, with a tail that does not fill a vector
+        Tensor inputs({1003});
+        for (int i = 0; i < 1003; i++) {
+            inputs.at(i) = (i - 501) / 25.0;
+        }
+        for (const Activations::Activation& activ : Activations::activations) {
+            REQUIRE(activ.func_kernel != nullptr);
+            Tensor y = activ.forward(inputs), dy = activ.backward(inputs);
+            for (int i = 0; i < 1003; i++) {
+                REQUIRE(y.at(i) == Approx(activ.func(inputs.at(i))).margin(1e-6));
+                REQUIRE(dy.at(i) == Approx(activ.derivative(inputs.at(i))).margin(1e-6));
+            }
+            Tensor in_place = inputs;
+            activ.apply(in_place);
+            REQUIRE(in_place == y);
+        }
+
+        // Views that are not contiguous, and user-defined activations, apply the function per element
+        Tensor matrix = Tensor::array(std::vector<std::vector<float>>{{1, -2}, {-3, 4}});
+        REQUIRE(Activations::relu.forward(matrix.permute({1, 0})) ==
+                Tensor::array(std::vector<std::vector<float>>{{1, 0}, {0, 4}}));
+        Activations::Activation square("square", [](float x) { return x * x; }, [](float x) { return 2 * x; });
+        REQUIRE(square.func_kernel == nullptr);
+        REQUIRE(square.forward(matrix) == Tensor::array(std::vector<std::vector<float>>{{1, 4}, {9, 16}}));
+    }
+
+    SECTION("Test double precision") {
+        Tensor inputs({101}, DTYPE_FLOAT64);
+        double* x = inputs.data_as<double>();
+        for (int i = 0; i < 101; i++) {
+            x[i] = (i - 50) / 7.0;
+        }
+        for (const Activations::Activation& activ : Activations::activations) {
+            REQUIRE(activ.double_kernel != nullptr);
+            Tensor y = activ.forward(inputs);
+            REQUIRE(y.dtype == DTYPE_FLOAT64);
+            REQUIRE(y.shape == inputs.shape);
+            for (int i = 0; i < 101; i++) {
+                REQUIRE(y.data_as<double>()[i] == Approx(activ.func(x[i])).epsilon(1e-6).margin(1e-6));
+            }
+        }
+        // Computed in double, not rounded through a float
+        Tensor tiny({1}, DTYPE_FLOAT64);
+        tiny.data_as<double>()[0] = 1e-3;
+        REQUIRE(Activations::sigmoid.forward(tiny).data_as<double>()[0] == 1 / (1 + std::exp(-1e-3)));
+        REQUIRE(Activations::tanh.forward(tiny).data_as<double>()[0] == std::tanh(1e-3));
+
+        Activations::Activation square("square", [](float x) { return x * x; }, [](float x) { return 2 * x; });
+        REQUIRE_THROWS_AS(square.forward(inputs), std::runtime_error);
+        REQUIRE_THROWS_AS(Activations::relu.forward(Tensor({3}, DTYPE_INT32)), std::invalid_argument);
+    }
+
     SECTION("Test apply_derivative") {
         Activations::swish.apply_derivative(x);
         REQUIRE(x.at(0) == Approx(0.9276705384254456));
@@ -0,0 +1,89 @@
+#include <catch2/catch_all.hpp>
+#include <cstdint>
+
+#include "../include/FJML/allocator.h"
+#include "../include/FJML/tensor.h"
+
+using namespace FJML;
+
+TEST_CASE("Testing allocator", "[allocator]") {
+    SECTION("Testing size class cache") {
+        { Tensor warmup({123, 45}); }
+        Memory::reset_stats();
+        size_t in_use = Memory::stats().bytes_in_use;
+        {
+            Tensor a({123, 45});
+            REQUIRE(Memory::stats().hits == 1);
+            REQUIRE(Memory::stats().misses == 0);
+            REQUIRE(Memory::stats().bytes_in_use >= in_use + 123 * 45 * sizeof(float));
+        }
+        REQUIRE(Memory::stats().bytes_in_use == in_use);
+        REQUIRE(Memory::stats().bytes_held >= 123 * 45 * sizeof(float));
+
+        Memory::release();
+        REQUIRE(Memory::stats().bytes_held == 0);
+        Tensor b({123, 45});
+        REQUIRE(Memory::stats().misses == 1);
+    }
+
+    SECTION("Testing alignment") {
+        for (int size : {1, 3, 17, 100, 1000}) {
+            Tensor a({size});
+            REQUIRE((uintptr_t)a.data % Memory::ALIGNMENT == 0);
+        }
+        Memory::StepArena arena;
+        for (int size : {1, 3, 17, 100}) {
+            Tensor a({size});
+            REQUIRE((uintptr_t)a.data % Memory::ALIGNMENT == 0);
+        }
+    }
+
+    SECTION("Testing thread cache") {
+        Memory::set_thread_cache(true);
+        { Tensor a({77}); }
+        Memory::reset_stats();
+        { Tensor a({77}, 2); }
+        REQUIRE(Memory::stats().hits == 1);
+        Memory::set_thread_cache(false);
+    }
+
+    SECTION("Testing copy assignment reuses storage") {
+        Tensor a({10, 10}, 1), b({20, 5}, 2);
+        float* data = a.data;
+        a = b;
+        REQUIRE(a.data == data);
+        REQUIRE(a.shape == std::vector<int>{20, 5});
+        REQUIRE(a.at(3, 4) == 2);
+    }
+
+    SECTION("Testing step arena") {
+        Memory::StepArena arena(1 << 16);
+        Tensor survivor({16}, 5);
+        float* first;
+        {
+            Tensor a({100}, 1);
+            first = a.data;
+            REQUIRE(arena.bytes_used() > 0);
+        }
+        arena.reset();
+        {
+            // The first chunk still holds the survivor, so it is retired and a new one is used
+            Tensor a({100}, 1);
+            REQUIRE(a.data != first);
+        }
+        arena.reset();
+        REQUIRE(arena.bytes_used() == 0);
+        float* second;
+        {
+            Tensor a({100}, 3);
+            second = a.data;
+        }
+        arena.reset();
+        {
+            // Nothing survived, so the chunk is rewound and the same memory is handed out again
+            Tensor a({100}, 4);
+            REQUIRE(a.data == second);
+        }
+        REQUIRE(survivor.at(15) == 5);
+    }
+}
@@ -1,6 +1,11 @@
 #include <catch2/catch_all.hpp>
 
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+
 #include "../include/FJML/data.h"
+#include "../include/FJML/parallel.h"
 
 using namespace FJML;
 
@@ -38,6 +43,12 @@ TEST_CASE("Testing data", "[data]") {
                 }
             }
         }
+
+        REQUIRE(Data::one_hot(Tensor::from_vector(std::vector<int32_t>{2, 0}), 3) ==
+                Tensor::array(std::vector<std::vector<float>>{{0, 0, 1}, {1, 0, 0}}));
+        REQUIRE_THROWS_AS(Data::one_hot(Tensor::from_vector(std::vector<int32_t>{3}), 3), std::out_of_range);
+        REQUIRE_THROWS_AS(Data::one_hot(Tensor::array(std::vector<float>{-1}), 3), std::out_of_range);
+        REQUIRE_THROWS_AS(Data::one_hot(Tensor::array(std::vector<float>{0.5}), 3), std::out_of_range);
     }
 
     SECTION("Testing split") {
@@ -61,4 +72,287 @@ TEST_CASE("Testing data", "[data]") {
             REQUIRE(x_test.at(i, 2) == y_test.at(i, 1) + 1);
         }
     }
+
+    SECTION("Testing batch loader") {
+        Tensor x({10, 3}), y({10});
+        for (int i = 0; i < 10; i++) {
+            for (int j = 0; j < 3; j++) {
+                x.at(i, j) = i * 3 + j;
+            }
+            y.at(i) = i;
+        }
+
+        Data::BatchLoader loader(x, y, 4, true, 3);
+        REQUIRE(loader.num_batches() == 3);
+        std::vector<std::vector<float>> orders;
+        for (int epoch = 0; epoch < 3; epoch++) {
+            // Every row appears once per epoch, with its target, and the last batch has the rest of the rows
+            std::vector<float> order;
+            Tensor x_batch, y_batch;
+            for (int b = 0; b < 3; b++) {
+                loader.next(x_batch, y_batch);
+                REQUIRE(x_batch.shape == std::vector<int>{b < 2 ? 4 : 2, 3});
+                REQUIRE(y_batch.shape == std::vector<int>{b < 2 ? 4 : 2});
+                for (int i = 0; i < x_batch.shape[0]; i++) {
+                    REQUIRE(x_batch.at(i, 0) == y_batch.at(i) * 3);
+                    REQUIRE(x_batch.at(i, 2) == y_batch.at(i) * 3 + 2);
+                    order.push_back(y_batch.at(i));
+                }
+            }
+            std::vector<float> sorted = order;
+            std::sort(sorted.begin(), sorted.end());
+            for (int i = 0; i < 10; i++) {
+                REQUIRE(sorted[i] == i);
+            }
+            orders.push_back(order);
+        }
+        REQUIRE((orders[0] != orders[1] || orders[1] != orders[2]));
+
+        Data::BatchLoader in_order(x, y, 3, false, 1);
+        Tensor x_batch, y_batch;
+        for (int i = 0; i < 12; i += 3) {
+            in_order.next(x_batch, y_batch);
+            REQUIRE(y_batch.at(0) == i % 10);
+        }
+
+        REQUIRE_THROWS_AS(Data::BatchLoader(x, y.slice(0, 5), 4), std::invalid_argument);
+        REQUIRE_THROWS_AS(Data::BatchLoader(x, y, 0), std::invalid_argument);
+        REQUIRE_THROWS_AS(Data::BatchLoader(x, y, 4, true, 0), std::invalid_argument);
+
+        SECTION("Testing batch loader with integer labels") {
+            Tensor labels = y.view({10}).astype(DTYPE_INT32);
+            Data::BatchLoader label_loader(x, labels, 4, true, 3);
+            std::vector<int> order;
+            for (int b = 0; b < 3; b++) {
+                label_loader.next(x_batch, y_batch);
+                REQUIRE(y_batch.dtype == DTYPE_INT32);
+                REQUIRE(y_batch.shape == std::vector<int>{b < 2 ? 4 : 2});
+                const int32_t* classes = y_batch.data_as<int32_t>();
+                for (int i = 0; i < y_batch.shape[0]; i++) {
+                    REQUIRE(x_batch.at(i, 1) == classes[i] * 3 + 1);
+                    order.push_back(classes[i]);
+                }
+            }
+            std::sort(order.begin(), order.end());
+            for (int i = 0; i < 10; i++) {
+                REQUIRE(order[i] == i);
+            }
+            REQUIRE_THROWS_AS(Data::BatchLoader(x, labels.slice(0, 5), 4), std::invalid_argument);
+        }
+    }
+
+    SECTION("Testing load csv") {
+        std::ofstream("/tmp/fjml_data.csv") << "label,a,b\n"
+                                               "1,0.5,-2\n"
+                                               "\n"
+                                               "0, 1e3 ,.25\r\n"
+                                               "2,-1.5E-2,nan\n"
+                                               "3,1e-30,123456789012345678901234";
+
+        Tensor x, y;
+        Data::load_csv("/tmp/fjml_data.csv", x, y);
+        REQUIRE(x.shape == std::vector<int>{4, 2});
+        REQUIRE(y.shape == std::vector<int>{4, 1});
+        std::vector<float> labels{1, 0, 2, 3};
+        std::vector<std::vector<float>> inputs{{0.5, -2}, {1e3, 0.25}, {-1.5e-2, 0}, {1e-30f, 123456789012345678901234.0f}};
+        for (int i = 0; i < 4; i++) {
+            REQUIRE(y.at(i, 0) == labels[i]);
+            for (int j = 0; j < 2; j++) {
+                if (i == 2 && j == 1) {
+                    REQUIRE(std::isnan(x.at(i, j)));
+                } else {
+                    REQUIRE(x.at(i, j) == inputs[i][j]);
+                }
+            }
+        }
+
+        Tensor all = Data::load_csv("/tmp/fjml_data.csv", true, 2);
+        REQUIRE(all.shape == std::vector<int>{2, 3});
+        REQUIRE(all.at(1, 0) == 0);
+        REQUIRE(all.at(1, 1) == 1000);
+        Data::load_csv("/tmp/fjml_data.csv", x, y, 2, true, 1);
+        REQUIRE(x.shape == std::vector<int>{1, 2});
+        REQUIRE(x.at(0, 1) == 0.5);
+        REQUIRE(y.at(0, 0) == -2);
+
+        Tensor classes;
+        Data::load_csv("/tmp/fjml_data.csv", x, classes, 0, true, -1, DTYPE_INT32);
+        REQUIRE(classes == Tensor::from_vector(std::vector<int32_t>{1, 0, 2, 3}));
+        REQUIRE(x.shape == std::vector<int>{4, 2});
+        REQUIRE(x.at(1, 0) == 1000);
+        // The labels must be integers
+        REQUIRE_THROWS_AS(Data::load_csv("/tmp/fjml_data.csv", x, classes, 1, true, -1, DTYPE_INT32),
+                          std::runtime_error);
+        REQUIRE_THROWS_AS(Data::load_csv("/tmp/fjml_data.csv", x, classes, -1, true, -1, DTYPE_INT32),
+                          std::invalid_argument);
+        REQUIRE_THROWS_AS(Data::load_csv("/tmp/fjml_data.csv", x, classes, 0, true, -1, DTYPE_FLOAT64),
+                          std::invalid_argument);
+
+        std::ofstream("/tmp/fjml_bad.csv") << "1,2\n3,4\n5\n";
+        REQUIRE_THROWS_AS(Data::load_csv("/tmp/fjml_bad.csv", false), std::runtime_error);
+        std::ofstream("/tmp/fjml_bad.csv") << "1,2\n3,x\n";
+        REQUIRE_THROWS_AS(Data::load_csv("/tmp/fjml_bad.csv", false), std::runtime_error);
+        REQUIRE_THROWS_AS(Data::load_csv("/tmp/fjml_bad.csv", x, y, 2, false), std::invalid_argument);
+        REQUIRE_THROWS_AS(Data::load_csv("/tmp/fjml_missing.csv"), std::invalid_argument);
+    }
+
+    SECTION("Testing load csv in parallel") {
+        // Large enough to be split into pieces, which must be parsed into the right rows
+        int rows = 30000;
+        {
+            std::ofstream file("/tmp/fjml_large.csv");
+            file << std::setprecision(9) << "label,a,b,c\n";
+            for (int i = 0; i < rows; i++) {
+                file << i % 10 << "," << i << "," << i * 0.125 << "," << -i / 4.0 << "\n";
+            }
+        }
+        int threads = get_num_threads();
+        set_num_threads(4);
+        Tensor x, y;
+        Data::load_csv("/tmp/fjml_large.csv", x, y);
+        REQUIRE(x.shape == std::vector<int>{rows, 3});
+        for (int i = 0; i < rows; i++) {
+            REQUIRE(y.at(i, 0) == i % 10);
+            REQUIRE(x.at(i, 0) == i);
+            REQUIRE(x.at(i, 1) == i * 0.125f);
+            REQUIRE(x.at(i, 2) == -i / 4.0f);
+        }
+
+        // Streaming gives the same rows, a batch at a time
+        Data::CsvStream stream("/tmp/fjml_large.csv");
+        REQUIRE(stream.num_columns() == 4);
+        for (int pass = 0; pass < 2; pass++) {
+            Tensor x_batch, y_batch;
+            int row = 0;
+            while (stream.next(7000, x_batch, y_batch)) {
+                REQUIRE(x_batch.shape == std::vector<int>{std::min(7000, rows - row), 3});
+                for (int i = 0; i < x_batch.shape[0]; i++, row++) {
+                    REQUIRE(y_batch.at(i, 0) == row % 10);
+                    REQUIRE(x_batch.at(i, 0) == row);
+                    REQUIRE(x_batch.at(i, 2) == -row / 4.0f);
+                }
+            }
+            REQUIRE(row == rows);
+            REQUIRE_FALSE(stream.next(7000, x_batch, y_batch));
+            stream.rewind();
+        }
+        Data::CsvStream label_stream("/tmp/fjml_large.csv", 0, true, DTYPE_INT32);
+        Tensor x_batch, labels;
+        REQUIRE(label_stream.next(100, x_batch, labels));
+        REQUIRE(labels.shape == std::vector<int>{100});
+        REQUIRE(labels.data_as<int32_t>()[13] == 3);
+        REQUIRE(x_batch.at(13, 0) == 13);
+        REQUIRE_THROWS_AS(Data::CsvStream("/tmp/fjml_large.csv", 4), std::invalid_argument);
+        REQUIRE_THROWS_AS(Data::CsvStream("/tmp/fjml_large.csv", 0, true, DTYPE_FLOAT16), std::invalid_argument);
+        set_num_threads(threads);
+    }
+
+    SECTION("Testing binary data files") {
+        Tensor x({3, 4, 5});
+        for (int i = 0; i < 60; i++) {
+            x.data[i] = i * 0.1f - 2;
+        }
+        Data::save_binary("/tmp/fjml_data.bin", x);
+        Tensor loaded = Data::load_binary("/tmp/fjml_data.bin");
+        REQUIRE(loaded.shape == x.shape);
+        REQUIRE(loaded == x);
+
+        // Views are saved as their elements
+        Data::save_binary("/tmp/fjml_data.bin", x.slice(1, 3, 1));
+        REQUIRE(Data::load_binary("/tmp/fjml_data.bin") == x.slice(1, 3, 1));
+
+        std::ofstream("/tmp/fjml_bad.bin") << "not a data file";
+        REQUIRE_THROWS_AS(Data::load_binary("/tmp/fjml_bad.bin"), std::runtime_error);
+        REQUIRE_THROWS_AS(Data::load_binary("/tmp/fjml_missing.bin"), std::invalid_argument);
+    }
+
+    SECTION("Testing mapped datasets") {
+        Tensor x({20, 2, 3}), y({20, 1});
+        for (int i = 0; i < 20; i++) {
+            for (int j = 0; j < 6; j++) {
+                x.data[i * 6 + j] = i * 10 + j;
+            }
+            y.at(i, 0) = i;
+        }
+        Data::save_binary("/tmp/fjml_x.bin", x);
+        Data::save_binary("/tmp/fjml_y.bin", y);
+
+        Data::MappedDataset mapped_x("/tmp/fjml_x.bin"), mapped_y("/tmp/fjml_y.bin");
+        REQUIRE(mapped_x.shape() == x.shape);
+        REQUIRE(mapped_x.num_rows() == 20);
+        REQUIRE(mapped_x.row_size() == 6);
+        REQUIRE(mapped_x.tensor() == x);
+        REQUIRE(mapped_x.rows(5, 8) == x.slice(5, 8));
+        REQUIRE(mapped_x.row(7)[2] == 72);
+        REQUIRE_THROWS_AS(mapped_x.rows(5, 21), std::out_of_range);
+        REQUIRE_THROWS_AS(mapped_x.rows(5, 5), std::out_of_range);
+        REQUIRE_NOTHROW(mapped_x.prefetch(0, 20));
+        REQUIRE_NOTHROW(mapped_x.release(0, 20));
+
+        // Writing to a view does not change the file
+        Tensor view = mapped_x.rows(0, 1);
+        view.data[0] = -1;
+        REQUIRE(mapped_x.row(0)[0] == -1);
+        REQUIRE(Data::MappedDataset("/tmp/fjml_x.bin").row(0)[0] == 0);
+        view.data[0] = 0;
+
+        SECTION("Testing block shuffling") {
+            // Every row appears once per epoch, and each batch comes from a single block
+            Data::BatchLoader loader(mapped_x, mapped_y, 5, true, 2, 5);
+            REQUIRE(loader.num_batches() == 4);
+            for (int epoch = 0; epoch < 3; epoch++) {
+                std::vector<float> order;
+                Tensor x_batch, y_batch;
+                for (int b = 0; b < 4; b++) {
+                    loader.next(x_batch, y_batch);
+                    REQUIRE(x_batch.shape == std::vector<int>{5, 2, 3});
+                    for (int i = 0; i < 5; i++) {
+                        REQUIRE(x_batch.at(i, 1, 2) == y_batch.at(i, 0) * 10 + 5);
+                        REQUIRE((int)y_batch.at(i, 0) / 5 == (int)y_batch.at(0, 0) / 5);
+                        order.push_back(y_batch.at(i, 0));
+                    }
+                }
+                std::sort(order.begin(), order.end());
+                for (int i = 0; i < 20; i++) {
+                    REQUIRE(order[i] == i);
+                }
+            }
+
+            // Blocks that do not divide the rows, or are larger than the data
+            for (int block_rows : {3, 7, 100}) {
+                Data::BatchLoader blocks(x, y, 6, true, 2, block_rows);
+                std::vector<float> order;
+                Tensor x_batch, y_batch;
+                for (int b = 0; b < blocks.num_batches(); b++) {
+                    blocks.next(x_batch, y_batch);
+                    for (int i = 0; i < x_batch.shape[0]; i++) {
+                        order.push_back(y_batch.at(i, 0));
+                    }
+                }
+                std::sort(order.begin(), order.end());
+                REQUIRE(order.size() == 20);
+                for (int i = 0; i < 20; i++) {
+                    REQUIRE(order[i] == i);
+                }
+            }
+            REQUIRE_THROWS_AS(Data::BatchLoader(x, y, 6, true, 2, -1), std::invalid_argument);
+        }
+
+        SECTION("Testing csv to binary") {
+            std::ofstream("/tmp/fjml_convert.csv") << "label,a,b\n1,0.5,-2\n\n0,3,4\n";
+            Data::csv_to_binary("/tmp/fjml_convert.csv", "/tmp/fjml_convert_x.bin", "/tmp/fjml_convert_y.bin");
+            Tensor converted_x = Data::load_binary("/tmp/fjml_convert_x.bin");
+            REQUIRE(converted_x.shape == std::vector<int>{2, 2});
+            REQUIRE(converted_x.at(0, 1) == -2);
+            REQUIRE(converted_x.at(1, 0) == 3);
+            Data::MappedDataset converted_y("/tmp/fjml_convert_y.bin");
+            REQUIRE(converted_y.shape() == std::vector<int>{2, 1});
+            REQUIRE(converted_y.row(0)[0] == 1);
+            REQUIRE(converted_y.row(1)[0] == 0);
+        }
+
+        std::ofstream("/tmp/fjml_bad.bin") << "not a data file, but long enough to hold a header of 64 bytes.....";
+        REQUIRE_THROWS_AS(Data::MappedDataset("/tmp/fjml_bad.bin"), std::runtime_error);
+        REQUIRE_THROWS_AS(Data::MappedDataset("/tmp/fjml_missing.bin"), std::invalid_argument);
+    }
 }
@@ -0,0 +1,143 @@
+#include <catch2/catch_all.hpp>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <random>
+
+#include <immintrin.h>
+
+#include "../include/FJML/half.h"
+#include "../include/FJML/linalg.h"
+
+using namespace FJML;
+using namespace Catch;
+
+TEST_CASE("Testing half precision", "[half]") {
+    std::mt19937 gen(42);
+
+    SECTION("Testing bfloat16 conversions") {
+        REQUIRE(Half::to_bfloat16(1.0f) == 0x3f80);
+        REQUIRE(Half::from_bfloat16(0x3f80) == 1.0f);
+        // Ties round to even
+        REQUIRE(Half::to_bfloat16(1.0f + 1.0f / 256) == 0x3f80);
+        REQUIRE(Half::to_bfloat16(1.0f + 3.0f / 256) == 0x3f82);
+        REQUIRE(Half::to_bfloat16(std::numeric_limits<float>::infinity()) == 0x7f80);
+        REQUIRE(std::isnan(Half::from_bfloat16(Half::to_bfloat16(std::numeric_limits<float>::quiet_NaN()))));
+        for (int bits = 0; bits < 1 << 16; bits++) {
+            float x = Half::from_bfloat16(bits);
+            if (!std::isnan(x)) {
+                REQUIRE(Half::to_bfloat16(x) == bits);
+            }
+        }
+    }
+
+    SECTION("Testing float16 conversions") {
+        REQUIRE(Half::to_float16(1.0f) == 0x3c00);
+        REQUIRE(Half::to_float16(65504.0f) == 0x7bff);
+        REQUIRE(Half::to_float16(1e6f) == 0x7c00);
+        REQUIRE(Half::to_float16(-1e6f) == 0xfc00);
+        REQUIRE(Half::from_float16(0x0001) == std::ldexp(1.0f, -24));
+        REQUIRE(std::isnan(Half::from_float16(Half::to_float16(std::numeric_limits<float>::quiet_NaN()))));
+        for (int bits = 0; bits < 1 << 16; bits++) {
+            float x = Half::from_float16(bits);
+            if (!std::isnan(x)) {
+                REQUIRE(Half::to_float16(x) == bits);
+            }
+        }
+#ifdef __F16C__
+        // Rounding matches the hardware, including subnormals and overflow
+        std::uniform_int_distribution<uint32_t> any_bits;
+        for (int i = 0; i < 100000; i++) {
+            uint32_t bits = any_bits(gen);
+            float x;
+            std::memcpy(&x, &bits, sizeof(x));
+            if (!std::isnan(x)) {
+                REQUIRE(Half::to_float16(x) == _cvtss_sh(x, _MM_FROUND_TO_NEAREST_INT));
+            }
+        }
+#endif
+    }
+
+    SECTION("Testing array conversions") {
+        std::normal_distribution<float> normal(0, 100);
+        std::vector<float> values(1000);
+        for (float& x : values) {
+            x = normal(gen);
+        }
+        values[3] = std::numeric_limits<float>::infinity();
+        values[17] = -1e-7f;
+        values[500] = 1e6f;
+        for (DType dtype : {DTYPE_BFLOAT16, DTYPE_FLOAT16}) {
+            std::vector<uint16_t> half(values.size());
+            std::vector<float> back(values.size());
+            Half::convert(values.data(), half.data(), values.size(), dtype);
+            Half::convert(half.data(), back.data(), half.size(), dtype);
+            for (int i = 0; i < (int)values.size(); i++) {
+                if (dtype == DTYPE_BFLOAT16) {
+                    REQUIRE(half[i] == Half::to_bfloat16(values[i]));
+                    REQUIRE(back[i] == Half::from_bfloat16(half[i]));
+                } else {
+                    REQUIRE(half[i] == Half::to_float16(values[i]));
+                    REQUIRE(back[i] == Half::from_float16(half[i]));
+                }
+            }
+        }
+        REQUIRE_THROWS_AS(Half::convert(values.data(), (uint16_t*)nullptr, 0, DTYPE_FLOAT32), std::invalid_argument);
+        REQUIRE(parse_dtype(dtype_name(DTYPE_BFLOAT16)) == DTYPE_BFLOAT16);
+        REQUIRE_THROWS_AS(parse_dtype("int4"), std::invalid_argument);
+    }
+
+    SECTION("Testing half tensors") {
+        Tensor a = Tensor::array(std::vector<std::vector<float>>{{1, 2.5, -3}, {0.1f, 1000, 1e-3f}});
+        HalfTensor half(a, DTYPE_BFLOAT16);
+        REQUIRE(half.shape == a.shape);
+        REQUIRE(half.size() == 6);
+        Tensor back = half.to_float();
+        REQUIRE(back.shape == a.shape);
+        REQUIRE(back.at(0, 1) == 2.5f);
+        REQUIRE(back.at(1, 0) == Approx(0.1).epsilon(1.0 / 256));
+
+        // Views are converted like contiguous tensors
+        HalfTensor column(a.slice(1, 2, 1), DTYPE_FLOAT16);
+        REQUIRE(column.to_float() == Tensor::array(std::vector<std::vector<float>>{{2.5}, {1000}}));
+        REQUIRE(HalfTensor().size() == 0);
+    }
+
+    SECTION("Testing gemm with half precision weights") {
+        std::uniform_real_distribution<float> uniform(-1, 1);
+        auto random = [&](int rows, int cols) {
+            Tensor t({rows, cols}, uninitialized);
+            for (int i = 0; i < rows * cols; i++) {
+                t.data[i] = uniform(gen);
+            }
+            return t;
+        };
+        Tensor a = random(37, 300), b = random(300, 70), b_t = random(70, 300), bias = random(1, 70).reshape({70});
+        for (DType dtype : {DTYPE_BFLOAT16, DTYPE_FLOAT16}) {
+            HalfTensor half_b(b, dtype), half_b_t(b_t, dtype);
+            Tensor expected = LinAlg::matrix_multiply(a, half_b.to_float());
+            Tensor c;
+            LinAlg::gemm(a, half_b, false, false, 1, 0, c);
+            REQUIRE(c.shape == expected.shape);
+            for (int i = 0; i < c.data_size[0]; i++) {
+                REQUIRE(c.data[i] == Approx(expected.data[i]).margin(1e-4));
+            }
+
+            Tensor expected_t = LinAlg::matrix_multiply(a, LinAlg::transpose(half_b_t.to_float()));
+            Tensor d;
+            LinAlg::gemm(a, half_b_t, false, true, 1, 0, d);
+            for (int i = 0; i < d.data_size[0]; i++) {
+                REQUIRE(d.data[i] == Approx(expected_t.data[i]).margin(1e-4));
+            }
+
+            Tensor dense = LinAlg::dense_forward(a, half_b, bias, Activations::relu.func_kernel);
+            Tensor expected_dense = LinAlg::dense_forward(a, half_b.to_float(), bias, Activations::relu.func_kernel);
+            for (int i = 0; i < dense.data_size[0]; i++) {
+                REQUIRE(dense.data[i] == Approx(expected_dense.data[i]).margin(1e-4));
+            }
+        }
+        Tensor c;
+        REQUIRE_THROWS_AS(LinAlg::gemm(b, HalfTensor(b, DTYPE_BFLOAT16), false, false, 1, 0, c),
+                          std::invalid_argument);
+    }
+}
@@ -1,4 +1,5 @@
 #include <catch2/catch_all.hpp>
+#include <iomanip>
 
 #include "../include/FJML/layers.h"
 
@@ -14,6 +15,7 @@ TEST_CASE("Test layers", "[layers]") {
 
         REQUIRE_NOTHROW(layer.apply(input));
         REQUIRE_NOTHROW(layer.backward(input, input));
+        REQUIRE_THROWS_AS(layer.apply_double(input.astype(DTYPE_FLOAT64), {}), std::runtime_error);
         std::ofstream file("/tmp/dummy.fjml");
         REQUIRE_NOTHROW(layer.save(file));
         REQUIRE_NOTHROW(layer.summary());
@@ -83,6 +85,61 @@ TEST_CASE("Test layers", "[layers]") {
             REQUIRE(dense.weights.at(2, 1) == Approx(6.2));
         }
 
+        SECTION("Test forward") {
+            Layers::Dense other{3, 2, Activations::tanh};
+            other.set_optimizer(new Optimizers::SGD(0.1));
+            Layers::Dense cached{3, 2, Activations::tanh};
+            cached.set_optimizer(new Optimizers::SGD(0.1));
+            cached.weights = other.weights;
+            cached.bias = other.bias;
+
+            Tensor batch = Tensor::array(std::vector<std::vector<float>>{{1, 2, -1}, {0.5, -3, 2}});
+            Tensor grad = Tensor::array(std::vector<std::vector<float>>{{1, 2}, {-1, 0.5}});
+
+            Tensor output = cached.forward(batch);
+            REQUIRE(output == other.apply(batch));
+            REQUIRE(cached.pre_activation.shape == std::vector<int>{2, 2});
+
+            // The kept pre-activations give the same gradients as recomputing them
+            Tensor cached_grad = cached.backward(batch, grad);
+            Tensor other_grad = other.backward(batch, grad);
+            for (int i = 0; i < 2; i++) {
+                for (int j = 0; j < 3; j++) {
+                    REQUIRE(cached_grad.at(i, j) == Approx(other_grad.at(i, j)));
+                }
+            }
+            for (int i = 0; i < 3; i++) {
+                for (int j = 0; j < 2; j++) {
+                    REQUIRE(cached.weights.at(i, j) == Approx(other.weights.at(i, j)));
+                }
+            }
+
+            // A backward pass on a different input recomputes them
+            cached.forward(batch);
+            Tensor other_batch = batch * 2.0f;
+            REQUIRE(cached.backward(other_batch, grad) == other.backward(other_batch, grad));
+        }
+
+        SECTION("Test double precision") {
+            Tensor batch = Tensor::array(std::vector<std::vector<float>>{{1, 2, -1}, {0.5, -3, 2}});
+            Tensor batch64 = batch.astype(DTYPE_FLOAT64);
+            std::vector<Tensor> params{dense.weights.astype(DTYPE_FLOAT64), dense.bias.astype(DTYPE_FLOAT64)};
+            Tensor output = dense.apply_double(batch64, params);
+            REQUIRE(output.dtype == DTYPE_FLOAT64);
+            REQUIRE(output.shape == std::vector<int>{2, 2});
+            Tensor expected = dense.apply(batch);
+            for (int i = 0; i < 4; i++) {
+                REQUIRE(output.data_as<double>()[i] == Approx(expected.data[i]).margin(1e-5));
+            }
+            // The parameters passed in are used, not those of the layer
+            params[1].data_as<double>()[0] += 1;
+            REQUIRE(dense.apply_double(batch64, params).data_as<double>()[0] ==
+                    Approx(output.data_as<double>()[0] + 1));
+            REQUIRE_THROWS_AS(dense.apply_double(batch64, {params[0]}), std::invalid_argument);
+            REQUIRE_THROWS_AS(dense.apply_double(batch64, {params[1], params[1]}), std::invalid_argument);
+            REQUIRE_THROWS_AS(dense.apply_double(batch64, {dense.weights, dense.bias}), std::invalid_argument);
+        }
+
         SECTION("Test save and load") {
             std::ofstream file("/tmp/dense.fjml");
             dense.save(file);
@@ -116,6 +173,66 @@ TEST_CASE("Test layers", "[layers]") {
             REQUIRE_THROWS(Layers::load(file6));
         }
 
+        SECTION("Test half precision weights") {
+            Tensor expected = dense.apply(input);
+            for (DType dtype : {DTYPE_BFLOAT16, DTYPE_FLOAT16}) {
+                dense.set_weight_dtype(dtype);
+                REQUIRE(dense.weights.data == nullptr);
+                REQUIRE(dense.parameters() == std::vector<Tensor*>{&dense.bias});
+                REQUIRE(dense.config() == "linear:" + dtype_name(dtype));
+                // The weights are small integers, which both formats hold exactly
+                REQUIRE(dense.apply(input) == expected);
+                REQUIRE(dense.forward(input) == expected);
+                REQUIRE_THROWS_AS(dense.backward(input, expected), std::runtime_error);
+
+                std::ofstream file("/tmp/dense_half.fjml");
+                dense.save(file);
+                file.close();
+                std::ifstream file2("/tmp/dense_half.fjml");
+                Layers::Dense* loaded = (Layers::Dense*)Layers::load(file2);
+                REQUIRE(loaded->weight_dtype == dtype);
+                REQUIRE(loaded->apply(input) == expected);
+                delete loaded;
+            }
+            dense.set_weight_dtype(DTYPE_BFLOAT16);
+            Tensor half_output = dense.apply_double(input.astype(DTYPE_FLOAT64), {dense.bias.astype(DTYPE_FLOAT64)});
+            REQUIRE(half_output.astype(DTYPE_FLOAT32) == expected);
+            dense.set_weight_dtype(DTYPE_FLOAT32);
+            REQUIRE(dense.weights.at(2, 1) == 6);
+            REQUIRE(dense.apply(input) == expected);
+            REQUIRE_NOTHROW(dense.backward(input, expected));
+        }
+
+        SECTION("Test quantized layer") {
+            Tensor batch = Tensor::array(std::vector<std::vector<float>>{{1, 2, -1}, {0.5, -3, 2}});
+            Tensor expected = dense.apply(batch);
+            Layers::QuantizedDense quantized(dense, 3.0f / 127);
+            REQUIRE(quantized.weight_scales.at(1) == Approx(6.0 / 127));
+            REQUIRE(quantized.parameters().empty());
+            Tensor output = quantized.apply(batch);
+            REQUIRE(output.shape == expected.shape);
+            for (int i = 0; i < 4; i++) {
+                REQUIRE(output.data[i] == Approx(expected.data[i]).margin(0.2));
+            }
+            REQUIRE_THROWS_AS(quantized.backward(batch, output), std::runtime_error);
+            REQUIRE_THROWS_AS(quantized.apply(input.view({3, 1})), std::invalid_argument);
+
+            std::ofstream file("/tmp/quantized.fjml");
+            file << std::setprecision(9);
+            quantized.save(file);
+            file.close();
+            std::ifstream file2("/tmp/quantized.fjml");
+            Layers::Layer* loaded = Layers::load(file2);
+            REQUIRE(loaded->name == "QuantizedDense");
+            REQUIRE(loaded->apply(batch) == output);
+            delete loaded;
+
+            std::vector<Tensor> params = quantized.saved_parameters();
+            Layers::Layer* restored = Layers::load("QuantizedDense", quantized.config(), params);
+            REQUIRE(restored->apply(batch) == output);
+            delete restored;
+        }
+
         SECTION("Test summary") { dense.summary(); }
     }
 
@@ -130,6 +247,18 @@ TEST_CASE("Test layers", "[layers]") {
             REQUIRE(output.at(0, 2) == Approx(0.03511903));
         }
 
+        SECTION("Test double precision") {
+            Tensor output = softmax.apply_double(input.astype(DTYPE_FLOAT64), {});
+            REQUIRE(output.shape == std::vector<int>{1, 3});
+            const double* y = output.data_as<double>();
+            REQUIRE(y[0] == Approx(0.25949648));
+            REQUIRE(y[1] == Approx(0.70538455));
+            REQUIRE(y[2] == Approx(0.03511903));
+            REQUIRE(y[0] + y[1] + y[2] == Approx(1).epsilon(1e-15));
+            REQUIRE_THROWS_AS(softmax.apply_double(Tensor({3}, DTYPE_FLOAT64), {}), std::invalid_argument);
+            REQUIRE_THROWS_AS(softmax.apply_double(input, {}), std::invalid_argument);
+        }
+
         SECTION("Test backward") {
             Tensor grad = Tensor::array(std::vector<float>{1, 2, 3});
             grad.reshape({1, 3});
@@ -141,6 +270,28 @@ TEST_CASE("Test layers", "[layers]") {
             REQUIRE(input_grad.at(0, 2) == Approx(0.0430).margin(0.001));
         }
 
+        SECTION("Test backward of a batch") {
+            Tensor batch({4, 7}), grad({4, 7});
+            for (int i = 0; i < 4; i++) {
+                for (int j = 0; j < 7; j++) {
+                    batch.at(i, j) = (i * 5 + j * 3) % 7 - 3;
+                    grad.at(i, j) = (i + j * 2) % 5 - 2;
+                }
+            }
+            Tensor s = softmax.apply(batch), input_grad = softmax.backward(batch, grad);
+            // Compare with the product of the Jacobian ds_k/dx_j = s_k * ([j == k] - s_j) and the gradient
+            for (int i = 0; i < 4; i++) {
+                for (int j = 0; j < 7; j++) {
+                    float expected = 0;
+                    for (int k = 0; k < 7; k++) {
+                        expected += s.at(i, k) * ((j == k) - s.at(i, j)) * grad.at(i, k);
+                    }
+                    REQUIRE(input_grad.at(i, j) == Approx(expected).margin(1e-6));
+                }
+            }
+            REQUIRE_THROWS_AS(softmax.backward(batch, grad.slice(0, 2)), std::invalid_argument);
+        }
+
         SECTION("Test save and load") {
             std::ofstream file("/tmp/softmax.fjml");
             softmax.save(file);
@@ -1,6 +1,12 @@
 #include <catch2/catch_all.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <random>
 
+#include "../include/FJML/activations.h"
 #include "../include/FJML/linalg.h"
+#include "../include/FJML/parallel.h"
 
 using namespace FJML;
 
@@ -139,6 +145,206 @@ TEST_CASE("Testing linalg functions", "[linalg]") {
         // }
     }
 
+    SECTION("Testing gemm") {
+        Tensor a = Tensor::array(std::vector<std::vector<float>>{{1, 2}, {3, 4}, {5, 6}});
+        Tensor b = Tensor::array(std::vector<std::vector<float>>{{7, 8, 9}, {10, 11, 12}});
+
+        SECTION("Testing gemm with transposed operands") {
+            Tensor a_t = LinAlg::transpose(a), b_t = LinAlg::transpose(b);
+            Tensor expected = LinAlg::matrix_multiply(a, b);
+
+            Tensor c, d, e;
+            LinAlg::gemm(a_t, b, true, false, 1, 0, c);
+            LinAlg::gemm(a, b_t, false, true, 1, 0, d);
+            LinAlg::gemm(a_t, b_t, true, true, 1, 0, e);
+            REQUIRE(c == expected);
+            REQUIRE(d == expected);
+            REQUIRE(e == expected);
+        }
+
+        SECTION("Testing gemm with views") {
+            Tensor expected = LinAlg::matrix_multiply(a, b);
+            Tensor a_t = LinAlg::transpose(a), b_t = LinAlg::transpose(b);
+
+            // Permuted views are read in place as transposed matrices
+            REQUIRE(LinAlg::matrix_multiply(a_t.permute({1, 0}), b_t.permute({1, 0})) == expected);
+
+            Tensor c = Tensor::zeros({4, 3});
+            Tensor rows = c.slice(1, 4);
+            LinAlg::gemm(a, b, false, false, 1, 0, rows);
+            REQUIRE(c.slice(1, 4) == expected);
+            REQUIRE(c.at(0, 0) == 0);
+
+            Tensor cols = b.slice(1, 3, 1);
+            Tensor expected_cols = LinAlg::matrix_multiply(a, cols.contiguous());
+            REQUIRE(LinAlg::matrix_multiply(a, cols) == expected_cols);
+        }
+
+        SECTION("Testing gemm with alpha and beta") {
+            Tensor c = Tensor::ones({3, 3});
+            LinAlg::gemm(a, b, false, false, 2, 3, c);
+            REQUIRE(c.at(0, 0) == 57);
+            REQUIRE(c.at(1, 2) == 153);
+            REQUIRE(c.at(2, 1) == 215);
+
+            LinAlg::gemm(a, b, false, false, 1, 1, c);
+            REQUIRE(c.at(0, 0) == 84);
+            REQUIRE(c.at(1, 2) == 228);
+            REQUIRE(c.at(2, 1) == 321);
+        }
+
+        SECTION("Testing gemm with invalid shapes") {
+            Tensor c;
+            REQUIRE_THROWS_AS(LinAlg::gemm(a, b, true, false, 1, 0, c), std::invalid_argument);
+            Tensor d = Tensor::zeros({2, 2});
+            REQUIRE_THROWS_AS(LinAlg::gemm(a, b, false, false, 1, 1, d), std::invalid_argument);
+        }
+
+        SECTION("Testing sgemm against a reference") {
+            // Sizes that cross the MC, KC and NC blocks and leave partial 6 x 16 tiles
+            std::mt19937 gen(3);
+            std::uniform_real_distribution<float> value(0, 1);
+            for (std::vector<int> size : {std::vector<int>{121, 257, 33}, std::vector<int>{130, 513, 4113}}) {
+                int m = size[0], k = size[1], n = size[2];
+                std::vector<float> a(m * k), b(k * n), a_t(k * m), b_t(n * k);
+                for (int i = 0; i < m; i++) {
+                    for (int p = 0; p < k; p++) {
+                        a[i * k + p] = a_t[p * m + i] = value(gen);
+                    }
+                }
+                for (int p = 0; p < k; p++) {
+                    for (int j = 0; j < n; j++) {
+                        b[p * n + j] = b_t[j * k + p] = value(gen);
+                    }
+                }
+                std::vector<double> expected(m * n, 0);
+                for (int i = 0; i < m; i++) {
+                    for (int p = 0; p < k; p++) {
+                        double x = a[i * k + p];
+                        for (int j = 0; j < n; j++) {
+                            expected[i * n + j] += x * b[p * n + j];
+                        }
+                    }
+                }
+                for (int trans = 0; trans < 4; trans++) {
+                    bool trans_a = trans & 1, trans_b = trans & 2;
+                    std::vector<float> c(m * n);
+                    LinAlg::sgemm(trans_a, trans_b, m, n, k, 1, trans_a ? a_t.data() : a.data(), trans_a ? m : k,
+                                  trans_b ? b_t.data() : b.data(), trans_b ? k : n, 0, c.data(), n);
+                    double worst = 0;
+                    for (int i = 0; i < m * n; i++) {
+                        worst = std::max(worst, std::abs(c[i] - expected[i]) / expected[i]);
+                    }
+                    REQUIRE(worst < 1e-5);
+                }
+            }
+        }
+
+        SECTION("Testing dgemm against a reference") {
+            // Sizes that leave partial tiles at every edge, with k larger than a block of K
+            std::mt19937 gen(42);
+            std::uniform_real_distribution<double> dist(-1, 1);
+            for (int m : {1, 7, 13}) {
+                for (int n : {1, 9, 70}) {
+                    for (int k : {1, 5, 300}) {
+                        for (int trans = 0; trans < 4; trans++) {
+                            bool trans_a = trans & 1, trans_b = trans & 2;
+                            std::vector<double> a(m * k), b(k * n), c(m * n), expected(m * n);
+                            for (double& x : a) {
+                                x = dist(gen);
+                            }
+                            for (double& x : b) {
+                                x = dist(gen);
+                            }
+                            for (int i = 0; i < m * n; i++) {
+                                c[i] = expected[i] = dist(gen);
+                            }
+                            for (int i = 0; i < m; i++) {
+                                for (int j = 0; j < n; j++) {
+                                    long double sum = 0;
+                                    for (int p = 0; p < k; p++) {
+                                        sum += (long double)(trans_a ? a[p * m + i] : a[i * k + p]) *
+                                               (trans_b ? b[j * k + p] : b[p * n + j]);
+                                    }
+                                    expected[i * n + j] = 0.5 * sum + 0.25 * expected[i * n + j];
+                                }
+                            }
+                            LinAlg::dgemm(trans_a, trans_b, m, n, k, 0.5, a.data(), trans_a ? m : k, b.data(),
+                                          trans_b ? k : n, 0.25, c.data(), n);
+                            for (int i = 0; i < m * n; i++) {
+                                REQUIRE(c[i] == Approx(expected[i]).epsilon(1e-13).margin(1e-13));
+                            }
+                        }
+                    }
+                }
+            }
+        }
+
+        SECTION("Testing gemm on double tensors") {
+            // Single precision loses the 1 next to 1e8, double precision keeps it
+            Tensor a = Tensor::array(std::vector<std::vector<float>>{{1e8f, 1, -1e8f}});
+            Tensor b = Tensor::array(std::vector<std::vector<float>>{{1}, {1}, {1}});
+            Tensor single;
+            LinAlg::gemm(a, b, false, false, 1, 0, single);
+            REQUIRE(single.at(0, 0) == 0);
+            Tensor a64 = a.astype(DTYPE_FLOAT64), b64 = b.astype(DTYPE_FLOAT64), out;
+            LinAlg::gemm(a64, b64, false, false, 1, 0, out);
+            REQUIRE(out.dtype == DTYPE_FLOAT64);
+            REQUIRE(out.shape == std::vector<int>{1, 1});
+            REQUIRE(out.data_as<double>()[0] == 1);
+
+            LinAlg::gemm(b64, a64, true, true, 2, 1, out);
+            REQUIRE(out.data_as<double>()[0] == 3);
+            REQUIRE_THROWS_AS(LinAlg::gemm(a64, a64, false, false, 1, 0, out), std::invalid_argument);
+            REQUIRE_THROWS_AS(LinAlg::gemm(a64, b64, true, true, 1, 1, out), std::invalid_argument);
+            REQUIRE_THROWS_AS(LinAlg::gemm(a64, b, false, false, 1, 0, out), std::invalid_argument);
+            REQUIRE_THROWS_AS(LinAlg::gemm(a.astype(DTYPE_INT32), b.astype(DTYPE_INT32), false, false, 1, 0, out),
+                              std::invalid_argument);
+        }
+    }
+
+    SECTION("Testing int8 gemm") {
+        std::mt19937 gen(7);
+        std::uniform_int_distribution<int> value(-127, 127);
+        for (int k : {1, 31, 32, 100, 300}) {
+            int m = 5, n = 70;
+            std::vector<int8_t> a(m * k), b(n * k);
+            for (int8_t& x : a) {
+                x = value(gen);
+            }
+            for (int8_t& x : b) {
+                x = value(gen);
+            }
+            // The extremes saturate 16 bit pair sums unless the signs are handled exactly
+            a[0] = -127;
+            b[0] = -127;
+            std::vector<float> scales(n), bias(n), c(m * n);
+            for (int j = 0; j < n; j++) {
+                scales[j] = 0.5f + j;
+                bias[j] = j % 3 - 1.0f;
+            }
+            LinAlg::GemmEpilogue epilogue;
+            epilogue.bias = bias.data();
+            epilogue.activation = Activations::relu.func_kernel;
+            LinAlg::qgemm(m, n, k, a.data(), k, b.data(), k, scales.data(), c.data(), n, &epilogue);
+            for (int i = 0; i < m; i++) {
+                for (int j = 0; j < n; j++) {
+                    int sum = 0;
+                    for (int p = 0; p < k; p++) {
+                        sum += a[i * k + p] * b[j * k + p];
+                    }
+                    REQUIRE(c[i * n + j] == std::max(0.0f, sum * scales[j] + bias[j]));
+                }
+            }
+        }
+
+        std::vector<float> x = {0.5f, -1.26f, 300, -300, 0.004f, 0, 1, -1};
+        std::vector<int8_t> q(x.size());
+        LinAlg::quantize(x.data(), q.data(), x.size(), 0.01f);
+        REQUIRE(q == std::vector<int8_t>{50, -126, 127, -127, 0, 0, 100, -100});
+        REQUIRE_THROWS_AS(LinAlg::quantize(x.data(), q.data(), x.size(), 0), std::invalid_argument);
+    }
+
     SECTION("Testing transpose") {
         Tensor a = Tensor::array(std::vector<std::vector<float>>{{1, 2}, {3, 4}, {5, 6}});
         Tensor b = LinAlg::transpose(a);
@@ -173,6 +379,130 @@ TEST_CASE("Testing linalg functions", "[linalg]") {
             REQUIRE(LinAlg::sum(a) == 78);
             REQUIRE(LinAlg::mean(a) == 6.5);
         }
+
+        SECTION("Testing precision of large sums") {
+            Tensor a({1 << 22}, 0.1f);
+            REQUIRE(LinAlg::sum(a) == Approx((1 << 22) * 0.1f).epsilon(1e-6));
+            REQUIRE(LinAlg::mean(a) == Approx(0.1f).epsilon(1e-6));
+        }
+    }
+
+    SECTION("Testing reductions along axes") {
+        Tensor a({2, 3, 4});
+        for (int i = 0; i < 2; i++) {
+            for (int j = 0; j < 3; j++) {
+                for (int k = 0; k < 4; k++) {
+                    a.at(i, j, k) = (i * 7 + j * 5 + k * 3) % 11 - 4;
+                }
+            }
+        }
+
+        Tensor sum_0 = LinAlg::sum(a, {0}), max_1 = LinAlg::max(a, {1}), min_2 = LinAlg::min(a, {2});
+        Tensor mean_02 = LinAlg::mean(a, {2, 0}), var_12 = LinAlg::var(a, {1, 2}, true);
+        REQUIRE(sum_0.shape == std::vector<int>{3, 4});
+        REQUIRE(max_1.shape == std::vector<int>{2, 4});
+        REQUIRE(min_2.shape == std::vector<int>{2, 3});
+        REQUIRE(mean_02.shape == std::vector<int>{3});
+        REQUIRE(var_12.shape == std::vector<int>{2, 1, 1});
+        for (int j = 0; j < 3; j++) {
+            for (int k = 0; k < 4; k++) {
+                REQUIRE(sum_0.at(j, k) == a.at(0, j, k) + a.at(1, j, k));
+            }
+        }
+        for (int i = 0; i < 2; i++) {
+            for (int k = 0; k < 4; k++) {
+                REQUIRE(max_1.at(i, k) == std::max({a.at(i, 0, k), a.at(i, 1, k), a.at(i, 2, k)}));
+            }
+            for (int j = 0; j < 3; j++) {
+                REQUIRE(min_2.at(i, j) == std::min({a.at(i, j, 0), a.at(i, j, 1), a.at(i, j, 2), a.at(i, j, 3)}));
+            }
+        }
+        for (int j = 0; j < 3; j++) {
+            float total = 0;
+            for (int i = 0; i < 2; i++) {
+                for (int k = 0; k < 4; k++) {
+                    total += a.at(i, j, k);
+                }
+            }
+            REQUIRE(mean_02.at(j) == Approx(total / 8));
+        }
+        for (int i = 0; i < 2; i++) {
+            float mean = LinAlg::mean(a.slice(i, i + 1)), squares = 0;
+            for (float x : a.slice(i, i + 1).contiguous()) {
+                squares += (x - mean) * (x - mean);
+            }
+            REQUIRE(var_12.at(i, 0, 0) == Approx(squares / 12));
+        }
+
+        REQUIRE(LinAlg::sum(a, {0, 1, 2}).shape == std::vector<int>{1});
+        REQUIRE(LinAlg::sum(a, {0, 1, 2}).at(0) == LinAlg::sum(a));
+        REQUIRE(LinAlg::sum(a, {0, 2}, true).shape == std::vector<int>{1, 3, 1});
+        // Views are reduced like copies
+        REQUIRE(LinAlg::sum(a.permute({2, 1, 0}), {2}) == LinAlg::transpose(sum_0));
+        REQUIRE(LinAlg::min(a) == -4);
+
+        REQUIRE_THROWS_AS(LinAlg::sum(a, {3}), std::invalid_argument);
+        REQUIRE_THROWS_AS(LinAlg::sum(a, {1, 1}), std::invalid_argument);
+        REQUIRE_THROWS_AS(LinAlg::sum(a, std::vector<int>{}), std::invalid_argument);
+
+        SECTION("Testing reductions of other types") {
+            // The same kernels reduce double and integer tensors, into tensors of the same type
+            Tensor doubles = a.astype(DTYPE_FLOAT64), ints = a.astype(DTYPE_INT32);
+            Tensor double_sum = LinAlg::sum(doubles, {0}), double_var = LinAlg::var(doubles, {1, 2}, true);
+            REQUIRE(double_sum.dtype == DTYPE_FLOAT64);
+            REQUIRE(double_sum.astype(DTYPE_FLOAT32) == sum_0);
+            REQUIRE(double_var.astype(DTYPE_FLOAT32).at(1, 0, 0) == Approx(var_12.at(1, 0, 0)));
+            REQUIRE(LinAlg::mean(doubles) == Approx(LinAlg::mean(a)));
+            REQUIRE(LinAlg::max(ints, {1}) == max_1.astype(DTYPE_INT32));
+            REQUIRE(LinAlg::min(ints, {2}).dtype == DTYPE_INT32);
+            REQUIRE(LinAlg::min(ints) == -4);
+            REQUIRE(LinAlg::argmax(ints, 1) == LinAlg::argmax(a, 1));
+            // Sums and averages of integers are left to the caller to convert
+            REQUIRE_THROWS_AS(LinAlg::sum(ints, {0}), std::invalid_argument);
+            REQUIRE_THROWS_AS(LinAlg::mean(ints), std::invalid_argument);
+            REQUIRE_THROWS_AS(LinAlg::logsumexp(ints, {1}), std::invalid_argument);
+        }
+
+        SECTION("Testing logsumexp") {
+            Tensor b = Tensor::array(std::vector<std::vector<float>>{{1000, 1000}, {0, std::log(3.0f)}});
+            Tensor c = LinAlg::logsumexp(b, {1});
+            REQUIRE(c.at(0) == Approx(1000 + std::log(2.0f)));
+            REQUIRE(c.at(1) == Approx(std::log(4.0f)));
+            Tensor d = Tensor::array(std::vector<float>{-INFINITY, -INFINITY});
+            REQUIRE(LinAlg::logsumexp(d, {0}).at(0) == -INFINITY);
+        }
+
+        SECTION("Testing large reductions") {
+            // More rows and columns than are reduced at once, split across several threads
+            int threads = get_num_threads();
+            set_num_threads(3);
+            Tensor b({1000, 130});
+            for (int i = 0; i < 1000; i++) {
+                for (int j = 0; j < 130; j++) {
+                    b.at(i, j) = (i * 31 + j * 17) % 101 / 10.0f;
+                }
+            }
+            Tensor columns = LinAlg::sum(b, {0}), rows = LinAlg::sum(b, {1}), column_max = LinAlg::argmax(b, 0, true);
+            REQUIRE(column_max.shape == std::vector<int>{1, 130});
+            for (int j = 0; j < 130; j++) {
+                double total = 0;
+                int best = 0;
+                for (int i = 0; i < 1000; i++) {
+                    total += b.at(i, j);
+                    best = b.at(i, j) > b.at(best, j) ? i : best;
+                }
+                REQUIRE(columns.at(j) == Approx(total).epsilon(1e-6));
+                REQUIRE(column_max.at(0, j) == best);
+            }
+            for (int i = 0; i < 1000; i++) {
+                double total = 0;
+                for (int j = 0; j < 130; j++) {
+                    total += b.at(i, j);
+                }
+                REQUIRE(rows.at(i) == Approx(total).epsilon(1e-6));
+            }
+            set_num_threads(threads);
+        }
     }
 
     SECTION("Testing random_choice") {
@@ -244,6 +574,30 @@ TEST_CASE("Testing linalg functions", "[linalg]") {
         REQUIRE_THROWS(LinAlg::equal(a, d));
     }
 
+    SECTION("Testing threads") {
+        int threads = get_num_threads();
+        REQUIRE(threads >= 1);
+        REQUIRE_THROWS_AS(set_num_threads(0), std::invalid_argument);
+
+        // Large enough to be split across threads, with a last chunk that is not full
+        Tensor a({300001});
+        for (int i = 0; i < 300001; i++) {
+            a.at(i) = (i % 1000) / 7.0f - 50;
+        }
+        set_num_threads(1);
+        float serial_sum = LinAlg::sum(a), serial_max = LinAlg::max(a);
+        Tensor serial_pow = LinAlg::pow(a, 2), serial_expr = Tensor(a * a + 1.0f);
+        set_num_threads(4);
+        REQUIRE(get_num_threads() == 4);
+        // Reductions split the tensor into the same ranges however many threads there are
+        REQUIRE(LinAlg::sum(a) == serial_sum);
+        REQUIRE(LinAlg::max(a) == serial_max);
+        REQUIRE(LinAlg::pow(a, 2) == serial_pow);
+        REQUIRE(Tensor(a * a + 1.0f) == serial_expr);
+        REQUIRE(LinAlg::sum(LinAlg::equal(a, a)) == 300001);
+        set_num_threads(threads);
+    }
+
     SECTION("Testing dense forward") {
         Tensor weights = Tensor::array(std::vector<std::vector<float>>{{1, 2, 3}, {4, 5, 6}});
         Tensor inputs = Tensor::array(std::vector<std::vector<float>>{{1, 2}, {3, 4}});
@@ -257,6 +611,29 @@ TEST_CASE("Testing linalg functions", "[linalg]") {
         REQUIRE(outputs.at(1, 0) == 20);
         REQUIRE(outputs.at(1, 1) == 28);
         REQUIRE(outputs.at(1, 2) == 36);
+
+        SECTION("Testing fused dense forward") {
+            // Sizes that leave partial tiles, and more than one block along the shared dimension
+            Tensor x = Tensor::rand({37, 300}), w = Tensor::rand({300, 45}), b = Tensor::rand({45});
+            Tensor expected = LinAlg::dense_forward(x, w, b);
+            Tensor pre;
+            Tensor fused = LinAlg::dense_forward(x, w, b, Activations::tanh.func_kernel, &pre);
+            REQUIRE(pre.shape == expected.shape);
+            Tensor activated = Activations::tanh.forward(expected);
+            for (int i = 0; i < 37; i++) {
+                for (int j = 0; j < 45; j++) {
+                    REQUIRE(pre.at(i, j) == Approx(expected.at(i, j)));
+                    REQUIRE(fused.at(i, j) == Approx(activated.at(i, j)));
+                }
+            }
+
+            // The pre-activation buffer is reused when it already has the right shape
+            float* data = pre.data;
+            LinAlg::dense_forward(x, w, b, nullptr, &pre);
+            REQUIRE(pre.data == data);
+            REQUIRE(LinAlg::dense_forward(inputs.permute({1, 0}).permute({1, 0}), weights, biases,
+                                          Activations::relu.func_kernel) == outputs);
+        }
     }
 
     SECTION("Benchmarks") {
@@ -287,7 +664,19 @@ TEST_CASE("Testing linalg functions", "[linalg]") {
             }
         }
 
-        BENCHMARK("matrix multiply matrix") { return FJML::LinAlg::matrix_multiply(d, e); };
+        // The rate is 2 * 500^3 flops over the time of each call, averaged over every run of the benchmark
+        double seconds = 0;
+        long runs = 0;
+        BENCHMARK_ADVANCED("matrix multiply matrix")(Catch::Benchmark::Chronometer meter) {
+            auto start = std::chrono::steady_clock::now();
+            meter.measure([&] { return FJML::LinAlg::matrix_multiply(d, e); });
+            seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            runs += meter.runs();
+        };
+        if (runs > 0) {
+            std::cout << "matrix multiply matrix: " << 2.0 * 500 * 500 * 500 * runs / seconds / 1e9 << " GFLOP/s"
+                      << std::endl;
+        }
 
         Tensor bias{{500}};
         for (int i = 0; i < 500; i++) {
@@ -300,5 +689,13 @@ TEST_CASE("Testing linalg functions", "[linalg]") {
             }
         }
         BENCHMARK("dense forward") { return FJML::LinAlg::dense_forward(d, inputs, bias); };
+        BENCHMARK("dense forward with relu") {
+            Tensor result = FJML::LinAlg::dense_forward(d, inputs, bias);
+            Activations::relu.apply(result);
+            return result;
+        };
+        BENCHMARK("fused dense forward with relu") {
+            return FJML::LinAlg::dense_forward(d, inputs, bias, Activations::relu.func_kernel);
+        };
     }
 }
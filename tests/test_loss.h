@@ -1,4 +1,5 @@
 #include <catch2/catch_all.hpp>
+#include <cmath>
 
 #include "../include/FJML/loss.h"
 
@@ -130,6 +131,13 @@ TEST_CASE("Testing loss functions", "[loss]") {
             REQUIRE(dy.at(0, 0) == Approx(0));
             REQUIRE(dy.at(0, 1) == Approx(0));
             REQUIRE(dy.at(0, 2) == Approx(-1 / 0.3));
+
+            // Through a softmax layer, the derivative is the prediction minus the label
+            Tensor dz = loss.calc_softmax_derivative(y, yhat);
+            REQUIRE(dz.at(0, 0) == Approx(0.3));
+            REQUIRE(dz.at(0, 1) == Approx(0.4));
+            REQUIRE(dz.at(0, 2) == Approx(-0.7));
+            REQUIRE_THROWS(Loss::crossentropy(true).calc_softmax_derivative(y, yhat));
         }
     }
 
@@ -149,6 +157,11 @@ TEST_CASE("Testing loss functions", "[loss]") {
             REQUIRE(dy.at(0, 0) == Approx(0.09003058075904846));
             REQUIRE(dy.at(0, 1) == Approx(0.24472849071025848));
             REQUIRE(dy.at(0, 2) == Approx(-0.334758996963501));
+
+            Tensor labels = y.astype(DTYPE_INT32);
+            REQUIRE(loss.calc_loss(labels, yhat) == loss.calc_loss(y, yhat));
+            REQUIRE(loss.calc_derivative(labels, yhat) == dy);
+            REQUIRE_THROWS_AS(loss.calc_softmax_derivative(labels, yhat), std::runtime_error);
         }
 
         SECTION("Testing not from_logits") {
@@ -166,6 +179,42 @@ TEST_CASE("Testing loss functions", "[loss]") {
             REQUIRE(dy.at(0, 0) == Approx(0));
             REQUIRE(dy.at(0, 1) == Approx(0));
             REQUIRE(dy.at(0, 2) == Approx(-1 / 0.3));
+
+            Tensor dz = loss.calc_softmax_derivative(y, yhat);
+            REQUIRE(dz.at(0, 0) == Approx(0.3));
+            REQUIRE(dz.at(0, 1) == Approx(0.4));
+            REQUIRE(dz.at(0, 2) == Approx(-0.7));
+
+            // Labels that are not class indices are rejected instead of indexing out of bounds
+            Tensor bad = Tensor::array(std::vector<float>{3});
+            REQUIRE_THROWS_AS(loss.calc_loss(bad, yhat), std::out_of_range);
+            REQUIRE_THROWS_AS(loss.calc_derivative(bad, yhat), std::out_of_range);
+            REQUIRE_THROWS_AS(loss.calc_softmax_derivative(bad, yhat), std::out_of_range);
+        }
+
+        SECTION("Testing integer labels") {
+            Tensor labels = Tensor::array(std::vector<float>{2, 0, 1});
+            Tensor probs =
+                Tensor::array(std::vector<std::vector<float>>{{0.3, 0.4, 0.3}, {0.5, 0.25, 0.25}, {0.1, 0.8, 0.1}});
+            Tensor classes = labels.astype(DTYPE_INT32);
+            Loss::Loss loss = Loss::sparse_categorical_crossentropy(false);
+
+            // Integer labels index the predictions directly, with the same results as labels stored as floats
+            REQUIRE(loss.calc_loss(classes, probs) == loss.calc_loss(labels, probs));
+            REQUIRE(loss.calc_derivative(classes, probs) == loss.calc_derivative(labels, probs));
+            REQUIRE(loss.calc_softmax_derivative(classes, probs) == loss.calc_softmax_derivative(labels, probs));
+            REQUIRE(loss.calc_loss(classes.slice(1, 3), probs.slice(1, 3)) ==
+                    Approx(-std::log(0.5) - std::log(0.8)));
+
+            REQUIRE_THROWS_AS(loss.calc_loss(Tensor::from_vector(std::vector<int32_t>{3, 0, 1}), probs),
+                              std::out_of_range);
+            REQUIRE_THROWS_AS(loss.calc_loss(classes.slice(0, 2), probs), std::invalid_argument);
+            REQUIRE_THROWS_AS(loss.calc_loss(Tensor::from_vector(std::vector<int32_t>{-1, 0, 1}), probs),
+                              std::out_of_range);
+            REQUIRE_THROWS_AS(Loss::mse.calc_loss(classes, probs), std::invalid_argument);
+            // Views of the labels are read like copies
+            Tensor column = labels.view({3, 1}).astype(DTYPE_INT32);
+            REQUIRE(loss.calc_loss(column.permute({1, 0}).view({3}), probs) == loss.calc_loss(classes, probs));
         }
     }
 }
@@ -20,6 +20,9 @@ TEST_CASE("Test metrics", "[metrics]") {
             Tensor::array(std::vector<std::vector<float>>{{1, 0, 0}, {0.1, 0.8, 0.1}, {0.6, 0.3, 0.1}});
 
         REQUIRE(MLP::sparse_categorical_accuracy.compute(labels, predictions) == Approx(2.0 / 3.0));
+        REQUIRE(MLP::sparse_categorical_accuracy.compute_labels(labels.astype(DTYPE_INT32), predictions) ==
+                Approx(2.0 / 3.0));
+        REQUIRE_FALSE(MLP::accuracy.compute_labels);
     }
 
     SECTION("Test mean squared error") {
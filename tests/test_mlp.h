@@ -1,3 +1,5 @@
+#include <chrono>
+
 #include <catch2/catch_all.hpp>
 
 #include "../include/FJML/mlp.h"
@@ -15,8 +17,7 @@ TEST_CASE("Test mlp", "[mlp]") {
 
     SECTION("Test set_optimizer") {
         mlp.set_optimizer(new Optimizers::Adam());
-        REQUIRE(((Layers::Dense*)mlp.layers.at(0))->w_opt->name == "Adam");
-        REQUIRE(((Layers::Dense*)mlp.layers.at(0))->b_opt->name == "Adam");
+        REQUIRE(mlp.optimizer->name == "Adam");
     }
 
     SECTION("Test add") {
@@ -72,6 +73,346 @@ TEST_CASE("Test mlp", "[mlp]") {
         REQUIRE(((Layers::Dense*)mlp.layers.at(0))->bias.at(0) == Approx(-0.998).margin(0.000001));
     }
 
+    SECTION("Test gradient check") {
+        MLP::MLP model({new Layers::Dense(4, 6, Activations::tanh), new Layers::Dense(6, 5, Activations::swish),
+                        new Layers::Dense(5, 3, Activations::sigmoid), new Layers::Softmax()},
+                       Loss::mse);
+        Tensor input({5, 4});
+        for (int i = 0; i < 20; i++) {
+            input.data[i] = std::sin(i * 0.7f);
+        }
+        REQUIRE(model.check_gradients(input) < 1e-4);
+        // A layer that cannot be trained has no gradients to check
+        ((Layers::Dense*)model.layers.at(1))->set_weight_dtype(DTYPE_BFLOAT16);
+        REQUIRE_THROWS_AS(model.check_gradients(input), std::runtime_error);
+        REQUIRE_THROWS_AS(model.check_gradients(input, 0), std::invalid_argument);
+        REQUIRE_THROWS_AS(model.check_gradients(input.view({20})), std::invalid_argument);
+
+        // A wrong derivative is caught
+        Activations::Activation wrong(
+            "wrong", [](float x) { return x * x; }, [](float x) { return x; }, nullptr, nullptr,
+            [](const double* in, double* out, long n) {
+                for (long i = 0; i < n; i++) {
+                    out[i] = in[i] * in[i];
+                }
+            });
+        MLP::MLP broken({new Layers::Dense(4, 3, wrong)}, Loss::mse);
+        REQUIRE(broken.check_gradients(input) > 0.01);
+        Activations::Activation right("right", [](float x) { return x * x; }, [](float x) { return 2 * x; }, nullptr,
+                                      nullptr, wrong.double_kernel);
+        MLP::MLP fixed({new Layers::Dense(4, 3, right)}, Loss::mse);
+        REQUIRE(fixed.check_gradients(input) < 1e-4);
+    }
+
+    SECTION("Test flat parameters") {
+        MLP::MLP mlp2({new Layers::Dense(3, 4, Activations::tanh), new Layers::Dense(4, 2, Activations::linear)},
+                      Loss::mse, new Optimizers::SGD(0.1));
+        Layers::Dense *first = (Layers::Dense*)mlp2.layers.at(0), *second = (Layers::Dense*)mlp2.layers.at(1);
+        Layers::Dense reference_first = *first, reference_second = *second;
+        reference_first.set_optimizer(new Optimizers::SGD(0.1));
+        reference_second.set_optimizer(new Optimizers::SGD(0.1));
+
+        mlp2.flatten_parameters();
+        REQUIRE(mlp2.flat_params.shape == std::vector<int>{3 * 4 + 4 + 4 * 2 + 2});
+        REQUIRE(first->weights.data == mlp2.flat_params.data);
+        REQUIRE(first->bias.data == mlp2.flat_params.data + 12);
+        REQUIRE(second->weights.data == mlp2.flat_params.data + 16);
+        REQUIRE(second->bias.data == mlp2.flat_params.data + 24);
+        REQUIRE(second->b_grad.data == mlp2.flat_grads.data + 24);
+        REQUIRE(first->weights == reference_first.weights);
+        REQUIRE(second->bias == reference_second.bias);
+
+        // One step on the flat buffers updates the layers like their own optimizers would
+        Tensor input = Tensor::array(std::vector<std::vector<float>>{{1, 2, -1}, {0.5, -3, 2}});
+        Tensor target = Tensor::array(std::vector<std::vector<float>>{{1, 0}, {-1, 2}});
+        mlp2.grad_descent(input, target);
+        Tensor hidden = reference_first.apply(input);
+        reference_first.backward(input, reference_second.backward(hidden, Loss::mse.calc_derivative(
+                                                                              target, reference_second.apply(hidden))));
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 4; j++) {
+                REQUIRE(first->weights.at(i, j) == Approx(reference_first.weights.at(i, j)));
+            }
+        }
+        for (int j = 0; j < 2; j++) {
+            REQUIRE(second->bias.at(j) == Approx(reference_second.bias.at(j)));
+        }
+        REQUIRE(first->weights.data == mlp2.flat_params.data);
+
+        // Assigning a parameter or adding a layer moves everything into new buffers
+        first->bias = Tensor::ones({4});
+        mlp2.add(new Layers::Dense(2, 1, Activations::linear));
+        mlp2.flatten_parameters();
+        REQUIRE(mlp2.flat_params.shape == std::vector<int>{26 + 2 + 1});
+        REQUIRE(first->bias.data == mlp2.flat_params.data + 12);
+        REQUIRE(mlp2.flat_params.at(12) == 1);
+        REQUIRE(((Layers::Dense*)mlp2.layers.at(2))->weights.data == mlp2.flat_params.data + 26);
+
+        // Clipping scales all the gradients together
+        for (int i = 0; i < 29; i++) {
+            mlp2.flat_grads.at(i) = i % 2 == 0 ? 3 : -4;
+        }
+        float norm = mlp2.clip_grad_norm(1000);
+        REQUIRE(norm == Approx(std::sqrt(15 * 9 + 14 * 16)));
+        REQUIRE(mlp2.flat_grads.at(0) == 3);
+        REQUIRE(mlp2.clip_grad_norm(1) == Approx(norm));
+        REQUIRE(std::sqrt(LinAlg::dot_product(mlp2.flat_grads, mlp2.flat_grads)) == Approx(1));
+        REQUIRE(mlp2.flat_grads.at(1) == Approx(-4 / norm));
+        REQUIRE_THROWS_AS(mlp2.clip_grad_norm(0), std::invalid_argument);
+        REQUIRE_THROWS_AS(mlp2.set_max_grad_norm(-1), std::invalid_argument);
+    }
+
+    SECTION("Test gradient accumulation") {
+        MLP::MLP mlp2({new Layers::Dense(3, 4, Activations::tanh), new Layers::Dense(4, 2, Activations::linear)},
+                      Loss::mse, new Optimizers::SGD(0.1));
+        Tensor input({5, 3}), target({5, 2});
+        for (int i = 0; i < 5; i++) {
+            for (int j = 0; j < 3; j++) {
+                input.at(i, j) = (i * 3 + j) % 7 / 3.0f - 1;
+            }
+            target.at(i, 0) = i % 2;
+            target.at(i, 1) = i / 5.0f;
+        }
+
+        // The gradients of a batch of 2 rows and one of 3, weighted by their rows, are those of the whole batch
+        mlp2.zero_grad();
+        mlp2.backward(input, target);
+        Tensor full_grads = mlp2.flat_grads;
+        mlp2.zero_grad();
+        mlp2.backward(input.slice(0, 2), target.slice(0, 2), 2 / 5.0f);
+        mlp2.backward(input.slice(2, 5), target.slice(2, 5), 3 / 5.0f);
+        for (int i = 0; i < full_grads.shape[0]; i++) {
+            REQUIRE(mlp2.flat_grads.at(i) == Approx(full_grads.at(i)).margin(1e-6));
+        }
+
+        // backward leaves the parameters alone until step
+        Tensor params = mlp2.flat_params;
+        REQUIRE(mlp2.flat_params == params);
+        mlp2.step();
+        for (int i = 0; i < params.shape[0]; i++) {
+            REQUIRE(mlp2.flat_params.at(i) == Approx(params.at(i) - 0.1 * full_grads.at(i)));
+        }
+
+        mlp2.zero_grad();
+        for (int i = 0; i < full_grads.shape[0]; i++) {
+            REQUIRE(mlp2.flat_grads.at(i) == 0);
+        }
+        REQUIRE_THROWS_AS(mlp2.train(input, target, input, target, 1, 2, "", {}, 0), std::invalid_argument);
+        REQUIRE_NOTHROW(mlp2.train(input, target, input, target, 1, 2, "", {}, 2));
+    }
+
+    SECTION("Test data parallel") {
+        MLP::MLP serial({new Layers::Dense(3, 8, Activations::relu), new Layers::Dense(8, 3, Activations::linear),
+                         new Layers::Softmax()},
+                        Loss::crossentropy(false), new Optimizers::Adam());
+        MLP::MLP parallel({serial.layers.at(0)->clone(), serial.layers.at(1)->clone(), new Layers::Softmax()},
+                          Loss::crossentropy(false), new Optimizers::Adam());
+        parallel.set_num_workers(3);
+        REQUIRE_THROWS_AS(parallel.set_num_workers(0), std::invalid_argument);
+
+        Tensor input({10, 3}), target({10, 3});
+        for (int i = 0; i < 10; i++) {
+            for (int j = 0; j < 3; j++) {
+                input.at(i, j) = (i * 3 + j) % 7 / 3.0f - 1;
+                target.at(i, j) = i % 3 == j;
+            }
+        }
+        // The shards of 3, 3 and 4 rows give the gradients of the whole batch, and the same steps
+        for (int step = 0; step < 3; step++) {
+            serial.grad_descent(input, target);
+            parallel.grad_descent(input, target);
+            for (int i = 0; i < serial.flat_grads.shape[0]; i++) {
+                REQUIRE(parallel.flat_grads.at(i) == Approx(serial.flat_grads.at(i)).margin(1e-6));
+                REQUIRE(parallel.flat_params.at(i) == Approx(serial.flat_params.at(i)).margin(1e-5));
+            }
+        }
+
+        // Batches smaller than the number of workers use fewer workers
+        parallel.set_num_workers(16);
+        serial.grad_descent(input, target);
+        parallel.grad_descent(input, target);
+        for (int i = 0; i < serial.flat_grads.shape[0]; i++) {
+            REQUIRE(parallel.flat_grads.at(i) == Approx(serial.flat_grads.at(i)).margin(1e-6));
+        }
+
+        // Errors in a worker are passed on to the caller
+        REQUIRE_THROWS(parallel.backward(input, Tensor({10, 4})));
+    }
+
+    SECTION("Test integer labels") {
+        MLP::MLP floats({new Layers::Dense(3, 8, Activations::relu), new Layers::Dense(8, 3, Activations::linear),
+                         new Layers::Softmax()},
+                        Loss::sparse_categorical_crossentropy(false), new Optimizers::Adam());
+        MLP::MLP integers({floats.layers.at(0)->clone(), floats.layers.at(1)->clone(), new Layers::Softmax()},
+                          Loss::sparse_categorical_crossentropy(false), new Optimizers::Adam());
+        integers.set_num_workers(3);
+
+        Tensor input({12, 3}), target({12});
+        for (int i = 0; i < 12; i++) {
+            for (int j = 0; j < 3; j++) {
+                input.at(i, j) = (i * 3 + j) % 7 / 3.0f - 1;
+            }
+            target.at(i) = i % 3;
+        }
+        Tensor labels = target.astype(DTYPE_INT32);
+        // The labels are read directly, in shards for the workers, and give the same steps as labels stored as floats
+        for (int step = 0; step < 3; step++) {
+            floats.grad_descent(input, target);
+            integers.grad_descent(input, labels);
+            for (int i = 0; i < floats.flat_params.shape[0]; i++) {
+                REQUIRE(integers.flat_params.at(i) == Approx(floats.flat_params.at(i)).margin(1e-5));
+            }
+        }
+
+        REQUIRE_NOTHROW(integers.train(input, labels, input, labels, 2, 4, "", {MLP::sparse_categorical_accuracy}));
+        REQUIRE_THROWS_AS(integers.train(input, labels, input, labels, 1, 4, "", {MLP::accuracy}),
+                          std::invalid_argument);
+        REQUIRE_THROWS_AS(integers.train(input, labels, input, target, 1, 4, ""), std::invalid_argument);
+        integers.set_loss(Loss::mse);
+        REQUIRE_THROWS_AS(integers.train(input, labels, input, labels, 1, 4, ""), std::invalid_argument);
+        REQUIRE_THROWS(integers.grad_descent(input, labels));
+    }
+
+    SECTION("Test hogwild") {
+        Tensor x_train({256, 1}), y_train({256, 1});
+        for (int i = 0; i < 256; i++) {
+            x_train.at(i, 0) = i / 128.0f - 1;
+            y_train.at(i, 0) = 2 * x_train.at(i, 0) - 1;
+        }
+        REQUIRE_THROWS_AS(mlp.set_hogwild(true, -2), std::invalid_argument);
+        for (int max_staleness : {-1, 0, 2}) {
+            MLP::MLP mlp2({new Layers::Dense(1, 1, Activations::linear)}, Loss::mse, new Optimizers::SGD(0.1));
+            mlp2.set_num_workers(4);
+            mlp2.set_hogwild(true, max_staleness);
+            mlp2.train(x_train, y_train, x_train, y_train, 20, 8, "");
+            REQUIRE(((Layers::Dense*)mlp2.layers.at(0))->weights.at(0, 0) == Approx(2).margin(0.01));
+            REQUIRE(((Layers::Dense*)mlp2.layers.at(0))->bias.at(0) == Approx(-1).margin(0.01));
+        }
+
+        // Integer labels sorted by class, with the inputs in a view that is not contiguous. The workers gather their
+        // batches from shuffled rows, so the batches mix both classes.
+        Tensor columns({1, 256});
+        std::vector<int32_t> classes(256);
+        for (int i = 0; i < 256; i++) {
+            columns.at(0, i) = i / 128.0f - 1;
+            classes[i] = i >= 128;
+        }
+        Tensor x_view = columns.permute({1, 0});
+        Tensor labels = Tensor::from_vector(classes);
+        MLP::MLP classifier({new Layers::Dense(1, 2, Activations::linear), new Layers::Softmax()},
+                            Loss::sparse_categorical_crossentropy(false), new Optimizers::SGD(0.5));
+        classifier.set_num_workers(4);
+        classifier.set_hogwild(true);
+        classifier.train(x_view, labels, x_view, labels, 20, 8, "");
+        Tensor probabilities = classifier.run(x_view);
+        REQUIRE(probabilities.at(0, 0) > 0.9f);
+        REQUIRE(probabilities.at(255, 1) > 0.9f);
+        REQUIRE(probabilities.at(64, 0) > 0.5f);
+        REQUIRE(probabilities.at(192, 1) > 0.5f);
+    }
+
+    SECTION("Test training on mapped data") {
+        Tensor x_train({256, 1}), y_train({256, 1});
+        for (int i = 0; i < 256; i++) {
+            x_train.at(i, 0) = i / 128.0f - 1;
+            y_train.at(i, 0) = 2 * x_train.at(i, 0) - 1;
+        }
+        Data::save_binary("/tmp/fjml_train_x.bin", x_train);
+        Data::save_binary("/tmp/fjml_train_y.bin", y_train);
+        Data::MappedDataset mapped_x("/tmp/fjml_train_x.bin"), mapped_y("/tmp/fjml_train_y.bin");
+
+        MLP::MLP mlp2({new Layers::Dense(1, 1, Activations::linear)}, Loss::mse, new Optimizers::SGD(0.1));
+        mlp2.train(mapped_x, mapped_y, x_train, y_train, 20, 8, "", {MLP::mean_squared_error}, 1, 64);
+        REQUIRE(((Layers::Dense*)mlp2.layers.at(0))->weights.at(0, 0) == Approx(2).margin(0.01));
+        REQUIRE(((Layers::Dense*)mlp2.layers.at(0))->bias.at(0) == Approx(-1).margin(0.01));
+        REQUIRE_THROWS_AS(mlp2.train(mapped_x, mapped_y, x_train, y_train, 1, 8, "", {}, 1, -1), std::invalid_argument);
+        REQUIRE_THROWS_AS(mlp2.train(mapped_x, mapped_y, x_train, y_train, 1, 0, ""), std::invalid_argument);
+    }
+
+    SECTION("Test save and load") {
+        MLP::MLP model({new Layers::Dense(3, 4, Activations::tanh), new Layers::Dense(4, 2, Activations::linear),
+                        new Layers::Softmax()},
+                       Loss::crossentropy(false), new Optimizers::SGD(0.1));
+        Tensor input = Tensor::array(std::vector<std::vector<float>>{{1, 2, -1}, {0.5, -3, 2}});
+        Tensor output = model.run(input);
+
+        model.save("/tmp/model.fjml");
+        for (bool map : {true, false}) {
+            MLP::MLP loaded;
+            loaded.load_binary("/tmp/model.fjml", map);
+            REQUIRE(loaded.layers.size() == 3);
+            REQUIRE(loaded.layers.at(2)->name == "Softmax");
+            Layers::Dense* dense = (Layers::Dense*)loaded.layers.at(0);
+            REQUIRE(dense->activ.name == "tanh");
+            REQUIRE((uintptr_t)dense->weights.data % 64 == 0);
+            REQUIRE((uintptr_t)dense->bias.data % 64 == 0);
+            REQUIRE(dense->weights == ((Layers::Dense*)model.layers.at(0))->weights);
+            REQUIRE(loaded.run(input) == output);
+        }
+
+        // Training a mapped model works, and does not change the file
+        MLP::MLP mapped;
+        mapped.load("/tmp/model.fjml");
+        mapped.set_loss(Loss::crossentropy(false));
+        mapped.set_optimizer(new Optimizers::SGD(0.1));
+        mapped.grad_descent(input, Tensor::array(std::vector<std::vector<float>>{{1, 0}, {0, 1}}));
+        REQUIRE(mapped.run(input) != output);
+        MLP::MLP reloaded;
+        reloaded.load("/tmp/model.fjml");
+        REQUIRE(reloaded.run(input) == output);
+
+        // Weights stored in 16 bit formats are saved with their format, and read back exactly
+        MLP::MLP half;
+        for (Layers::Layer* l : model.layers) {
+            half.add(l->clone());
+        }
+        ((Layers::Dense*)half.layers.at(0))->set_weight_dtype(DTYPE_BFLOAT16);
+        ((Layers::Dense*)half.layers.at(1))->set_weight_dtype(DTYPE_FLOAT16);
+        Tensor half_output = half.run(input);
+        REQUIRE(half_output.at(0, 0) == Approx(output.at(0, 0)).margin(0.02));
+        half.save("/tmp/half_model.fjml");
+        MLP::MLP half_loaded;
+        half_loaded.load("/tmp/half_model.fjml");
+        REQUIRE(((Layers::Dense*)half_loaded.layers.at(0))->weight_dtype == DTYPE_BFLOAT16);
+        REQUIRE(((Layers::Dense*)half_loaded.layers.at(1))->weight_dtype == DTYPE_FLOAT16);
+        REQUIRE(half_loaded.run(input) == half_output);
+
+        // Quantized models are saved in both formats, and read back exactly
+        MLP::MLP quantized;
+        for (Layers::Layer* l : model.layers) {
+            quantized.add(l->clone());
+        }
+        quantized.quantize(input);
+        REQUIRE(quantized.layers.at(0)->name == "QuantizedDense");
+        REQUIRE(quantized.layers.at(1)->name == "QuantizedDense");
+        REQUIRE(quantized.layers.at(2)->name == "Softmax");
+        Tensor quantized_output = quantized.run(input);
+        for (int i = 0; i < 4; i++) {
+            REQUIRE(quantized_output.data[i] == Approx(output.data[i]).margin(0.05));
+        }
+        for (bool binary : {true, false}) {
+            quantized.save("/tmp/quantized_model.fjml", binary);
+            MLP::MLP quantized_loaded;
+            quantized_loaded.load("/tmp/quantized_model.fjml");
+            REQUIRE(quantized_loaded.run(input) == quantized_output);
+        }
+
+        // The text format is still read, and keeps every digit
+        model.save("/tmp/model.txt", false);
+        MLP::MLP text;
+        text.load("/tmp/model.txt");
+        REQUIRE(text.run(input) == output);
+
+        // Truncated or unknown files are rejected
+        std::ifstream original("/tmp/model.fjml", std::ios::binary);
+        std::string contents((std::istreambuf_iterator<char>(original)), std::istreambuf_iterator<char>());
+        std::ofstream("/tmp/truncated.fjml", std::ios::binary).write(contents.data(), contents.size() - 8);
+        REQUIRE_THROWS_AS(text.load("/tmp/truncated.fjml"), std::runtime_error);
+        REQUIRE_THROWS_AS(text.load_binary("/tmp/model.txt"), std::runtime_error);
+        REQUIRE_THROWS_AS(text.load("/tmp/does_not_exist.fjml"), std::invalid_argument);
+        REQUIRE(text.layers.size() == 3);
+    }
+
     SECTION("Test summary") { REQUIRE_NOTHROW(mlp.summary()); }
 
     SECTION("Test linear regression") {
@@ -118,3 +459,35 @@ TEST_CASE("Test mlp", "[mlp]") {
         REQUIRE(MLP::accuracy.compute(y_train, mlp2.run(x_train)) == Approx(1.0).margin(0.001));
     }
 }
+
+TEST_CASE("Benchmark data parallel training", "[mlp][!benchmark]") {
+    const int batch_size = 1024, features = 128, classes = 10, steps = 20;
+    Tensor input({batch_size, features}), target({batch_size, classes});
+    for (int i = 0; i < batch_size; i++) {
+        for (int j = 0; j < features; j++) {
+            input.at(i, j) = (i * 31 + j * 7) % 17 / 8.0f - 1;
+        }
+        target.at(i, i % classes) = 1;
+    }
+
+    double serial_seconds = 0;
+    for (int workers = 1; workers <= 8; workers *= 2) {
+        MLP::MLP mlp({new Layers::Dense(features, 128, Activations::relu),
+                      new Layers::Dense(128, 128, Activations::relu), new Layers::Dense(128, classes),
+                      new Layers::Softmax()},
+                     Loss::crossentropy(false), new Optimizers::Adam());
+        mlp.set_num_workers(workers);
+        mlp.grad_descent(input, target);
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < steps; i++) {
+            mlp.grad_descent(input, target);
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (workers == 1) {
+            serial_seconds = seconds;
+        }
+        double speedup = serial_seconds / seconds;
+        std::cout << "data parallel training with " << workers << " workers: " << seconds / steps * 1000
+                  << " ms per step, speedup " << speedup << ", efficiency " << speedup / workers << std::endl;
+    }
+}
@@ -30,6 +30,69 @@ TEST_CASE("Test optimizers in 1d", "[optimizers]") {
         REQUIRE(Loss::mse.calc_loss(y, yhat) < orig_loss);
     }
 
+    SECTION("Testing SGD with momentum") {
+        Tensor grad = Tensor::array(std::vector<float>{1, -2, 0.5});
+        Tensor params = Tensor::zeros({3}), nesterov_params = Tensor::zeros({3});
+        Optimizers::SGD sgd(0.1, 0.5), nesterov(0.1, 0.5, true);
+        for (int step = 0; step < 3; step++) {
+            sgd.apply_grad(params, grad);
+            nesterov.apply_grad(nesterov_params, grad);
+        }
+        // The velocities after each step are g, 1.5g and 1.75g
+        for (int i = 0; i < 3; i++) {
+            REQUIRE(params.at(i) == Approx(-0.1 * (1 + 1.5 + 1.75) * grad.at(i)));
+            REQUIRE(nesterov_params.at(i) == Approx(-0.1 * (1.5 + 1.75 + 1.875) * grad.at(i)));
+        }
+
+        REQUIRE_THROWS_AS(Optimizers::SGD(0.1, -1), std::invalid_argument);
+        REQUIRE_THROWS_AS(Optimizers::SGD(0.1, 0, true), std::invalid_argument);
+    }
+
+    SECTION("Testing Adam steps") {
+        // Long enough for the vectorized loop, with a tail
+        int n = 1003;
+        Tensor params({n}), grad({n}), strided({n, 2});
+        for (int i = 0; i < n; i++) {
+            params.at(i) = strided.at(i, 0) = (i % 13) / 13.0f - 0.5f;
+            grad.at(i) = (i % 7) / 7.0f - 0.4f;
+        }
+        Tensor column = strided.slice(0, 1, 1), grad_column = grad;
+        grad_column.reshape({n, 1});
+        Optimizers::Adam adam, strided_adam;
+        std::vector<double> m(n, 0), v(n, 0), expected(n);
+        for (int i = 0; i < n; i++) {
+            expected[i] = params.at(i);
+        }
+        for (int t = 1; t <= 3; t++) {
+            adam.apply_grad(params, grad);
+            strided_adam.apply_grad(column, grad_column);
+            for (int i = 0; i < n; i++) {
+                m[i] = 0.9 * m[i] + 0.1 * grad.at(i);
+                v[i] = 0.999 * v[i] + 0.001 * grad.at(i) * grad.at(i);
+                double m_hat = m[i] / (1 - std::pow(0.9, t)), v_hat = v[i] / (1 - std::pow(0.999, t));
+                expected[i] -= 0.001 * m_hat / (std::sqrt(v_hat) + 1e-8);
+            }
+        }
+        for (int i = 0; i < n; i++) {
+            REQUIRE(params.at(i) == Approx(expected[i]).margin(1e-6));
+            REQUIRE(column.at(i, 0) == Approx(expected[i]).margin(1e-6));
+        }
+    }
+
+    SECTION("Testing one element parameters") {
+        // A default constructed state tensor also has one element, so the state must still be allocated
+        Tensor param = Tensor::array(std::vector<float>{1}), grad = Tensor::array(std::vector<float>{2});
+        Optimizers::SGD sgd(0.1, 0.9);
+        sgd.apply_grad(param, grad);
+        sgd.apply_grad(param, grad);
+        REQUIRE(param.at(0) == Approx(1 - 0.1 * 2 - 0.1 * 3.8));
+
+        Tensor adam_param = Tensor::array(std::vector<float>{1});
+        Optimizers::Adam adam;
+        adam.apply_grad(adam_param, grad);
+        REQUIRE(adam_param.at(0) == Approx(1 - 0.001).margin(1e-6));
+    }
+
     SECTION("Testing clone") {
         Optimizers::SGD sgd;
         Optimizers::SGD sgd_clone = *((Optimizers::SGD*)sgd.clone());
@@ -136,6 +136,18 @@ TEST_CASE("Testing tensor", "[tensor]") {
             REQUIRE(tensor.at({1, 2}) == 1);
         }
 
+        SECTION("Testing empty") {
+            Tensor tensor = Tensor::empty({2, 3});
+            REQUIRE(tensor.shape == std::vector<int>({2, 3}));
+            REQUIRE(tensor.ndim() == 2);
+            REQUIRE(tensor.data_size == std::vector<int>({6, 3, 1}));
+            REQUIRE(tensor.data != nullptr);
+
+            Tensor tagged({4, 5}, uninitialized);
+            REQUIRE(tagged.shape == std::vector<int>({4, 5}));
+            REQUIRE(tagged.data_size == std::vector<int>({20, 5, 1}));
+        }
+
         SECTION("Testing random") {
             Tensor rand_tensor = Tensor::rand({2, 3});
 
@@ -362,6 +374,248 @@ TEST_CASE("Testing tensor", "[tensor]") {
         }
     }
 
+    SECTION("Test views") {
+        Tensor tensor = Tensor::array(std::vector<std::vector<float>>{{1, 2, 3}, {4, 5, 6}, {7, 8, 9}, {10, 11, 12}});
+
+        SECTION("Test slice") {
+            Tensor rows = tensor.slice(1, 3);
+            REQUIRE(rows.shape == std::vector<int>({2, 3}));
+            REQUIRE(rows.data == tensor.data + 3);
+            REQUIRE(rows.is_contiguous());
+            REQUIRE(rows == Tensor::array(std::vector<std::vector<float>>{{4, 5, 6}, {7, 8, 9}}));
+
+            Tensor cols = tensor.slice(1, 3, 1);
+            REQUIRE(cols.shape == std::vector<int>({4, 2}));
+            REQUIRE(!cols.is_contiguous());
+            REQUIRE(cols == Tensor::array(std::vector<std::vector<float>>{{2, 3}, {5, 6}, {8, 9}, {11, 12}}));
+
+            // Views share memory with the original
+            cols.at(0, 0) = 20;
+            REQUIRE(tensor.at(0, 1) == 20);
+            cols *= 2;
+            REQUIRE(tensor.at(3, 2) == 24);
+            REQUIRE(tensor.at(3, 0) == 10);
+
+            REQUIRE_THROWS_AS(tensor.slice(2, 5), std::out_of_range);
+            REQUIRE_THROWS_AS(tensor.slice(0, 1, 2), std::invalid_argument);
+        }
+
+        SECTION("Test select") {
+            Tensor row = tensor.select(2);
+            REQUIRE(row.shape == std::vector<int>({3}));
+            REQUIRE(row == Tensor::array({7, 8, 9}));
+
+            Tensor col = tensor.select(1, 1);
+            REQUIRE(col.shape == std::vector<int>({4}));
+            REQUIRE(col == Tensor::array({2, 5, 8, 11}));
+            REQUIRE_THROWS_AS(tensor.select(4), std::out_of_range);
+        }
+
+        SECTION("Test permute") {
+            Tensor t = tensor.permute({1, 0});
+            REQUIRE(t.shape == std::vector<int>({3, 4}));
+            REQUIRE(t.data == tensor.data);
+            REQUIRE(t.at(2, 1) == 6);
+            REQUIRE(t.at(0, 3) == 10);
+
+            std::stringstream ss;
+            ss << t;
+            REQUIRE(ss.str() == "[[1, 4, 7, 10], [2, 5, 8, 11], [3, 6, 9, 12]]");
+
+            // Iterators walk the view in row-major order
+            std::vector<float> values;
+            for (float x : t) {
+                values.push_back(x);
+            }
+            REQUIRE(values[1] == 4);
+            REQUIRE(values[4] == 2);
+
+            REQUIRE_THROWS_AS(tensor.permute({0, 0}), std::invalid_argument);
+            REQUIRE_THROWS_AS(tensor.permute({0}), std::invalid_argument);
+        }
+
+        SECTION("Test contiguous and view") {
+            Tensor t = tensor.permute({1, 0});
+            REQUIRE_THROWS_AS(t.view({12}), std::invalid_argument);
+
+            Tensor c = t.contiguous();
+            REQUIRE(c.is_contiguous());
+            REQUIRE(c.data != tensor.data);
+            REQUIRE(c == t);
+            REQUIRE(c.contiguous().data == c.data);
+
+            Tensor flat = tensor.view({12});
+            REQUIRE(flat.data == tensor.data);
+            REQUIRE(flat.at(7) == 8);
+
+            // Copies are always deep, and contiguous
+            Tensor copy = t;
+            REQUIRE(copy.is_contiguous());
+            copy.at(0, 0) = 100;
+            REQUIRE(tensor.at(0, 0) == 1);
+        }
+
+        SECTION("Test operators on views") {
+            Tensor t = tensor.permute({1, 0});
+            Tensor sum = t + t.contiguous();
+            REQUIRE(sum.is_contiguous());
+            REQUIRE(sum == t * 2);
+            REQUIRE(t.calc_function([](float x) { return x + 1; }).at(2, 3) == 13);
+        }
+    }
+
+    SECTION("Test broadcasting") {
+        Tensor matrix = Tensor::array(std::vector<std::vector<float>>{{1, 2, 3}, {4, 5, 6}});
+        Tensor row = Tensor::array({10, 20, 30});
+        Tensor col = Tensor::array(std::vector<std::vector<float>>{{1}, {2}});
+
+        REQUIRE(matrix + row == Tensor::array(std::vector<std::vector<float>>{{11, 22, 33}, {14, 25, 36}}));
+        REQUIRE(row - matrix == Tensor::array(std::vector<std::vector<float>>{{9, 18, 27}, {6, 15, 24}}));
+        REQUIRE(matrix * col == Tensor::array(std::vector<std::vector<float>>{{1, 2, 3}, {8, 10, 12}}));
+        REQUIRE(matrix / col == Tensor::array(std::vector<std::vector<float>>{{1, 2, 3}, {2, 2.5, 3}}));
+
+        Tensor outer = col + row;
+        REQUIRE(outer.shape == std::vector<int>({2, 3}));
+        REQUIRE(outer == Tensor::array(std::vector<std::vector<float>>{{11, 21, 31}, {12, 22, 32}}));
+
+        matrix -= row;
+        REQUIRE(matrix == Tensor::array(std::vector<std::vector<float>>{{-9, -18, -27}, {-6, -15, -24}}));
+        REQUIRE_THROWS_AS(row += matrix, std::invalid_argument);
+        REQUIRE_THROWS_AS(matrix + Tensor::array({1, 2}), std::invalid_argument);
+
+        // Large enough to be split across threads
+        Tensor big = Tensor::ones({300, 400}), big_row({400}), big_col({300, 1});
+        for (int i = 0; i < 400; i++) {
+            big_row.at(i) = i;
+        }
+        for (int i = 0; i < 300; i++) {
+            big_col.at(i, 0) = 1000 * i;
+        }
+        Tensor sum = big + big_row + big_col;
+        REQUIRE(sum.at(0, 0) == 1);
+        REQUIRE(sum.at(123, 45) == 123046);
+        REQUIRE(sum.at(299, 399) == 299400);
+        Tensor transposed_sum = big.permute({1, 0}) + big_col.view({300});
+        REQUIRE(transposed_sum.at(45, 123) == 123001);
+    }
+
+    SECTION("Test expressions") {
+        Tensor a = Tensor::array({1, 2, 3, 4}), b = Tensor::array({4, 3, 2, 1}), m = Tensor::array({2, 4, 6, 8});
+
+        Tensor result = 0.5 * a + b * b - a / 2 + 1;
+        REQUIRE(result == Tensor::array({17, 10, 5, 2}));
+        REQUIRE(-(a - b) == Tensor::array({3, 1, -1, -3}));
+        REQUIRE(LinAlg::sqrt(a * a + 0) == a);
+
+        // The result is written into the memory of m, which is also an operand
+        float* data = m.data;
+        m = 0.5 * m + m;
+        REQUIRE(m.data == data);
+        REQUIRE(m == Tensor::array({3, 6, 9, 12}));
+        m -= a * 2 + 1;
+        REQUIRE(m == Tensor::array({0, 1, 2, 3}));
+        REQUIRE(m.data == data);
+
+        // m is shared with a view, so the result gets new memory and the view is unchanged
+        Tensor view = m.view({2, 2});
+        m = m * 2;
+        REQUIRE(m.data != data);
+        REQUIRE(view.at(1, 1) == 3);
+        REQUIRE(m == Tensor::array({0, 2, 4, 6}));
+
+        // Operands that need broadcasting or are not contiguous are evaluated one operation at a time
+        Tensor matrix = Tensor::array(std::vector<std::vector<float>>{{1, 2}, {3, 4}});
+        Tensor row = Tensor::array({10, 20});
+        Tensor broadcast = matrix.permute({1, 0}) * 2 + row;
+        REQUIRE(broadcast == Tensor::array(std::vector<std::vector<float>>{{12, 26}, {14, 28}}));
+        REQUIRE_THROWS_AS(a + matrix * 2, std::invalid_argument);
+
+        // Large enough to be split across threads
+        Tensor big = Tensor::ones({300, 400}), big2 = Tensor::ones({300, 400}) * 3;
+        Tensor fused = (big + big2) * (big2 - 1) / 2;
+        REQUIRE(fused.at(123, 45) == 4);
+        REQUIRE(fused.at(299, 399) == 4);
+
+        // Temporary operands are owned by the expression, so it can outlive the statement that builds it
+        auto owned = (a + b) * Tensor::ones({4}) + Tensor::array({1, 2, 3, 4}) * 2;
+        REQUIRE(owned == Tensor::array({7, 9, 11, 13}));
+        auto make = [](const Tensor& x) { return x * Tensor::array({2, 2, 2, 2}) - Tensor::ones({4}); };
+        auto returned = make(a);
+        REQUIRE(returned == Tensor::array({1, 3, 5, 7}));
+        // Copies of an owned operand share its memory
+        auto copy = owned;
+        REQUIRE(Tensor(copy) == Tensor(owned));
+    }
+
+    SECTION("Test dtypes") {
+        SECTION("Test conversions") {
+            Tensor matrix = Tensor::array(std::vector<std::vector<float>>{{1, 0.1f}, {-3, 4}});
+            Tensor converted = matrix.astype(DTYPE_FLOAT64);
+            REQUIRE(converted.dtype == DTYPE_FLOAT64);
+            REQUIRE(converted.shape == std::vector<int>{2, 2});
+            REQUIRE(converted.data_as<double>()[1] == (double)0.1f);
+            REQUIRE(converted.astype(DTYPE_FLOAT32) == matrix);
+            REQUIRE_THROWS_AS(converted.data_as<float>(), std::invalid_argument);
+            REQUIRE_THROWS_AS(converted.at(0, 0), std::invalid_argument);
+            // Views are converted like contiguous tensors
+            Tensor transposed = Tensor::array(std::vector<std::vector<float>>{{1, -3}, {0.1f, 4}});
+            REQUIRE(matrix.permute({1, 0}).astype(DTYPE_FLOAT64).astype(DTYPE_FLOAT32) == transposed);
+
+            Tensor column = Tensor::array(std::vector<std::vector<float>>{{2}, {0}, {1}, {2}});
+            Tensor labels = column.astype(DTYPE_INT32);
+            REQUIRE(labels.shape == std::vector<int>{4, 1});
+            REQUIRE(labels.view({4}) == Tensor::from_vector(std::vector<int32_t>{2, 0, 1, 2}));
+            REQUIRE(labels.astype(DTYPE_FLOAT32) == column);
+            REQUIRE(labels != column);
+            // Only integers can be converted to integers
+            REQUIRE_THROWS_AS(Tensor::array(std::vector<float>{1, 0.5}).astype(DTYPE_INT32), std::out_of_range);
+            REQUIRE_THROWS_AS(Tensor::array(std::vector<float>{3e9}).astype(DTYPE_INT32), std::out_of_range);
+
+            REQUIRE(Tensor({2, 3}, DTYPE_FLOAT64).astype(DTYPE_FLOAT32) == Tensor({2, 3}));
+            REQUIRE(Tensor({3}, DTYPE_INT32) == Tensor::from_vector(std::vector<int32_t>{0, 0, 0}));
+            REQUIRE(Tensor().astype(DTYPE_INT32).dtype == DTYPE_INT32);
+            REQUIRE(dtype_size(DTYPE_FLOAT64) == 8);
+            REQUIRE(parse_dtype(dtype_name(DTYPE_INT32)) == DTYPE_INT32);
+            REQUIRE_THROWS_AS(Tensor({2}, DTYPE_BFLOAT16), std::invalid_argument);
+        }
+
+        SECTION("Test arithmetic") {
+            Tensor a = Tensor::array(std::vector<float>{1e8f, 1, -1e8f}).astype(DTYPE_FLOAT64);
+            Tensor b = Tensor::array(std::vector<std::vector<float>>{{1}, {2}}).astype(DTYPE_FLOAT64);
+            Tensor sum = a + b;
+            REQUIRE(sum.dtype == DTYPE_FLOAT64);
+            REQUIRE(sum.shape == std::vector<int>{2, 3});
+            // Double precision keeps the 1 next to 1e8
+            REQUIRE(sum.data_as<double>()[1] + sum.data_as<double>()[0] + sum.data_as<double>()[2] == 4);
+            REQUIRE(Tensor(a / 4).data_as<double>()[1] == 0.25);
+
+            Tensor labels = Tensor::from_vector(std::vector<int32_t>{3, -1, 7});
+            REQUIRE(Tensor(labels * 2 + labels) == Tensor::from_vector(std::vector<int32_t>{9, -3, 21}));
+            REQUIRE_THROWS_AS(Tensor(labels + 0.5), std::invalid_argument);
+            REQUIRE_THROWS_AS(Tensor(labels / 2), std::invalid_argument);
+            REQUIRE_THROWS_AS(Tensor(labels + Tensor::array({1, 2, 3})), std::invalid_argument);
+            REQUIRE_THROWS_AS(Tensor(a + labels), std::invalid_argument);
+        }
+
+        SECTION("Test slices") {
+            Tensor labels = Tensor::from_vector(std::vector<int32_t>{0, 1, 2, 3, 4});
+            Tensor middle = labels.slice(1, 4);
+            REQUIRE(middle == Tensor::from_vector(std::vector<int32_t>{1, 2, 3}));
+            // Slices share memory with the original
+            middle.data_as<int32_t>()[0] = 7;
+            REQUIRE(labels.data_as<int32_t>()[1] == 7);
+            REQUIRE(labels.slice(2, 2).data_size[0] == 0);
+            REQUIRE_THROWS_AS(labels.slice(3, 6), std::out_of_range);
+
+            Tensor copy = labels.view({5, 1}).permute({1, 0}).contiguous();
+            REQUIRE(copy.dtype == DTYPE_INT32);
+            REQUIRE(copy.view({5}) == labels);
+            std::stringstream ss;
+            ss << middle;
+            REQUIRE(ss.str() == "[7, 2, 3]");
+        }
+    }
+
     SECTION("Test tensor output") {
         Tensor tensor = Tensor::array(std::vector<std::vector<float>>{{1, 2}, {1, 2}, {2, 3}});
         std::stringstream ss;
@@ -399,5 +653,6 @@ TEST_CASE("Testing tensor", "[tensor]") {
         BENCHMARK("Tensor scalar division") { return t2 / 21; };
         BENCHMARK("Tensor hammard product") { return t2 * t3; };
         BENCHMARK("Tensor division") { return t2 / t3; };
+        BENCHMARK("Tensor fused expression") { return Tensor(0.9 * t2 + 0.1 * t3 * t3); };
     }
 }
@@ -1,7 +1,9 @@
 #include <catch2/catch_all.hpp>
 
 #include "test_activations.h"
+#include "test_allocator.h"
 #include "test_data.h"
+#include "test_half.h"
 #include "test_layers.h"
 #include "test_linalg.h"
 #include "test_loss.h"